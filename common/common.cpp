@@ -197,6 +197,82 @@ int32_t cpu_get_num_math() {
     return cpu_get_num_physical_cores();
 }
 
+bool parse_cpu_range(const std::string & range, bool (&boolmask)[GGML_MAX_N_THREADS]) {
+    size_t dash_loc = range.find('-');
+    if (dash_loc == std::string::npos) {
+        fprintf(stderr, "Format of CPU range is invalid! Expected [<start>]-[<end>].\n");
+        return false;
+    }
+
+    size_t start_i;
+    size_t end_i;
+
+    if (dash_loc == 0) {
+        start_i = 0;
+    } else {
+        start_i = std::stoull(range.substr(0, dash_loc));
+        if (start_i >= GGML_MAX_N_THREADS) {
+            fprintf(stderr, "Start index out of bounds!\n");
+            return false;
+        }
+    }
+
+    if (dash_loc == range.length() - 1) {
+        end_i = GGML_MAX_N_THREADS - 1;
+    } else {
+        end_i = std::stoull(range.substr(dash_loc + 1));
+        if (end_i >= GGML_MAX_N_THREADS) {
+            fprintf(stderr, "End index out of bounds!\n");
+            return false;
+        }
+    }
+
+    for (size_t i = start_i; i <= end_i; i++) {
+        boolmask[i] = true;
+    }
+
+    return true;
+}
+
+bool parse_cpu_mask(const std::string & mask, bool (&boolmask)[GGML_MAX_N_THREADS]) {
+    // discard the optional "0x" prefix
+    size_t start_i = 0;
+    if (mask.length() >= 2 && mask.substr(0, 2) == "0x") {
+        start_i = 2;
+    }
+
+    size_t num_digits = mask.length() - start_i;
+    if (num_digits > GGML_MAX_N_THREADS/4) {
+        num_digits = GGML_MAX_N_THREADS/4;
+    }
+
+    size_t end_i = num_digits + start_i;
+
+    // the last hex digit holds CPUs 0-3
+    for (size_t i = start_i, n = (num_digits*4 - 1); i < end_i; i++, n -= 4) {
+        char c = mask.at(i);
+        int8_t id = c;
+
+        if ((c >= '0' && c <= '9')) {
+            id -= '0';
+        } else if (c >= 'a' && c <= 'f') {
+            id -= 'a' - 10;
+        } else if (c >= 'A' && c <= 'F') {
+            id -= 'A' - 10;
+        } else {
+            fprintf(stderr, "Invalid hex character '%c' at position %d\n", c, int32_t(i));
+            return false;
+        }
+
+        boolmask[  n  ] = boolmask[  n  ] || ((id & 8) != 0);
+        boolmask[n - 1] = boolmask[n - 1] || ((id & 4) != 0);
+        boolmask[n - 2] = boolmask[n - 2] || ((id & 2) != 0);
+        boolmask[n - 3] = boolmask[n - 3] || ((id & 1) != 0);
+    }
+
+    return true;
+}
+
 //
 // CLI argument parsing
 //
@@ -275,6 +351,9 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
     if (!params.tensor_buft_overrides.empty()) {
         params.tensor_buft_overrides.push_back({nullptr, nullptr});
     }
+    if (!params.cache_type_overrides.empty()) {
+        params.cache_type_overrides.push_back({nullptr, GGML_TYPE_COUNT});
+    }
 
     return true;
 }
@@ -297,6 +376,8 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
     return true;
 }
 
+static ggml_type kv_cache_type_from_str(const std::string & s);
+
 namespace {
 bool parse_buft_overrides(const std::string& value, std::vector<llama_model_tensor_buft_override>& overrides) {
     /* static */ std::map<std::string, ggml_backend_buffer_type_t> buft_list;
@@ -329,6 +410,26 @@ bool parse_buft_overrides(const std::string& value, std::vector<llama_model_tens
     }
     return true;
 }
+bool parse_kv_cache_type_overrides(const std::string & value, std::vector<llama_kv_cache_type_override> & overrides) {
+    for (const auto & override : string_split<std::string>(value, ',')) {
+        std::string::size_type pos = override.find('=');
+        if (pos == std::string::npos) {
+            fprintf(stderr, "Invalid KV cache type override argument %s\n", value.c_str());
+            return false;
+        }
+        std::string tensor_name = override.substr(0, pos);
+        std::string cache_type  = override.substr(pos + 1);
+        ggml_type type;
+        try {
+            type = kv_cache_type_from_str(cache_type);
+        } catch (const std::exception & e) {
+            fprintf(stderr, "%s\n", e.what());
+            return false;
+        }
+        overrides.push_back({strdup(tensor_name.c_str()), type});
+    }
+    return true;
+}
 template<class T1, class T2>
 std::vector<std::pair<T1,T2>> string_split_pairs(const std::string & str, char delim) {
     std::vector<std::pair<T1,T2>> values;
@@ -397,6 +498,40 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         }
         return true;
     }
+    if (arg == "--poll") {
+        CHECK_ARG
+        params.poll = std::stoi(argv[i]);
+        if (params.poll > 100) {
+            invalid_param = true;
+        }
+        return true;
+    }
+    if (arg == "-C" || arg == "--cpu-mask") {
+        CHECK_ARG
+        if (!parse_cpu_mask(argv[i], params.cpu_mask)) {
+            invalid_param = true;
+        }
+        return true;
+    }
+    if (arg == "-Cr" || arg == "--cpu-range") {
+        CHECK_ARG
+        if (!parse_cpu_range(argv[i], params.cpu_mask)) {
+            invalid_param = true;
+        }
+        return true;
+    }
+    if (arg == "--cpu-strict") {
+        params.cpu_strict = true;
+        return true;
+    }
+    if (arg == "--dep-barriers") {
+        params.dep_barriers = true;
+        return true;
+    }
+    if (arg == "-gr" || arg == "--graph-reuse") {
+        params.graph_reuse = true;
+        return true;
+    }
     if (arg == "-p" || arg == "--prompt") {
         CHECK_ARG
         params.prompt = argv[i];
@@ -566,6 +701,35 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.defrag_thold = std::stof(argv[i]);
         return true;
     }
+    if (arg == "--defrag-max-cells") {
+        CHECK_ARG
+        params.defrag_max_cells = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--defrag-async") {
+        params.defrag_async = true;
+        return true;
+    }
+    if (arg == "--kv-block-size" || arg == "-kvb") {
+        CHECK_ARG
+        params.kv_block_size = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--kv-budget") {
+        CHECK_ARG
+        params.kv_budget = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--kv-budget-sink") {
+        CHECK_ARG
+        params.kv_budget_sink = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--kv-budget-recent") {
+        CHECK_ARG
+        params.kv_budget_recent = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "--samplers") {
         CHECK_ARG
         const auto sampler_names = string_split(argv[i], ';');
@@ -857,6 +1021,14 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.cache_type_v = argv[++i];
         return true;
     }
+    if (arg == "-cto" || arg == "--cache-type-override") {
+        CHECK_ARG
+        if (!parse_kv_cache_type_overrides(std::string{argv[i]}, params.cache_type_overrides)) {
+            fprintf(stderr, "error: Invalid KV cache type override: %s\n", argv[i]);
+            invalid_param = true;
+        }
+        return true;
+    }
     if (arg == "-mli" || arg == "--multiline-input") {
         params.multiline_input = true;
         return true;
@@ -891,6 +1063,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.fused_moe_up_gate = true;
         return true;
     }
+    if (arg == "-fqkv" || arg == "--fused-qkv") {
+        params.fused_qkv = true;
+        return true;
+    }
     if (arg == "-ser" || arg == "--smart-expert-reduction") {
         CHECK_ARG
         auto values = string_split_pairs<int,float>(argv[i], ',');
@@ -997,7 +1173,26 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
     }
     if (arg == "-rtr" || arg == "--run-time-repack") {
         params.repack_tensors = true;
-        params.use_mmap = false;
+        return true;
+    }
+    if (arg == "--rtr-cache") {
+        CHECK_ARG
+        params.repack_cache = argv[i];
+        return true;
+    }
+    if (arg == "--shm-model") {
+        CHECK_ARG
+        params.shm_model = argv[i];
+        return true;
+    }
+    if (arg == "--expert-paging") {
+        params.expert_paging = true;
+        return true;
+    }
+    if (arg == "--expert-pin") {
+        CHECK_ARG
+        params.expert_pin_mb = std::stoi(argv[i]);
+        params.expert_paging = true;
         return true;
     }
     if (arg == "-thp" || arg == "--transparent-huge-pages") {
@@ -1010,6 +1205,7 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
         else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
         else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+        else if (value == "split") { params.numa = GGML_NUMA_STRATEGY_SPLIT; }
         else { invalid_param = true; }
         return true;
     }
@@ -1333,6 +1529,30 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.slot_prompt_similarity = std::stof(argv[i]);
         return true;
     }
+    if (arg == "--prefix-cache" || arg == "-pc") {
+        CHECK_ARG
+        params.n_prefix_cache = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--kv-spill") {
+        CHECK_ARG
+        params.kv_spill_mem = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--kv-spill-disk") {
+        CHECK_ARG
+        params.kv_spill_disk = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--kv-spill-path") {
+        CHECK_ARG
+        params.kv_spill_path = argv[i];
+        return true;
+    }
+    if (arg == "--ctx-shift-sink") {
+        params.ctx_shift_sink = true;
+        return true;
+    }
     if (arg == "-pps") {
         params.is_pp_shared = true;
         return true;
@@ -1465,6 +1685,16 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         else { invalid_param = true; }
         return true;
     }
+    if (arg == "--profile") {
+        CHECK_ARG
+        params.profile_file = argv[i];
+        return true;
+    }
+    if (arg == "--iqk-tune") {
+        CHECK_ARG
+        params.iqk_tune_file = argv[i];
+        return true;
+    }
 
 #ifndef LOG_DISABLE_LOGS
     // Parse args for logging parameters
@@ -1545,6 +1775,13 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "*",           "-s,    --seed SEED",            "RNG seed (default: %d, use random seed for < 0)", params.seed });
     options.push_back({ "*",           "-t,    --threads N",            "number of threads to use during generation (default: %d)", params.n_threads });
     options.push_back({ "*",           "-tb,   --threads-batch N",      "number of threads to use during batch and prompt processing (default: same as --threads)" });
+    options.push_back({ "*",           "       --poll N",               "use a persistent CPU thread pool that polls for work at level N before sleeping, 0-100\n"
+                                                                        "(default: %d, -1 = no persistent thread pool)", params.poll });
+    options.push_back({ "*",           "-C,    --cpu-mask M",           "CPU affinity mask of the thread pool (--poll): arbitrarily long hex (default: \"\")" });
+    options.push_back({ "*",           "-Cr,   --cpu-range lo-hi",      "range of CPUs for the thread pool affinity, complements --cpu-mask" });
+    options.push_back({ "*",           "       --cpu-strict",           "pin each thread pool thread to a single CPU from the mask (default: %s)", params.cpu_strict ? "true" : "false" });
+    options.push_back({ "*",           "       --dep-barriers",         "only synchronize the threads between graph nodes that depend on each other (default: %s)", params.dep_barriers ? "true" : "false" });
+    options.push_back({ "*",           "-gr,   --graph-reuse",          "reuse the graph of the previous token during generation on the CPU (default: %s)", params.graph_reuse ? "true" : "false" });
     options.push_back({ "speculative", "-td,   --threads-draft N",      "number of threads to use during generation (default: same as --threads)" });
     options.push_back({ "speculative", "-tbd,  --threads-batch-draft N",
                                                                         "number of threads to use during batch and prompt processing (default: same as --threads-draft)" });
@@ -1565,6 +1802,8 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "*",           "-mla,  --mla-use",              "enable MLA (default: %d)", params.mla_attn });
     options.push_back({ "*",           "-amb,  --attention-max-batch",  "max batch size for attention computations (default: %d)", params.attn_max_batch});
     options.push_back({ "*",           "-fmoe, --fused-moe",            "enable fused MoE (default: %s)", params.fused_moe_up_gate ? "enabled" : "disabled" });
+    options.push_back({ "*",           "-fqkv, --fused-qkv",            "merge the Q, K, V projections into one matmul at load time (disables mmap) and fuse\n"
+                                                                        "the attention output projection with the residual add (default: %s)", params.fused_qkv ? "enabled" : "disabled" });
     options.push_back({ "*",         "-ser,  --smart-expert-reduction,","experts reduction (default: %d,%g)", params.min_experts, params.thresh_experts});
     options.push_back({ "*",           "-p,    --prompt PROMPT",        "prompt to start generation with\n"
                                                                         "in conversation mode, this will be used as system prompt\n"
@@ -1663,6 +1902,9 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "*",           "-nkvo, --no-kv-offload",        "disable KV offload" });
     options.push_back({ "*",           "-ctk,  --cache-type-k TYPE",    "KV cache data type for K (default: %s)", params.cache_type_k.c_str() });
     options.push_back({ "*",           "-ctv,  --cache-type-v TYPE",    "KV cache data type for V (default: %s)", params.cache_type_v.c_str() });
+    options.push_back({ "*",           "-cto,  --cache-type-override PATTERN=TYPE,...",
+                                                                        "KV cache data type of the cache tensors matching PATTERN (cache_k_l<layer>, cache_v_l<layer>).\n"
+                                                                        "example: -cto \"cache_[kv]_l(0|1)$=q8_0\"" });
 
     options.push_back({ "perplexity" });
     options.push_back({ "perplexity",  "       --all-logits",           "return logits for all tokens in the batch (default: %s)", params.logits_all ? "true" : "false" });
@@ -1680,6 +1922,15 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
 
     options.push_back({ "parallel" });
     options.push_back({ "*",           "-dt,   --defrag-thold N",       "KV cache defragmentation threshold (default: %.1f, < 0 - disabled)", (double)params.defrag_thold });
+    options.push_back({ "*",           "       --defrag-max-cells N",   "move at most N KV cells per defragmentation step, the next decodes continue (default: %d, 0 - no limit)", params.defrag_max_cells });
+    options.push_back({ "*",           "       --defrag-async",         "move the KV data of the defragmentation on a separate thread while the next batch is prepared,\n"
+                                                                        "needs a KV cache in host memory (default: %s)", params.defrag_async ? "true" : "false" });
+    options.push_back({ "*",           "-kvb,  --kv-block-size N",      "hand out KV cache cells to the sequences in blocks of N cells (paged KV cache)\n"
+                                                                        "the slots of the server share the whole context (default: %d, 0 - contiguous)", params.kv_block_size });
+    options.push_back({ "*",           "       --kv-budget N",          "keep at most N KV cells per sequence, the cells that got the least attention are evicted\n"
+                                                                        "(default: %d, 0 - unlimited)", params.kv_budget });
+    options.push_back({ "*",           "       --kv-budget-sink N",     "the first N cells of a sequence are never evicted (default: %d)", params.kv_budget_sink });
+    options.push_back({ "*",           "       --kv-budget-recent N",   "the last N cells of a sequence are never evicted (default: %d)", params.kv_budget_recent });
     options.push_back({ "*",           "-np,   --parallel N",           "number of parallel sequences to decode (default: %d)", params.n_parallel });
     options.push_back({ "*",           "-ns,   --sequences N",          "number of sequences to decode (default: %d)", params.n_sequences });
     options.push_back({ "*",           "-cb,   --cont-batching",        "enable continuous batching (a.k.a dynamic batching) (default: %s)", params.cont_batching ? "enabled" : "disabled" });
@@ -1698,11 +1949,23 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     if (llama_supports_mmap()) {
         options.push_back({ "*",           "       --no-mmap",              "do not memory-map model (slower load but may reduce pageouts if not using mlock)" });
     }
-    options.push_back({ "*",           "       --run-time-repack",      "repack tensors if interleaved variant is available"});
+    options.push_back({ "*",           "-rtr, --run-time-repack",       "repack tensors if interleaved variant is available (disables mmap unless the repack cache is used)"});
+    options.push_back({ "*",           "       --rtr-cache DIR",        "write the run-time repacked model to DIR on the first load and memory map it on later loads\n"
+                                                                        "(default: none)" });
+    options.push_back({ "*",           "       --shm-model NAME",       "share the loaded (and repacked) model between processes through the shared memory segment\n"
+                                                                        "NAME: the first process publishes it, the others map it read-only (linux only, default: none)" });
+    options.push_back({ "*",           "-thp, --transparent-huge-pages", "back the weights, the KV cache and the compute buffers with huge pages (hugetlbfs pages\n"
+                                                                        "if reserved, transparent huge pages otherwise; linux only)" });
+    options.push_back({ "*",           "       --expert-paging",        "prefetch the selected experts of MoE models and the most used ones of the next layer\n"
+                                                                        "(for memory mapped models larger than the RAM)" });
+    options.push_back({ "*",           "       --expert-pin N",         "with expert paging, lock the most used experts in RAM up to N MiB (default: %d)", params.expert_pin_mb });
+    options.push_back({ "*",           "       --iqk-tune FNAME",       "autotune the CPU matmul tile sizes and thread split for the model's weight shapes,\n"
+                                                                        "results are cached in FNAME per CPU model (default: none)" });
     options.push_back({ "*",           "       --numa TYPE",            "attempt optimizations that help on some NUMA systems\n"
                                                                         "  - distribute: spread execution evenly over all nodes\n"
                                                                         "  - isolate: only spawn threads on CPUs on the node that execution started on\n"
                                                                         "  - numactl: use the CPU map provided by numactl\n"
+                                                                        "  - split: distribute, and split the matmul weights so each node computes its local rows\n"
                                                                         "if run without this previously, it is recommended to drop the system page cache before using this\n"
                                                                         "see https://github.com/ggerganov/llama.cpp/issues/1437" });
 
@@ -1767,6 +2030,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "bench",       "-npp n0,n1,...",                "number of prompt tokens" });
     options.push_back({ "bench",       "-ntg n0,n1,...",                "number of text generation tokens" });
     options.push_back({ "bench",       "-npl n0,n1,...",                "number of parallel prompts" });
+    options.push_back({ "bench",       "       --profile FNAME",        "record a per-op CPU profile, print a summary and write it to FNAME in Chrome trace format (sweep-bench)" });
 
     options.push_back({ "embedding" });
     options.push_back({ "embedding",   "       --embd-normalize",       "normalisation for embendings (default: %d) (-1=none, 0=max absolute int16, 1=taxicab, 2=euclidean, >2=p-norm)", params.embd_normalize });
@@ -1797,6 +2061,12 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
                                                                         "https://github.com/ggerganov/llama.cpp/wiki/Templates-supported-by-llama_chat_apply_template" });
     options.push_back({ "server",      "-sps,  --slot-prompt-similarity SIMILARITY",
                                                                         "how much the prompt of a request must match the prompt of a slot in order to use that slot (default: %.2f, 0.0 = disabled)\n", params.slot_prompt_similarity });
+    options.push_back({ "server",      "-pc,   --prefix-cache N",       "number of prompt prefixes kept in the KV cache after use and shared between the slots (default: %d, 0 = disabled)", params.n_prefix_cache });
+    options.push_back({ "server",      "       --kv-spill N",           "MiB of host memory for the KV of conversations that lost their slot, restored when they resume (default: %d, 0 = disabled)", params.kv_spill_mem });
+    options.push_back({ "server",      "       --kv-spill-path PATH",   "directory for the spilled KV that does not fit into --kv-spill (default: none)" });
+    options.push_back({ "server",      "       --kv-spill-disk N",      "MiB of disk space for the spilled KV in --kv-spill-path (default: %d)", params.kv_spill_disk });
+    options.push_back({ "server",      "       --ctx-shift-sink",       "context shift moves the n_keep attention sink tokens forward instead of the rest of the context back,\n"
+                                                                        "so that only the sink tokens are re-rotated (not with a system prompt or --prefix-cache) (default: %s)", params.ctx_shift_sink ? "enabled" : "disabled" });
     options.push_back({ "server",      "       --lora-init-without-apply",     "load LoRA adapters without applying them (apply later via POST /lora-adapters) (default: %s)", params.lora_init_without_apply ? "enabled" : "disabled"});
 
 #ifndef LOG_DISABLE_LOGS
@@ -2268,6 +2538,10 @@ struct llama_init_result llama_init_from_gpt_params(gpt_params & params) {
         params.sparams.logit_bias[llama_token_eos(model)] = -INFINITY;
     }
 
+    if (!params.iqk_tune_file.empty()) {
+        llama_iqk_tune(lctx, params.iqk_tune_file.c_str());
+    }
+
     if (params.warmup) {
         LOG("warming up the model with an empty run\n");
 
@@ -2327,7 +2601,12 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
     mparams.repack_tensors  = params.repack_tensors;
+    mparams.repack_cache    = params.repack_cache.empty() ? nullptr : params.repack_cache.c_str();
+    mparams.shm_model       = params.shm_model.empty() ? nullptr : params.shm_model.c_str();
     mparams.use_thp         = params.use_thp;
+    mparams.fused_qkv       = params.fused_qkv;
+    mparams.expert_paging   = params.expert_paging;
+    mparams.expert_pin_mb   = params.expert_pin_mb;
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -2391,6 +2670,12 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.n_ubatch          = params.n_ubatch;
     cparams.n_threads         = params.n_threads;
     cparams.n_threads_batch   = params.n_threads_batch == -1 ? params.n_threads : params.n_threads_batch;
+    cparams.poll              = params.poll;
+    cparams.cpu_mask          = params.cpu_mask;
+    cparams.cpu_strict        = params.cpu_strict;
+    cparams.dep_barriers      = params.dep_barriers;
+    cparams.graph_reuse       = params.graph_reuse;
+    cparams.profile           = !params.profile_file.empty();
     cparams.seed              = params.seed;
     cparams.logits_all        = params.logits_all;
     cparams.embeddings        = params.embedding;
@@ -2405,6 +2690,12 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.defrag_max_cells  = params.defrag_max_cells;
+    cparams.defrag_async      = params.defrag_async;
+    cparams.kv_block_size     = params.kv_block_size;
+    cparams.kv_budget         = params.kv_budget;
+    cparams.kv_budget_sink    = params.kv_budget_sink;
+    cparams.kv_budget_recent  = params.kv_budget_recent;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -2412,12 +2703,20 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.mla_attn          = params.mla_attn;
     cparams.attn_max_batch    = params.attn_max_batch;
     cparams.fused_moe_up_gate = params.fused_moe_up_gate;
+    cparams.fused_attn_out    = params.fused_qkv;
     cparams.min_experts       = params.min_experts;
     cparams.thresh_experts    = params.thresh_experts;
 
     cparams.type_k = kv_cache_type_from_str(params.cache_type_k);
     cparams.type_v = kv_cache_type_from_str(params.cache_type_v);
 
+    if (params.cache_type_overrides.empty()) {
+        cparams.kv_type_overrides = NULL;
+    } else {
+        GGML_ASSERT(params.cache_type_overrides.back().pattern == nullptr && "KV cache type overrides not terminated with empty pattern");
+        cparams.kv_type_overrides = params.cache_type_overrides.data();
+    }
+
     return cparams;
 }
 
@@ -3383,7 +3682,11 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "n_probs: %d # only used by server binary, default: 0\n", sparams.n_probs);
     fprintf(stream, "no_mmap: %s # default: false\n", !params.use_mmap ? "true" : "false");
     fprintf(stream, "repack: %s # default: false\n", params.repack_tensors ? "true" : "false");
+    fprintf(stream, "repack_cache: %s # default:\n", params.repack_cache.c_str());
+    fprintf(stream, "shm_model: %s # default:\n", params.shm_model.c_str());
     fprintf(stream, "use_thp: %s # default: false\n", params.use_thp ? "true" : "false");
+    fprintf(stream, "expert_paging: %s # default: false\n", params.expert_paging ? "true" : "false");
+    fprintf(stream, "expert_pin_mb: %d # default: 0\n", params.expert_pin_mb);
     fprintf(stream, "penalize_nl: %s # default: false\n", sparams.penalize_nl ? "true" : "false");
     fprintf(stream, "ppl_output_type: %d # default: 0\n", params.ppl_output_type);
     fprintf(stream, "ppl_stride: %d # default: 0\n", params.ppl_stride);
@@ -3415,6 +3718,7 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "mla_attn: %d # default: 0\n", params.mla_attn);
     fprintf(stream, "attn_max_batch: %d # default: 0\n", params.attn_max_batch);
     fprintf(stream, "fused_moe: %s # default: false\n", params.fused_moe_up_gate ? "true" : "false");
+    fprintf(stream, "fused_qkv: %s # default: false\n", params.fused_qkv ? "true" : "false");
     fprintf(stream, "ser: %d,%g # defaulr: -1,0\n", params.min_experts, params.thresh_experts);
     fprintf(stream, "temp: %f # default: 0.8\n", sparams.temp);
 
@@ -3423,6 +3727,9 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
 
     fprintf(stream, "tfs: %f # default: 1.0\n", sparams.tfs_z);
     fprintf(stream, "threads: %d # default: %u\n", params.n_threads, std::thread::hardware_concurrency());
+    fprintf(stream, "poll: %d # default: -1\n", params.poll);
+    fprintf(stream, "dep_barriers: %s # default: false\n", params.dep_barriers ? "true" : "false");
+    fprintf(stream, "graph_reuse: %s # default: false\n", params.graph_reuse ? "true" : "false");
     fprintf(stream, "top_k: %d # default: 40\n", sparams.top_k);
     fprintf(stream, "top_p: %f # default: 0.95\n", sparams.top_p);
     fprintf(stream, "min_p: %f # default: 0.0\n", sparams.min_p);
@@ -64,6 +64,10 @@ struct llama_control_vector_load_info;
 int32_t cpu_get_num_physical_cores();
 int32_t cpu_get_num_math();
 
+// parse a hex CPU mask (e.g. "0xff00") or a CPU range (e.g. "8-15") into mask[GGML_MAX_N_THREADS]
+bool parse_cpu_mask (const std::string & mask,  bool (&boolmask)[GGML_MAX_N_THREADS]);
+bool parse_cpu_range(const std::string & range, bool (&boolmask)[GGML_MAX_N_THREADS]);
+
 //
 // CLI argument parsing
 //
@@ -81,6 +85,12 @@ struct gpt_params {
     int32_t n_threads_draft       =    -1;
     int32_t n_threads_batch       =    -1; // number of threads to use for batch processing (-1 = use n_threads)
     int32_t n_threads_batch_draft =    -1;
+    int32_t poll                  =    -1; // CPU thread pool polling level (0 - no polling, 100 - aggressive polling, -1 - no thread pool)
+    bool    cpu_mask[GGML_MAX_N_THREADS] = {false}; // CPU affinity mask of the thread pool (all false - no affinity)
+    bool    cpu_strict            = false; // pin each thread pool thread to a single CPU from cpu_mask
+    bool    dep_barriers          = false; // only synchronize the threads between dependent graph nodes
+    bool    graph_reuse           = false; // reuse the graph of the previous token during generation
+    bool    defrag_async          = false; // move the KV data of the defragmentation on a separate thread
     int32_t n_predict             =    -1; // new tokens to predict
     int32_t n_ctx                 =     0; // context size
     int32_t n_batch               =  2048; // logical batch size for prompt processing (must be >=32 to use BLAS)
@@ -106,6 +116,11 @@ struct gpt_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          = -1.0f; // KV cache defragmentation threshold
+    int32_t defrag_max_cells      =     0; // KV cells moved per defragmentation step (0 = no limit)
+    int32_t kv_block_size         =     0; // KV cells are handed out to the sequences in blocks of this size (0 = contiguous)
+    int32_t kv_budget             =     0; // KV cells per sequence, the cells with the least attention are evicted (0 = unlimited)
+    int32_t kv_budget_sink        =     4; // the first cells of a sequence are never evicted
+    int32_t kv_budget_recent      =    64; // the last cells of a sequence are never evicted
 
     ggml_backend_sched_eval_callback cb_eval = nullptr;
     void * cb_eval_user_data                 = nullptr;
@@ -185,6 +200,7 @@ struct gpt_params {
     int  mla_attn          = 0;     // MLA 0: standard attention, 1: MLA with K and transposed V cache, 2: MLA with just K cache
     int  attn_max_batch    = 0;     // Max batch size to use when computing attention (only applicable if flash_attn = false)
     bool fused_moe_up_gate = false; // fused up*unary(gate) op for MoE models
+    bool fused_qkv         = false; // merged Q/K/V projection and Wo fused with the residual add
     int  min_experts       = -1;
     float thresh_experts   = 0;
 
@@ -202,9 +218,12 @@ struct gpt_params {
     bool check_tensors     = false; // validate tensor data
     bool repack_tensors    = false; // repack tensors if interleaved variant is available
     bool use_thp           = false; // use transparent huge pages (linux only)
+    bool expert_paging     = false; // count, prefetch and pin the routed experts of MoE models
+    int32_t expert_pin_mb  = 0;     // MiB of the most used experts locked in RAM with expert paging
 
     std::string cache_type_k = "f16"; // KV cache data type for the K
     std::string cache_type_v = "f16"; // KV cache data type for the V
+    std::vector<llama_kv_cache_type_override> cache_type_overrides; // per layer KV cache data types
 
     // multimodal models (see examples/llava)
     std::string mmproj = "";        // path to multimodal projector
@@ -242,6 +261,14 @@ struct gpt_params {
 
     float slot_prompt_similarity = 0.5f;
 
+    int32_t n_prefix_cache = 0; // number of prompt prefixes kept in the KV cache and shared between the slots
+
+    int32_t     kv_spill_mem  = 0;     // host memory for the KV of conversations evicted from their slot (MiB)
+    int32_t     kv_spill_disk = 16384; // disk space for the KV that does not fit into kv_spill_mem (MiB)
+    std::string kv_spill_path;         // directory for the KV that does not fit into kv_spill_mem
+
+    bool ctx_shift_sink = false; // context shift keeps the n_keep first tokens as attention sinks next to the rest
+
     // batched-bench params
     bool is_pp_shared = false;
 
@@ -284,6 +311,10 @@ struct gpt_params {
     std::string lora_outfile = "ggml-lora-merged-f16.gguf";
 
     bool sweep_bench_output_jsonl = false;
+    std::string profile_file = ""; // per-op CPU profile written in Chrome trace format (sweep-bench)
+    std::string iqk_tune_file = ""; // cache of the autotuned CPU matmul configurations (autotune if not empty)
+    std::string repack_cache  = ""; // directory of the cache of run-time repacked models (no cache if empty)
+    std::string shm_model     = ""; // name of the shared memory segment the model is published in (none if empty)
 };
 
 void gpt_params_handle_hf_token(gpt_params & params);
@@ -0,0 +1,280 @@
+#include "llama-kv-cells.h"
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <set>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// Measures the host side cost of the KV cache cell book keeping: building the KQ mask and the sequence operations,
+// with the cells stored as a structure of arrays with sequence bitmasks (llama_kv_cells) and, for comparison, as
+// an array of cells with a std::set of sequence ids each (the previous layout).
+
+struct benchmark_params_struct {
+    int32_t n_cells      = 128*1024;
+    int32_t n_seq        = 64;
+    int32_t n_shared     = 1024;
+    int32_t n_iterations = 10;
+};
+
+static void print_usage(int /*argc*/, char ** argv, const benchmark_params_struct & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -c N, --cells N       number of KV cells (default: %d)\n", params.n_cells);
+    fprintf(stderr, "  -s N, --sequences N   number of sequences (default: %d)\n", params.n_seq);
+    fprintf(stderr, "  -p N, --shared N      number of cells shared by all sequences (default: %d)\n", params.n_shared);
+    fprintf(stderr, "  -i N, --iter N        number of iterations (default: %d)\n", params.n_iterations);
+    fprintf(stderr, "\n");
+}
+
+// the previous layout of the cells
+struct kv_cell_set {
+    llama_pos pos   = -1;
+    llama_pos delta = 0;
+
+    std::set<llama_seq_id> seq_id;
+
+    bool has_seq_id(llama_seq_id id) const { return seq_id.find(id) != seq_id.end(); }
+    bool is_empty() const { return seq_id.empty(); }
+};
+
+struct kv_cells_set {
+    std::vector<kv_cell_set> cells;
+
+    void fill(const std::vector<llama_pos> & pos, const std::vector<std::vector<llama_seq_id>> & seqs) {
+        cells.assign(pos.size(), kv_cell_set());
+        for (size_t i = 0; i < pos.size(); ++i) {
+            cells[i].pos = pos[i];
+            cells[i].seq_id.insert(seqs[i].begin(), seqs[i].end());
+        }
+    }
+    void mask_row(llama_seq_id seq_id, llama_pos pos, uint32_t n, float * row) const {
+        for (uint32_t i = 0; i < n; ++i) {
+            row[i] = !cells[i].has_seq_id(seq_id) || cells[i].pos > pos ? -INFINITY : 0.0f;
+        }
+    }
+    uint32_t remove_seq(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+        uint32_t n_freed = 0;
+        for (auto & cell : cells) {
+            if (cell.pos >= p0 && cell.pos < p1 && cell.has_seq_id(seq_id)) {
+                cell.seq_id.erase(seq_id);
+                if (cell.is_empty()) {
+                    cell.pos = -1;
+                    ++n_freed;
+                }
+            }
+        }
+        return n_freed;
+    }
+    void copy_seq(llama_seq_id src, llama_seq_id dst, llama_pos p0, llama_pos p1) {
+        for (auto & cell : cells) {
+            if (cell.has_seq_id(src) && cell.pos >= p0 && cell.pos < p1) {
+                cell.seq_id.insert(dst);
+            }
+        }
+    }
+    void keep_seq(llama_seq_id seq_id) {
+        for (auto & cell : cells) {
+            if (!cell.has_seq_id(seq_id)) {
+                cell.pos = -1;
+                cell.seq_id.clear();
+            } else {
+                cell.seq_id.clear();
+                cell.seq_id.insert(seq_id);
+            }
+        }
+    }
+    llama_pos seq_pos_max(llama_seq_id seq_id) const {
+        llama_pos result = 0;
+        for (const auto & cell : cells) {
+            if (cell.has_seq_id(seq_id)) result = std::max(result, cell.pos);
+        }
+        return result;
+    }
+    uint32_t find_free_range(uint32_t n) const {
+        // the linear search of llama_kv_cache_find_slot
+        uint32_t head = 0;
+        while (head + n <= cells.size()) {
+            bool found = true;
+            for (uint32_t i = 0; i < n; ++i) {
+                if (cells[head + i].pos >= 0) {
+                    found = false;
+                    head += i + 1;
+                    break;
+                }
+            }
+            if (found) return head;
+        }
+        return cells.size();
+    }
+};
+
+static void fill_cells(llama_kv_cells & cells, const std::vector<llama_pos> & pos, const std::vector<std::vector<llama_seq_id>> & seqs) {
+    cells.resize(pos.size());
+    for (size_t i = 0; i < pos.size(); ++i) {
+        if (pos[i] < 0) continue;
+        cells.set_pos(i, pos[i]);
+        for (auto s : seqs[i]) cells.seq_add(i, s);
+    }
+}
+
+int main(int argc, char ** argv) {
+    benchmark_params_struct params;
+
+    bool invalid_param = false;
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-c" || arg == "--cells") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_cells = std::stoi(argv[i]);
+        } else if (arg == "-s" || arg == "--sequences") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_seq = std::stoi(argv[i]);
+        } else if (arg == "-p" || arg == "--shared") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_shared = std::stoi(argv[i]);
+        } else if (arg == "-i" || arg == "--iter") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_iterations = std::stoi(argv[i]);
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv, params);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argc, argv, params);
+            exit(1);
+        }
+    }
+    if (invalid_param) {
+        fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+        print_usage(argc, argv, params);
+        exit(1);
+    }
+    if (params.n_seq < 1 || params.n_shared < 0 || params.n_cells <= params.n_shared + 2*params.n_seq) {
+        fprintf(stderr, "error: need n_cells > n_shared + 2*n_sequences\n");
+        exit(1);
+    }
+
+    // a prompt shared by all sequences followed by the tokens of each sequence, 1/8 of the cache is left free
+    const int n_cells  = params.n_cells;
+    const int n_seq    = params.n_seq;
+    const int n_shared = params.n_shared;
+    const int n_per_seq = (n_cells - n_cells/8 - n_shared)/n_seq;
+
+    std::vector<llama_pos> pos(n_cells, -1);
+    std::vector<std::vector<llama_seq_id>> seqs(n_cells);
+    for (int i = 0; i < n_shared; ++i) {
+        pos[i] = i;
+        for (int s = 0; s < n_seq; ++s) seqs[i].push_back(s);
+    }
+    for (int s = 0; s < n_seq; ++s) {
+        for (int j = 0; j < n_per_seq; ++j) {
+            const int i = n_shared + s*n_per_seq + j;
+            pos[i] = n_shared + j;
+            seqs[i].push_back(s);
+        }
+    }
+    // punch a few holes so that the free cells are fragmented
+    for (int i = n_shared; i < n_shared + n_seq*n_per_seq; i += 997) {
+        pos[i] = -1;
+        seqs[i].clear();
+    }
+    const int n_kv = GGML_PAD(n_shared + n_seq*n_per_seq, 256);
+
+    kv_cells_set   cells_set;
+    llama_kv_cells cells_soa;
+
+    std::vector<float> mask(size_t(n_kv)*std::max(n_seq, 512));
+
+    printf("\nn_cells = %d, n_sequences = %d, n_shared = %d, n_kv = %d, n_iterations = %d\n\n",
+            n_cells, n_seq, n_shared, n_kv, params.n_iterations);
+    printf("| %-36s | %12s | %12s | %8s |\n", "operation", "std::set us", "bitmask us", "speedup");
+    printf("| %-36s | %12s | %12s | %8s |\n", "------------------------------------", "-----------:", "-----------:", "-------:");
+
+    volatile int64_t sink = 0;
+
+    // times op over the iterations, the cells are refilled before each call if reset is set
+    auto time_op = [&](const std::function<void()> & reset, const std::function<void()> & op) {
+        int64_t t_total = 0;
+        for (int it = 0; it < params.n_iterations; ++it) {
+            if (reset) reset();
+            const int64_t t_start = ggml_time_us();
+            op();
+            t_total += ggml_time_us() - t_start;
+        }
+        return double(t_total)/params.n_iterations;
+    };
+
+    auto reset_set = [&]() { cells_set.fill(pos, seqs); };
+    auto reset_soa = [&]() { fill_cells(cells_soa, pos, seqs); };
+    reset_set();
+    reset_soa();
+
+    struct test {
+        std::string name;
+        bool        modifies;
+        std::function<void()> op_set;
+        std::function<void()> op_soa;
+    };
+
+    const llama_pos p_mid = n_shared + n_per_seq/2;
+
+    std::vector<test> tests = {
+        { "mask, " + std::to_string(n_seq) + " seqs x 1 token", false,
+            [&]() { for (int s = 0; s < n_seq; ++s) cells_set.mask_row(s, n_shared + n_per_seq, n_kv, mask.data() + size_t(s)*n_kv); },
+            [&]() { for (int s = 0; s < n_seq; ++s) cells_soa.mask_row(s, n_shared + n_per_seq, n_kv, mask.data() + size_t(s)*n_kv); } },
+        { "mask, 1 seq x 512 tokens", false,
+            [&]() { for (int j = 0; j < 512; ++j) cells_set.mask_row(0, n_shared + j, n_kv, mask.data() + size_t(j)*n_kv); },
+            [&]() { for (int j = 0; j < 512; ++j) cells_soa.mask_row(0, n_shared + j, n_kv, mask.data() + size_t(j)*n_kv); } },
+        { "seq_rm (second half of a sequence)", true,
+            [&]() { sink += cells_set.remove_seq(n_seq/2, p_mid, -1u >> 1); },
+            [&]() { uint32_t f; sink += cells_soa.remove_seq(n_seq/2, p_mid, -1u >> 1, f); } },
+        { "seq_cp (whole sequence)", true,
+            [&]() { cells_set.copy_seq(0, n_seq - 1, 0, -1u >> 1); },
+            [&]() { cells_soa.copy_seq(0, n_seq - 1, 0, -1u >> 1); } },
+        { "seq_keep", true,
+            [&]() { cells_set.keep_seq(n_seq/2); },
+            [&]() { uint32_t f; sink += cells_soa.keep_seq(n_seq/2, f); } },
+        { "seq_pos_max", false,
+            [&]() { sink += cells_set.seq_pos_max(n_seq - 1); },
+            [&]() { sink += cells_soa.seq_pos_max(n_seq - 1); } },
+        { "find_slot, 512 tokens", false,
+            [&]() { sink += cells_set.find_free_range(512); },
+            [&]() { sink += cells_soa.find_free_range(0, 512); } },
+        { "find_slot, 1 token", false,
+            [&]() { sink += cells_set.find_free_range(1); },
+            [&]() { sink += cells_soa.find_free_range(0, 1); } },
+    };
+
+    for (const auto & t : tests) {
+        const double t_set = time_op(t.modifies ? std::function<void()>(reset_set) : nullptr, t.op_set);
+        const double t_soa = time_op(t.modifies ? std::function<void()>(reset_soa) : nullptr, t.op_soa);
+        printf("| %-36s | %12.1f | %12.1f | %7.1fx |\n", t.name.c_str(), t_set, t_soa, t_soa > 0 ? t_set/t_soa : 0.0);
+    }
+
+    return 0;
+}
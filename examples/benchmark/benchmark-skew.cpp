@@ -0,0 +1,247 @@
+#include "common.h"
+#include "ggml.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// Measures the latency distribution of the dense and MoE matmuls with the static split of the rows between
+// threads and with the dynamically claimed chunks, while "noisy neighbour" threads compete for the CPUs.
+
+struct benchmark_params_struct {
+    int32_t   n_threads    = 4;
+    int32_t   n_skew       = 1;
+    int32_t   n_iterations = 200;
+    int32_t   n_tokens     = 1;
+    ggml_type type         = GGML_TYPE_Q4_0;
+};
+
+static void print_usage(int /*argc*/, char ** argv, const benchmark_params_struct & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
+    fprintf(stderr, "  -s N, --skew N        number of busy threads competing with the computation (default: %d)\n", params.n_skew);
+    fprintf(stderr, "  -i N, --iter N        number of iterations (default: %d)\n", params.n_iterations);
+    fprintf(stderr, "  -n N, --tokens N      number of activation columns (default: %d)\n", params.n_tokens);
+    fprintf(stderr, "  -q T, --type T        type of the weights (default: %s)\n", ggml_type_name(params.type));
+    fprintf(stderr, "\n");
+}
+
+static ggml_tensor * new_weights(ggml_context * ctx, ggml_type type, int64_t ne0, int64_t ne1, int64_t ne2, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> data(ne0*ne1*ne2);
+    for (auto & x : data) {
+        x = dist(rng);
+    }
+    ggml_tensor * t = ggml_new_tensor_3d(ctx, type, ne0, ne1, ne2);
+    ggml_quantize_chunk(type, data.data(), t->data, 0, ne1*ne2, ne0, nullptr);
+    return t;
+}
+
+struct latency_stats {
+    double avg, p50, p90, p99, max;
+};
+
+static latency_stats run(ggml_cgraph * graph, ggml_threadpool * threadpool, const benchmark_params_struct & params,
+        int chunks_per_thread, std::vector<uint8_t> & work_buffer) {
+    ggml_cplan plan = ggml_graph_plan(graph, params.n_threads);
+    plan.threadpool        = threadpool;
+    plan.chunks_per_thread = chunks_per_thread;
+    work_buffer.resize(plan.work_size);
+    plan.work_data = work_buffer.data();
+
+    // warmup
+    for (int i = 0; i < 3; ++i) {
+        ggml_graph_compute(graph, &plan);
+    }
+
+    std::vector<double> t_us;
+    for (int i = 0; i < params.n_iterations; ++i) {
+        const int64_t t_start = ggml_time_us();
+        ggml_graph_compute(graph, &plan);
+        t_us.push_back(ggml_time_us() - t_start);
+    }
+    std::sort(t_us.begin(), t_us.end());
+
+    auto pct = [&t_us](double p) { return t_us[std::min(t_us.size() - 1, size_t(p*t_us.size()))]; };
+
+    latency_stats stats;
+    stats.avg = 0;
+    for (double t : t_us) {
+        stats.avg += t;
+    }
+    stats.avg /= t_us.size();
+    stats.p50 = pct(0.50);
+    stats.p90 = pct(0.90);
+    stats.p99 = pct(0.99);
+    stats.max = t_us.back();
+    return stats;
+}
+
+int main(int argc, char ** argv) {
+    benchmark_params_struct params;
+
+    bool invalid_param = false;
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-t" || arg == "--threads") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_threads = std::stoi(argv[i]);
+        } else if (arg == "-s" || arg == "--skew") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_skew = std::stoi(argv[i]);
+        } else if (arg == "-i" || arg == "--iter") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_iterations = std::stoi(argv[i]);
+        } else if (arg == "-n" || arg == "--tokens") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_tokens = std::stoi(argv[i]);
+        } else if (arg == "-q" || arg == "--type") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.type = GGML_TYPE_COUNT;
+            for (int j = 0; j < GGML_TYPE_COUNT; ++j) {
+                const char * name = ggml_type_name(ggml_type(j));
+                if (name && strcmp(name, argv[i]) == 0) {
+                    params.type = ggml_type(j);
+                }
+            }
+            if (params.type == GGML_TYPE_COUNT) {
+                invalid_param = true;
+                break;
+            }
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv, params);
+            exit(0);
+        } else {
+            invalid_param = true;
+            break;
+        }
+    }
+    if (invalid_param || params.n_threads < 1 || params.n_iterations < 1 || params.n_tokens < 1) {
+        fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+        print_usage(argc, argv, params);
+        exit(1);
+    }
+
+    print_build_info();
+
+    const int64_t n_embd     = 4096;
+    const int64_t n_ff       = 4096;
+    const int64_t n_ff_exp   = 1536;
+    const int64_t n_expert   = 16;
+    const int64_t n_exp_used = 4;
+
+    ggml_init_params ip = {
+        /*.mem_size   =*/ ggml_row_size(params.type, n_embd)*(n_ff + n_ff_exp*n_expert) +
+                          ggml_row_size(GGML_TYPE_F32, n_embd)*(n_exp_used + 1)*params.n_tokens +
+                          ggml_row_size(GGML_TYPE_F32, n_ff)*params.n_tokens +
+                          ggml_row_size(GGML_TYPE_F32, n_ff_exp)*n_exp_used*params.n_tokens + 1024*1024,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+    ggml_context * ctx = ggml_init(ip);
+    if (!ctx) {
+        fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+        return 1;
+    }
+
+    std::mt19937 rng(1234);
+
+    ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, params.n_tokens);
+    ggml_set_f32(x, 0.5f);
+
+    ggml_tensor * w = new_weights(ctx, params.type, n_embd, n_ff, 1, rng);
+    ggml_cgraph * gf_dense = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf_dense, ggml_mul_mat(ctx, w, x));
+
+    ggml_tensor * as  = new_weights(ctx, params.type, n_embd, n_ff_exp, n_expert, rng);
+    ggml_tensor * xe  = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd, n_exp_used, params.n_tokens);
+    ggml_tensor * ids = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, n_exp_used, params.n_tokens);
+    ggml_set_f32(xe, 0.5f);
+    for (int i = 0; i < params.n_tokens; ++i) {
+        std::vector<int32_t> experts(n_expert);
+        for (int j = 0; j < n_expert; ++j) {
+            experts[j] = j;
+        }
+        std::shuffle(experts.begin(), experts.end(), rng);
+        memcpy((char *) ids->data + i*ids->nb[1], experts.data(), n_exp_used*sizeof(int32_t));
+    }
+    ggml_cgraph * gf_moe = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf_moe, ggml_mul_mat_id(ctx, as, xe, ids));
+
+    ggml_threadpool_params tpp = ggml_threadpool_params_default(params.n_threads);
+    ggml_threadpool * threadpool = ggml_threadpool_new(&tpp);
+
+    // the noisy neighbours
+    std::atomic<bool> done(false);
+    std::vector<std::thread> skew_threads;
+    for (int i = 0; i < params.n_skew; ++i) {
+        skew_threads.emplace_back([&done]() {
+            volatile uint64_t n = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                n = n + 1;
+            }
+        });
+    }
+
+    printf("\ntype = %s, n_threads = %d, n_skew = %d, n_tokens = %d, n_iterations = %d\n\n",
+            ggml_type_name(params.type), params.n_threads, params.n_skew, params.n_tokens, params.n_iterations);
+    printf("| %-24s | %-10s | %9s | %9s | %9s | %9s | %9s |\n", "matmul", "split", "avg us", "p50 us", "p90 us", "p99 us", "max us");
+    printf("| %-24s | %-10s | %9s | %9s | %9s | %9s | %9s |\n", "------------------------", "----------", "--------:", "--------:", "--------:", "--------:", "--------:");
+
+    std::vector<uint8_t> work_buffer;
+
+    const struct {
+        const char  * name;
+        ggml_cgraph * graph;
+    } tests[] = {
+        { "dense",                    gf_dense },
+        { "moe (mul_mat_id)",         gf_moe   },
+    };
+    for (const auto & test : tests) {
+        for (int chunks_per_thread : { 1, 0 }) {
+            const latency_stats stats = run(test.graph, threadpool, params, chunks_per_thread, work_buffer);
+            printf("| %-24s | %-10s | %9.1f | %9.1f | %9.1f | %9.1f | %9.1f |\n", test.name,
+                    chunks_per_thread == 1 ? "static" : "dynamic", stats.avg, stats.p50, stats.p90, stats.p99, stats.max);
+        }
+    }
+
+    done = true;
+    for (auto & t : skew_threads) {
+        t.join();
+    }
+
+    ggml_threadpool_free(threadpool);
+    ggml_free(ctx);
+
+    return 0;
+}
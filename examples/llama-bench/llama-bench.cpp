@@ -242,6 +242,9 @@ struct cmd_params {
     std::vector<ggml_type> type_k;
     std::vector<ggml_type> type_v;
     std::vector<std::pair<int,int>> n_threads;
+    std::vector<int> poll;
+    std::vector<bool> dep_barriers;
+    std::vector<bool> graph_reuse;
     std::vector<int> n_gpu_layers;
     std::vector<std::string> rpc_servers;
     std::vector<llama_split_mode> split_mode;
@@ -264,6 +267,7 @@ struct cmd_params {
     bool use_thp = false;
     output_formats output_format;
     output_formats output_format_stderr;
+    std::string profile;
 };
 
 static const cmd_params cmd_params_defaults = {
@@ -277,6 +281,9 @@ static const cmd_params cmd_params_defaults = {
     /* type_k               */ {GGML_TYPE_F16},
     /* type_v               */ {GGML_TYPE_F16},
     /* n_threads            */ {{cpu_get_num_math(), cpu_get_num_math()}},
+    /* poll                 */ {-1},
+    /* dep_barriers         */ {false},
+    /* graph_reuse          */ {false},
     /* n_gpu_layers         */ {99},
     /* rpc_servers          */ {""},
     /* split_mode           */ {LLAMA_SPLIT_MODE_LAYER},
@@ -299,6 +306,7 @@ static const cmd_params cmd_params_defaults = {
     /* fmoe                 */ false,
     /* output_format        */ MARKDOWN,
     /* output_format_stderr */ NONE,
+    /* profile              */ "",
 };
 
 static void print_usage(int /* argc */, char ** argv) {
@@ -317,6 +325,9 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  -ctv, --cache-type-v <t>            (default: %s)\n", join(transform_to_str(cmd_params_defaults.type_v, ggml_type_name), ",").c_str());
     printf("  -t, --threads <n>                   (default: %s)\n", join(cmd_params_defaults.n_threads, ",").c_str());
     printf("  -tgb, --threads-gen-batch <n1,n2>   (default: %s)\n", join(cmd_params_defaults.n_threads, ",").c_str());
+    printf("  --poll <-1...100>                   (default: %s)\n", join(cmd_params_defaults.poll, ",").c_str());
+    printf("  -dep, --dep-barriers <0|1>          (default: %s)\n", join(cmd_params_defaults.dep_barriers, ",").c_str());
+    printf("  -gr, --graph-reuse <0|1>            (default: %s)\n", join(cmd_params_defaults.graph_reuse, ",").c_str());
     printf("  -ngl, --n-gpu-layers <n>            (default: %s)\n", join(cmd_params_defaults.n_gpu_layers, ",").c_str());
     printf("  -rpc, --rpc <rpc_servers>           (default: %s)\n", join(cmd_params_defaults.rpc_servers, ",").c_str());
     printf("  -sm, --split-mode <none|layer|row>  (default: %s)\n", join(transform_to_str(cmd_params_defaults.split_mode, split_mode_str), ",").c_str());
@@ -327,7 +338,7 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  -amb, --attn-max-batch <i>          (default: %s)\n", join(cmd_params_defaults.attn_max_batch, ",").c_str());
     printf("  -ser, --smart-expert-reduction <i,f>(default: %s)\n", join(cmd_params_defaults.attn_max_batch, ",").c_str());
     printf("  -mmp, --mmap <0|1>                  (default: %s)\n", join(cmd_params_defaults.use_mmap, ",").c_str());
-    printf("  --numa <distribute|isolate|numactl> (default: disabled)\n");
+    printf("  --numa <distribute|isolate|numactl|split> (default: disabled)\n");
     printf("  -embd, --embeddings <0|1>           (default: %s)\n", join(cmd_params_defaults.embeddings, ",").c_str());
     printf("  -ts, --tensor-split <ts0/ts1/..>    (default: 0)\n");
     printf("  -r, --repetitions <n>               (default: %d)\n", cmd_params_defaults.reps);
@@ -339,6 +350,8 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  -thp, --transparent-huge-pages <0|1> (default: %s)\n", cmd_params_defaults.use_thp? "1" : "0");
     printf("  -ot, --override-tensor pattern      (default: none)\n");
     printf("  -fmoe, --fused-moe <0|1>            (default: %s)\n", cmd_params_defaults.fmoe? "1" : "0");
+    printf("  -prof, --profile <file>             record a per-op CPU profile of each test, print a summary to stderr\n");
+    printf("                                      and write it to <file> (<file>.<test> with several tests) in Chrome trace format\n");
     printf("\n");
     printf("Multiple values can be given for each parameter by separating them with ',' or by specifying the parameter multiple times.\n");
 }
@@ -569,6 +582,27 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                 }
                 params.n_threads.push_back({p[0], p[1]});
             }
+        } else if (arg == "--poll") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto p = string_split<int>(argv[i], split_delim);
+            params.poll.insert(params.poll.end(), p.begin(), p.end());
+        } else if (arg == "-dep" || arg == "--dep-barriers") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto p = string_split<bool>(argv[i], split_delim);
+            params.dep_barriers.insert(params.dep_barriers.end(), p.begin(), p.end());
+        } else if (arg == "-gr" || arg == "--graph-reuse") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto p = string_split<bool>(argv[i], split_delim);
+            params.graph_reuse.insert(params.graph_reuse.end(), p.begin(), p.end());
         } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -626,6 +660,7 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                 /**/ if (value == "distribute" || value == "" ) { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
                 else if (value == "isolate")                    { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
                 else if (value == "numactl")                    { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+                else if (value == "split")                      { params.numa = GGML_NUMA_STRATEGY_SPLIT; }
                 else { invalid_param = true; break; }
             }
         } else if (arg == "-fa" || arg == "--flash-attn") {
@@ -718,6 +753,12 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                 break;
             }
             params.warmup = std::stoi(argv[i]);
+        } else if (arg == "-prof" || arg == "--profile") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.profile = argv[i];
         } else if (arg == "-rtr" || arg == "--run-time-repack") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -780,6 +821,9 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     if (params.use_mmap.empty())     { params.use_mmap = cmd_params_defaults.use_mmap; }
     if (params.embeddings.empty())   { params.embeddings = cmd_params_defaults.embeddings; }
     if (params.n_threads.empty())    { params.n_threads = cmd_params_defaults.n_threads; }
+    if (params.poll.empty())         { params.poll = cmd_params_defaults.poll; }
+    if (params.dep_barriers.empty()) { params.dep_barriers = cmd_params_defaults.dep_barriers; }
+    if (params.graph_reuse.empty())  { params.graph_reuse = cmd_params_defaults.graph_reuse; }
     if (!params.buft_overrides.empty()) params.buft_overrides.emplace_back(llama_model_tensor_buft_override{nullptr, nullptr});
 
     return params;
@@ -806,6 +850,9 @@ struct cmd_params_instance {
     ggml_type type_k;
     ggml_type type_v;
     std::pair<int,int> n_threads;
+    int poll;
+    bool dep_barriers;
+    bool graph_reuse;
     int n_gpu_layers;
     std::string rpc_servers;
     llama_split_mode split_mode;
@@ -861,6 +908,11 @@ struct cmd_params_instance {
         cparams.n_ubatch = n_ubatch;
         cparams.type_k = type_k;
         cparams.type_v = type_v;
+        cparams.n_threads = n_threads.first;
+        cparams.n_threads_batch = n_threads.second;
+        cparams.poll = poll;
+        cparams.dep_barriers = dep_barriers;
+        cparams.graph_reuse = graph_reuse;
         cparams.offload_kqv = !no_kv_offload;
         cparams.flash_attn = flash_attn;
         cparams.mla_attn = mla_attn;
@@ -895,7 +947,10 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
     for (const auto & mla : params.mla_attn)
     for (const auto & amb : params.attn_max_batch)
     for (const auto & ser : params.ser)
-    for (const auto & nt : params.n_threads) {
+    for (const auto & nt : params.n_threads)
+    for (const auto & pl : params.poll)
+    for (const auto & dep : params.dep_barriers)
+    for (const auto & gr : params.graph_reuse) {
         for (const auto & n_prompt : params.n_prompt) {
             if (n_prompt == 0) {
                 continue;
@@ -910,6 +965,9 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .type_k       = */ tk,
                 /* .type_v       = */ tv,
                 /* .n_threads    = */ nt,
+                /* .poll         = */ pl,
+                /* .dep_barriers = */ dep,
+                /* .graph_reuse  = */ gr,
                 /* .n_gpu_layers = */ nl,
                 /* .rpc_servers  = */ rpc,
                 /* .split_mode   = */ sm,
@@ -944,6 +1002,9 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .type_k       = */ tk,
                 /* .type_v       = */ tv,
                 /* .n_threads    = */ nt,
+                /* .poll         = */ pl,
+                /* .dep_barriers = */ dep,
+                /* .graph_reuse  = */ gr,
                 /* .n_gpu_layers = */ nl,
                 /* .rpc_servers  = */ rpc,
                 /* .split_mode   = */ sm,
@@ -978,6 +1039,9 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .type_k       = */ tk,
                 /* .type_v       = */ tv,
                 /* .n_threads    = */ nt,
+                /* .poll         = */ pl,
+                /* .dep_barriers = */ dep,
+                /* .graph_reuse  = */ gr,
                 /* .n_gpu_layers = */ nl,
                 /* .rpc_servers  = */ rpc,
                 /* .split_mode   = */ sm,
@@ -1012,6 +1076,9 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .type_k       = */ tk,
                 /* .type_v       = */ tv,
                 /* .n_threads    = */ nt,
+                /* .poll         = */ pl,
+                /* .dep_barriers = */ dep,
+                /* .graph_reuse  = */ gr,
                 /* .n_gpu_layers = */ nl,
                 /* .rpc_servers  = */ rpc,
                 /* .split_mode   = */ sm,
@@ -1055,6 +1122,9 @@ struct test {
     int n_batch;
     int n_ubatch;
     std::pair<int,int> n_threads;
+    int poll;
+    bool dep_barriers;
+    bool graph_reuse;
     bool has_rpc;
     ggml_type type_k;
     ggml_type type_v;
@@ -1089,6 +1159,9 @@ struct test {
         n_batch = inst.n_batch;
         n_ubatch = inst.n_ubatch;
         n_threads = inst.n_threads;
+        poll = inst.poll;
+        dep_barriers = inst.dep_barriers;
+        graph_reuse = inst.graph_reuse;
         has_rpc = !inst.rpc_servers.empty();
         type_k = inst.type_k;
         type_v = inst.type_v;
@@ -1193,7 +1266,7 @@ struct test {
             "cpu_info", "gpu_info",
             "model_filename", "model_type", "model_size", "model_n_params",
             "n_batch", "n_ubatch",
-            "n_threads", "type_k", "type_v",
+            "n_threads", "poll", "dep_barriers", "graph_reuse", "type_k", "type_v",
             "n_gpu_layers", "split_mode",
             "main_gpu", "no_kv_offload", "flash_attn", "mla_attn", "attn_max_batch", "ser",
             "tensor_split", "use_mmap", "embeddings", "repack", "fused_moe", "use_thp",
@@ -1208,7 +1281,7 @@ struct test {
 
     static field_type get_field_type(const std::string & field) {
         if (field == "build_number" || field == "n_batch" || field == "n_ubatch" ||
-            field == "n_threads" ||
+            field == "n_threads" || field == "poll" ||
             field == "model_size" || field == "model_n_params" ||
             field == "n_gpu_layers" || field == "main_gpu" ||
             field == "n_prompt" || field == "n_gen" || field == "mla_attn" || field == "attn_max_batch" ||
@@ -1217,7 +1290,7 @@ struct test {
         }
         if (field == "cuda" || field == "vulkan" || field == "kompute" || field == "metal" ||
             field == "gpu_blas" || field == "blas" || field == "sycl" ||field == "f16_kv" || field == "no_kv_offload" ||
-            field == "flash_attn" || field == "use_mmap" || field == "embeddings" || field == "repack" || field == "use_thp" ||
+            field == "flash_attn" || field == "dep_barriers" || field == "graph_reuse" || field == "use_mmap" || field == "embeddings" || field == "repack" || field == "use_thp" ||
             field == "fused_moe") {
             return BOOL;
         }
@@ -1256,7 +1329,7 @@ struct test {
             cpu_info, gpu_info,
             model_filename, model_type, std::to_string(model_size), std::to_string(model_n_params),
             std::to_string(n_batch), std::to_string(n_ubatch),
-            std::to_string(is_gen ? n_threads.first : n_threads.second), ggml_type_name(type_k), ggml_type_name(type_v),
+            std::to_string(is_gen ? n_threads.first : n_threads.second), std::to_string(poll), std::to_string(dep_barriers), std::to_string(graph_reuse), ggml_type_name(type_k), ggml_type_name(type_v),
             std::to_string(n_gpu_layers), split_mode_str(split_mode),
             std::to_string(main_gpu), std::to_string(no_kv_offload), std::to_string(flash_attn),
             std::to_string(mla_attn), std::to_string(attn_max_batch), ser_to_string(ser),
@@ -1409,6 +1482,15 @@ struct markdown_printer : public printer {
         if (field == "n_threads") {
             return 7;
         }
+        if (field == "poll") {
+            return 4;
+        }
+        if (field == "dep_barriers") {
+            return 3;
+        }
+        if (field == "graph_reuse") {
+            return 2;
+        }
         if (field == "n_batch") {
             return 7;
         }
@@ -1473,6 +1555,12 @@ struct markdown_printer : public printer {
         if (field == "flash_attn") {
             return "fa";
         }
+        if (field == "dep_barriers") {
+            return "dep";
+        }
+        if (field == "graph_reuse") {
+            return "gr";
+        }
         if (field == "mla_attn") {
             return "mla";
         }
@@ -1516,6 +1604,15 @@ struct markdown_printer : public printer {
         if (params.n_threads.size() > 1 || params.n_threads != cmd_params_defaults.n_threads || is_cpu_backend) {
             fields.emplace_back("n_threads");
         }
+        if (params.poll.size() > 1 || params.poll != cmd_params_defaults.poll) {
+            fields.emplace_back("poll");
+        }
+        if (params.dep_barriers.size() > 1 || params.dep_barriers != cmd_params_defaults.dep_barriers) {
+            fields.emplace_back("dep_barriers");
+        }
+        if (params.graph_reuse.size() > 1 || params.graph_reuse != cmd_params_defaults.graph_reuse) {
+            fields.emplace_back("graph_reuse");
+        }
         if (params.n_batch.size() > 1 || params.n_batch != cmd_params_defaults.n_batch) {
             fields.emplace_back("n_batch");
         }
@@ -1788,7 +1885,9 @@ int main(int argc, char ** argv) {
     llama_model * lmodel = nullptr;
     const cmd_params_instance * prev_inst = nullptr;
 
-    for (const auto & inst : params_instances) {
+    for (size_t i_inst = 0; i_inst < params_instances.size(); ++i_inst) {
+        const auto & inst = params_instances[i_inst];
+
         // keep the same model between tests when possible
         if (!lmodel || !prev_inst || !inst.equal_mparams(*prev_inst)) {
             if (lmodel) {
@@ -1803,7 +1902,10 @@ int main(int argc, char ** argv) {
             prev_inst = &inst;
         }
 
-        llama_context * ctx = llama_new_context_with_model(lmodel, inst.to_llama_cparams());
+        llama_context_params cparams = inst.to_llama_cparams();
+        cparams.profile = !params.profile.empty();
+
+        llama_context * ctx = llama_new_context_with_model(lmodel, cparams);
         if (ctx == NULL) {
             fprintf(stderr, "%s: error: failed to create context with model '%s'\n", __func__, inst.model.c_str());
             llama_free_model(lmodel);
@@ -1825,6 +1927,11 @@ int main(int argc, char ** argv) {
             }
         }
 
+        ggml_profile * profile = llama_get_profile(ctx);
+        if (profile) {
+            ggml_profile_reset(profile);
+        }
+
         for (int i = 0; i < params.reps; i++) {
             llama_kv_cache_clear(ctx);
 
@@ -1854,6 +1961,18 @@ int main(int argc, char ** argv) {
 
         llama_print_timings(ctx);
 
+        if (profile) {
+            std::string fname = params.profile;
+            if (params_instances.size() > 1) {
+                fname += "." + std::to_string(i_inst);
+            }
+            fprintf(stderr, "\nprofile of test %zu (%s):\n", i_inst, t.test_label.c_str());
+            ggml_profile_print(profile, stderr);
+            if (!ggml_profile_write(profile, fname.c_str())) {
+                fprintf(stderr, "%s: error: failed to write the profile to %s\n", __func__, fname.c_str());
+            }
+        }
+
         llama_free(ctx);
     }
 
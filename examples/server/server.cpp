@@ -36,13 +36,24 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cerrno>
 #include <cstddef>
+#include <filesystem>
+#include <map>
 #include <set>
 #include <mutex>
+#include <future>
+#include <functional>
 #include <thread>
 #include <signal.h>
 #include <memory>
 
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
 using json = nlohmann::ordered_json;
 
 bool server_verbose = false;
@@ -182,6 +193,8 @@ struct server_slot {
 
     int32_t n_past_se = 0; // self-extend
 
+    int32_t n_pos_shift = 0; // the tokens are at this much past their index in the KV cache after attention sink shifts
+
     // stats
     size_t n_sent_text = 0; // number of sent text character
     size_t n_sent_token_probs = 0;
@@ -377,6 +390,528 @@ struct server_metrics {
     }
 };
 
+// radix tree of the prompt prefixes that are kept in the KV cache after the slots that computed them moved on
+// every stored prefix (entry) is held by a sequence of its own; the cells are shared with the slots and between the
+// entries through the multi-sequence membership of the KV cells, so a common prefix occupies the cache only once
+struct server_prefix_cache {
+    struct node {
+        std::vector<llama_token> tokens; // label of the edge from the parent
+
+        std::map<llama_token, std::unique_ptr<node>> children;
+
+        std::set<llama_seq_id> seq_ids;    // entries that contain the prefix ending at this node
+        llama_seq_id seq_id_end = -1;      // entry that ends at this node
+    };
+
+    struct entry {
+        std::vector<llama_token> tokens;
+        int64_t t_last_used = -1; // -1 - the sequence is not in use
+    };
+
+    node root;
+
+    llama_seq_id seq_id_first = 0;
+    std::vector<entry> entries; // entry i is held by sequence seq_id_first + i
+
+    void init(llama_seq_id seq_id_first_, int32_t n_entries) {
+        seq_id_first = seq_id_first_;
+        entries.assign(std::max(0, n_entries), entry());
+    }
+
+    bool enabled() const {
+        return !entries.empty();
+    }
+
+    void clear() {
+        root = node();
+        for (auto & e : entries) {
+            e = entry();
+        }
+    }
+
+    entry & get(llama_seq_id seq_id) {
+        return entries[seq_id - seq_id_first];
+    }
+
+    // length of the longest stored prefix of tokens and the sequence that holds it
+    size_t match(const std::vector<llama_token> & tokens, llama_seq_id & seq_id) {
+        const node * cur = &root;
+
+        size_t i = 0;
+        seq_id = -1;
+
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            const node * child = it->second.get();
+
+            size_t j = 0;
+            while (j < child->tokens.size() && i + j < tokens.size() && child->tokens[j] == tokens[i + j]) {
+                j++;
+            }
+
+            i += j;
+            seq_id = *child->seq_ids.begin();
+
+            if (j < child->tokens.size()) {
+                break;
+            }
+
+            cur = child;
+        }
+
+        if (seq_id >= 0) {
+            get(seq_id).t_last_used = ggml_time_us();
+        }
+
+        return i;
+    }
+
+    // the least recently used entry, -1 if there is none
+    llama_seq_id lru() const {
+        llama_seq_id seq_id = -1;
+        int64_t t_last_used = 0;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const entry & e = entries[i];
+            if (e.t_last_used >= 0 && (seq_id < 0 || e.t_last_used < t_last_used)) {
+                seq_id      = seq_id_first + i;
+                t_last_used = e.t_last_used;
+            }
+        }
+        return seq_id;
+    }
+
+    // sequences that can share cells with tokens beyond the first n_keep
+    std::vector<llama_seq_id> overlapping(const std::vector<llama_token> & tokens, int32_t n_keep) const {
+        std::vector<llama_seq_id> res;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const entry & e = entries[i];
+            if (e.t_last_used >= 0 && (int32_t) common_part(e.tokens, tokens) > n_keep) {
+                res.push_back(seq_id_first + i);
+            }
+        }
+        return res;
+    }
+
+    // stores tokens (not yet fully covered by an entry) and returns the sequence that has to hold them
+    // the entries that are made redundant or evicted to make room are appended to removed, their cells must be
+    // removed from the KV cache before the new sequence is filled
+    llama_seq_id insert(const std::vector<llama_token> & tokens, std::vector<llama_seq_id> & removed) {
+        // entries that are a prefix of tokens are covered by the new one
+        {
+            const node * cur = &root;
+            size_t i = 0;
+            while (i < tokens.size()) {
+                auto it = cur->children.find(tokens[i]);
+                if (it == cur->children.end()) {
+                    break;
+                }
+                const node * child = it->second.get();
+                if (i + child->tokens.size() > tokens.size() ||
+                    !std::equal(child->tokens.begin(), child->tokens.end(), tokens.begin() + i)) {
+                    break;
+                }
+                if (child->seq_id_end >= 0) {
+                    removed.push_back(child->seq_id_end);
+                }
+                i += child->tokens.size();
+                cur = child;
+            }
+        }
+        for (llama_seq_id seq_id : removed) {
+            remove(seq_id);
+        }
+
+        // a free sequence, or the least recently used one
+        llama_seq_id seq_id = -1;
+        for (size_t i = 0; i < entries.size() && seq_id < 0; ++i) {
+            if (entries[i].t_last_used < 0) {
+                seq_id = seq_id_first + i;
+            }
+        }
+        if (seq_id < 0) {
+            seq_id = lru();
+            remove(seq_id);
+            removed.push_back(seq_id);
+        }
+
+        entry & e = get(seq_id);
+        e.tokens      = tokens;
+        e.t_last_used = ggml_time_us();
+
+        node * cur = &root;
+        cur->seq_ids.insert(seq_id);
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                std::unique_ptr<node> leaf(new node());
+                leaf->tokens.assign(tokens.begin() + i, tokens.end());
+                leaf->seq_ids.insert(seq_id);
+                leaf->seq_id_end = seq_id;
+                cur->children[tokens[i]] = std::move(leaf);
+                break;
+            }
+
+            node * child = it->second.get();
+
+            size_t j = 0;
+            while (j < child->tokens.size() && i + j < tokens.size() && child->tokens[j] == tokens[i + j]) {
+                j++;
+            }
+
+            if (j < child->tokens.size()) {
+                // split the edge
+                std::unique_ptr<node> mid(new node());
+                mid->tokens.assign(child->tokens.begin(), child->tokens.begin() + j);
+                mid->seq_ids = child->seq_ids;
+
+                child->tokens.erase(child->tokens.begin(), child->tokens.begin() + j);
+                const llama_token key = child->tokens[0];
+
+                mid->children[key] = std::move(it->second);
+                it->second = std::move(mid);
+                child = it->second.get();
+            }
+
+            child->seq_ids.insert(seq_id);
+
+            i += j;
+            if (i == tokens.size()) {
+                child->seq_id_end = seq_id;
+            }
+
+            cur = child;
+        }
+
+        return seq_id;
+    }
+
+    void remove(llama_seq_id seq_id) {
+        entry & e = get(seq_id);
+        const std::vector<llama_token> & tokens = e.tokens;
+
+        root.seq_ids.erase(seq_id);
+
+        // drop the entry from the nodes on its path, the branch that only it used goes away
+        node * cur = &root;
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            GGML_ASSERT(it != cur->children.end());
+
+            node * child = it->second.get();
+            child->seq_ids.erase(seq_id);
+            if (child->seq_ids.empty()) {
+                cur->children.erase(it);
+                break;
+            }
+            if (child->seq_id_end == seq_id) {
+                child->seq_id_end = -1;
+            }
+
+            i += child->tokens.size();
+            cur = child;
+        }
+
+        // merge the nodes on the path that are left with a single child
+        cur = &root;
+        i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            node * child = it->second.get();
+            if (child->seq_id_end < 0 && child->children.size() == 1) {
+                std::unique_ptr<node> grandchild = std::move(child->children.begin()->second);
+                grandchild->tokens.insert(grandchild->tokens.begin(), child->tokens.begin(), child->tokens.end());
+                it->second = std::move(grandchild);
+                continue;
+            }
+
+            i += child->tokens.size();
+            cur = child;
+        }
+
+        e = entry();
+    }
+};
+
+// KV of the conversations that were pushed out of their slot
+// the state of the slot sequence is kept in host memory and, when that fills up, written to a file in the background;
+// a conversation that resumes gets its cells back instead of evaluating the whole prompt again
+struct server_kv_spill {
+    struct entry {
+        uint64_t id = 0;
+
+        std::vector<llama_token> tokens;
+        std::vector<uint8_t>     data; // state of the sequence, empty while it is only in the file, only resized on the main thread
+
+        size_t      size = 0; // size of the state
+        std::string path;     // file with the state, empty if there is none
+
+        std::future<bool> io; // pending write or read of the file
+        bool reading = false;
+        bool loaded  = false; // read back for a prompt, stays in memory until it is restored or released
+
+        int64_t t_last_used = 0;
+
+        // the state is only in the file and no read or write is pending
+        bool needs_read() const {
+            return !io.valid() && data.empty();
+        }
+    };
+
+    std::vector<std::shared_ptr<entry>> entries;
+
+    size_t      n_bytes_mem_max  = 0;
+    size_t      n_bytes_disk_max = 0;
+    std::string dir;
+
+    uint64_t id_next = 0;
+
+    void init(size_t n_bytes_mem_max_, const std::string & dir_, size_t n_bytes_disk_max_) {
+        n_bytes_mem_max  = n_bytes_mem_max_;
+        n_bytes_disk_max = dir_.empty() ? 0 : n_bytes_disk_max_;
+        dir              = dir_;
+
+        if (!dir.empty()) {
+            remove_stale_files();
+        }
+    }
+
+    static int64_t pid() {
+#ifdef _WIN32
+        return _getpid();
+#else
+        return getpid();
+#endif
+    }
+
+    static bool process_alive(int64_t pid) {
+#ifdef _WIN32
+        HANDLE h = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD) pid);
+        if (h == NULL) {
+            return GetLastError() != ERROR_INVALID_PARAMETER;
+        }
+        DWORD code = 0;
+        const bool alive = GetExitCodeProcess(h, &code) && code == STILL_ACTIVE;
+        CloseHandle(h);
+        return alive;
+#else
+        return kill((pid_t) pid, 0) == 0 || errno == EPERM;
+#endif
+    }
+
+    // the files are named after the process, so that servers can share the directory;
+    // the files of processes that are gone (or of an earlier process with our pid) are left over from a crash
+    void remove_stale_files() const {
+        const std::string prefix = "kv-spill-";
+        std::error_code ec;
+        for (const auto & it : std::filesystem::directory_iterator(dir, ec)) {
+            const std::string name = it.path().filename().string();
+            if (name.compare(0, prefix.size(), prefix) != 0 || name.size() < 4 || name.compare(name.size() - 4, 4, ".bin") != 0) {
+                continue;
+            }
+            const int64_t owner = std::strtoll(name.c_str() + prefix.size(), nullptr, 10);
+            if (owner > 0 && (owner == pid() || !process_alive(owner))) {
+                LOG_INFO("removing stale spilled KV", {{"path", it.path().string()}});
+                std::filesystem::remove(it.path(), ec);
+            }
+        }
+    }
+
+    bool enabled() const {
+        return n_bytes_mem_max > 0;
+    }
+
+    // the entry with the longest common prefix with tokens, if it is longer than n_min
+    std::shared_ptr<entry> find(const std::vector<llama_token> & tokens, size_t n_min) const {
+        std::shared_ptr<entry> res;
+        for (const auto & e : entries) {
+            const size_t n = common_part(e->tokens, tokens);
+            if (n > n_min) {
+                n_min = n;
+                res   = e;
+            }
+        }
+        return res;
+    }
+
+    void add(const std::vector<llama_token> & tokens, std::vector<uint8_t> && data) {
+        // an older state of the same conversation is not needed anymore
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (common_part(entries[i]->tokens, tokens) == entries[i]->tokens.size()) {
+                remove(entries[i--]);
+            }
+        }
+
+        std::shared_ptr<entry> e(new entry());
+        e->id          = id_next++;
+        e->tokens      = tokens;
+        e->size        = data.size();
+        e->data        = std::move(data);
+        e->t_last_used = ggml_time_us();
+
+        entries.push_back(e);
+
+        update();
+    }
+
+    void remove(std::shared_ptr<entry> e) {
+        if (e->io.valid()) {
+            e->io.wait();
+        }
+        if (!e->path.empty()) {
+            std::remove(e->path.c_str());
+        }
+        entries.erase(std::find(entries.begin(), entries.end(), e));
+    }
+
+    void clear() {
+        while (!entries.empty()) {
+            remove(entries.back());
+        }
+    }
+
+    // starts reading the state of an entry that is only in the file, the state is kept in memory until release()
+    void prefetch(const std::shared_ptr<entry> & e) {
+        if (!e->needs_read()) {
+            return;
+        }
+
+        // the buffer is allocated here, so that the worker only writes its contents
+        e->data.resize(e->size);
+        e->reading     = true;
+        e->loaded      = true;
+        e->t_last_used = ggml_time_us();
+        e->io = std::async(std::launch::async, [e]() {
+            FILE * f = std::fopen(e->path.c_str(), "rb");
+            if (f == nullptr) {
+                return false;
+            }
+            const bool ok = std::fread(e->data.data(), 1, e->size, f) == e->size;
+            std::fclose(f);
+            return ok;
+        });
+    }
+
+    // waits for the pending read or write of an entry, returns false if the entry had to be dropped
+    bool finish_io(std::shared_ptr<entry> e) {
+        const bool ok = e->io.get();
+        if (e->reading) {
+            e->reading = false;
+            if (!ok) {
+                LOG_WARNING("failed to read spilled KV", {{"path", e->path}});
+                remove(e);
+                return false;
+            }
+        } else if (ok) {
+            e->data.clear();
+            e->data.shrink_to_fit();
+        } else {
+            LOG_WARNING("failed to write spilled KV", {{"path", e->path}});
+            std::remove(e->path.c_str());
+            e->path.clear();
+        }
+        return true;
+    }
+
+    // the state read back for a prompt is not restored (the restore failed, another state was restored or the request
+    // is gone), so it can be moved out of memory again
+    void release(const std::shared_ptr<entry> & e) {
+        if (!e->loaded) {
+            return;
+        }
+        e->loaded = false;
+        update();
+    }
+
+    // picks up the finished reads and writes and moves the least recently used states to the files (or drops them)
+    // until the entries fit into the budgets
+    void update() {
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const auto & e = entries[i];
+            if (e->io.valid() && e->io.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                if (!finish_io(e)) {
+                    i--;
+                }
+            }
+        }
+
+        auto lru = [this](const std::function<bool(const entry &)> & pred) {
+            std::shared_ptr<entry> res;
+            for (const auto & e : entries) {
+                if (!e->io.valid() && pred(*e) && (!res || e->t_last_used < res->t_last_used)) {
+                    res = e;
+                }
+            }
+            return res;
+        };
+
+        while (true) {
+            size_t n_bytes_mem = 0;
+            for (const auto & e : entries) {
+                // the memory of the states that are being written is released soon
+                if (!(e->io.valid() && !e->reading)) {
+                    n_bytes_mem += e->data.size();
+                }
+            }
+            if (n_bytes_mem <= n_bytes_mem_max) {
+                break;
+            }
+
+            auto e = lru([](const entry & e) { return !e.data.empty() && !e.loaded; });
+            if (!e) {
+                break;
+            }
+
+            if (!e->path.empty()) {
+                // also in the file
+                e->data.clear();
+                e->data.shrink_to_fit();
+            } else if (!dir.empty() && e->size <= n_bytes_disk_max) {
+                e->path = dir + "/kv-spill-" + std::to_string(pid()) + "-" + std::to_string(e->id) + ".bin";
+                e->io = std::async(std::launch::async, [e]() {
+                    FILE * f = std::fopen(e->path.c_str(), "wb");
+                    if (f == nullptr) {
+                        return false;
+                    }
+                    const bool ok = std::fwrite(e->data.data(), 1, e->size, f) == e->size;
+                    return std::fclose(f) == 0 && ok;
+                });
+            } else {
+                remove(e);
+            }
+        }
+
+        while (true) {
+            size_t n_bytes_disk = 0;
+            for (const auto & e : entries) {
+                if (!e->path.empty()) {
+                    n_bytes_disk += e->size;
+                }
+            }
+            if (n_bytes_disk <= n_bytes_disk_max) {
+                break;
+            }
+
+            auto e = lru([](const entry & e) { return !e.path.empty(); });
+            if (!e) {
+                break;
+            }
+
+            remove(e);
+        }
+    }
+};
+
 struct server_queue {
     int id = 0;
     bool running;
@@ -649,10 +1184,18 @@ struct server_context {
 
     server_metrics metrics;
 
+    server_prefix_cache prefix_cache;
+
+    server_kv_spill kv_spill;
+    std::map<int, std::shared_ptr<server_kv_spill::entry>> kv_spill_loading; // id_slot -> state read back for its prompt
+
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
     ~server_context() {
+        // waits for the pending writes and deletes the files
+        kv_spill.clear();
+
         if (ctx) {
             llama_free(ctx);
             ctx = nullptr;
@@ -707,7 +1250,8 @@ struct server_context {
     }
 
     void init() {
-        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
+        // with a paged KV cache the slots take cells from a common pool as they grow
+        const int32_t n_ctx_slot = llama_get_kv_cache_block_size(ctx) > 0 ? n_ctx : n_ctx / params.n_parallel;
 
         LOG_INFO("initializing slots", {{"n_slots", params.n_parallel}});
 
@@ -750,6 +1294,32 @@ struct server_context {
             slots.push_back(slot);
         }
 
+        // the sequences after the ones of the slots hold the shared prompt prefixes
+        if (params.n_prefix_cache > 0) {
+            const llama_seq_id seq_id_first = params.n_parallel + 1;
+            if (params.grp_attn_n != 1 || !llama_kv_cache_seq_rm(ctx, seq_id_first, -1, -1)) {
+                // self-extend moves the cells of a slot, recurrent models have no cells to share
+                LOG_WARNING("prefix cache is not supported with this model or configuration - disabling", {});
+            } else {
+                prefix_cache.init(seq_id_first, params.n_prefix_cache);
+
+                LOG_INFO("prefix cache", {
+                    {"n_entries", params.n_prefix_cache},
+                    {"seq_id_first", seq_id_first},
+                });
+            }
+        }
+
+        if (params.kv_spill_mem > 0) {
+            kv_spill.init((size_t) params.kv_spill_mem << 20, params.kv_spill_path, (size_t) params.kv_spill_disk << 20);
+
+            LOG_INFO("kv spill", {
+                {"mem_mib",  params.kv_spill_mem},
+                {"path",     params.kv_spill_path},
+                {"disk_mib", params.kv_spill_path.empty() ? 0 : params.kv_spill_disk},
+            });
+        }
+
         default_generation_settings_for_props = get_formated_generation(slots.front());
         default_generation_settings_for_props["seed"] = -1;
 
@@ -1109,6 +1679,17 @@ struct server_context {
         slot.command = SLOT_COMMAND_LOAD_PROMPT;
         slot.prompt_tokens.clear();
 
+        // start reading back the KV of the conversation if it went to disk, the slot waits for it in update_slots
+        if (kv_spill.enabled() && slot.params.cache_prompt && !slot.infill && !slot.embedding) {
+            const auto tokens = tokenize(slot.prompt, system_prompt.empty());
+            auto e = kv_spill.find(tokens, common_part(slot.cache_tokens, tokens));
+            if (e && e->needs_read()) {
+                kv_spill.prefetch(e);
+                kv_spill_loading_release(slot.id);
+                kv_spill_loading[slot.id] = e;
+            }
+        }
+
         LOG_INFO("slot is processing task", {
             {"id_slot", slot.id},
             {"id_task", slot.id_task},
@@ -1123,6 +1704,239 @@ struct server_context {
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
         clean_kv_cache = false;
+
+        prefix_cache.clear();
+    }
+
+    // keeps the cells of the first n tokens of the slot in the prefix cache
+    void prefix_cache_store(const server_slot & slot, const std::vector<llama_token> & tokens, size_t n) {
+        if (!prefix_cache.enabled() || slot.ga_n != 1 || n == 0 || n > tokens.size()) {
+            return;
+        }
+
+        const int32_t n_system = system_tokens.size();
+
+        // only store what is actually in the cache
+        if (llama_kv_cache_seq_pos_max(ctx, slot.id + 1) < n_system + (llama_pos) n - 1) {
+            return;
+        }
+
+        const std::vector<llama_token> prefix(tokens.begin(), tokens.begin() + n);
+
+        llama_seq_id seq_id_match;
+        if (prefix_cache.match(prefix, seq_id_match) == n) {
+            return;
+        }
+
+        std::vector<llama_seq_id> removed;
+        const llama_seq_id seq_id = prefix_cache.insert(prefix, removed);
+
+        for (llama_seq_id seq_id_rm : removed) {
+            llama_kv_cache_seq_rm(ctx, seq_id_rm, -1, -1);
+        }
+
+        llama_kv_cache_seq_cp(ctx, slot.id + 1, seq_id, n_system, n_system + n);
+
+        LOG_VERBOSE("prefix cache store", {
+            {"id_slot",   slot.id},
+            {"seq_id",    seq_id},
+            {"n_tokens",  n},
+            {"n_removed", removed.size()},
+        });
+    }
+
+    // attaches the longest stored prefix of the prompt to the slot if it is longer than what the slot already has
+    void prefix_cache_attach(server_slot & slot, const std::vector<llama_token> & prompt_tokens) {
+        if (!prefix_cache.enabled() || slot.ga_n != 1) {
+            return;
+        }
+
+        llama_seq_id seq_id_src;
+        const int32_t n_match = prefix_cache.match(prompt_tokens, seq_id_src);
+        if (n_match <= slot.n_past) {
+            return;
+        }
+
+        const int32_t n_system = system_tokens.size();
+
+        llama_kv_cache_seq_rm(ctx, slot.id + 1, n_system, -1);
+        llama_kv_cache_seq_cp(ctx, seq_id_src, slot.id + 1, n_system, n_system + n_match);
+
+        if (slot.params.cache_prompt) {
+            // push the rest of the prefix into the sampling context (do not apply grammar)
+            for (int32_t i = slot.n_past; i < n_match; ++i) {
+                llama_sampling_accept(slot.ctx_sampling, ctx, prompt_tokens[i], false);
+            }
+            slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_match);
+        }
+
+        LOG_INFO("reusing prompt prefix from the prefix cache", {
+            {"id_slot",  slot.id},
+            {"id_task",  slot.id_task},
+            {"seq_id",   seq_id_src},
+            {"n_past",   slot.n_past},
+            {"n_prefix", n_match},
+        });
+
+        slot.n_past = n_match;
+    }
+
+    // the prefixes that share cells with the part of the slot that is about to be shifted can not be kept
+    void prefix_cache_release_shifted(const server_slot & slot, int32_t n_keep) {
+        if (!prefix_cache.enabled()) {
+            return;
+        }
+
+        const auto & tokens = slot.params.cache_prompt ? slot.cache_tokens : slot.prompt_tokens;
+
+        for (llama_seq_id seq_id : prefix_cache.overlapping(tokens, n_keep - (int32_t) system_tokens.size())) {
+            prefix_cache.remove(seq_id);
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        }
+    }
+
+    // copies the state of the slot sequence to the spill store
+    void kv_spill_store(const server_slot & slot) {
+        const int32_t n_system = system_tokens.size();
+
+        if (slot.cache_tokens.empty() ||
+            llama_kv_cache_seq_pos_max(ctx, slot.id + 1) != n_system + (llama_pos) slot.cache_tokens.size() - 1) {
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        std::vector<uint8_t> data(llama_state_seq_get_size(ctx, slot.id + 1));
+        if (data.empty() || data.size() > kv_spill.n_bytes_mem_max ||
+            llama_state_seq_get_data(ctx, data.data(), data.size(), slot.id + 1) != data.size()) {
+            return;
+        }
+
+        LOG_INFO("spilling slot KV", {
+            {"id_slot",  slot.id},
+            {"n_tokens", slot.cache_tokens.size()},
+            {"n_bytes",  data.size()},
+            {"t_ms",     (ggml_time_us() - t_start) / 1e3},
+        });
+
+        kv_spill.add(slot.cache_tokens, std::move(data));
+    }
+
+    // the state read back for the prompt of a slot is not going to be restored
+    void kv_spill_loading_release(int id_slot) {
+        auto it = kv_spill_loading.find(id_slot);
+        if (it != kv_spill_loading.end()) {
+            auto e = it->second;
+            kv_spill_loading.erase(it);
+            kv_spill.release(e);
+        }
+    }
+
+    // before the slot gives up (part of) its conversation for the new prompt, the conversation is spilled
+    // a spilled conversation that shares a longer prefix with the prompt takes its place
+    void kv_spill_swap(server_slot & slot, const std::vector<llama_token> & prompt_tokens) {
+        if (!kv_spill.enabled()) {
+            return;
+        }
+
+        const size_t n_past = common_part(slot.cache_tokens, prompt_tokens);
+
+        auto e = kv_spill.find(prompt_tokens, n_past);
+
+        // the state prefetched for the prompt may not be the one that is restored
+        {
+            auto it = kv_spill_loading.find(slot.id);
+            if (it != kv_spill_loading.end() && it->second != e) {
+                kv_spill_loading_release(slot.id);
+            }
+            kv_spill_loading.erase(slot.id);
+        }
+
+        if (e && e->io.valid() && !kv_spill.finish_io(e)) {
+            e.reset();
+        }
+        if (e && e->needs_read()) {
+            // not prefetched - read it now
+            kv_spill.prefetch(e);
+            if (!kv_spill.finish_io(e)) {
+                e.reset();
+            }
+        }
+
+        if (n_past < slot.cache_tokens.size()) {
+            kv_spill_store(slot);
+        }
+
+        if (!e) {
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        if (llama_state_seq_set_data(ctx, e->data.data(), e->data.size(), slot.id + 1) == 0) {
+            // not enough room in the KV cache - the prompt is evaluated as usual
+            llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
+            if (!system_tokens.empty()) {
+                llama_kv_cache_seq_cp(ctx, 0, slot.id + 1, -1, -1);
+            }
+            slot.cache_tokens.clear();
+
+            LOG_WARNING("failed to restore spilled KV", {
+                {"id_slot",  slot.id},
+                {"n_tokens", e->tokens.size()},
+            });
+            kv_spill.release(e);
+            return;
+        }
+
+        LOG_INFO("restored slot KV", {
+            {"id_slot",  slot.id},
+            {"n_tokens", e->tokens.size()},
+            {"n_bytes",  e->data.size()},
+            {"t_ms",     (ggml_time_us() - t_start) / 1e3},
+        });
+
+        slot.cache_tokens = e->tokens;
+        kv_spill.remove(e);
+    }
+
+    // spills the least recently used idle slot and frees its cells, returns false if there is none
+    bool kv_spill_evict_idle() {
+        if (!kv_spill.enabled()) {
+            return false;
+        }
+
+        server_slot * lru = nullptr;
+        for (server_slot & slot : slots) {
+            if (slot.available() && slot.params.cache_prompt && !slot.cache_tokens.empty() &&
+                (lru == nullptr || slot.t_last_used < lru->t_last_used)) {
+                lru = &slot;
+            }
+        }
+
+        if (lru == nullptr) {
+            return false;
+        }
+
+        kv_spill_store(*lru);
+
+        llama_kv_cache_seq_rm(ctx, lru->id + 1, system_tokens.size(), -1);
+        lru->cache_tokens.clear();
+
+        return true;
+    }
+
+    // removes the least recently used prefix from the KV cache, returns false if there is none
+    bool prefix_cache_evict() {
+        const llama_seq_id seq_id = prefix_cache.lru();
+        if (seq_id < 0) {
+            return false;
+        }
+
+        prefix_cache.remove(seq_id);
+        llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+
+        return true;
     }
 
     void system_prompt_update() {
@@ -1133,6 +1947,10 @@ struct server_context {
         kv_cache_clear();
         system_tokens.clear();
 
+        // the spilled states contain the old system prompt
+        kv_spill.clear();
+        kv_spill_loading.clear();
+
         if (!system_prompt.empty()) {
             system_tokens = ::llama_tokenize(ctx, system_prompt, true);
 
@@ -1754,6 +2572,13 @@ struct server_context {
                     const size_t token_count = slot->cache_tokens.size();
                     const int64_t t_start = ggml_time_us();
 
+                    if (slot->n_pos_shift != 0) {
+                        // the saved tokens start at their index
+                        llama_kv_cache_seq_add(ctx, slot->id + 1, 0, -1, -slot->n_pos_shift);
+                        llama_kv_cache_update(ctx);
+                        slot->n_pos_shift = 0;
+                    }
+
                     std::string filename = task.data.at("filename");
                     std::string filepath = task.data.at("filepath");
 
@@ -1806,6 +2631,7 @@ struct server_context {
                         break;
                     }
                     slot->cache_tokens.resize(token_count);
+                    slot->n_pos_shift = 0;
 
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
@@ -1844,6 +2670,7 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_cache_seq_rm(ctx, slot->id + 1, -1, -1);
                     slot->cache_tokens.clear();
+                    slot->n_pos_shift = 0;
 
                     server_task_result result;
                     result.id = task.id;
@@ -1891,6 +2718,8 @@ struct server_context {
             system_prompt_update();
         }
 
+        kv_spill.update();
+
         // release slots
         for (auto & slot : slots) {
             if (slot.command == SLOT_COMMAND_RELEASE) {
@@ -1898,6 +2727,11 @@ struct server_context {
                 slot.command     = SLOT_COMMAND_NONE;
                 slot.t_last_used = ggml_time_us();
 
+                // keep the generated tokens too, they are the start of the next turn of a conversation
+                if (slot.params.cache_prompt && !slot.truncated && !slot.embedding) {
+                    prefix_cache_store(slot, slot.cache_tokens, slot.cache_tokens.size());
+                }
+
                 LOG_INFO("slot released", {
                     {"id_slot",         slot.id},
                     {"id_task",         slot.id_task},
@@ -1925,10 +2759,13 @@ struct server_context {
 
             if (all_idle) {
                 LOG_INFO("all slots are idle", {});
-                if (system_prompt.empty() && clean_kv_cache) {
+                if (system_prompt.empty() && clean_kv_cache && !prefix_cache.enabled()) {
                     kv_cache_clear();
                 }
 
+                // stop the CPU threads from spinning until the next request
+                llama_pause_threadpool(ctx);
+
                 return;
             }
         }
@@ -1965,8 +2802,27 @@ struct server_context {
                         {"n_cache_tokens",  slot.cache_tokens.size()}
                     });
 
-                    llama_kv_cache_seq_rm (ctx, slot.id + 1, n_keep            , n_keep + n_discard);
-                    llama_kv_cache_seq_add(ctx, slot.id + 1, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
+                    // the sink cells are rotated, they must not be shared with the system prompt or other slots
+                    if (params.ctx_shift_sink && system_tokens.empty() && !prefix_cache.enabled()) {
+                        // the n_keep sink tokens move forward to the rest of the context, only their K is rotated
+                        const llama_pos p0 = slot.n_pos_shift;
+
+                        llama_kv_cache_seq_rm (ctx, slot.id + 1, p0 + n_keep, p0 + n_keep + n_discard);
+                        llama_kv_cache_seq_add(ctx, slot.id + 1, p0,          p0 + n_keep,             n_discard);
+
+                        slot.n_pos_shift += n_discard;
+
+                        // the positions keep growing, move them back once in a while to bound the rotation angles
+                        if (slot.n_pos_shift + slot.n_ctx > std::max(llama_n_ctx_train(model), 4*slot.n_ctx)) {
+                            llama_kv_cache_seq_add(ctx, slot.id + 1, 0, -1, -slot.n_pos_shift);
+                            slot.n_pos_shift = 0;
+                        }
+                    } else {
+                        prefix_cache_release_shifted(slot, n_keep);
+
+                        llama_kv_cache_seq_rm (ctx, slot.id + 1, n_keep            , n_keep + n_discard);
+                        llama_kv_cache_seq_add(ctx, slot.id + 1, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
+                    }
 
                     if (slot.params.cache_prompt) {
                         for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
@@ -1998,7 +2854,7 @@ struct server_context {
 
             // TODO: we always have to take into account the "system_tokens"
             //       this is not great and needs to be improved somehow
-            llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast, { slot.id + 1 }, true);
+            llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast + slot.n_pos_shift, { slot.id + 1 }, true);
 
             slot.n_past += 1;
 
@@ -2026,6 +2882,13 @@ struct server_context {
         // -1: none, 0: non-embedding, 1: embedding
         int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
 
+        // the states read back for slots that do not wait for their prompt anymore (cancelled or failed tasks)
+        for (auto & slot : slots) {
+            if (kv_spill_loading.count(slot.id) && !(slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT)) {
+                kv_spill_loading_release(slot.id);
+            }
+        }
+
         // next, batch any pending prompts without exceeding n_batch
         if (params.cont_batching || batch.n_tokens == 0) {
             for (auto & slot : slots) {
@@ -2033,6 +2896,14 @@ struct server_context {
                 if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT) {
                     auto & prompt_tokens = slot.prompt_tokens;
 
+                    // the KV of the conversation is still being read back - other slots go ahead
+                    {
+                        auto it = kv_spill_loading.find(slot.id);
+                        if (it != kv_spill_loading.end() && it->second->io.valid()) {
+                            continue;
+                        }
+                    }
+
                     // we haven't tokenized the prompt yet - do it now:
                     if (prompt_tokens.empty()) {
                         LOG_VERBOSE("tokenizing prompt", {
@@ -2157,12 +3028,22 @@ struct server_context {
 
                             llama_sampling_reset(slot.ctx_sampling);
 
+                            if (slot.n_pos_shift != 0) {
+                                // the positions of the cached tokens do not match their index any more
+                                llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size(), -1);
+                                slot.cache_tokens.clear();
+                                slot.n_pos_shift = 0;
+                            }
+
                             if (!slot.params.cache_prompt) {
                                 slot.n_past_se = 0;
                                 slot.ga_i      = 0;
                             } else {
                                 GGML_ASSERT(slot.ga_n == 1);
 
+                                // the conversation may have been spilled from another slot
+                                kv_spill_swap(slot, prompt_tokens);
+
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
 
@@ -2171,6 +3052,9 @@ struct server_context {
                                     llama_sampling_accept(slot.ctx_sampling, ctx, slot.cache_tokens[i], false);
                                 }
                             }
+
+                            // a longer prefix may have been computed by another slot
+                            prefix_cache_attach(slot, prompt_tokens);
                         }
 
                         if (slot.n_past == slot.n_prompt_tokens && slot.n_past > 0) {
@@ -2205,7 +3089,7 @@ struct server_context {
                     }
 
                     // keep only the common part
-                    int p0 = (int) system_tokens.size() + slot.n_past;
+                    int p0 = (int) system_tokens.size() + slot.n_past + slot.n_pos_shift;
                     if (!llama_kv_cache_seq_rm(ctx, slot.id + 1, p0, -1)) {
                         // could not partially delete (likely using a non-Transformer model)
                         llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
@@ -2219,6 +3103,7 @@ struct server_context {
                         // there is no common part left (except for the system prompt)
                         slot.n_past = 0;
                         slot.n_past_se = 0;
+                        slot.n_pos_shift = 0;
                         slot.ga_i = 0;
                         // TODO: is the system prompt ever in the sampling context?
                         llama_sampling_reset(slot.ctx_sampling);
@@ -2250,7 +3135,7 @@ struct server_context {
                             }
                         }
 
-                        llama_batch_add(batch, prompt_tokens[slot.n_past], system_tokens.size() + slot_npast, { slot.id + 1 }, false);
+                        llama_batch_add(batch, prompt_tokens[slot.n_past], system_tokens.size() + slot_npast + slot.n_pos_shift, { slot.id + 1 }, false);
 
                         if (slot.params.cache_prompt) {
                             slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
@@ -2355,6 +3240,13 @@ struct server_context {
             const int ret = llama_decode(ctx, batch_view);
 
             if (ret != 0) {
+                if (ret > 0 && (prefix_cache_evict() || kv_spill_evict_idle())) {
+                    // the cells of a stored prefix or of an idle slot may be enough - retry with the same batch size
+                    i -= n_batch;
+
+                    continue; // continue loop of n_batch
+                }
+
                 if (n_batch == 1 || ret < 0) {
                     // if you get here, it means the KV cache is full - try increasing it via the context size
                     LOG_ERROR("failed to decode the batch: KV cache is full - try increasing it via the context size", {
@@ -2407,6 +3299,8 @@ struct server_context {
                     slot.t_start_generation = ggml_time_us();
                     slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
                     metrics.on_prompt_eval(slot);
+
+                    prefix_cache_store(slot, slot.prompt_tokens, slot.n_prompt_tokens);
                 }
 
                 llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
@@ -119,6 +119,10 @@ int main(int argc, char ** argv) {
     llama_batch_clear(batch);
     llama_kv_cache_clear(ctx);
 
+    if (llama_get_profile(ctx)) {
+        ggml_profile_reset(llama_get_profile(ctx));
+    }
+
     for (unsigned int n_kv = 0; n_kv < n_kv_max; n_kv += params.n_ubatch) {
         // clean up KV cache before generation
         llama_kv_cache_seq_rm(ctx, 0, n_kv, -1);
@@ -180,6 +184,14 @@ int main(int argc, char ** argv) {
 
     llama_batch_free(batch);
 
+    if (ggml_profile * profile = llama_get_profile(ctx)) {
+        LOG_TEE("\n");
+        ggml_profile_print(profile, stderr);
+        if (!ggml_profile_write(profile, params.profile_file.c_str())) {
+            LOG_TEE("%s: failed to write the profile to %s\n", __func__, params.profile_file.c_str());
+        }
+    }
+
     llama_free(ctx);
     llama_free_model(model);
 
@@ -102,13 +102,23 @@ extern "C" {
 
     GGML_API GGML_CALL bool ggml_backend_is_cpu                (ggml_backend_t backend);
     GGML_API           void ggml_backend_cpu_set_n_threads     (ggml_backend_t backend_cpu, int n_threads);
+    GGML_API           void ggml_backend_cpu_set_threadpool    (ggml_backend_t backend_cpu, struct ggml_threadpool * threadpool); // not owned by the backend
+    GGML_API           void ggml_backend_cpu_set_profile       (ggml_backend_t backend_cpu, struct ggml_profile * profile); // not owned by the backend
+    GGML_API           void ggml_backend_cpu_set_dep_barriers  (ggml_backend_t backend_cpu, bool dep_barriers); // see ggml_graph_plan_dep_barriers()
     GGML_API           void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data);
 
+    // the caller guarantees that the next graphs have the same nodes and shapes as the last one computed,
+    // so its plan can be reused instead of being recomputed (the data of the tensors may change)
+    GGML_API           void ggml_backend_cpu_set_reuse_plan    (ggml_backend_t backend_cpu, bool reuse_plan);
+
     // Create a backend buffer from an existing pointer
     GGML_API GGML_CALL ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size);
 
     GGML_API GGML_CALL ggml_backend_buffer_type_t ggml_backend_cpu_buffer_type(void);
 
+    // CPU buffers backed by huge pages (hugetlbfs if available, transparent huge pages otherwise)
+    GGML_API GGML_CALL ggml_backend_buffer_type_t ggml_backend_cpu_huge_buffer_type(void);
+
 #ifdef GGML_USE_CPU_HBM
     GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void);
 #endif
@@ -241,6 +241,7 @@
 #endif
 #define GGML_MAX_OP_PARAMS      64
 #define GGML_DEFAULT_N_THREADS  4
+#define GGML_MAX_N_THREADS      512
 #define GGML_DEFAULT_GRAPH_SIZE 2048
 #if UINTPTR_MAX == 0xFFFFFFFF
     #define GGML_MEM_ALIGN 4
@@ -576,6 +577,7 @@ extern "C" {
         GGML_OP_MUL_MAT_ID,
         GGML_OP_OUT_PROD,
         GGML_OP_MOE_FUSED_UP_GATE,
+        GGML_OP_MUL_MAT_ADD,
 
         GGML_OP_SCALE,
         GGML_OP_SET,
@@ -674,6 +676,8 @@ extern "C" {
         GGML_TENSOR_FLAG_INPUT  = 1,
         GGML_TENSOR_FLAG_OUTPUT = 2,
         GGML_TENSOR_FLAG_PARAM  = 4,
+        GGML_TENSOR_FLAG_NUMA   = 8, // rows (or experts) of the tensor are spread over the NUMA nodes
+        GGML_TENSOR_FLAG_PAGED  = 16, // experts of the tensor are counted, prefetched and locked (ggml_expert_paging_add)
     };
 
     // ggml object
@@ -735,6 +739,19 @@ extern "C" {
     // If it returns true, the computation is aborted
     typedef bool (*ggml_abort_callback)(void * data);
 
+    // persistent CPU thread pool that can be reused across ggml_graph_compute() calls
+    struct ggml_threadpool;
+
+    struct ggml_threadpool_params {
+        bool cpumask[GGML_MAX_N_THREADS]; // CPU affinity mask of the worker threads (all false = do not set affinity)
+        int  n_threads;                   // number of threads, including the thread calling ggml_graph_compute()
+        int  poll;                        // polling level before sleeping (0 = no polling, 100 = aggressive polling)
+        bool strict_cpu;                  // pin each worker thread to a single CPU from cpumask
+        bool paused;                      // start in the paused state
+    };
+
+    // per-node CPU profile recorded by ggml_graph_compute(), see ggml_profile_init()
+    struct ggml_profile;
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -743,6 +760,18 @@ extern "C" {
 
         int n_threads;
 
+        struct ggml_threadpool * threadpool; // if not NULL, the graph is computed by the threads of this pool
+
+        // only synchronize the threads before nodes that depend on the ones computed since the last barrier,
+        // set with `ggml_graph_plan_dep_barriers()` which also accounts for it in `work_size`
+        bool dep_barriers;
+
+        // number of chunks per thread the rows of the iqk matmuls are split into, the chunks are claimed
+        // dynamically by the threads (0 - default, 1 - static split)
+        int chunks_per_thread;
+
+        struct ggml_profile * profile; // if not NULL, the time each thread spends on each node is recorded into it
+
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
@@ -798,6 +827,7 @@ extern "C" {
         GGML_NUMA_STRATEGY_ISOLATE    = 2,
         GGML_NUMA_STRATEGY_NUMACTL    = 3,
         GGML_NUMA_STRATEGY_MIRROR     = 4,
+        GGML_NUMA_STRATEGY_SPLIT      = 5, // distribute threads and split the matmul weights between the nodes
         GGML_NUMA_STRATEGY_COUNT
     };
 
@@ -816,6 +846,7 @@ extern "C" {
     GGML_API void    ggml_time_init(void); // call this once at the beginning of the program
     GGML_API int64_t ggml_time_ms(void);
     GGML_API int64_t ggml_time_us(void);
+    GGML_API int64_t ggml_time_ns(void);
     GGML_API int64_t ggml_cycles(void);
     GGML_API int64_t ggml_cycles_per_ms(void);
 
@@ -825,6 +856,20 @@ extern "C" {
     GGML_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    // with GGML_NUMA_STRATEGY_SPLIT, move the rows of a 2D matmul weight (or the experts of a 3D one) to the
+    // NUMA nodes whose threads compute them - returns true if the tensor was distributed
+    GGML_API bool    ggml_numa_distribute_tensor(struct ggml_tensor * tensor);
+
+    // expert paging for the 3D weights of MoE models: the experts GGML_OP_MUL_MAT_ID selects are counted per group (the
+    // weights sharing the router output, e.g. a layer), prefetched together with the most used experts of the next group,
+    // and the most used ones are kept locked in RAM within pin_budget bytes - one registry per model, freed (and the
+    // experts unlocked) with ggml_expert_paging_free before the weights; add returns true if the tensor is paged
+    struct ggml_expert_paging;
+
+    GGML_API struct ggml_expert_paging * ggml_expert_paging_init(size_t pin_budget);
+    GGML_API bool    ggml_expert_paging_add(struct ggml_expert_paging * paging, struct ggml_tensor * tensor, int group);
+    GGML_API void    ggml_expert_paging_free(struct ggml_expert_paging * paging);
+
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
 
@@ -1339,6 +1384,14 @@ extern "C" {
             struct ggml_tensor  * ids,
             enum ggml_unary_op    op);
 
+    // a*b + c, with c (same shape as the result, F32, contiguous) added to the rows of the result while they
+    // are still in cache (e.g., the attention output projection followed by the residual connection)
+    GGML_API struct ggml_tensor * ggml_mul_mat_add(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
     // A: m columns, n rows,
     // B: p columns, n rows,
     // result is m columns, p rows
@@ -2216,6 +2269,9 @@ extern "C" {
     // ggml_graph_plan() has to be called before ggml_graph_compute()
     // when plan.work_size > 0, caller must allocate memory for plan.work_data
     GGML_API struct ggml_cplan ggml_graph_plan   (const struct ggml_cgraph * cgraph, int n_threads /*= GGML_DEFAULT_N_THREADS*/);
+    // switch the plan to dependency-driven barriers, must be called before allocating plan.work_data
+    GGML_API void ggml_graph_plan_dep_barriers(const struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
+    // when plan.threadpool is set, n_threads is capped at the number of threads in the pool
     GGML_API enum ggml_status  ggml_graph_compute(      struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
     // same as ggml_graph_compute() but the work data is allocated as a part of the context
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
@@ -2223,6 +2279,38 @@ extern "C" {
 
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
+    // thread pool
+    // the worker threads are created once and wait for work between graphs by spinning (as controlled by poll)
+    // and then sleeping. A paused pool keeps its threads asleep until resumed or until the next graph is computed.
+    GGML_API struct ggml_threadpool_params ggml_threadpool_params_default(int n_threads);
+    GGML_API struct ggml_threadpool *      ggml_threadpool_new          (const struct ggml_threadpool_params * params);
+    GGML_API void                          ggml_threadpool_free         (struct ggml_threadpool * threadpool);
+    GGML_API int                           ggml_threadpool_get_n_threads(const struct ggml_threadpool * threadpool);
+    GGML_API void                          ggml_threadpool_pause        (struct ggml_threadpool * threadpool);
+    GGML_API void                          ggml_threadpool_resume       (struct ggml_threadpool * threadpool);
+
+    // per-node profile
+    // For every node ggml_graph_compute() records the compute time of each thread and the time spent in the
+    // barrier that follows. The nodes are aggregated by op, name (without the layer number), type pair and iqk
+    // kernel tile, together with an estimate of their FLOPs and of the bytes they touch. The timeline of each
+    // thread is also kept for the first max_trace_events node/thread pairs.
+    GGML_API struct ggml_profile * ggml_profile_init (size_t max_trace_events);
+    GGML_API void                  ggml_profile_free (struct ggml_profile * profile);
+    GGML_API void                  ggml_profile_reset(struct ggml_profile * profile);
+    // table of the aggregated nodes, sorted by time
+    GGML_API void                  ggml_profile_print(const struct ggml_profile * profile, FILE * stream);
+    // Chrome trace format (chrome://tracing, Perfetto) with the aggregated nodes under "ggmlProfile"
+    GGML_API bool                  ggml_profile_write(const struct ggml_profile * profile, const char * fname);
+
+    // iqk matmul autotuning
+    // Benchmarks the iqk_mul_mat tile and row chunk configurations for the 2D weight times ny columns, on the rows
+    // one of n_threads threads gets, and uses the fastest for matmuls with this weight shape and type and a similar
+    // ny (1, 2...15, >= 16) from then on. Returns false if iqk_mul_mat does not handle the weight.
+    GGML_API bool                  ggml_iqk_tune(const struct ggml_tensor * weight, int64_t ny, int n_threads);
+    // The tuned configurations are keyed by CPU model, a file written on another CPU model is not loaded.
+    GGML_API bool                  ggml_iqk_tune_load(const char * fname);
+    GGML_API bool                  ggml_iqk_tune_save(const char * fname);
+
     GGML_API void                 ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
     GGML_API struct ggml_cgraph * ggml_graph_import(const char * fname, struct ggml_context ** ctx_data, struct ggml_context ** ctx_eval);
 
@@ -740,11 +740,126 @@ ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void) {
 }
 #endif
 
+// buffer type huge pages: the buffer is mapped with explicit huge pages (MAP_HUGETLB) when the hugetlbfs pool has enough
+// free pages, and otherwise aligned to the huge page size and advised for transparent huge pages (MADV_HUGEPAGE). The
+// buffer name tells which one was used. Buffers smaller than a huge page, and all buffers on other systems, are plain CPU
+// buffers.
+
+#if defined(__linux__)
+#include <sys/mman.h>
+
+static size_t ggml_backend_cpu_huge_page_size(void) {
+    static size_t page_size = 0;
+    if (page_size == 0) {
+        size_t kib = 2048;
+        FILE * f = fopen("/proc/meminfo", "r");
+        if (f) {
+            char line[256];
+            while (fgets(line, sizeof(line), f)) {
+                if (sscanf(line, "Hugepagesize: %zu kB", &kib) == 1) break;
+            }
+            fclose(f);
+        }
+        page_size = kib*1024;
+    }
+    return page_size;
+}
+
+GGML_CALL static const char * ggml_backend_cpu_hugetlb_buffer_get_name(ggml_backend_buffer_t buf) {
+    return "CPU_HUGETLB";
+
+    GGML_UNUSED(buf);
+}
+
+GGML_CALL static const char * ggml_backend_cpu_thp_buffer_get_name(ggml_backend_buffer_t buf) {
+    return "CPU_THP";
+
+    GGML_UNUSED(buf);
+}
+
+GGML_CALL static void ggml_backend_cpu_huge_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    const size_t page_size = ggml_backend_cpu_huge_page_size();
+    munmap(buffer->context, GGML_PAD(buffer->size, page_size));
+}
+
+GGML_CALL static ggml_backend_buffer_t ggml_backend_cpu_huge_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    const size_t page_size = ggml_backend_cpu_huge_page_size();
+    if (size < page_size) {
+        // not worth a huge page
+        return ggml_backend_cpu_buffer_type_alloc_buffer(buft, size);
+    }
+    const size_t map_size  = GGML_PAD(size, page_size);
+
+    bool hugetlb = true;
+    void * ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr == MAP_FAILED) {
+        // over-allocate by one huge page and trim, so that the transparent huge pages can cover the whole buffer
+        hugetlb = false;
+        char * base = mmap(NULL, map_size + page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            fprintf(stderr, "%s: failed to allocate buffer of size %zu\n", __func__, size);
+            return NULL;
+        }
+        char * aligned = (char *) GGML_PAD((uintptr_t) base, page_size);
+        if (aligned > base) {
+            munmap(base, aligned - base);
+        }
+        munmap(aligned + map_size, base + page_size - aligned);
+        ptr = aligned;
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, map_size, MADV_HUGEPAGE);
+#endif
+    }
+
+    ggml_backend_buffer_t buffer = ggml_backend_cpu_buffer_from_ptr(ptr, size);
+    buffer->buft = buft;
+    buffer->iface.get_name    = hugetlb ? ggml_backend_cpu_hugetlb_buffer_get_name : ggml_backend_cpu_thp_buffer_get_name;
+    buffer->iface.free_buffer = ggml_backend_cpu_huge_buffer_free_buffer;
+
+    return buffer;
+}
+#else
+GGML_CALL static ggml_backend_buffer_t ggml_backend_cpu_huge_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    return ggml_backend_cpu_buffer_type_alloc_buffer(buft, size);
+}
+#endif
+
+GGML_CALL static const char * ggml_backend_cpu_huge_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return "CPU_HUGE";
+
+    GGML_UNUSED(buft);
+}
+
+GGML_CALL ggml_backend_buffer_type_t ggml_backend_cpu_huge_buffer_type(void) {
+    static struct ggml_backend_buffer_type ggml_backend_cpu_buffer_type_huge = {
+        /* .iface    = */ {
+            /* .get_name         = */ ggml_backend_cpu_huge_buffer_type_get_name,
+            /* .alloc_buffer     = */ ggml_backend_cpu_huge_buffer_type_alloc_buffer,
+            /* .get_alignment    = */ ggml_backend_cpu_buffer_type_get_alignment,
+            /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+            /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+            /* .is_host          = */ ggml_backend_cpu_buffer_type_is_host,
+        },
+        /* .context  = */ NULL,
+    };
+
+    return &ggml_backend_cpu_buffer_type_huge;
+}
+
 struct ggml_backend_cpu_context {
     int n_threads;
+    struct ggml_threadpool * threadpool;
+    struct ggml_profile    * profile;
+    bool dep_barriers;
     void * work_data;
     size_t work_size;
 
+    // the plan of the last graph, reused for the next one with reuse_plan (see ggml_backend_cpu_set_reuse_plan())
+    bool reuse_plan;
+    struct ggml_cplan plan;
+    struct ggml_tensor ** plan_nodes;
+    int plan_n_nodes;
+
     ggml_abort_callback abort_callback;
     void *              abort_callback_data;
 };
@@ -781,6 +896,10 @@ GGML_CALL static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(gg
     cpu_plan->cplan = ggml_graph_plan(cgraph, cpu_ctx->n_threads);
     cpu_plan->cgraph = *cgraph; // FIXME: deep copy
 
+    if (cpu_ctx->dep_barriers) {
+        ggml_graph_plan_dep_barriers(cgraph, &cpu_plan->cplan);
+    }
+
     if (cpu_plan->cplan.work_size > 0) {
         cpu_plan->cplan.work_data = malloc(cpu_plan->cplan.work_size);
         if (cpu_plan->cplan.work_data == NULL) {
@@ -789,6 +908,8 @@ GGML_CALL static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(gg
         }
     }
 
+    cpu_plan->cplan.threadpool          = cpu_ctx->threadpool;
+    cpu_plan->cplan.profile             = cpu_ctx->profile;
     cpu_plan->cplan.abort_callback      = cpu_ctx->abort_callback;
     cpu_plan->cplan.abort_callback_data = cpu_ctx->abort_callback_data;
 
@@ -815,7 +936,23 @@ GGML_CALL static enum ggml_status ggml_backend_cpu_graph_plan_compute(ggml_backe
 GGML_CALL static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
     struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
 
-    struct ggml_cplan cplan = ggml_graph_plan(cgraph, cpu_ctx->n_threads);
+    const bool reuse = cpu_ctx->reuse_plan && cpu_ctx->plan_nodes == cgraph->nodes && cpu_ctx->plan_n_nodes == cgraph->n_nodes &&
+        cpu_ctx->plan.n_threads == cpu_ctx->n_threads && cpu_ctx->plan.dep_barriers == cpu_ctx->dep_barriers;
+
+    struct ggml_cplan cplan;
+    if (reuse) {
+        cplan = cpu_ctx->plan;
+    } else {
+        cplan = ggml_graph_plan(cgraph, cpu_ctx->n_threads);
+
+        if (cpu_ctx->dep_barriers) {
+            ggml_graph_plan_dep_barriers(cgraph, &cplan);
+        }
+
+        cpu_ctx->plan         = cplan;
+        cpu_ctx->plan_nodes   = cgraph->nodes;
+        cpu_ctx->plan_n_nodes = cgraph->n_nodes;
+    }
 
     if (cpu_ctx->work_size < cplan.work_size) {
         free(cpu_ctx->work_data);
@@ -828,6 +965,8 @@ GGML_CALL static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t
     }
     cplan.work_data = cpu_ctx->work_data;
 
+    cplan.threadpool          = cpu_ctx->threadpool;
+    cplan.profile             = cpu_ctx->profile;
     cplan.abort_callback      = cpu_ctx->abort_callback;
     cplan.abort_callback_data = cpu_ctx->abort_callback_data;
 
@@ -893,8 +1032,14 @@ ggml_backend_t ggml_backend_cpu_init(void) {
     }
 
     ctx->n_threads           = GGML_DEFAULT_N_THREADS;
+    ctx->threadpool          = NULL;
+    ctx->profile             = NULL;
+    ctx->dep_barriers        = false;
     ctx->work_data           = NULL;
     ctx->work_size           = 0;
+    ctx->reuse_plan          = false;
+    ctx->plan_nodes          = NULL;
+    ctx->plan_n_nodes        = 0;
     ctx->abort_callback      = NULL;
     ctx->abort_callback_data = NULL;
 
@@ -923,6 +1068,34 @@ void ggml_backend_cpu_set_n_threads(ggml_backend_t backend_cpu, int n_threads) {
     ctx->n_threads = n_threads;
 }
 
+void ggml_backend_cpu_set_threadpool(ggml_backend_t backend_cpu, struct ggml_threadpool * threadpool) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->threadpool = threadpool;
+}
+
+void ggml_backend_cpu_set_profile(ggml_backend_t backend_cpu, struct ggml_profile * profile) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->profile = profile;
+}
+
+void ggml_backend_cpu_set_dep_barriers(ggml_backend_t backend_cpu, bool dep_barriers) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->dep_barriers = dep_barriers;
+}
+
+void ggml_backend_cpu_set_reuse_plan(ggml_backend_t backend_cpu, bool reuse_plan) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->reuse_plan = reuse_plan;
+}
+
 void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data) {
     GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
 
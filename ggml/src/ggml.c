@@ -147,6 +147,32 @@ typedef void * thread_ret_t;
 
 typedef pthread_t ggml_thread_t;
 
+#if defined(_WIN32)
+typedef CRITICAL_SECTION   ggml_mutex_t;
+typedef CONDITION_VARIABLE ggml_cond_t;
+
+#define ggml_mutex_init(m)       InitializeCriticalSection(m)
+#define ggml_mutex_destroy(m)    DeleteCriticalSection(m)
+#define ggml_mutex_lock(m)       EnterCriticalSection(m)
+#define ggml_mutex_unlock(m)     LeaveCriticalSection(m)
+#define ggml_cond_init(c)        InitializeConditionVariable(c)
+#define ggml_cond_destroy(c)     UNUSED(c)
+#define ggml_cond_wait(c, m)     SleepConditionVariableCS(c, m, INFINITE)
+#define ggml_cond_broadcast(c)   WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t ggml_mutex_t;
+typedef pthread_cond_t  ggml_cond_t;
+
+#define ggml_mutex_init(m)       pthread_mutex_init(m, NULL)
+#define ggml_mutex_destroy(m)    pthread_mutex_destroy(m)
+#define ggml_mutex_lock(m)       pthread_mutex_lock(m)
+#define ggml_mutex_unlock(m)     pthread_mutex_unlock(m)
+#define ggml_cond_init(c)        pthread_cond_init(c, NULL)
+#define ggml_cond_destroy(c)     pthread_cond_destroy(c)
+#define ggml_cond_wait(c, m)     pthread_cond_wait(c, m)
+#define ggml_cond_broadcast(c)   pthread_cond_broadcast(c)
+#endif
+
 #ifdef GGML_USE_CPU_HBM
 #include <hbwmalloc.h>
 #endif
@@ -552,6 +578,11 @@ int64_t ggml_time_us(void) {
     QueryPerformanceCounter(&t);
     return ((t.QuadPart-timer_start) * 1000000) / timer_freq;
 }
+int64_t ggml_time_ns(void) {
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return (int64_t)((double)(t.QuadPart-timer_start) * 1e9 / timer_freq);
+}
 #else
 void ggml_time_init(void) {}
 int64_t ggml_time_ms(void) {
@@ -565,6 +596,12 @@ int64_t ggml_time_us(void) {
     clock_gettime(CLOCK_MONOTONIC, &ts);
     return (int64_t)ts.tv_sec*1000000 + (int64_t)ts.tv_nsec/1000;
 }
+
+int64_t ggml_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000 + (int64_t)ts.tv_nsec;
+}
 #endif
 
 int64_t ggml_cycles(void) {
@@ -2613,6 +2650,8 @@ struct ggml_compute_state_shared {
 
     int n_threads;
 
+    struct ggml_threadpool * threadpool; // NULL when the threads are created for this graph only
+
     // synchronization primitives
     atomic_int n_barrier;
     atomic_int n_barrier_passed;
@@ -2622,15 +2661,41 @@ struct ggml_compute_state_shared {
 
     atomic_int current_chunk; // currently processing chunk during mul_mat, shared between all the threads
 
+    // dependency-driven barriers (see ggml_graph_plan_dep_barriers()), NULL when there is a barrier after every node
+    const struct ggml_dep_node * dep;
+    uint8_t * dep_chunks; // the chunk counters of the nodes of a group, one per cache line
+    uint8_t * dep_wdata;  // the work buffer slices of the nodes of a group
+
     enum ggml_status ec;
 };
 
 struct ggml_compute_state {
     ggml_thread_t thrd;
     int ith;
+    int cpu; // thread pool only: the CPU this worker is pinned to with strict_cpu, -1 otherwise
+    int numa_node; // thread pool only: the NUMA node this worker runs on, -1 if not a single one
     struct ggml_compute_state_shared * shared;
 };
 
+struct ggml_threadpool {
+    ggml_mutex_t mutex; // protects the sleeping workers from missing a wake-up
+    ggml_cond_t  cond;  // signaled when a graph is submitted or the pool is stopped
+
+    struct ggml_threadpool_params params;
+
+    // the state of the graph currently being computed, filled in by ggml_graph_compute()
+    struct ggml_compute_state_shared shared;
+
+    // workers[0] is the thread that calls ggml_graph_compute(), the others are owned by the pool
+    struct ggml_compute_state * workers;
+
+    // the upper bits count the submitted graphs, the lower 16 bits hold the number of threads
+    // participating in the latest one, so a worker can decide if it is needed without touching shared
+    atomic_int  n_graph;
+    atomic_bool pause;
+    atomic_bool stop;
+};
+
 struct ggml_compute_params {
     // ith = thread index, nth = number of threads
     int ith, nth;
@@ -2640,6 +2705,9 @@ struct ggml_compute_params {
     void * wdata;
 
     struct ggml_compute_state_shared * shared;
+
+    // chunk counter of the node being computed, shared between all the threads
+    atomic_int * current_chunk;
 };
 
 //
@@ -3865,6 +3933,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "MUL_MAT_ID",
     "OUT_PROD",
     "MOE_FUSED_UP_GATE",
+    "MUL_MAT_ADD",
 
     "SCALE",
     "SET",
@@ -3925,7 +3994,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 82, "GGML_OP_COUNT != 82");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -3960,6 +4029,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "X[i]*Y",
     "X*Y",
     "X*Y1&X*Y2",
+    "X*Y+Z",
 
     "x*v",
     "y-\\>view(x)",
@@ -4020,7 +4090,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 82, "GGML_OP_COUNT != 82");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -4094,19 +4164,25 @@ inline static void ggml_critical_section_start(void) {
     }
 }
 
-#ifdef GGML_USE_OPENMP
+static inline void ggml_thread_cpu_relax(void) {
+#if defined(__SSE3__)
+    _mm_pause();
+#elif defined __ARM_NEON
+    __asm__ __volatile__("isb\n");
+#endif
+}
+
 static void ggml_barrier(struct ggml_compute_state_shared * shared) {
     if (shared->n_threads == 1) {
         return;
     }
 
-    #pragma omp barrier
-}
-#else
-static void ggml_barrier(struct ggml_compute_state_shared * shared) {
-    if (shared->n_threads == 1) {
+#ifdef GGML_USE_OPENMP
+    if (!shared->threadpool) {
+        #pragma omp barrier
         return;
     }
+#endif
 
     atomic_int * n_barrier = &shared->n_barrier;
     atomic_int * n_barrier_passed = &shared->n_barrier_passed;
@@ -4126,17 +4202,12 @@ static void ggml_barrier(struct ggml_compute_state_shared * shared) {
                 if (atomic_load(n_barrier_passed) != passed_old) {
                     return;
                 }
-            #if defined(__SSE3__)
-                _mm_pause();
-            #elif defined __ARM_NEON
-                __asm__ __volatile__("isb\n");
-            #endif
+                ggml_thread_cpu_relax();
             }
             sched_yield();
         }
     }
 }
-#endif
 
 // TODO: make this somehow automatically executed
 //       some sort of "sentry" mechanism
@@ -4251,6 +4322,519 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+// With GGML_NUMA_STRATEGY_SPLIT the rows of a 2D matmul weight are split between the nodes in multiples of
+// GGML_NUMA_ROW_STEP (a multiple of the row interleaving of all iqk types), and the experts of a 3D weight
+// are placed whole on a node. The threads are distributed between the nodes as ith % n_nodes, thread pool
+// workers pinned with a cpumask run on the node of their CPUs, and the threads of a node compute only the
+// rows (experts) that are local to them.
+#define GGML_NUMA_ROW_STEP 16
+
+static inline bool ggml_numa_split(void) {
+    return g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_SPLIT && g_state.numa.n_nodes > 1;
+}
+
+// the rows [*first, *last) of a 2D weight with nrows rows that are placed on node
+static void ggml_numa_rows(int64_t nrows, int node, int n_nodes, int64_t * first, int64_t * last) {
+    const int64_t n_units = nrows/GGML_NUMA_ROW_STEP;
+    *first = GGML_NUMA_ROW_STEP*((n_units*node)/n_nodes);
+    *last  = node == n_nodes - 1 ? nrows : GGML_NUMA_ROW_STEP*((n_units*(node + 1))/n_nodes);
+}
+
+// the node on which expert i of a 3D weight with n_as experts is placed
+static inline int ggml_numa_expert_node(int64_t i, int64_t n_as, int n_nodes) {
+    return (int) ((i*n_nodes)/n_as);
+}
+
+static int ggml_numa_cpu_node(int cpu) {
+    for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
+        for (uint32_t i = 0; i < g_state.numa.nodes[n].n_cpus; ++i) {
+            if ((int) g_state.numa.nodes[n].cpus[i] == cpu) {
+                return n;
+            }
+        }
+    }
+    return -1;
+}
+
+// the node that a thread pool worker runs on once its affinity is set (see ggml_threadpool_worker): the node of
+// its CPU (cpu >= 0) or of all the CPUs in cpumask, else the one of set_numa_thread_affinity(), -1 if none
+static int ggml_numa_worker_node(int ith, int cpu, const bool * cpumask) {
+    if (!ggml_is_numa()) {
+        return -1;
+    }
+    if (cpu >= 0) {
+        return ggml_numa_cpu_node(cpu);
+    }
+    if (cpumask) {
+        int node = -1;
+        for (int i = 0; i < GGML_MAX_N_THREADS; ++i) {
+            if (cpumask[i]) {
+                const int n = ggml_numa_cpu_node(i);
+                if (n < 0 || (node >= 0 && n != node)) {
+                    return -1;
+                }
+                node = n;
+            }
+        }
+        return node;
+    }
+    switch (g_state.numa.numa_strategy) {
+        case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_SPLIT:
+            return ith % g_state.numa.n_nodes;
+        case GGML_NUMA_STRATEGY_ISOLATE:
+            return g_state.numa.current_node;
+        default:
+            return -1;
+    }
+}
+
+#if defined(__gnu_linux__)
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+// prefer node for the pages of [addr, addr + size), and move the pages that are already there
+static bool ggml_numa_bind(const void * addr, size_t size, int node) {
+#if defined(SYS_mbind)
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const uintptr_t start = (uintptr_t) addr & ~(page_size - 1);
+    const uintptr_t end   = ((uintptr_t) addr + size + page_size - 1) & ~(page_size - 1);
+    unsigned long mask = 1ul << node;
+    return syscall(SYS_mbind, (void *) start, end - start, MPOL_PREFERRED, &mask, 8*sizeof(mask), MPOL_MF_MOVE) == 0;
+#else
+    UNUSED(addr);
+    UNUSED(size);
+    UNUSED(node);
+    return false;
+#endif
+}
+#endif
+
+bool ggml_numa_distribute_tensor(struct ggml_tensor * tensor) {
+    if (!ggml_numa_split() || tensor->data == NULL || !ggml_is_contiguous(tensor) || tensor->ne[3] != 1) {
+        return false;
+    }
+    const int n_nodes = g_state.numa.n_nodes;
+    if (tensor->ne[2] == 1 && tensor->ne[1] < GGML_NUMA_ROW_STEP*n_nodes) {
+        return false;
+    }
+    if (tensor->ne[2] > 1 && tensor->ne[2] < n_nodes) {
+        return false;
+    }
+
+#if defined(__gnu_linux__)
+    static bool warned = false;
+    bool ok = true;
+    for (int node = 0; node < n_nodes; ++node) {
+        const char * data;
+        size_t size;
+        if (tensor->ne[2] == 1) {
+            int64_t first, last;
+            ggml_numa_rows(tensor->ne[1], node, n_nodes, &first, &last);
+            data = (const char *) tensor->data + first*tensor->nb[1];
+            size = (last - first)*tensor->nb[1];
+        } else {
+            int64_t first = 0;
+            while (first < tensor->ne[2] && ggml_numa_expert_node(first, tensor->ne[2], n_nodes) < node) ++first;
+            int64_t last = first;
+            while (last < tensor->ne[2] && ggml_numa_expert_node(last, tensor->ne[2], n_nodes) == node) ++last;
+            data = (const char *) tensor->data + first*tensor->nb[2];
+            size = (last - first)*tensor->nb[2];
+        }
+        ok = ggml_numa_bind(data, size, node) && ok;
+    }
+    if (!ok && !warned) {
+        fprintf(stderr, "warning: %s: mbind() failed for %s: %s, the weights stay where they are\n", __func__, tensor->name, strerror(errno));
+        warned = true;
+    }
+#endif
+
+    // the compute side only depends on the flag, so it is correct even if the pages could not be moved
+    tensor->flags |= GGML_TENSOR_FLAG_NUMA;
+    return true;
+}
+
+// Expert paging: the experts that GGML_OP_MUL_MAT_ID / GGML_OP_MOE_FUSED_UP_GATE select from the registered 3D weights
+// are counted per group (the weights of a group share the router output). When a group gets a new selection, the
+// selected experts of all its weights and the most used experts of the next group are prefetched with
+// madvise(MADV_WILLNEED), so the cold experts are read ahead in parallel instead of being faulted in page by page by
+// the matmul threads. Every GGML_EXPERT_PAGING_PERIOD selections the most used experts are locked in RAM within the
+// pin budget (the ones that dropped out are unlocked) and the counts are halved, so the ranking follows recent usage.
+// The experts that are not locked are left to the page cache.
+// The madvise()/mlock() calls are made by a background thread of the registry: a selection only queues its prefetches
+// and asks for the rebalance, so the compute threads never wait for the kernel.
+// Each model has its own registry; the compute threads find it through the list of registries by the weight data.
+
+#define GGML_EXPERT_PAGING_PERIOD 256
+#define GGML_EXPERT_PAGING_MAX_REQUESTS 1024
+
+struct ggml_paged_weight {
+    const char * data;
+    size_t       expert_size;
+    int          group;
+};
+
+struct ggml_paged_group {
+    int64_t    n_expert;
+    size_t     expert_size; // bytes of one expert summed over the weights of the group
+    uint32_t * counts;      // [n_expert]
+    bool     * pinned;      // [n_expert], only used by the background thread
+    // the last selection: the weight that observed it first and the ids
+    const char * last_data;
+    const void * last_ids;
+};
+
+struct ggml_expert_ref {
+    int     group;
+    int32_t expert;
+};
+
+// the weights and the groups only change while the model is loaded, before the first selection
+struct ggml_expert_paging {
+    ggml_mutex_t mutex; // the graphs of several contexts of the model can compute at the same time
+    ggml_cond_t  cond;  // signaled when work is queued for the background thread or the registry is freed
+    size_t pin_budget;
+    int64_t n_select;
+    int n_weights;
+    int n_groups;
+    struct ggml_paged_weight * weights;
+    struct ggml_paged_group  * groups;
+
+    // the work queued by the selections, the prefetches beyond GGML_EXPERT_PAGING_MAX_REQUESTS are dropped
+    struct ggml_expert_ref requests[GGML_EXPERT_PAGING_MAX_REQUESTS];
+    int  n_requests;
+    bool rebalance;
+    bool stop;
+
+    // the background thread and its state
+    bool          started;
+    ggml_thread_t thread;
+    size_t        pinned;
+    bool          pin_failed;
+
+    struct ggml_expert_paging * next;
+};
+
+// the registries of all models, changed and searched in the critical section
+static struct ggml_expert_paging * g_expert_paging_list = NULL;
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/mman.h>
+#define GGML_EXPERT_PAGING_SUPPORTED
+static thread_ret_t ggml_expert_paging_thread(void * data);
+#endif
+
+struct ggml_expert_paging * ggml_expert_paging_init(size_t pin_budget) {
+    struct ggml_expert_paging * paging = calloc(1, sizeof(struct ggml_expert_paging));
+    ggml_mutex_init(&paging->mutex);
+    ggml_cond_init(&paging->cond);
+    paging->pin_budget = pin_budget;
+#if defined(GGML_EXPERT_PAGING_SUPPORTED)
+    paging->started = pthread_create(&paging->thread, NULL, ggml_expert_paging_thread, paging) == 0;
+    if (!paging->started) {
+        fprintf(stderr, "warning: %s: failed to create the expert paging thread, the experts are only counted\n", __func__);
+    }
+#endif
+
+    ggml_critical_section_start();
+    paging->next = g_expert_paging_list;
+    g_expert_paging_list = paging;
+    ggml_critical_section_end();
+
+    return paging;
+}
+
+bool ggml_expert_paging_add(struct ggml_expert_paging * paging, struct ggml_tensor * tensor, int group) {
+#if defined(GGML_EXPERT_PAGING_SUPPORTED)
+    if (tensor->data == NULL || group < 0 || !ggml_is_contiguous(tensor) || tensor->ne[2] < 2 || tensor->ne[3] != 1) {
+        return false;
+    }
+    ggml_mutex_lock(&paging->mutex);
+    if (group >= paging->n_groups) {
+        paging->groups = realloc(paging->groups, (group + 1)*sizeof(struct ggml_paged_group));
+        memset(paging->groups + paging->n_groups, 0, (group + 1 - paging->n_groups)*sizeof(struct ggml_paged_group));
+        paging->n_groups = group + 1;
+    }
+    struct ggml_paged_group * g = &paging->groups[group];
+    if (g->n_expert == 0) {
+        g->n_expert = tensor->ne[2];
+        g->counts   = calloc(g->n_expert, sizeof(uint32_t));
+        g->pinned   = calloc(g->n_expert, sizeof(bool));
+    } else if (g->n_expert != tensor->ne[2]) {
+        ggml_mutex_unlock(&paging->mutex);
+        return false;
+    }
+    g->expert_size += tensor->nb[2];
+
+    // the weights are also searched in the critical section (taken after the mutex, never the other way around)
+    ggml_critical_section_start();
+    paging->weights = realloc(paging->weights, (paging->n_weights + 1)*sizeof(struct ggml_paged_weight));
+    paging->weights[paging->n_weights++] = (struct ggml_paged_weight) { tensor->data, tensor->nb[2], group };
+    ggml_critical_section_end();
+    ggml_mutex_unlock(&paging->mutex);
+
+    tensor->flags |= GGML_TENSOR_FLAG_PAGED;
+    return true;
+#else
+    UNUSED(paging);
+    UNUSED(tensor);
+    UNUSED(group);
+    return false;
+#endif
+}
+
+#if defined(GGML_EXPERT_PAGING_SUPPORTED)
+// op 0 prefetches, 1 locks and 2 unlocks the expert in all the weights of the group; the lock covers only the pages
+// that belong to the expert alone, the prefetch all of them
+static bool ggml_expert_paging_apply(const struct ggml_expert_paging * paging, int group, int64_t expert, int op) {
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    bool ok = true;
+    for (int i = 0; i < paging->n_weights; ++i) {
+        const struct ggml_paged_weight * w = &paging->weights[i];
+        if (w->group != group) continue;
+        const uintptr_t addr = (uintptr_t) (w->data + expert*w->expert_size);
+        if (op == 0) {
+            const uintptr_t start = addr & ~(page_size - 1);
+            ok = madvise((void *) start, addr + w->expert_size - start, MADV_WILLNEED) == 0 && ok;
+            continue;
+        }
+        const uintptr_t start = (addr + page_size - 1) & ~(page_size - 1);
+        const uintptr_t end   = (addr + w->expert_size) & ~(page_size - 1);
+        if (end <= start) continue;
+        ok = (op == 1 ? mlock((void *) start, end - start) : munlock((void *) start, end - start)) == 0 && ok;
+    }
+    return ok;
+}
+
+struct ggml_expert_rank {
+    uint32_t count;
+    int      group;
+    int32_t  expert;
+};
+
+static int ggml_expert_rank_cmp(const void * a, const void * b) {
+    const struct ggml_expert_rank * ra = a;
+    const struct ggml_expert_rank * rb = b;
+    return ra->count < rb->count ? 1 : ra->count > rb->count ? -1 : 0;
+}
+
+// the counts of all the experts, which are halved, taken with the mutex held
+static struct ggml_expert_rank * ggml_expert_paging_ranks(struct ggml_expert_paging * paging, int64_t * n_ranks) {
+    int64_t n_total = 0;
+    for (int ig = 0; ig < paging->n_groups; ++ig) {
+        n_total += paging->groups[ig].n_expert;
+    }
+    struct ggml_expert_rank * ranks = malloc(n_total*sizeof(struct ggml_expert_rank));
+    int64_t n = 0;
+    for (int ig = 0; ig < paging->n_groups; ++ig) {
+        struct ggml_paged_group * g = &paging->groups[ig];
+        for (int64_t e = 0; e < g->n_expert; ++e) {
+            ranks[n++] = (struct ggml_expert_rank) { g->counts[e], ig, (int32_t) e };
+            g->counts[e] /= 2;
+        }
+    }
+    *n_ranks = n;
+    return ranks;
+}
+
+// locks the most used experts of ranks within the budget, called by the background thread without the mutex
+static void ggml_expert_paging_rebalance(struct ggml_expert_paging * paging, struct ggml_expert_rank * ranks, int64_t n) {
+    qsort(ranks, n, sizeof(struct ggml_expert_rank), ggml_expert_rank_cmp);
+
+    // unlock the experts that are no longer among the most used first, so the budget is available for the new ones
+    size_t budget = 0;
+    int64_t n_keep = 0;
+    for (; n_keep < n && ranks[n_keep].count > 0; ++n_keep) {
+        const size_t size = paging->groups[ranks[n_keep].group].expert_size;
+        if (budget + size > paging->pin_budget) break;
+        budget += size;
+    }
+    for (int64_t i = n_keep; i < n; ++i) {
+        struct ggml_paged_group * g = &paging->groups[ranks[i].group];
+        if (g->pinned[ranks[i].expert]) {
+            ggml_expert_paging_apply(paging, ranks[i].group, ranks[i].expert, 2);
+            g->pinned[ranks[i].expert] = false;
+            paging->pinned -= g->expert_size;
+        }
+    }
+    for (int64_t i = 0; i < n_keep; ++i) {
+        struct ggml_paged_group * g = &paging->groups[ranks[i].group];
+        if (g->pinned[ranks[i].expert]) continue;
+        if (!ggml_expert_paging_apply(paging, ranks[i].group, ranks[i].expert, 1)) {
+            fprintf(stderr, "warning: %s: mlock() failed: %s, %.1f MiB of experts are locked, not locking more (raise RLIMIT_MEMLOCK)\n",
+                    __func__, strerror(errno), paging->pinned/1024.0/1024.0);
+            ggml_expert_paging_apply(paging, ranks[i].group, ranks[i].expert, 2);
+            paging->pin_failed = true;
+            break;
+        }
+        g->pinned[ranks[i].expert] = true;
+        paging->pinned += g->expert_size;
+    }
+}
+
+static thread_ret_t ggml_expert_paging_thread(void * data) {
+    struct ggml_expert_paging * paging = data;
+    struct ggml_expert_ref requests[GGML_EXPERT_PAGING_MAX_REQUESTS];
+
+    while (true) {
+        ggml_mutex_lock(&paging->mutex);
+        while (!paging->stop && paging->n_requests == 0 && !paging->rebalance) {
+            ggml_cond_wait(&paging->cond, &paging->mutex);
+        }
+        if (paging->stop) {
+            ggml_mutex_unlock(&paging->mutex);
+            break;
+        }
+        const int n_requests = paging->n_requests;
+        memcpy(requests, paging->requests, n_requests*sizeof(struct ggml_expert_ref));
+        paging->n_requests = 0;
+        struct ggml_expert_rank * ranks = NULL;
+        int64_t n_ranks = 0;
+        if (paging->rebalance && !paging->pin_failed) {
+            ranks = ggml_expert_paging_ranks(paging, &n_ranks);
+        }
+        paging->rebalance = false;
+        ggml_mutex_unlock(&paging->mutex);
+
+        for (int i = 0; i < n_requests; ++i) {
+            if (!paging->groups[requests[i].group].pinned[requests[i].expert]) {
+                ggml_expert_paging_apply(paging, requests[i].group, requests[i].expert, 0);
+            }
+        }
+        if (ranks) {
+            ggml_expert_paging_rebalance(paging, ranks, n_ranks);
+            free(ranks);
+        }
+    }
+
+    return 0;
+}
+
+static void ggml_expert_paging_request(struct ggml_expert_paging * paging, int group, int64_t expert) {
+    if (paging->n_requests < GGML_EXPERT_PAGING_MAX_REQUESTS) {
+        paging->requests[paging->n_requests++] = (struct ggml_expert_ref) { group, (int32_t) expert };
+    }
+}
+#endif
+
+void ggml_expert_paging_free(struct ggml_expert_paging * paging) {
+    if (!paging) {
+        return;
+    }
+
+    ggml_critical_section_start();
+    for (struct ggml_expert_paging ** p = &g_expert_paging_list; *p; p = &(*p)->next) {
+        if (*p == paging) {
+            *p = paging->next;
+            break;
+        }
+    }
+    ggml_critical_section_end();
+
+#if defined(GGML_EXPERT_PAGING_SUPPORTED)
+    if (paging->started) {
+        ggml_mutex_lock(&paging->mutex);
+        paging->stop = true;
+        ggml_cond_broadcast(&paging->cond);
+        ggml_mutex_unlock(&paging->mutex);
+        pthread_join(paging->thread, NULL);
+    }
+#endif
+
+    // the graphs of the model are done at this point, so no selection can be using the registry
+    ggml_mutex_lock(&paging->mutex);
+    for (int ig = 0; ig < paging->n_groups; ++ig) {
+        struct ggml_paged_group * g = &paging->groups[ig];
+#if defined(GGML_EXPERT_PAGING_SUPPORTED)
+        for (int64_t e = 0; e < g->n_expert; ++e) {
+            if (g->pinned[e]) {
+                ggml_expert_paging_apply(paging, ig, e, 2);
+            }
+        }
+#endif
+        free(g->counts);
+        free(g->pinned);
+    }
+    free(paging->groups);
+    free(paging->weights);
+    ggml_mutex_unlock(&paging->mutex);
+    ggml_cond_destroy(&paging->cond);
+    ggml_mutex_destroy(&paging->mutex);
+    free(paging);
+}
+
+// called by thread 0 of a GGML_OP_MUL_MAT_ID / GGML_OP_MOE_FUSED_UP_GATE with the n_active experts it uses
+static void ggml_expert_paging_select(const struct ggml_tensor * src0, const struct ggml_tensor * ids, const int32_t * active, int n_active) {
+#if defined(GGML_EXPERT_PAGING_SUPPORTED)
+    struct ggml_expert_paging * paging = NULL;
+    struct ggml_paged_weight w;
+    ggml_critical_section_start();
+    for (struct ggml_expert_paging * p = g_expert_paging_list; p && !paging; p = p->next) {
+        for (int i = 0; i < p->n_weights; ++i) {
+            if (p->weights[i].data == src0->data) {
+                paging = p;
+                w = p->weights[i];
+                break;
+            }
+        }
+    }
+    ggml_critical_section_end();
+    if (!paging) return;
+
+    // the registry lives as long as the model, whose weights this graph is using
+    ggml_mutex_lock(&paging->mutex);
+    struct ggml_paged_group * g = &paging->groups[w.group];
+    // the other weights of the group with the same ids see the selection that was already handled
+    if (g->last_ids == ids->data && g->last_data != w.data) {
+        ggml_mutex_unlock(&paging->mutex);
+        return;
+    }
+    g->last_ids  = ids->data;
+    g->last_data = w.data;
+
+    for (int i = 0; i < n_active; ++i) {
+        ++g->counts[active[i]];
+        ggml_expert_paging_request(paging, w.group, active[i]);
+    }
+
+    // the routing of the next group is not known yet, its most used experts are the best guess
+    if (w.group + 1 < paging->n_groups) {
+        const struct ggml_paged_group * next = &paging->groups[w.group + 1];
+        bool * taken = next->n_expert > 0 ? calloc(next->n_expert, sizeof(bool)) : NULL;
+        for (int i = 0; i < n_active && taken; ++i) {
+            int64_t best = -1;
+            for (int64_t e = 0; e < next->n_expert; ++e) {
+                if (!taken[e] && (best < 0 || next->counts[e] > next->counts[best])) best = e;
+            }
+            if (best < 0 || next->counts[best] == 0) break;
+            taken[best] = true;
+            ggml_expert_paging_request(paging, w.group + 1, best);
+        }
+        free(taken);
+    }
+
+    if (++paging->n_select % GGML_EXPERT_PAGING_PERIOD == 0 && paging->pin_budget > 0) {
+        paging->rebalance = true;
+    }
+    if (paging->started) {
+        ggml_cond_broadcast(&paging->cond);
+    } else {
+        paging->n_requests = 0;
+        paging->rebalance  = false;
+    }
+    ggml_mutex_unlock(&paging->mutex);
+#else
+    UNUSED(src0);
+    UNUSED(ids);
+    UNUSED(active);
+    UNUSED(n_active);
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -6838,6 +7422,34 @@ struct ggml_tensor * ggml_moe_up_gate(
     return result;
 }
 
+// ggml_mul_mat_add
+
+struct ggml_tensor * ggml_mul_mat_add(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    GGML_ASSERT(ggml_can_mul_mat(a, b));
+    GGML_ASSERT(!ggml_is_transposed(a));
+
+    if (a->grad || b->grad || c->grad) {
+        return ggml_add(ctx, ggml_mul_mat(ctx, a, b), c);
+    }
+
+    const int64_t ne[4] = { a->ne[1], b->ne[1], b->ne[2], b->ne[3] };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne);
+
+    GGML_ASSERT(c->type == GGML_TYPE_F32 && ggml_is_contiguous(c) && ggml_are_same_shape(c, result));
+
+    result->op     = GGML_OP_MUL_MAT_ADD;
+    result->grad   = NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+    result->src[2] = c;
+
+    return result;
+}
+
 
 // ggml_out_prod
 
@@ -14381,13 +14993,111 @@ static inline uint32_t simple_gcd(uint32_t a, uint32_t b) {
     return a;
 }
 
-static void ggml_compute_forward_mul_mat(
+#if GGML_USE_IQK_MULMAT
+#define GGML_IQK_CHUNKS_PER_THREAD 4
+#define GGML_IQK_MIN_CHUNK_ROWS    16
+
+// the number of non-empty chunks when n_units units of rows are split into n_chunk chunks
+static inline int ggml_iqk_split_units(int64_t n_units, int64_t n_chunk) {
+    // iqk gives ceil(n_units/n_chunk) units to each chunk
+    const int64_t units_per_chunk = (n_units + n_chunk - 1)/n_chunk;
+    return (int) ((n_units + units_per_chunk - 1)/units_per_chunk);
+}
+
+// The rows of the iqk matmuls are split into more chunks than threads, and the chunks are claimed through
+// params->current_chunk, so a thread that is slowed down (an E-core, a noisy neighbour) does not hold up
+// the others until the next barrier. The chunks are multiples of row_step (the row interleaving of the
+// type), and none of them is empty. n_items is the number of matrices sharing the chunks (MoE experts).
+// min_rows is the autotuned minimum chunk size (iqk_mul_mat_chunk_rows), 0 for the default.
+static int ggml_iqk_n_chunks(const struct ggml_compute_params * params, int64_t nrows, int row_step, int n_items, int min_rows) {
+    const int chunks_per_thread = params->shared->cplan->chunks_per_thread > 0 ? params->shared->cplan->chunks_per_thread : GGML_IQK_CHUNKS_PER_THREAD;
+
+    const int64_t n_units   = nrows/row_step;
+    const int64_t min_units = MAX(1, (min_rows > 0 ? min_rows : GGML_IQK_MIN_CHUNK_ROWS)/row_step);
+
+    int64_t n_chunk = (chunks_per_thread*params->nth + n_items - 1)/n_items;
+    n_chunk = MAX(1, MIN(n_chunk, n_units/min_units));
+    if (chunks_per_thread == 1) {
+        // static split: every thread gets (at most) one chunk, as iqk would split the rows by itself
+        n_chunk = MIN(params->nth, n_units);
+    }
+
+    return ggml_iqk_split_units(n_units, n_chunk);
+}
+
+// the next chunk for a thread that is done with chunk, params->current_chunk must have been set to nth
+static inline int ggml_iqk_next_chunk(const struct ggml_compute_params * params, int chunk) {
+    return params->shared->cplan->chunks_per_thread == 1 ? chunk + params->nth : atomic_fetch_add(params->current_chunk, 1);
+}
+
+// the rows [*first, *last) that iqk_mul_mat computes for chunk out of n_chunk (see ggml_iqk_split_units)
+static inline void ggml_iqk_chunk_rows(int64_t nrows, int row_step, int n_chunk, int chunk, int64_t * first, int64_t * last) {
+    const int64_t n_units         = nrows/row_step;
+    const int64_t units_per_chunk = (n_units + n_chunk - 1)/n_chunk;
+    *first = MIN(nrows, chunk*units_per_chunk*row_step);
+    *last  = MIN(nrows, *first + units_per_chunk*row_step);
+}
+
+// adds rows [first, last) of residual to those of the 2D dst of a GGML_OP_MUL_MAT_ADD
+static void ggml_mul_mat_add_rows(struct ggml_tensor * dst, const struct ggml_tensor * residual, int64_t first, int64_t last) {
+    for (int64_t i1 = 0; i1 < dst->ne[1]; ++i1) {
+        float * d = (float *)((char *)dst->data + i1*dst->nb[1]) + first;
+        const float * c = (const float *)residual->data + i1*dst->ne[0] + first;
+        ggml_vec_add_f32(last - first, d, d, c);
+    }
+}
+
+// the node of the calling thread and its index/count among the threads of that node, or -1 if the rows of src0
+// are not split between the nodes. Thread pool workers use the node they are pinned to, and the rows are only split
+// if every thread is pinned to a single node and every node has a thread.
+static int ggml_numa_thread_node(const struct ggml_tensor * src0, const struct ggml_compute_params * params, int * node_ith, int * node_nth) {
+    const int ith = params->ith;
+    const int nth = params->nth;
+    if (!(src0->flags & GGML_TENSOR_FLAG_NUMA) || !ggml_numa_split() || nth < (int) g_state.numa.n_nodes) {
+        return -1;
+    }
+    const int n_nodes = g_state.numa.n_nodes;
+    const struct ggml_threadpool * threadpool = params->shared->threadpool;
+    if (!threadpool) {
+        const int node = ith % n_nodes;
+        *node_ith = ith / n_nodes;
+        *node_nth = (nth - node + n_nodes - 1) / n_nodes;
+        return node;
+    }
+    const int node = threadpool->workers[ith].numa_node;
+    int n_threads[GGML_NUMA_MAX_NODES] = {0};
+    int n_before = 0;
+    for (int j = 0; j < nth; ++j) {
+        const int n = threadpool->workers[j].numa_node;
+        if (n < 0) {
+            return -1;
+        }
+        n_before += j < ith && n == node;
+        ++n_threads[n];
+    }
+    for (int n = 0; n < n_nodes; ++n) {
+        if (n_threads[n] == 0) {
+            return -1;
+        }
+    }
+    *node_ith = n_before;
+    *node_nth = n_threads[node];
+    return node;
+}
+#endif
+
+// Returns true if the residual of a GGML_OP_MUL_MAT_ADD node has been added to dst, which the chunked iqk
+// matmuls do; the other paths leave it to ggml_compute_forward_mul_mat.
+static bool ggml_compute_forward_mul_mat_impl(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
 
     const struct ggml_tensor * src0 = dst->src[0];
     const struct ggml_tensor * src1 = dst->src[1];
 
+    // GGML_OP_MUL_MAT_ADD: the iqk chunks add it to their rows right away
+    const struct ggml_tensor * residual = dst->op == GGML_OP_MUL_MAT_ADD ? dst->src[2] : NULL;
+
     GGML_TENSOR_BINARY_OP_LOCALS
 
     const int ith = params->ith;
@@ -14436,7 +15146,7 @@ static void ggml_compute_forward_mul_mat(
                     ne02, ne03, ne12, ne13, nb02, nb03, nb12, nb13, nb2/sizeof(float), nb3/sizeof(float),
                     src0->type, src0->data, nb01,
                     src1->type, src1->data, nb11,
-                    (float *)dst->data, nb1/sizeof(float), ith, nth)) return;
+                    (float *)dst->data, nb1/sizeof(float), ith, nth)) return false;
     }
 #endif
 
@@ -14459,7 +15169,7 @@ static void ggml_compute_forward_mul_mat(
                                      src1->type,
                                      dst->type))
                     goto UseGgmlGemm1;
-        return;
+        return false;
     }
 UseGgmlGemm1:;
 #endif
@@ -14543,7 +15253,7 @@ UseGgmlGemm1:;
 
         if (ith == 0) {
             // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-            //atomic_store(&params->shared->current_chunk, nth);
+            atomic_store(params->current_chunk, nth);
         }
 
         ggml_barrier(params->shared);
@@ -14554,12 +15264,49 @@ UseGgmlGemm1:;
 #if GGML_USE_IQK_MULMAT
     if (src1->type != vec_dot_type && dst->type == GGML_TYPE_F32) {
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+        const int row_step = ne02*ne03*ne12*ne13 == 1 ? iqk_mul_mat_row_step(ne00, type, vec_dot_type) : 0;
+        int node_ith, node_nth;
+        const int node = row_step > 0 ? ggml_numa_thread_node(src0, params, &node_ith, &node_nth) : -1;
+        if (node >= 0) {
+            // the threads of a node compute the rows of src0 that are on that node, split statically
+            int64_t first, last;
+            ggml_numa_rows(ne01, node, g_state.numa.n_nodes, &first, &last);
+            const int n_chunk = ggml_iqk_split_units((last - first)/row_step, node_nth);
+            for (int chunk = node_ith; chunk < n_chunk; chunk += node_nth) {
+                iqk_mul_mat(last - first, ne11, ne00,
+                        type, (const char *)src0->data + first*nb01, nb01,
+                        vec_dot_type, wdata, row_size,
+                        (float *)dst->data + first, nb1/sizeof(float), chunk, n_chunk);
+                if (residual) {
+                    int64_t i0_first, i0_last;
+                    ggml_iqk_chunk_rows(last - first, row_step, n_chunk, chunk, &i0_first, &i0_last);
+                    ggml_mul_mat_add_rows(dst, residual, first + i0_first, first + i0_last);
+                }
+            }
+            return true;
+        }
+        if (row_step > 0) {
+            const int n_chunk = ggml_iqk_n_chunks(params, ne01, row_step, 1,
+                    iqk_mul_mat_chunk_rows(ne01, ne11, ne00, type, vec_dot_type, params->nth));
+            for (int chunk = ith; chunk < n_chunk; chunk = ggml_iqk_next_chunk(params, chunk)) {
+                iqk_mul_mat(ne01, ne11, ne00,
+                        type, src0->data, nb01,
+                        vec_dot_type, wdata, row_size,
+                        (float *)dst->data, nb1/sizeof(float), chunk, n_chunk);
+                if (residual) {
+                    int64_t i0_first, i0_last;
+                    ggml_iqk_chunk_rows(ne01, row_step, n_chunk, chunk, &i0_first, &i0_last);
+                    ggml_mul_mat_add_rows(dst, residual, i0_first, i0_last);
+                }
+            }
+            return true;
+        }
         if (iqk_mul_mat_4d(ne01, ne11, ne00,
                     ne02, ne03, ne12, ne13, nb02, nb03, row_size*ne11, row_size*ne11*ne12,
                     nb2/sizeof(float), nb3/sizeof(float),
                     src0->type, src0->data, nb01,
                     vec_dot_type, wdata, row_size,
-                    (float *)dst->data, nb1/sizeof(float), ith, nth)) return;
+                    (float *)dst->data, nb1/sizeof(float), ith, nth)) return false;
     }
 #endif
 
@@ -14581,13 +15328,13 @@ UseGgmlGemm1:;
                                      vec_dot_type,
                                      dst->type))
                     goto UseGgmlGemm2;
-        return;
+        return false;
     }
 UseGgmlGemm2:;
 #endif
 
     if (ith == 0) {
-        atomic_store(&params->shared->current_chunk, nth);
+        atomic_store(params->current_chunk, nth);
     }
     ggml_barrier(params->shared);
 
@@ -14639,7 +15386,7 @@ UseGgmlGemm2:;
         int64_t src0_end   = ((ith + 1) * ne01) / nth;
         src0_start = (src0_start % matmul_num_cols) ? src0_start + matmul_num_cols - (src0_start % matmul_num_cols): src0_start;
         src0_end   = (src0_end   % matmul_num_cols) ? src0_end   + matmul_num_cols - (src0_end   % matmul_num_cols): src0_end;
-        if (src0_start >= src0_end) return;
+        if (src0_start >= src0_end) return false;
 
         // If there are more than three rows in src1, use gemm; otherwise, use gemv.
         if (gemm && (ne11 > 3)) {
@@ -14651,7 +15398,7 @@ UseGgmlGemm2:;
                  (const char *) src0->data + src0_start * nb01, (const char *) src1_wdata + (src1_col_stride * iter), 1,
                  src0_end - src0_start);
         }
-        return;
+        return false;
     }
 
     // The first chunk comes from our thread_id, the rest will get auto-assigned.
@@ -14673,11 +15420,39 @@ UseGgmlGemm2:;
             break;
         }
 
-        current_chunk = atomic_fetch_add(&params->shared->current_chunk, 1);
+        current_chunk = atomic_fetch_add(params->current_chunk, 1);
     }
+
+    return false;
 }
 
-// ggml_compute_forward_mul_mat_id
+static void ggml_compute_forward_mul_mat(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+
+    if (ggml_compute_forward_mul_mat_impl(params, dst) || dst->op != GGML_OP_MUL_MAT_ADD) {
+        return;
+    }
+
+    // add the residual in a separate pass over the rows of dst
+    ggml_barrier(params->shared);
+
+    const int64_t nr  = ggml_nrows(dst);
+    const int64_t dr  = (nr + params->nth - 1)/params->nth;
+    const int64_t ir0 = MIN(nr, dr*params->ith);
+    const int64_t ir1 = MIN(nr, ir0 + dr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i3 = ir/(dst->ne[2]*dst->ne[1]);
+        const int64_t i2 = (ir - i3*dst->ne[2]*dst->ne[1])/dst->ne[1];
+        const int64_t i1 = ir - i3*dst->ne[2]*dst->ne[1] - i2*dst->ne[1];
+        float * d = (float *)((char *)dst->data + i1*dst->nb[1] + i2*dst->nb[2] + i3*dst->nb[3]);
+        const float * c = (const float *)dst->src[2]->data + ir*dst->ne[0];
+        ggml_vec_add_f32(dst->ne[0], d, d, c);
+    }
+}
+
+// ggml_compute_forward_mul_mat_id
 
 static void ggml_compute_forward_mul_mat_id(
         const struct ggml_compute_params * params,
@@ -14727,6 +15502,7 @@ static void ggml_compute_forward_mul_mat_id(
 
     int64_t * matrix_row_counts = (int64_t *) (wdata_src1_end); // [n_as]
     struct mmid_row_mapping * matrix_rows = (struct mmid_row_mapping *)(matrix_row_counts + n_as); // [n_as][ne11]
+    int32_t * active_experts = (int32_t *)(matrix_rows + n_as*ne12); // [n_as + 1], the number of experts with rows followed by their ids
 
     if (src1->type != vec_dot_type) {
         char * wdata = params->wdata;
@@ -14767,10 +15543,73 @@ static void ggml_compute_forward_mul_mat_id(
                 matrix_row_counts[i02] += 1;
             }
         }
+
+        int32_t n_active = 0;
+        for (int i02 = 0; i02 < n_as; ++i02) {
+            if (matrix_row_counts[i02] > 0) {
+                active_experts[1 + n_active++] = i02;
+            }
+        }
+        active_experts[0] = n_active;
+
+        if (src0->flags & GGML_TENSOR_FLAG_PAGED) {
+            ggml_expert_paging_select(src0, ids, active_experts + 1, n_active);
+        }
+
+        atomic_store(params->current_chunk, nth);
     }
 
     ggml_barrier(params->shared);
 
+#if GGML_USE_IQK_MULMAT
+    const int row_step = ne13 == 1 && dst->type == GGML_TYPE_F32 ? iqk_mul_mat_row_step(ne00, type, vec_dot_type) : 0;
+    if (row_step > 0) {
+        const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+        const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+
+        int node_ith, node_nth;
+        const int node = ggml_numa_thread_node(src0, params, &node_ith, &node_nth);
+        if (node >= 0) {
+            // the threads of a node compute only the active experts that are on that node, split statically
+            int n_local = 0;
+            for (int i = 1; i <= active_experts[0]; ++i) {
+                if (ggml_numa_expert_node(active_experts[i], n_as, g_state.numa.n_nodes) == node) ++n_local;
+            }
+            if (n_local == 0) {
+                return;
+            }
+            const int n_chunk = ggml_iqk_split_units(ne01/row_step, (node_nth + n_local - 1)/n_local);
+            for (int i = 1, item = 0; i <= active_experts[0]; ++i) {
+                const int cur_a = active_experts[i];
+                if (ggml_numa_expert_node(cur_a, n_as, g_state.numa.n_nodes) != node) continue;
+                for (int chunk = 0; chunk < n_chunk; ++chunk, ++item) {
+                    if (item % node_nth != node_ith) continue;
+                    iqk_mul_mat_moe(ne01, matrix_row_counts[cur_a], ne00, ne11,
+                            src0->type, (const char *)src0->data + cur_a*nb02, nb01,
+                            vec_dot_type, (const char *)wdata, row_size,
+                            (float *)dst->data, nb1, nb2,
+                            matrix_rows + cur_a*ne12, chunk, n_chunk);
+                }
+            }
+            return;
+        }
+
+        // the threads claim (expert, chunk of rows) pairs, so the ones done with an expert help with the others
+        const int n_active = active_experts[0];
+        const int n_chunk  = ggml_iqk_n_chunks(params, ne01, row_step, MAX(1, n_active), 0);
+
+        for (int chunk = ith; chunk < n_active*n_chunk; chunk = ggml_iqk_next_chunk(params, chunk)) {
+            const int cur_a = active_experts[1 + chunk/n_chunk];
+            iqk_mul_mat_moe(ne01, matrix_row_counts[cur_a], ne00, ne11,
+                    src0->type, (const char *)src0->data + cur_a*nb02, nb01,
+                    vec_dot_type, (const char *)wdata, row_size,
+                    (float *)dst->data, nb1, nb2,
+                    matrix_rows + cur_a*ne12, chunk%n_chunk, n_chunk);
+        }
+        return;
+    }
+#endif
+
     // compute each matrix multiplication in sequence
     for (int cur_a = 0; cur_a < n_as; ++cur_a) {
         const int64_t cne1 = matrix_row_counts[cur_a];
@@ -14786,18 +15625,6 @@ static void ggml_compute_forward_mul_mat_id(
 
         const int64_t nr0 = ne01; // src0 rows
         const int64_t nr1 = cne1; // src1 rows
-                                  //
-#if GGML_USE_IQK_MULMAT
-        if (ne13 == 1 && dst->type == GGML_TYPE_F32) {
-           if (!iqk_mul_mat_moe(nr0, nr1, ne00, ne11,
-                       src0->type, (const char *)src0_cur, nb01, ///ggml_type_size(src0->type),
-                       vec_dot_type, (const char *)wdata, row_size, ///ggml_type_size(vec_dot_type),
-                       (float *)dst->data, nb1, nb2,
-                       matrix_rows + cur_a*ne12, ith, nth)) goto IQK_MulMat_Not_Available;
-                continue;
-        }
-IQK_MulMat_Not_Available:;
-#endif
 
         if (((ggml_n_dims(src0) - 1) == 2) && gemv) {
             int64_t src0_cur_start = (ith * ne01) / nth;
@@ -14977,6 +15804,7 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
 
     int64_t * matrix_row_counts = (int64_t *) (wdata_src1_end); // [n_as]
     struct mmid_row_mapping * matrix_rows = (struct mmid_row_mapping *)(matrix_row_counts + n_as); // [n_as][ne11]
+    int32_t * active_experts = (int32_t *)(matrix_rows + n_as*ne12); // [n_as + 1], the number of experts with rows followed by their ids
 
     if (src1->type != vec_dot_type) {
 
@@ -15020,57 +15848,70 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
                 matrix_row_counts[i02] += 1;
             }
         }
+
+        int32_t n_active = 0;
+        for (int i02 = 0; i02 < n_as; ++i02) {
+            if (matrix_row_counts[i02] > 0) {
+                active_experts[1 + n_active++] = i02;
+            }
+        }
+        active_experts[0] = n_active;
+
+        if (src0->flags & GGML_TENSOR_FLAG_PAGED) {
+            ggml_expert_paging_select(src0, ids, active_experts + 1, n_active);
+        }
+
+        atomic_store(params->current_chunk, nth);
     }
 
     ggml_barrier(params->shared);
 
+    const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
-    // so GGML_TENSOR_BINARY_OP_LOCALS works
-
-    // compute each matrix multiplication in sequence
-    for (int cur_a = 0; cur_a < n_as; ++cur_a) {
-        const int64_t cne1 = matrix_row_counts[cur_a];
+    const int row_step = iqk_mul_mat_row_step(ne00, type, vec_dot_type);
+    if (row_step == 0) {
+        GGML_ABORT("fatal error");
+    }
 
-        if (cne1 == 0) {
-            continue;
+    int node_ith, node_nth;
+    const int node = src0_2->flags & GGML_TENSOR_FLAG_NUMA ? ggml_numa_thread_node(src0_1, params, &node_ith, &node_nth) : -1;
+    if (node >= 0) {
+        // the threads of a node compute only the active experts that are on that node, split statically
+        int n_local = 0;
+        for (int i = 1; i <= active_experts[0]; ++i) {
+            if (ggml_numa_expert_node(active_experts[i], n_as, g_state.numa.n_nodes) == node) ++n_local;
         }
+        if (n_local == 0) {
+            return;
+        }
+        const int n_chunk = ggml_iqk_split_units(ne01/row_step, (node_nth + n_local - 1)/n_local);
+        for (int i = 1, item = 0; i <= active_experts[0]; ++i) {
+            const int cur_a = active_experts[i];
+            if (ggml_numa_expert_node(cur_a, n_as, g_state.numa.n_nodes) != node) continue;
+            for (int chunk = 0; chunk < n_chunk; ++chunk, ++item) {
+                if (item % node_nth != node_ith) continue;
+                if (!iqk_moe_fused_up_gate(ne01, matrix_row_counts[cur_a], ne00, ne11, dst->op_params[0],
+                                    type, (const char *) src0_1->data + cur_a*nb02, (const char *) src0_2->data + cur_a*nb02, nb01,
+                                    vec_dot_type, (const char *)wdata, row_size,
+                                    (float *)dst->data, nb1, nb2,
+                                    matrix_rows + cur_a*ne12, chunk, n_chunk)) GGML_ABORT("fatal error");
+            }
+        }
+        return;
+    }
 
-        const char * src0_1_cur = (const char *) src0_1->data + cur_a*nb02;
-        const char * src0_2_cur = (const char *) src0_2->data + cur_a*nb02;
-
-        const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
-        const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+    // the threads claim (expert, chunk of rows) pairs, so the ones done with an expert help with the others
+    const int n_active = active_experts[0];
+    const int n_chunk  = ggml_iqk_n_chunks(params, ne01, row_step, MAX(1, n_active), 0);
 
-        const int64_t nr0 = ne01; // src0 rows
-        const int64_t nr1 = cne1; // src1 rows
-                                  //
-        if (!iqk_moe_fused_up_gate(nr0, nr1, ne00, ne11, dst->op_params[0],
-                            type, src0_1_cur, src0_2_cur, nb01,
+    for (int chunk = ith; chunk < n_active*n_chunk; chunk = ggml_iqk_next_chunk(params, chunk)) {
+        const int cur_a = active_experts[1 + chunk/n_chunk];
+        if (!iqk_moe_fused_up_gate(ne01, matrix_row_counts[cur_a], ne00, ne11, dst->op_params[0],
+                            type, (const char *) src0_1->data + cur_a*nb02, (const char *) src0_2->data + cur_a*nb02, nb01,
                             vec_dot_type, (const char *)wdata, row_size,
                             (float *)dst->data, nb1, nb2,
-                            matrix_rows + cur_a*ne12, ith, nth)) GGML_ABORT("fatal error");
-
-//        if (nth%2 == 0) {
-//            const char * src0_d = ith%2 == 0 ? src0_1_cur : src0_2_cur;
-//            void *        dst_d = ith%2 == 0 ? dst1->data : dst2->data;
-//            if (!iqk_mul_mat_moe(nr0, nr1, ne00, ne11,
-//                        type, src0_d, nb01,
-//                        vec_dot_type, (const char *)wdata, row_size,
-//                        (float *)dst_d, nb1, nb2,
-//                        matrix_rows + cur_a*ne12, ith/2, nth/2)) GGML_ABORT("fatal error");
-//
-//        } else {
-//            if (!iqk_mul_mat_moe(nr0, nr1, ne00, ne11,
-//                        src0_1->type, (const char *)src0_1_cur, nb01,
-//                        vec_dot_type, (const char *)wdata, row_size,
-//                        (float *)dst1->data, nb1, nb2,
-//                        matrix_rows + cur_a*ne12, ith, nth)) GGML_ABORT("fatal error");
-//            if (!iqk_mul_mat_moe(nr0, nr1, ne00, ne11,
-//                        src0_2->type, (const char *)src0_2_cur, nb01,
-//                        vec_dot_type, (const char *)wdata, row_size,
-//                        (float *)dst2->data, nb1, nb2,
-//                        matrix_rows + cur_a*ne12, ith, nth)) GGML_ABORT("fatal error");
-//        }
+                            matrix_rows + cur_a*ne12, chunk%n_chunk, n_chunk)) GGML_ABORT("fatal error");
     }
 
 #undef MMID_MATRIX_ROW
@@ -19707,6 +20548,7 @@ static bool ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 ggml_compute_forward_group_norm(params, tensor);
             } break;
         case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ADD:
             {
                 ggml_compute_forward_mul_mat(params, tensor);
             } break;
@@ -20483,6 +21325,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
             }
+        case GGML_OP_MUL_MAT_ADD:
+            {
+                GGML_ABORT("fatal error"); // TODO: not implemented
+            }
         case GGML_OP_OUT_PROD:
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
@@ -21360,6 +22206,7 @@ static void set_numa_thread_affinity(int thread_n) {
 
     switch(g_state.numa.numa_strategy) {
         case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_SPLIT:
             // run thread on node_num thread_n / (threads per node)
             node_num = thread_n % g_state.numa.n_nodes;
             break;
@@ -21414,11 +22261,32 @@ static void clear_numa_thread_affinity(void) {
 
     CPU_FREE(cpus);
 }
+
+// pin the calling thread to a single CPU (cpu >= 0) or to all CPUs set in cpumask
+static void set_threadpool_thread_affinity(int cpu, const bool * cpumask) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    if (cpu >= 0) {
+        CPU_SET(cpu, &cpuset);
+    } else {
+        for (int i = 0; i < GGML_MAX_N_THREADS; ++i) {
+            if (cpumask[i]) {
+                CPU_SET(i, &cpuset);
+            }
+        }
+    }
+
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
+    }
+}
 #else
 // TODO: Windows etc.
 // (the linux implementation may also work on BSD, someone should test)
 static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n);  }
 static void clear_numa_thread_affinity(void) {}
+static void set_threadpool_thread_affinity(int cpu, const bool * cpumask) { UNUSED(cpu); UNUSED(cpumask); }
 #endif
 
 static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
@@ -21498,6 +22366,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_MUL_MAT:
         case GGML_OP_MUL_MAT_ID:
         case GGML_OP_MOE_FUSED_UP_GATE:
+        case GGML_OP_MUL_MAT_ADD:
         case GGML_OP_OUT_PROD:
             {
                 n_tasks = n_threads;
@@ -21634,6 +22503,192 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
     return n_tasks;
 }
 
+// size of the work buffer needed by a node computed with n_tasks threads
+static size_t ggml_graph_node_work_size(const struct ggml_tensor * node, int n_tasks) {
+    size_t cur = 0;
+
+    switch (node->op) {
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            {
+                if (ggml_is_quantized(node->type) ||
+                    // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
+                    (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
+                    (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ACC:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ADD:
+            {
+                const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+
+                if (node->src[1]->type != vec_dot_type) {
+                    cur = ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
+                    if (node->src[1]->type != GGML_TYPE_F32) {
+                        cur += n_tasks*node->src[1]->ne[0]*sizeof(float); // src1->type -> f32 -> vec_dot_type
+                    }
+                }
+            } break;
+        case GGML_OP_MUL_MAT_ID:
+            {
+                cur = 0;
+                const struct ggml_tensor * src0 = node->src[0];
+                const struct ggml_tensor * src1 = node->src[1];
+                const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+                if (src1->type != vec_dot_type) {
+                    cur += ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
+                }
+                const int n_as = src0->ne[2];
+                cur += GGML_PAD(cur, sizeof(int64_t));       // align
+                cur += n_as * sizeof(int64_t);               // matrix_row_counts
+                cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
+                cur += (n_as + 1) * sizeof(int32_t);         // active_experts
+            } break;
+        case GGML_OP_MOE_FUSED_UP_GATE:
+            {
+                cur = 0;
+                const struct ggml_tensor * src0 = node->src[0];
+                const struct ggml_tensor * src2 = node->src[2];
+                const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+                if (src2->type != vec_dot_type) {
+                    cur += ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
+                }
+                const int n_as = src0->ne[2];
+                cur += GGML_PAD(cur, sizeof(int64_t));       // align
+                cur += n_as * sizeof(int64_t);               // matrix_row_counts
+                cur += n_as * src2->ne[2] * sizeof(int64_t); // matrix_rows
+                cur += (n_as + 1) * sizeof(int32_t);         // active_experts
+            } break;
+        case GGML_OP_OUT_PROD:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+            {
+                cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_1D:
+            {
+                GGML_ASSERT(node->src[0]->ne[3] == 1);
+                GGML_ASSERT(node->src[1]->ne[2] == 1);
+                GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                const int64_t ne00 = node->src[0]->ne[0];  // K
+                const int64_t ne01 = node->src[0]->ne[1];  // Cout
+                const int64_t ne02 = node->src[0]->ne[2];  // Cin
+
+                const int64_t ne10 = node->src[1]->ne[0];  // L
+                const int64_t ne11 = node->src[1]->ne[1];  // Cin
+
+                if ((node->src[0]->type == GGML_TYPE_F16 ||
+                     node->src[0]->type == GGML_TYPE_BF16) &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
+                    cur += sizeof(ggml_fp16_t)*ne10*ne11;
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(float)*ne00*ne01*ne02;
+                    cur += sizeof(float)*ne10*ne11;
+                } else {
+                    GGML_ABORT("fatal error");
+                }
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_2D:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+
+                cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const int64_t Dk = node->src[0]->ne[0];
+                const int64_t Dv = node->src[2]->ne[0];
+                const int64_t D  = MAX(Dk, Dv);
+
+                cur = 3*sizeof(float)*D*n_tasks; // 3x head size/thread
+#if GGML_USE_IQK_MULMAT
+                const struct ggml_tensor * q = node->src[0];
+                const struct ggml_tensor * k = node->src[1];
+                if (q->ne[1] == 1 && q->ne[3] == 1 && q->ne[2]/k->ne[2] > 1 && n_tasks > 1 && k->ne[1]/32 > 1) {
+                    int nstep_k = k->ne[1]/32;
+                    int gcd_k   = simple_gcd(nstep_k, n_tasks);
+                    if (gcd_k > 1) {
+                        int nth_k = n_tasks/gcd_k;
+                        int rk2 = q->ne[2]/k->ne[2];
+                        int nq_per_thread = (rk2 + nth_k - 1)/nth_k;
+                        size_t size = (Dv + 16)*nq_per_thread*sizeof(float)*n_tasks;
+                        if (ggml_is_quantized(k->type)) {
+                            enum ggml_type vec_dot_type = type_traits[k->type].vec_dot_type;
+                            size_t row_size = ggml_row_size(vec_dot_type, q->ne[0]);
+                            size += q->ne[2]*row_size;
+                        }
+                        cur = MAX(cur, size);
+                    }
+                }
+                const struct ggml_tensor * v = node->src[2];
+                int n_split = iqk_flash_attn_split_k(q->ne[3], q->ne[2], k->ne[3], k->ne[2], v->ne[2], q->ne[1], k->ne[1], n_tasks);
+                if (n_split > 1) {
+                    cur = MAX(cur, (Dv + 16)*q->ne[2]*n_split*sizeof(float));
+                }
+#endif
+            } break;
+        case GGML_OP_FLASH_ATTN_BACK:
+            {
+                const int64_t    D = node->src[0]->ne[0];
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_BF16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+            } break;
+
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ABORT("fatal error");
+            }
+        default:
+            break;
+    }
+
+    return cur;
+}
+
 struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threads) {
     if (n_threads <= 0) {
         n_threads = GGML_DEFAULT_N_THREADS;
@@ -21654,180 +22709,7 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
 
         max_tasks = MAX(max_tasks, n_tasks);
 
-        size_t cur = 0;
-
-        switch (node->op) {
-            case GGML_OP_CPY:
-            case GGML_OP_DUP:
-                {
-                    if (ggml_is_quantized(node->type) ||
-                        // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
-                        (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
-                        (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ADD:
-            case GGML_OP_ADD1:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ACC:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_MUL_MAT:
-                {
-                    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
-
-                    if (node->src[1]->type != vec_dot_type) {
-                        cur = ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
-                        if (node->src[1]->type != GGML_TYPE_F32) {
-                            cur += n_tasks*node->src[1]->ne[0]*sizeof(float); // src1->type -> f32 -> vec_dot_type
-                        }
-                    }
-                } break;
-            case GGML_OP_MUL_MAT_ID:
-                {
-                    cur = 0;
-                    const struct ggml_tensor * src0 = node->src[0];
-                    const struct ggml_tensor * src1 = node->src[1];
-                    const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
-                    if (src1->type != vec_dot_type) {
-                        cur += ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
-                    }
-                    const int n_as = src0->ne[2];
-                    cur += GGML_PAD(cur, sizeof(int64_t));       // align
-                    cur += n_as * sizeof(int64_t);               // matrix_row_counts
-                    cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
-                } break;
-            case GGML_OP_MOE_FUSED_UP_GATE:
-                {
-                    cur = 0;
-                    const struct ggml_tensor * src0 = node->src[0];
-                    const struct ggml_tensor * src2 = node->src[2];
-                    const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
-                    if (src2->type != vec_dot_type) {
-                        cur += ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
-                    }
-                    const int n_as = src0->ne[2];
-                    cur += GGML_PAD(cur, sizeof(int64_t));       // align
-                    cur += n_as * sizeof(int64_t);               // matrix_row_counts
-                    cur += n_as * src2->ne[2] * sizeof(int64_t); // matrix_rows
-                } break;
-            case GGML_OP_OUT_PROD:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_SOFT_MAX:
-            case GGML_OP_ROPE:
-                {
-                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_1D:
-                {
-                    GGML_ASSERT(node->src[0]->ne[3] == 1);
-                    GGML_ASSERT(node->src[1]->ne[2] == 1);
-                    GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                    const int64_t ne00 = node->src[0]->ne[0];  // K
-                    const int64_t ne01 = node->src[0]->ne[1];  // Cout
-                    const int64_t ne02 = node->src[0]->ne[2];  // Cin
-
-                    const int64_t ne10 = node->src[1]->ne[0];  // L
-                    const int64_t ne11 = node->src[1]->ne[1];  // Cin
-
-                    if ((node->src[0]->type == GGML_TYPE_F16 ||
-                         node->src[0]->type == GGML_TYPE_BF16) &&
-                        node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
-                        cur += sizeof(ggml_fp16_t)*ne10*ne11;
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                               node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(float)*ne00*ne01*ne02;
-                        cur += sizeof(float)*ne10*ne11;
-                    } else {
-                        GGML_ABORT("fatal error");
-                    }
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_2D:
-                {
-                    const int64_t ne00 = node->src[0]->ne[0]; // W
-                    const int64_t ne01 = node->src[0]->ne[1]; // H
-                    const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                    const int64_t ne03 = node->src[0]->ne[3]; // Channels In
-
-                    const int64_t ne10 = node->src[1]->ne[0]; // W
-                    const int64_t ne11 = node->src[1]->ne[1]; // H
-                    const int64_t ne12 = node->src[1]->ne[2]; // Channels In
-
-                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                    cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
-                } break;
-            case GGML_OP_FLASH_ATTN_EXT:
-                {
-                    const int64_t Dk = node->src[0]->ne[0];
-                    const int64_t Dv = node->src[2]->ne[0];
-                    const int64_t D  = MAX(Dk, Dv);
-
-                    cur = 3*sizeof(float)*D*n_tasks; // 3x head size/thread
-#if GGML_USE_IQK_MULMAT
-                    const struct ggml_tensor * q = node->src[0];
-                    const struct ggml_tensor * k = node->src[1];
-                    if (q->ne[1] == 1 && q->ne[3] == 1 && q->ne[2]/k->ne[2] > 1 && n_tasks > 1 && k->ne[1]/32 > 1) {
-                        int nstep_k = k->ne[1]/32;
-                        int gcd_k   = simple_gcd(nstep_k, n_tasks);
-                        if (gcd_k > 1) {
-                            int nth_k = n_tasks/gcd_k;
-                            int rk2 = q->ne[2]/k->ne[2];
-                            int nq_per_thread = (rk2 + nth_k - 1)/nth_k;
-                            size_t size = (Dv + 16)*nq_per_thread*sizeof(float)*n_tasks;
-                            if (ggml_is_quantized(k->type)) {
-                                enum ggml_type vec_dot_type = type_traits[k->type].vec_dot_type;
-                                size_t row_size = ggml_row_size(vec_dot_type, q->ne[0]);
-                                size += q->ne[2]*row_size;
-                            }
-                            cur = MAX(cur, size);
-                        }
-                    }
-#endif
-                } break;
-            case GGML_OP_FLASH_ATTN_BACK:
-                {
-                    const int64_t    D = node->src[0]->ne[0];
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_BF16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    }
-                } break;
-
-            case GGML_OP_CROSS_ENTROPY_LOSS:
-                {
-                    cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
-                } break;
-            case GGML_OP_COUNT:
-                {
-                    GGML_ABORT("fatal error");
-                }
-            default:
-                break;
-        }
-
-        work_size = MAX(work_size, cur);
+        work_size = MAX(work_size, ggml_graph_node_work_size(node, n_tasks));
     }
 
     if (work_size > 0) {
@@ -21841,53 +22723,676 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
     return cplan;
 }
 
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
-
-    const struct ggml_cgraph * cgraph = state->shared->cgraph;
-    const struct ggml_cplan  * cplan  = state->shared->cplan;
-
-    set_numa_thread_affinity(state->ith);
+//
+// dependency-driven barriers
+//
 
-    struct ggml_compute_params params = {
-        /*.ith   =*/ state->ith,
-        /*.nth   =*/ state->shared->n_threads,
-        /*.wsize =*/ cplan->work_size,
-        /*.wdata =*/ cplan->work_data,
-        /*.shared=*/ state->shared,
-    };
+// max number of consecutive nodes computed without a barrier between them
+#define GGML_DEP_MAX_GROUP 16
 
-#if IK_PRINT_TIMING
-    int64_t t_start = ggml_time_us();
-    int64_t t_eval  = 0;
-#endif
+struct ggml_dep_node {
+    size_t wdata_offs; // offset of the node's slice of the work buffer
+    size_t wsize;      // size of the node's slice of the work buffer
+    int    chunk;      // index of the node's chunk counter
+    bool   barrier;    // all threads must be done with the previous nodes before this one starts
+};
 
-    for (int node_n = 0; node_n < cgraph->n_nodes; node_n++) {
-        struct ggml_tensor * node = cgraph->nodes[node_n];
+static bool ggml_dep_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (!a->data || !b->data) {
+        return true;
+    }
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
 
-        if (ggml_is_noop(node)) continue;
+// custom ops may access anything, so they are always separated from the other nodes by barriers
+static bool ggml_dep_is_opaque(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_MAP_UNARY:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1_F32:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM3_F32:
+        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM3:
+            return true;
+        default:
+            return false;
+    }
+}
 
-#if IK_PRINT_TIMING
-        int64_t tim1 = ggml_time_us();
+// true if node can't start before prev is done: it reads the result of prev (RAW), overwrites one of
+// the inputs of prev (WAR) or writes to the same memory (WAW)
+static bool ggml_dep_conflict(const struct ggml_tensor * prev, const struct ggml_tensor * node) {
+    if (ggml_dep_is_opaque(prev) || ggml_dep_is_opaque(node) || ggml_dep_overlap(prev, node)) {
+        return true;
+    }
+    for (int j = 0; j < GGML_MAX_SRC; ++j) {
+        if (node->src[j] && ggml_dep_overlap(prev, node->src[j])) {
+            return true;
+        }
+        if (prev->src[j] && ggml_dep_overlap(prev->src[j], node)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Splits the graph into groups of consecutive nodes that don't depend on each other. Only the first node
+// of a group waits on a barrier, a thread that is done with its part of a node moves on to the next one.
+// The nodes of a group get separate slices of the work buffer and separate chunk counters, and a group is
+// closed early when its slices would exceed max_size. sched can be NULL to only get the size of the slices.
+static size_t ggml_graph_dep_schedule(const struct ggml_cgraph * cgraph, int n_threads, size_t max_size, struct ggml_dep_node * sched) {
+    const struct ggml_tensor * group[GGML_DEP_MAX_GROUP];
+
+    int    n_group    = 0;
+    size_t group_size = 0;
+    size_t work_size  = 0;
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (ggml_is_noop(node)) {
+            continue;
+        }
+
+        size_t cur = ggml_graph_node_work_size(node, ggml_get_n_tasks(node, n_threads));
+        if (cur > 0) {
+            cur = GGML_PAD(cur + CACHE_LINE_SIZE*(n_threads - 1), CACHE_LINE_SIZE);
+        }
+
+        bool barrier = n_group == 0 || n_group == GGML_DEP_MAX_GROUP || group_size + cur > max_size;
+        for (int k = 0; k < n_group && !barrier; ++k) {
+            barrier = ggml_dep_conflict(group[k], node);
+        }
+        if (barrier) {
+            n_group    = 0;
+            group_size = 0;
+        }
+
+        if (sched) {
+            sched[i].wdata_offs = group_size;
+            sched[i].wsize      = cur;
+            sched[i].chunk      = n_group;
+            sched[i].barrier    = barrier;
+        }
+
+        group[n_group++] = node;
+        group_size += cur;
+        work_size = MAX(work_size, group_size);
+    }
+
+    return work_size;
+}
+
+// the schedule and the chunk counters are stored at the start of the work buffer
+static size_t ggml_graph_dep_header_size(const struct ggml_cgraph * cgraph) {
+    return GGML_PAD(cgraph->n_nodes*sizeof(struct ggml_dep_node), CACHE_LINE_SIZE) + GGML_DEP_MAX_GROUP*CACHE_LINE_SIZE;
+}
+
+void ggml_graph_plan_dep_barriers(const struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
+    const size_t work_size = ggml_graph_dep_header_size(cgraph) + ggml_graph_dep_schedule(cgraph, cplan->n_threads, SIZE_MAX, NULL);
+
+    cplan->dep_barriers = true;
+    cplan->work_size    = MAX(cplan->work_size, work_size);
+}
+
+// falls back to a barrier after every node if the work buffer was not sized with ggml_graph_plan_dep_barriers()
+static void ggml_graph_dep_init(struct ggml_compute_state_shared * shared, const struct ggml_cgraph * cgraph, const struct ggml_cplan * cplan) {
+    shared->dep        = NULL;
+    shared->dep_chunks = NULL;
+    shared->dep_wdata  = NULL;
+
+    const size_t header_size = ggml_graph_dep_header_size(cgraph);
+
+    if (!cplan->dep_barriers || cplan->n_threads == 1 || cplan->work_size < header_size) {
+        return;
+    }
+
+    struct ggml_dep_node * sched = (struct ggml_dep_node *) cplan->work_data;
+
+    const size_t max_size = cplan->work_size - header_size;
+    if (ggml_graph_dep_schedule(cgraph, cplan->n_threads, max_size, sched) > max_size) {
+        return;
+    }
+
+    shared->dep        = sched;
+    shared->dep_chunks = cplan->work_data + header_size - GGML_DEP_MAX_GROUP*CACHE_LINE_SIZE;
+    shared->dep_wdata  = cplan->work_data + header_size;
+}
+
+//
+// per-node profile
+//
+
+struct ggml_profile_event {
+    int64_t t_start;      // 0 if the thread did not work on the node
+    int64_t t_end;
+    int64_t t_wait_start; // first barrier the thread waited on after the node
+    int64_t t_wait;       // total time spent in these barriers
+};
+
+// the nodes with the same op, name (without the layer number), types and kernel tile
+struct ggml_profile_entry {
+    char           name[GGML_MAX_NAME];
+    enum ggml_op   op;
+    enum ggml_type type0;  // type of src0 (of K for flash attention), GGML_TYPE_COUNT if none
+    enum ggml_type type1;  // type of src1 (of V for flash attention), for iqk matmuls the type src1 is converted to
+    int            tile;   // iqk nrc_y tile, 0 if the node is not an iqk matmul
+
+    int64_t count;
+    int64_t t_wall;        // from the first thread starting a node to the last one finishing it
+    int64_t t_busy;        // compute time summed over the threads
+    int64_t t_max;         // compute time of the slowest thread
+    int64_t t_wait;        // barrier time summed over the threads
+    double  t_mean;        // t_busy divided by the number of threads of each graph
+    double  flops;
+    double  bytes;         // all sources and the result
+    double  weight_bytes;  // the part of bytes that are matmul weights
+};
+
+struct ggml_profile_trace {
+    int64_t t_start;      // relative to t_origin
+    int64_t t_end;
+    int64_t t_wait_start;
+    int64_t t_wait;
+    int32_t graph;
+    int32_t entry;
+    int16_t layer;
+    int16_t ith;
+};
+
+struct ggml_profile {
+    int64_t t_origin;      // start of the first graph
+    int64_t n_graphs;
+    int64_t t_graphs;      // wall time of ggml_graph_compute() summed over the graphs
+
+    // the events of the graph being computed, n_nodes per thread
+    struct ggml_profile_event * events;
+    size_t  events_size;
+    int     n_threads;
+    int64_t t_graph_start;
+
+    struct ggml_profile_entry * entries;
+    int n_entries;
+    int entries_size;
+
+    struct ggml_profile_trace * trace;
+    size_t n_trace;
+    size_t max_trace;
+};
+
+struct ggml_profile * ggml_profile_init(size_t max_trace_events) {
+    struct ggml_profile * profile = GGML_CALLOC(1, sizeof(struct ggml_profile));
+    profile->max_trace = max_trace_events;
+    return profile;
+}
+
+void ggml_profile_free(struct ggml_profile * profile) {
+    if (!profile) {
+        return;
+    }
+    GGML_FREE(profile->events);
+    GGML_FREE(profile->entries);
+    GGML_FREE(profile->trace);
+    GGML_FREE(profile);
+}
+
+void ggml_profile_reset(struct ggml_profile * profile) {
+    profile->n_graphs  = 0;
+    profile->t_graphs  = 0;
+    profile->n_entries = 0;
+    profile->n_trace   = 0;
+}
+
+static void ggml_profile_graph_begin(struct ggml_profile * profile, const struct ggml_cgraph * cgraph, int n_threads) {
+    const size_t n_events = (size_t)cgraph->n_nodes*n_threads;
+    if (profile->events_size < n_events) {
+        GGML_FREE(profile->events);
+        profile->events      = GGML_MALLOC(n_events*sizeof(struct ggml_profile_event));
+        profile->events_size = n_events;
+    }
+    memset(profile->events, 0, n_events*sizeof(struct ggml_profile_event));
+
+    profile->n_threads     = n_threads;
+    profile->t_graph_start = ggml_time_ns();
+    if (profile->n_graphs == 0) {
+        profile->t_origin = profile->t_graph_start;
+    }
+}
+
+// ggml_barrier() that accounts the time spent waiting to ev (if not NULL)
+static void ggml_profile_barrier(struct ggml_compute_state_shared * shared, struct ggml_profile_event * ev) {
+    if (!ev) {
+        ggml_barrier(shared);
+        return;
+    }
+    const int64_t t_start = ggml_time_ns();
+    ggml_barrier(shared);
+    if (ev->t_wait == 0) {
+        ev->t_wait_start = t_start;
+    }
+    ev->t_wait += ggml_time_ns() - t_start;
+}
+
+// estimates the FLOPs and the bytes touched by node, and for the matmuls done by iqk the kernel that is used
+static void ggml_profile_node_info(const struct ggml_tensor * node, struct ggml_profile_entry * entry) {
+    const struct ggml_tensor * src0 = node->src[0];
+    const struct ggml_tensor * src1 = node->src[1];
+
+    entry->type0        = src0 ? src0->type : GGML_TYPE_COUNT;
+    entry->type1        = src1 ? src1->type : GGML_TYPE_COUNT;
+    entry->tile         = 0;
+    entry->flops        = (double)ggml_nelements(node);
+    entry->bytes        = (double)ggml_nbytes(node);
+    entry->weight_bytes = 0;
+
+    for (int j = 0; j < GGML_MAX_SRC; ++j) {
+        if (node->src[j]) {
+            entry->bytes += (double)ggml_nbytes(node->src[j]);
+        }
+    }
+
+    const struct ggml_tensor * b = NULL; // the activations of a matmul
+    int64_t ny = 0;                      // columns of b per matrix of the weights
+
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ADD:
+            {
+                entry->flops = 2.0*src0->ne[0]*ggml_nelements(node);
+                if (src0->op == GGML_OP_NONE) {
+                    entry->weight_bytes = (double)ggml_nbytes(src0);
+                }
+                b  = src1;
+                ny = src1->ne[1];
+            } break;
+        case GGML_OP_MUL_MAT_ID:
+        case GGML_OP_MOE_FUSED_UP_GATE:
+            {
+                const bool fused = node->op == GGML_OP_MOE_FUSED_UP_GATE;
+                const struct ggml_tensor * ids = fused ? node->src[3] : node->src[2];
+
+                // only the experts selected by ids are read
+                const int64_t n_ids  = ids->ne[0]*ids->ne[1];
+                const int64_t n_used = MIN(src0->ne[2], n_ids);
+                const double  bytes  = (double)ggml_nbytes(src0)/src0->ne[2]*n_used*(fused ? 2 : 1);
+
+                entry->flops        = (fused ? 4.0 : 2.0)*src0->ne[0]*ggml_nelements(node);
+                entry->bytes       += bytes - (double)ggml_nbytes(src0)*(fused ? 2 : 1);
+                entry->weight_bytes = bytes;
+
+                b  = fused ? node->src[2] : src1;
+                ny = MAX(1, n_ids/src0->ne[2]);
+                if (fused) {
+                    entry->type1 = b->type;
+                }
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const struct ggml_tensor * k = node->src[1];
+                const struct ggml_tensor * v = node->src[2];
+                entry->type0 = k->type;
+                entry->type1 = v->type;
+                entry->flops = 2.0*src0->ne[1]*src0->ne[2]*src0->ne[3]*k->ne[1]*(k->ne[0] + v->ne[0]);
+            } break;
+        default:
+            break;
+    }
+
+#if GGML_USE_IQK_MULMAT
+    if (b) {
+        // the same order in which ggml_compute_forward_mul_mat tries the iqk kernels
+        const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+        int tile = iqk_mul_mat_tile(src0->ne[0], src0->type, b->type, ny);
+        if (tile > 0) {
+            entry->type1 = b->type;
+        } else if ((tile = iqk_mul_mat_tile(src0->ne[0], src0->type, vec_dot_type, ny)) > 0) {
+            entry->type1 = vec_dot_type;
+        }
+        entry->tile = tile;
+    }
+#else
+    GGML_UNUSED(b);
+    GGML_UNUSED(ny);
 #endif
+}
+
+// splits "name-<layer>" into the name and the layer, layer is -1 if there is no layer number
+static int ggml_profile_split_name(const char * name, char * base) {
+    const size_t len = strlen(name);
+    size_t i = len;
+    while (i > 0 && name[i-1] >= '0' && name[i-1] <= '9') {
+        --i;
+    }
+    if (i < len && i > 1 && name[i-1] == '-') {
+        memcpy(base, name, i - 1);
+        base[i-1] = 0;
+        return atoi(name + i);
+    }
+    memcpy(base, name, len + 1);
+    return -1;
+}
+
+static int ggml_profile_find_entry(struct ggml_profile * profile, const struct ggml_profile_entry * key) {
+    for (int i = 0; i < profile->n_entries; ++i) {
+        const struct ggml_profile_entry * entry = &profile->entries[i];
+        if (entry->op == key->op && entry->type0 == key->type0 && entry->type1 == key->type1 && entry->tile == key->tile &&
+            strcmp(entry->name, key->name) == 0) {
+            return i;
+        }
+    }
+    if (profile->n_entries == profile->entries_size) {
+        profile->entries_size = MAX(64, 2*profile->entries_size);
+        profile->entries = realloc(profile->entries, profile->entries_size*sizeof(struct ggml_profile_entry));
+        GGML_ASSERT(profile->entries);
+    }
+    struct ggml_profile_entry * entry = &profile->entries[profile->n_entries];
+    *entry = *key;
+    entry->count  = 0;
+    entry->t_wall = entry->t_busy = entry->t_max = entry->t_wait = 0;
+    entry->t_mean = entry->flops = entry->bytes = entry->weight_bytes = 0;
+    return profile->n_entries++;
+}
+
+static void ggml_profile_graph_end(struct ggml_profile * profile, const struct ggml_cgraph * cgraph) {
+    const int n_nodes   = cgraph->n_nodes;
+    const int n_threads = profile->n_threads;
+
+    for (int i = 0; i < n_nodes; ++i) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        int64_t t_first = INT64_MAX, t_last = 0, t_busy = 0, t_max = 0, t_wait = 0;
+        for (int ith = 0; ith < n_threads; ++ith) {
+            const struct ggml_profile_event * ev = &profile->events[(size_t)ith*n_nodes + i];
+            if (ev->t_start == 0) {
+                continue;
+            }
+            t_first = MIN(t_first, ev->t_start);
+            t_last  = MAX(t_last,  ev->t_end);
+            t_busy += ev->t_end - ev->t_start;
+            t_max   = MAX(t_max, ev->t_end - ev->t_start);
+            t_wait += ev->t_wait;
+        }
+        if (t_first == INT64_MAX) {
+            // no-op or fused into the previous node
+            continue;
+        }
+
+        struct ggml_profile_entry key;
+        const int layer = ggml_profile_split_name(node->name, key.name);
+        key.op = node->op;
+        ggml_profile_node_info(node, &key);
+
+        const int ie = ggml_profile_find_entry(profile, &key);
+        struct ggml_profile_entry * entry = &profile->entries[ie];
+        entry->count        += 1;
+        entry->t_wall       += t_last - t_first;
+        entry->t_busy       += t_busy;
+        entry->t_max        += t_max;
+        entry->t_wait       += t_wait;
+        entry->t_mean       += (double)t_busy/n_threads;
+        entry->flops        += key.flops;
+        entry->bytes        += key.bytes;
+        entry->weight_bytes += key.weight_bytes;
+
+        for (int ith = 0; ith < n_threads && profile->n_trace < profile->max_trace; ++ith) {
+            const struct ggml_profile_event * ev = &profile->events[(size_t)ith*n_nodes + i];
+            if (ev->t_start == 0) {
+                continue;
+            }
+            if (profile->n_trace == 0 || (profile->n_trace & (profile->n_trace - 1)) == 0) {
+                // grow the trace in powers of 2
+                const size_t size = MIN(profile->max_trace, MAX(1024, 2*profile->n_trace));
+                profile->trace = realloc(profile->trace, size*sizeof(struct ggml_profile_trace));
+                GGML_ASSERT(profile->trace);
+            }
+            struct ggml_profile_trace * tr = &profile->trace[profile->n_trace++];
+            tr->t_start      = ev->t_start - profile->t_origin;
+            tr->t_end        = ev->t_end   - profile->t_origin;
+            tr->t_wait_start = ev->t_wait ? ev->t_wait_start - profile->t_origin : 0;
+            tr->t_wait       = ev->t_wait;
+            tr->graph        = (int32_t)profile->n_graphs;
+            tr->entry        = ie;
+            tr->layer        = (int16_t)layer;
+            tr->ith          = (int16_t)ith;
+        }
+    }
+
+    profile->t_graphs += ggml_time_ns() - profile->t_graph_start;
+    profile->n_graphs += 1;
+}
+
+static int ggml_profile_entry_cmp(const void * a, const void * b) {
+    const int64_t ta = ((const struct ggml_profile_entry *)a)->t_wall;
+    const int64_t tb = ((const struct ggml_profile_entry *)b)->t_wall;
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+static const char * ggml_profile_type_name(enum ggml_type type) {
+    return type < GGML_TYPE_COUNT ? ggml_type_name(type) : "-";
+}
+
+void ggml_profile_print(const struct ggml_profile * profile, FILE * stream) {
+    struct ggml_profile_entry * entries = GGML_MALLOC(MAX(1, profile->n_entries)*sizeof(struct ggml_profile_entry));
+    memcpy(entries, profile->entries, profile->n_entries*sizeof(struct ggml_profile_entry));
+    qsort(entries, profile->n_entries, sizeof(struct ggml_profile_entry), ggml_profile_entry_cmp);
+
+    int64_t t_nodes = 0;
+    for (int i = 0; i < profile->n_entries; ++i) {
+        t_nodes += entries[i].t_wall;
+    }
+
+    fprintf(stream, "%s: %" PRId64 " graphs, %.3f ms, %.3f ms in nodes\n", __func__,
+            profile->n_graphs, profile->t_graphs*1e-6, t_nodes*1e-6);
+    fprintf(stream, "%6s %10s %8s %9s %6s %9s %9s %8s %7s  %-16s %-24s %-20s %4s\n",
+            "time %", "total ms", "count", "avg us", "imbal", "wait ms", "GFLOP/s", "GB/s", "FLOP/B", "op", "name", "types", "tile");
+
+    for (int i = 0; i < profile->n_entries; ++i) {
+        const struct ggml_profile_entry * e = &entries[i];
+        char types[64];
+        snprintf(types, sizeof(types), "%s x %s", ggml_profile_type_name(e->type0), ggml_profile_type_name(e->type1));
+        const double t_wall = MAX(1, e->t_wall);
+        fprintf(stream, "%6.2f %10.3f %8" PRId64 " %9.2f %6.2f %9.3f %9.2f %8.2f %7.2f  %-16s %-24s %-20s %4d\n",
+                100.0*e->t_wall/MAX(1, t_nodes), e->t_wall*1e-6, e->count, e->t_wall*1e-3/e->count,
+                e->t_mean > 0 ? e->t_max/e->t_mean : 1.0, e->t_wait*1e-6,
+                e->flops/t_wall, e->bytes/t_wall, e->flops/MAX(1, e->bytes),
+                ggml_op_name(e->op), e->name, types, e->tile);
+    }
+
+    GGML_FREE(entries);
+}
+
+static void ggml_profile_write_string(FILE * f, const char * s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+        }
+        fputc((unsigned char)*s >= 0x20 ? *s : ' ', f);
+    }
+    fputc('"', f);
+}
+
+bool ggml_profile_write(const struct ggml_profile * profile, const char * fname) {
+    FILE * f = ggml_fopen(fname, "w");
+    if (!f) {
+        return false;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (size_t i = 0; i < profile->n_trace; ++i) {
+        const struct ggml_profile_trace * tr = &profile->trace[i];
+        const struct ggml_profile_entry * e  = &profile->entries[tr->entry];
+        char name[GGML_MAX_NAME + 8];
+        if (tr->layer >= 0) {
+            snprintf(name, sizeof(name), "%s-%d", e->name, tr->layer);
+        } else {
+            snprintf(name, sizeof(name), "%s", e->name);
+        }
+        fprintf(f, "%s{\"name\":", i > 0 ? ",\n" : "");
+        ggml_profile_write_string(f, name);
+        fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"graph\":%d}}",
+                ggml_op_name(e->op), tr->ith, tr->t_start*1e-3, (tr->t_end - tr->t_start)*1e-3, tr->graph);
+        if (tr->t_wait > 0) {
+            fprintf(f, ",\n{\"name\":\"barrier\",\"cat\":\"barrier\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"graph\":%d}}",
+                    tr->ith, tr->t_wait_start*1e-3, tr->t_wait*1e-3, tr->graph);
+        }
+    }
+    fprintf(f, "\n],\n");
+
+    fprintf(f, "\"ggmlProfile\":{\"graphs\":%" PRId64 ",\"graphs_us\":%.3f,\"nodes\":[\n", profile->n_graphs, profile->t_graphs*1e-3);
+    for (int i = 0; i < profile->n_entries; ++i) {
+        const struct ggml_profile_entry * e = &profile->entries[i];
+        fprintf(f, "%s{\"op\":\"%s\",\"name\":", i > 0 ? ",\n" : "", ggml_op_name(e->op));
+        ggml_profile_write_string(f, e->name);
+        fprintf(f, ",\"type0\":\"%s\",\"type1\":\"%s\",\"tile\":%d,\"count\":%" PRId64 ","
+                   "\"wall_us\":%.3f,\"busy_us\":%.3f,\"max_us\":%.3f,\"mean_us\":%.3f,\"wait_us\":%.3f,"
+                   "\"flops\":%.0f,\"bytes\":%.0f,\"weight_bytes\":%.0f}",
+                ggml_profile_type_name(e->type0), ggml_profile_type_name(e->type1), e->tile, e->count,
+                e->t_wall*1e-3, e->t_busy*1e-3, e->t_max*1e-3, e->t_mean*1e-3, e->t_wait*1e-3,
+                e->flops, e->bytes, e->weight_bytes);
+    }
+    fprintf(f, "\n]}}\n");
+
+    const bool ok = ferror(f) == 0;
+    fclose(f);
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool ggml_iqk_tune(const struct ggml_tensor * weight, int64_t ny, int n_threads) {
+#if GGML_USE_IQK_MULMAT
+    if (ggml_n_dims(weight) != 2 || !weight->data || ny < 1) {
+        return false;
+    }
+    const enum ggml_type vec_dot_type = type_traits[weight->type].vec_dot_type;
+    return iqk_tune_mul_mat(weight->ne[1], ny, weight->ne[0], weight->type, weight->data, weight->nb[1], vec_dot_type,
+            MAX(1, n_threads), NULL);
+#else
+    GGML_UNUSED(weight);
+    GGML_UNUSED(ny);
+    GGML_UNUSED(n_threads);
+    return false;
+#endif
+}
+
+bool ggml_iqk_tune_load(const char * fname) {
+#if GGML_USE_IQK_MULMAT
+    return iqk_tune_load(fname);
+#else
+    GGML_UNUSED(fname);
+    return false;
+#endif
+}
+
+bool ggml_iqk_tune_save(const char * fname) {
+#if GGML_USE_IQK_MULMAT
+    return iqk_tune_save(fname);
+#else
+    GGML_UNUSED(fname);
+    return false;
+#endif
+}
+
+static thread_ret_t ggml_graph_compute_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+
+    const struct ggml_cgraph * cgraph = state->shared->cgraph;
+    const struct ggml_cplan  * cplan  = state->shared->cplan;
+
+    // thread pool workers have their affinity set once when they are created
+    if (!state->shared->threadpool || state->ith == 0) {
+        set_numa_thread_affinity(state->ith);
+    }
+
+    struct ggml_compute_params params = {
+        /*.ith          =*/ state->ith,
+        /*.nth          =*/ state->shared->n_threads,
+        /*.wsize        =*/ cplan->work_size,
+        /*.wdata        =*/ cplan->work_data,
+        /*.shared       =*/ state->shared,
+        /*.current_chunk=*/ &state->shared->current_chunk,
+    };
+
+    const struct ggml_dep_node * dep = state->shared->dep;
+    bool first = true;
+
+    // the events of this thread when profiling, prof_last is the last node it computed
+    struct ggml_profile_event * prof_events = cplan->profile ? cplan->profile->events + (size_t)state->ith*cgraph->n_nodes : NULL;
+    struct ggml_profile_event * prof_last   = NULL;
+
+#if IK_PRINT_TIMING
+    int64_t t_start = ggml_time_us();
+    int64_t t_eval  = 0;
+#endif
+
+    for (int node_n = 0; node_n < cgraph->n_nodes; node_n++) {
+        struct ggml_tensor * node = cgraph->nodes[node_n];
+
+        if (ggml_is_noop(node)) continue;
+
+        if (dep) {
+            if (dep[node_n].barrier && !first) {
+                if (state->ith == 0 && cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
+                    state->shared->ec = GGML_STATUS_ABORTED;
+                }
+
+                ggml_profile_barrier(state->shared, prof_last);
+
+                if (state->shared->ec != GGML_STATUS_SUCCESS) {
+                    break;
+                }
+            }
+            first = false;
+
+            params.wsize         = dep[node_n].wsize;
+            params.wdata         = state->shared->dep_wdata + dep[node_n].wdata_offs;
+            params.current_chunk = (atomic_int *) (state->shared->dep_chunks + dep[node_n].chunk*CACHE_LINE_SIZE);
+        }
+
+#if IK_PRINT_TIMING
+        int64_t tim1 = ggml_time_us();
+#endif
+        struct ggml_profile_event * ev = prof_events ? prof_events + node_n : NULL;
+        if (ev) {
+            ev->t_start = ggml_time_ns();
+        }
         if (ggml_compute_forward(&params, node, node_n < cgraph->n_nodes-1 ? cgraph->nodes[node_n+1] : NULL)) {
             ++node_n;
         }
+        if (ev) {
+            ev->t_end = ggml_time_ns();
+            prof_last = ev;
+        }
 #if IK_PRINT_TIMING
         int64_t tim2 = ggml_time_us();
         t_eval += tim2 - tim1;
 #endif
 
+        if (dep) {
+            continue;
+        }
+
         if (state->ith == 0 && cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
             state->shared->ec = GGML_STATUS_ABORTED;
         }
 
-        ggml_barrier(state->shared);
+        ggml_profile_barrier(state->shared, prof_last);
 
         if (state->shared->ec != GGML_STATUS_SUCCESS) {
             break;
         }
     }
+
+    if (state->shared->threadpool) {
+        // the shared state is reused for the next graph as soon as thread 0 returns,
+        // so all workers must be done with it (including reading ec above) before that
+        ggml_profile_barrier(state->shared, prof_last);
+    }
 #if IK_PRINT_TIMING
     int64_t t_end = ggml_time_us();
     if (state->ith == 0) printf("ggml_barrier(...): %d us\n", (int)(t_end - t_start - t_eval));
@@ -21896,25 +23401,220 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     return 0;
 }
 
-enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
-    GGML_ASSERT(cplan);
-    GGML_ASSERT(cplan->n_threads > 0);
-    GGML_ASSERT(cplan->work_size == 0 || cplan->work_data != NULL);
+//
+// thread pool
+//
+
+#define GGML_THREADPOOL_N_THREADS_MASK 0xFFFF
+
+// wait until a new graph is submitted (returns its n_graph) or the pool is stopped (returns last_graph)
+static int ggml_threadpool_wait(struct ggml_threadpool * threadpool, int last_graph) {
+    if (!atomic_load(&threadpool->pause)) {
+        const int64_t n_rounds = (int64_t)1024*128*threadpool->params.poll;
+        for (int64_t i = 0; i < n_rounds; ++i) {
+            int n_graph = atomic_load(&threadpool->n_graph);
+            if (n_graph != last_graph || atomic_load(&threadpool->stop)) {
+                return n_graph;
+            }
+            ggml_thread_cpu_relax();
+        }
+    }
+
+    ggml_mutex_lock(&threadpool->mutex);
+    while (atomic_load(&threadpool->n_graph) == last_graph && !atomic_load(&threadpool->stop)) {
+        ggml_cond_wait(&threadpool->cond, &threadpool->mutex);
+    }
+    int n_graph = atomic_load(&threadpool->n_graph);
+    ggml_mutex_unlock(&threadpool->mutex);
+
+    return n_graph;
+}
+
+static thread_ret_t ggml_threadpool_worker(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * threadpool = state->shared->threadpool;
 
+    bool has_mask = false;
+    for (int i = 0; i < GGML_MAX_N_THREADS && !has_mask; ++i) {
+        has_mask = threadpool->params.cpumask[i];
+    }
+    if (state->cpu >= 0 || has_mask) {
+        set_threadpool_thread_affinity(state->cpu, threadpool->params.cpumask);
+    } else {
+        set_numa_thread_affinity(state->ith);
+    }
+
+    int last_graph = 0;
+    while (true) {
+        last_graph = ggml_threadpool_wait(threadpool, last_graph);
+        if (atomic_load(&threadpool->stop)) {
+            break;
+        }
+        if (state->ith < (last_graph & GGML_THREADPOOL_N_THREADS_MASK)) {
+            ggml_graph_compute_thread(state);
+        }
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool_params ggml_threadpool_params_default(int n_threads) {
+    struct ggml_threadpool_params params;
+    memset(&params, 0, sizeof(params));
+    params.n_threads  = n_threads;
+    params.poll       = 50;
+    params.strict_cpu = false;
+    params.paused     = false;
+    return params;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(const struct ggml_threadpool_params * params) {
+    GGML_ASSERT(params->n_threads > 0 && params->n_threads <= GGML_MAX_N_THREADS);
+    GGML_ASSERT(params->poll >= 0 && params->poll <= 100);
+
+    struct ggml_threadpool * threadpool = GGML_MALLOC(sizeof(struct ggml_threadpool));
+
+    threadpool->params = *params;
+    memset(&threadpool->shared, 0, sizeof(threadpool->shared));
+    threadpool->shared.threadpool = threadpool;
+
+    ggml_mutex_init(&threadpool->mutex);
+    ggml_cond_init(&threadpool->cond);
+    atomic_store(&threadpool->n_graph, 0);
+    atomic_store(&threadpool->pause, params->paused);
+    atomic_store(&threadpool->stop, false);
+
+    const int n_threads = params->n_threads;
+    threadpool->workers = GGML_MALLOC(sizeof(struct ggml_compute_state)*n_threads);
+
+    bool has_mask = false;
+    for (int i = 0; i < GGML_MAX_N_THREADS && !has_mask; ++i) {
+        has_mask = params->cpumask[i];
+    }
+
+    int cpu = -1;
+    for (int j = 0; j < n_threads; ++j) {
+        threadpool->workers[j] = (struct ggml_compute_state) {
+            .thrd      = 0,
+            .ith       = j,
+            .cpu       = -1,
+            .numa_node = -1,
+            .shared    = &threadpool->shared,
+        };
+        if (j > 0 && params->strict_cpu) {
+            // round-robin over the CPUs in the mask
+            for (int i = 1; i <= GGML_MAX_N_THREADS; ++i) {
+                int next = (cpu + i) % GGML_MAX_N_THREADS;
+                if (params->cpumask[next]) {
+                    cpu = next;
+                    threadpool->workers[j].cpu = cpu;
+                    break;
+                }
+            }
+        }
+        // worker 0 is the calling thread, which gets the affinity of set_numa_thread_affinity()
+        threadpool->workers[j].numa_node = ggml_numa_worker_node(j, threadpool->workers[j].cpu, j > 0 && has_mask ? params->cpumask : NULL);
+    }
+
+    for (int j = 1; j < n_threads; ++j) {
+        const int rc = ggml_thread_create(&threadpool->workers[j].thrd, NULL, ggml_threadpool_worker, &threadpool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return threadpool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * threadpool) {
+    if (!threadpool) {
+        return;
+    }
+
+    ggml_mutex_lock(&threadpool->mutex);
+    atomic_store(&threadpool->stop, true);
+    ggml_cond_broadcast(&threadpool->cond);
+    ggml_mutex_unlock(&threadpool->mutex);
+
+    for (int j = 1; j < threadpool->params.n_threads; ++j) {
+        const int rc = ggml_thread_join(threadpool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    ggml_mutex_destroy(&threadpool->mutex);
+    ggml_cond_destroy(&threadpool->cond);
+
+    GGML_FREE(threadpool->workers);
+    GGML_FREE(threadpool);
+}
+
+int ggml_threadpool_get_n_threads(const struct ggml_threadpool * threadpool) {
+    return threadpool->params.n_threads;
+}
+
+void ggml_threadpool_pause(struct ggml_threadpool * threadpool) {
+    atomic_store(&threadpool->pause, true);
+}
+
+void ggml_threadpool_resume(struct ggml_threadpool * threadpool) {
+    atomic_store(&threadpool->pause, false);
+}
+
+static enum ggml_status ggml_threadpool_compute(struct ggml_threadpool * threadpool, struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
+    const int n_threads = MIN(cplan->n_threads, threadpool->params.n_threads);
+
+    struct ggml_compute_state_shared * shared = &threadpool->shared;
+
+    // n_barrier is always back to 0 after a graph and n_barrier_passed keeps counting
+    shared->cgraph              = cgraph;
+    shared->cplan               = cplan;
+    shared->n_threads           = n_threads;
+    shared->abort_callback      = NULL;
+    shared->abort_callback_data = NULL;
+    shared->ec                  = GGML_STATUS_SUCCESS;
+    atomic_store(&shared->current_chunk, 0);
+    ggml_graph_dep_init(shared, cgraph, cplan);
+
+    if (n_threads > 1) {
+        // submitting a graph resumes a paused pool
+        ggml_mutex_lock(&threadpool->mutex);
+        atomic_store(&threadpool->pause, false);
+        unsigned n_graph = (unsigned)atomic_load(&threadpool->n_graph);
+        n_graph = ((n_graph | GGML_THREADPOOL_N_THREADS_MASK) + 1) | (unsigned)n_threads;
+        atomic_store(&threadpool->n_graph, (int)n_graph);
+        ggml_cond_broadcast(&threadpool->cond);
+        ggml_mutex_unlock(&threadpool->mutex);
+    }
+
+    ggml_graph_compute_thread(&threadpool->workers[0]);
+
+    // don't leave affinity set on the main thread
+    clear_numa_thread_affinity();
+
+    return shared->ec;
+}
+
+static enum ggml_status ggml_graph_compute_threads(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     int n_threads = cplan->n_threads;
 
     struct ggml_compute_state_shared state_shared = {
         /*.cgraph                  =*/ cgraph,
         /*.cgraph_plan             =*/ cplan,
         /*.n_threads               =*/ n_threads,
+        /*.threadpool              =*/ NULL,
         /*.n_barrier               =*/ 0,
         /*.n_barrier_passed        =*/ 0,
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
         /*.current_chunk           =*/ 0,
+        /*.dep                     =*/ NULL,
+        /*.dep_chunks              =*/ NULL,
+        /*.dep_wdata               =*/ NULL,
         /*.ec                      =*/ GGML_STATUS_SUCCESS,
     };
 
+    ggml_graph_dep_init(&state_shared, cgraph, cplan);
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
 //#if IK_PRINT_TIMING
@@ -21930,9 +23630,11 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
             }
 
             struct ggml_compute_state worker = {
-                .thrd   = 0,
-                .ith    = omp_get_thread_num(),
-                .shared = &state_shared,
+                .thrd      = 0,
+                .ith       = omp_get_thread_num(),
+                .cpu       = -1,
+                .numa_node = -1,
+                .shared    = &state_shared,
             };
             ggml_graph_compute_thread(&worker);
         }
@@ -21942,9 +23644,11 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
 //#endif
     } else {
         struct ggml_compute_state worker = {
-            .thrd   = 0,
-            .ith    = 0,
-            .shared = &state_shared,
+            .thrd      = 0,
+            .ith       = 0,
+            .cpu       = -1,
+            .numa_node = -1,
+            .shared    = &state_shared,
         };
         ggml_graph_compute_thread(&worker);
     }
@@ -21953,9 +23657,11 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
 
     for (int j = 0; j < n_threads; ++j) {
         workers[j] = (struct ggml_compute_state) {
-            .thrd   = 0,
-            .ith    = j,
-            .shared = &state_shared,
+            .thrd      = 0,
+            .ith       = j,
+            .cpu       = -1,
+            .numa_node = -1,
+            .shared    = &state_shared,
         };
     }
 
@@ -21985,6 +23691,25 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
     return state_shared.ec;
 }
 
+enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
+    GGML_ASSERT(cplan);
+    GGML_ASSERT(cplan->n_threads > 0);
+    GGML_ASSERT(cplan->work_size == 0 || cplan->work_data != NULL);
+
+    if (cplan->profile) {
+        ggml_profile_graph_begin(cplan->profile, cgraph, cplan->n_threads);
+    }
+
+    const enum ggml_status ec = cplan->threadpool ? ggml_threadpool_compute(cplan->threadpool, cgraph, cplan)
+                                                  : ggml_graph_compute_threads(cgraph, cplan);
+
+    if (cplan->profile) {
+        ggml_profile_graph_end(cplan->profile, cgraph);
+    }
+
+    return ec;
+}
+
 enum ggml_status ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads) {
     struct ggml_cplan cplan = ggml_graph_plan(cgraph, n_threads);
 
@@ -32,5 +32,27 @@
 #if defined(__AVX512F__) && defined(__AVX512VNNI__) && defined(__AVX512VL__) && defined(__AVX512BW__) && defined(__AVX512DQ__)
     #define HAVE_FANCY_SIMD
 #endif
+#if defined HAVE_AMX
+    #undef HAVE_AMX
+#endif
+#if defined(HAVE_FANCY_SIMD) && defined(__AMX_TILE__) && (defined(__AMX_INT8__) || defined(__AMX_BF16__))
+    #define HAVE_AMX
+#endif
 #endif
 
+
+#if defined __aarch64__
+#if defined HAVE_SVE
+    #undef HAVE_SVE
+#endif
+#if defined IQK_SVE_TARGET
+    #undef IQK_SVE_TARGET
+#endif
+#if defined __ARM_FEATURE_SVE
+    #define HAVE_SVE
+#elif defined __linux__ && ((defined __clang__ && __clang_major__ >= 17) || (!defined __clang__ && __GNUC__ >= 14))
+    // Not built for SVE: the SVE kernels get compiled with a target attribute and are only used if the CPU has it
+    #define HAVE_SVE
+    #define IQK_SVE_TARGET
+#endif
+#endif
@@ -25,6 +25,23 @@ inline uint32_t simple_gcd(uint32_t a, uint32_t b) {
     }
     return a;
 }
+
+// Token generation with a long KV cache: when there are fewer KV heads than threads (or the number of
+// KV heads is not a multiple of the number of threads), most threads have nothing to do if we only split
+// over heads. Instead, we split the KV length into n_split slices, each (KV head, slice) pair gets processed
+// by one thread, and the partial results are combined after a barrier (a.k.a. "flash decoding").
+constexpr int k_min_rows_per_split = 128;
+
+inline int flash_attn_k_step(int nek1) { return nek1%64 == 0 ? 64 : 32; }
+
+}
+
+int iqk_flash_attn_split_k(int neq3, int neq2, int nek3, int nek2, int nev2, int neq1, int nek1, int nth) {
+    if (nth < 2 || neq1 != 1 || neq3 != 1 || nek3 != 1 || nek2 < 1 || nev2 != nek2 || neq2%nek2 != 0) return 1;
+    if (nek1%32 != 0) return 1;
+    int n_split = nth/simple_gcd(nek2, nth);
+    n_split = std::min(n_split, nek1/k_min_rows_per_split);
+    return std::max(1, n_split);
 }
 
 // TODO: get the ggml_type enum here without polution
@@ -61,11 +78,23 @@ bool iqk_flash_attn_noalibi(int type_q, int type_mask, float max_bias,
     int rk3 = neq3/nek3;
     int rv3 = neq3/nev3;
 
+    int n_split = iqk_flash_attn_split_k(neq3, neq2, nek3, nek2, nev2, neq1, nek1, nth);
+
+    // MLA token generation with K and V in the same rows of the latent cache: iqk_flash_attn_mla streams the cache
+    // once for all heads, the threads get a slice of the cache each (split-K below)
+    const bool mla_decode = Dk == 576 && Dv == 512 && k == v && stride_k == stride_v && iqk_flash_attn_mla_supported(int_type_k) &&
+                            neq1 == 1 && neq3 == 1 && nek3 == 1 && nek2 == 1 && nev2 == 1 && nek1%32 == 0;
+    if (mla_decode && nth == 1) {
+        return iqk_flash_attn_mla(int_type_k, neq2, nek1, nbq2, stride_k, nb1/sizeof(float),
+                (const float *)q, k, mask, scale, softcap, qkv, nullptr, nullptr);
+    }
+    const bool mla_split = mla_decode && n_split == nth;
+
     // Getting confused all the time about where to load data from and store the results to
     // (especially when combining the results from the threads).
     // So, for now, making it work just for MLA (nek2 = 1).
     // I think it would also speed up things for GQA, but I'm leaving this for another day.
-    if (neq3 == 1 && rk2 > 1 && neq1 == 1 && nth >= 1 && nek1/32 > 1 && nek2 == 1) {
+    if (!mla_split && neq3 == 1 && rk2 > 1 && neq1 == 1 && nth >= 1 && nek1/32 > 1 && nek2 == 1) {
         int nstep_k = nek1/32;
         int gcd_k   = simple_gcd(nstep_k, nth);
         if (gcd_k >= 1) {
@@ -153,6 +182,70 @@ bool iqk_flash_attn_noalibi(int type_q, int type_mask, float max_bias,
         }
     }
 
+    if (n_split > 1) {
+        // Thread ith processes the (KV head, k-slice) pairs ith, ith + nth, ... The rk2 q heads that share a KV head
+        // are treated as rk2 q columns (they all use the same mask row), so the K/V slice is streamed just once.
+        int k_step  = flash_attn_k_step(nek1);
+        int nstep_k = nek1/k_step;
+        int n_task  = nek2*n_split;
+        auto size_task = (Dv + 16)*rk2; // floats: rk2 x Dv partial result + M and S for each of the rk2 rows
+        auto work = (float *)work_buffer;
+        for (int task = ith; task < n_task; task += nth) {
+            int ik2 = task/n_split;
+            int is  = task%n_split;
+            int first_k = (is*nstep_k/n_split)*k_step;
+            int this_nk = ((is + 1)*nstep_k/n_split)*k_step - first_k;
+            auto R = work + task*size_task;
+            if (mla_split) {
+                if (!iqk_flash_attn_mla(int_type_k, rk2, this_nk, nbq2, stride_k, Dv, (const float *)q,
+                            (const void *)((const char *)k + first_k*stride_k),
+                            (const void *)((const char *)mask + first_k*sizeof(uint16_t)),
+                            scale, softcap, R, R + Dv*rk2, R + (Dv+1)*rk2)) return false;
+                continue;
+            }
+            if (!iqk_flash_attn_impl(int_type_k, int_type_v,
+                        Dk, Dv, rk2, this_nk, nbq2, stride_k, stride_v, 0, Dv,
+                        (const float *)((const char *)q + ik2*rk2*nbq2),
+                        (const void  *)((const char *)k + ik2*nbk2 + first_k*stride_k),
+                        (const void  *)((const char *)v + ik2*nbv2 + first_k*stride_v),
+                        (const void  *)((const char *)mask + first_k*sizeof(uint16_t)), // we don't have ggml_half available here
+                        scale, softcap,
+                        R, R + Dv*rk2, R + (Dv+1)*rk2)) return false;
+        }
+
+        barrier(barrier_data);
+
+        for (int iq2 = ith; iq2 < neq2; iq2 += nth) {
+            int ik2 = iq2/rk2, j = iq2%rk2;
+            auto Racc = qkv + iq2*nb1/sizeof(float);
+            float M = -INFINITY, S = 0;
+            for (int is = 0; is < n_split; ++is) {
+                auto R  = work + (ik2*n_split + is)*size_task;
+                auto Mj = R[Dv*rk2 + j];
+                auto Sj = R[(Dv+1)*rk2 + j];
+                R += j*Dv;
+                if (Mj == -INFINITY) continue;
+                if (M == -INFINITY) {
+                    std::memcpy(Racc, R, Dv*sizeof(float));
+                    M = Mj; S = Sj;
+                } else if (Mj > M) {
+                    float c = exp(M - Mj);
+                    S = c*S + Sj;
+                    for (int i = 0; i < Dv; ++i) Racc[i] = c*Racc[i] + R[i];
+                    M = Mj;
+                } else {
+                    float c = exp(Mj - M);
+                    S += c*Sj;
+                    for (int i = 0; i < Dv; ++i) Racc[i] += c*R[i];
+                }
+            }
+            float norm = S > 0 ? 1/S : 1;
+            if (M == -INFINITY) std::memset(Racc, 0, Dv*sizeof(float));
+            else for (int i = 0; i < Dv; ++i) Racc[i] *= norm;
+        }
+        return true;
+    }
+
     // I keep changing my mind what is the best strategy to split the threads when processing
     // multiple heads. This is my current thinking, the commented out code below was the previous.
     int ntg = nth/simple_gcd(neq2*neq3, nth);
@@ -218,5 +311,10 @@ bool iqk_flash_attn_noalibi([[maybe_unused]] int type_q, [[maybe_unused]] int ty
     return false;
 }
 
+int iqk_flash_attn_split_k([[maybe_unused]] int neq3, [[maybe_unused]] int neq2, [[maybe_unused]] int nek3, [[maybe_unused]] int nek2,
+                           [[maybe_unused]] int nev2, [[maybe_unused]] int neq1, [[maybe_unused]] int nek1, [[maybe_unused]] int nth) {
+    return 1;
+}
+
 #endif
 
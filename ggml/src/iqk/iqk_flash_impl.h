@@ -27,3 +27,24 @@ bool iqk_flash_attn_impl(int type_k,             // type of k
                          float       * M,
                          float       * S);
 
+
+// Whether iqk_flash_attn_mla supports a latent cache of this type (Q8_0, Q8_KV, F16)
+bool iqk_flash_attn_mla_supported(int type_kv);
+
+// Token generation with the MLA latent cache (DeepSeek-2/3): the nq heads have one q row each, K is the whole
+// 576 element cache row and V its first 512 elements. The cache is streamed once for all heads.
+// M and S receive the softmax max and sum of each head if not null, qkv is then not normalized.
+bool iqk_flash_attn_mla(int type_kv,            // type of the latent cache
+                        int nq,                 // number of heads
+                        int nk,                 // number of cache rows
+                        int stride_q,           // distance between the q rows of the heads in bytes
+                        int stride_kv,          // distance between cache rows in bytes
+                        int stride_qkv,         // distance between the result rows of the heads in floats
+                        const float * q,        // q matrix
+                        const void  * kv,       // latent cache rows
+                        const void  * mask,     // mask row, fp16, shared by all heads
+                        float         scale,    // scale applied before softmax
+                        float         softcap,  // if > 0, a "soft-cap" operation is applied before softmax
+                        float       * qkv,      // v*softmax(scale*(k*q))
+                        float       * M,
+                        float       * S);
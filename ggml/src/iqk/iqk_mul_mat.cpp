@@ -46,6 +46,49 @@
 
 #include <utility>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <string>
+#if defined __x86_64__ && !defined _MSC_VER
+#include <cpuid.h>
+#elif defined __x86_64__
+#include <intrin.h>
+#elif defined __APPLE__
+#include <sys/sysctl.h>
+#endif
+#ifdef HAVE_AMX
+#include <cstdlib>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
+#ifdef HAVE_SVE
+#include <cstdlib>
+#endif
+#ifdef IQK_SVE_TARGET
+#include <sys/auxv.h>
+#ifndef HWCAP_SVE
+#define HWCAP_SVE (1 << 22)
+#endif
+#if defined __clang__
+#include <arm_sve.h>
+#else
+#pragma GCC push_options
+#pragma GCC target("+sve")
+#include <arm_sve.h>
+#pragma GCC pop_options
+#endif
+#endif
 #if FA_TIMING
 #include <chrono>
 #include <mutex>
@@ -150,16 +193,56 @@ struct DataInfo {
 
 typedef void (*mul_mat_t)(int n, const void * vx, size_t bx, const DataInfo& info, int nrc_x);
 
+#ifdef HAVE_AMX
+struct alignas(64) AmxTileConfig {
+    uint8_t  palette_id = 1;
+    uint8_t  start_row  = 0;
+    uint8_t  reserved[14] = {};
+    uint16_t colsb[16] = {};
+    uint8_t  rows[16] = {};
+    inline void set(int tile, int nrows, int ncolsb) { rows[tile] = nrows; colsb[tile] = ncolsb; }
+};
+
+// The tile configuration is loaded once per thread and only reloaded when a kernel needs a different one.
+// MulMat releases the tiles when the thread is done with the AMX kernels of a matrix multiplication.
+struct AmxTileState {
+    AmxTileConfig cfg;
+    bool loaded = false;
+    static AmxTileState& instance() {
+        thread_local AmxTileState state;
+        return state;
+    }
+    static inline void load(const AmxTileConfig& cfg) {
+        auto& state = instance();
+        if (state.loaded && std::memcmp(&state.cfg, &cfg, sizeof(cfg)) == 0) return;
+        _tile_loadconfig(&cfg);
+        state.cfg = cfg;
+        state.loaded = true;
+    }
+    static inline void release() {
+        auto& state = instance();
+        if (state.loaded) {
+            _tile_release();
+            state.loaded = false;
+        }
+    }
+};
+#endif
+
 struct MulMat {
     std::array<mul_mat_t, 8> funcs = {};
     mul_mat_t func16 = nullptr;
-    inline void mul_mat_NxM(int n, const void * vx, size_t bx, DataInfo& info, int nrc_x, int nrc_y) {
+    // Rows of A per block of the x loop, and the max. number of B columns per kernel call (0 - no limit).
+    // The defaults are replaced by the autotuned values for the shapes iqk_tune_mul_mat() has seen.
 #ifdef __aarch64__
-        constexpr int k_x_step = 64; //8192; // Tiling does not seem to help on my M2 Max (but difference to tiling is small)
+    int x_step = 64; //8192; // Tiling does not seem to help on my M2 Max (but difference to tiling is small)
 #else
-        constexpr int k_x_step = 64; // This works best on my Ryzen-7950X (but differences to other tile size are small)
+    int x_step = 64; // This works best on my Ryzen-7950X (but differences to other tile size are small)
 #endif
-        if (func16 && nrc_y >= 16) {
+    int ny_max = 0;
+    inline void mul_mat_NxM(int n, const void * vx, size_t bx, DataInfo& info, int nrc_x, int nrc_y) {
+        const int k_x_step = x_step;
+        if (func16 && nrc_y >= 16 && (ny_max == 0 || ny_max >= 16)) {
             int n_step = (nrc_y - info.cur_y)/16;
             for (int ix = 0; ix < nrc_x; ix += k_x_step) {
                 auto this_info = info;
@@ -170,11 +253,15 @@ struct MulMat {
                     this_info.cur_y += 16;
                 }
             }
+#ifdef HAVE_AMX
+            AmxTileState::release();
+#endif
             info.cur_y += 16 * n_step;
             if (info.cur_y == nrc_y) return;
         }
         int ny = funcs.size();
         while (!funcs[ny-1] && ny > 0) --ny;
+        if (ny_max > 0 && ny_max < ny) ny = ny_max;
         int n_left = nrc_y - info.cur_y;
         int n_step = n_left/ny;
         if (n_step > 0) {
@@ -253,6 +340,9 @@ struct MulMat {
                     this_info.cur_y += 16;
                 }
             }
+#ifdef HAVE_AMX
+            AmxTileState::release();
+#endif
             info.cur_y += 16 * n_step;
             if (info.cur_y == nrc_y) return;
         }
@@ -403,15 +493,64 @@ private:
 
 }
 
-bool iqk_mul_mat(long Nx, long Ny, long ne00,
-        int typeA, const void * A, long strideA,
-        int typeB, const void * B, long strideB,
-        float * C, long stride_C, int ith, int nth) {
+namespace {
 
-    MulMat mm;
-    if (!MulMat::prepare(typeA, typeB, ne00, mm, Ny)) {
-        return false;
+inline int ny_class(long Ny) { return Ny == 1 ? 0 : Ny < 16 ? 1 : 2; }
+
+struct TunedConfig {
+    int  typeA, typeB;
+    long ne00, Nx;
+    int  ny_class;
+    int  nth;
+    iqk_mm_config config;
+};
+
+// The autotuned configurations. Entries are only ever appended and are published with a release store of the count,
+// so the lookup on every iqk_mul_mat call does not lock and is a single atomic load when nothing has been tuned.
+// The thread count is part of the key because the benchmarks run on the rows of one thread. nth <= 0 takes the most
+// recent entry for any thread count: iqk_mul_mat does not know the number of threads (it gets the chunks), and the
+// tile (x_step, ny) depends much less on it than chunk_rows does.
+class TunedConfigs {
+public:
+    static TunedConfigs& instance() {
+        static TunedConfigs tuned;
+        return tuned;
+    }
+    const iqk_mm_config * find(long Nx, long Ny, long ne00, int typeA, int typeB, int nth) const {
+        int n = count.load(std::memory_order_acquire);
+        int c = ny_class(Ny);
+        for (int i = n-1; i >= 0; --i) {
+            auto& e = entries[i];
+            if (e.Nx == Nx && e.ne00 == ne00 && e.typeA == typeA && e.typeB == typeB && e.ny_class == c &&
+                (nth <= 0 || e.nth == nth)) return &e.config;
+        }
+        return nullptr;
+    }
+    void add(const TunedConfig& e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        int n = count.load(std::memory_order_relaxed);
+        if (n < k_max_entries) {
+            entries[n] = e;
+            count.store(n+1, std::memory_order_release);
+        }
     }
+    int size() const { return count.load(std::memory_order_acquire); }
+    const TunedConfig& operator[](int i) const { return entries[i]; }
+private:
+    static constexpr int k_max_entries = 1024;
+    std::array<TunedConfig, k_max_entries> entries;
+    std::atomic<int> count{0};
+    std::mutex mutex;
+};
+
+inline void apply_config(const iqk_mm_config& config, MulMat& mm) {
+    if (config.x_step > 0) mm.x_step = config.x_step;
+    mm.ny_max = config.ny;
+}
+
+void mul_mat_rows(MulMat& mm, long Nx, long Ny, long ne00,
+        int typeA, const void * A, long strideA, const void * B, long strideB,
+        float * C, long stride_C, int ith, int nth) {
 
     size_t row_size_qx = strideA; //*ggml_type_size(ggml_type(typeA));
     size_t row_size_qy = strideB; //*ggml_type_size(ggml_type(typeB));
@@ -426,10 +565,270 @@ bool iqk_mul_mat(long Nx, long Ny, long ne00,
     DataInfo info{C + first_x*num_rows, (const char *)B, (size_t)stride_C, row_size_qy, 0, 1, nullptr, 0};
 
     mm.mul_mat_NxM(ne00, (const char *)A + row_size_qx*first_x*num_rows, row_size_qx, info, nrc_x*num_rows, Ny);
+}
+
+}
+
+bool iqk_mul_mat(long Nx, long Ny, long ne00,
+        int typeA, const void * A, long strideA,
+        int typeB, const void * B, long strideB,
+        float * C, long stride_C, int ith, int nth) {
+
+    MulMat mm;
+    if (!MulMat::prepare(typeA, typeB, ne00, mm, Ny)) {
+        return false;
+    }
+    if (auto config = TunedConfigs::instance().find(Nx, Ny, ne00, typeA, typeB, 0)) {
+        apply_config(*config, mm);
+    }
+
+    mul_mat_rows(mm, Nx, Ny, ne00, typeA, A, strideA, B, strideB, C, stride_C, ith, nth);
 
     return true;
 }
 
+int iqk_mul_mat_row_step(long ne00, int typeA, int typeB) {
+    MulMat mm;
+    if (!MulMat::prepare(typeA, typeB, ne00, mm, 1)) {
+        return 0;
+    }
+    return MulMat::num_rows(ggml_type(typeA));
+}
+
+int iqk_mul_mat_tile(long ne00, int typeA, int typeB, long Ny) {
+    MulMat mm;
+    if (Ny < 1 || !MulMat::prepare(typeA, typeB, ne00, mm, Ny)) {
+        return 0;
+    }
+    if (mm.func16 && Ny >= 16) {
+        return 16;
+    }
+    int ny = mm.funcs.size();
+    while (ny > 0 && !mm.funcs[ny-1]) --ny;
+    return ny < Ny ? ny : int(Ny);
+}
+
+namespace {
+
+std::string cpu_model() {
+    std::string model;
+#if defined __x86_64__
+    unsigned int brand[12] = {};
+    for (unsigned int i = 0; i < 3; ++i) {
+#ifdef _MSC_VER
+        __cpuid((int *)(brand + 4*i), 0x80000002 + i);
+#else
+        __get_cpuid(0x80000002 + i, brand + 4*i + 0, brand + 4*i + 1, brand + 4*i + 2, brand + 4*i + 3);
+#endif
+    }
+    model.assign((const char *)brand, strnlen((const char *)brand, sizeof(brand)));
+#elif defined __APPLE__
+    char buf[256];
+    size_t len = sizeof(buf);
+    if (sysctlbyname("machdep.cpu.brand_string", buf, &len, nullptr, 0) == 0) model.assign(buf, strnlen(buf, len));
+#elif defined __linux__
+    // ARM has no model name in /proc/cpuinfo, the implementer and part numbers of the first CPU identify the core
+    if (FILE * f = fopen("/proc/cpuinfo", "r")) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            if (line[0] == '\n' && !model.empty()) break;
+            if (strncmp(line, "CPU implementer", 15) && strncmp(line, "CPU part", 8) && strncmp(line, "model name", 10)) continue;
+            const char * value = strchr(line, ':');
+            if (!value) continue;
+            if (!model.empty()) model += ' ';
+            model += value + 1;
+            model.erase(model.find_last_not_of(" \t\n") + 1);
+        }
+        fclose(f);
+    }
+#endif
+    size_t first = model.find_first_not_of(' ');
+    return first == std::string::npos ? std::string("unknown") : model.substr(first);
+}
+
+// Times iqk_mul_mat for one thread's share of the rows of A. The share is moved through A between calls, so for large
+// matrices the timing includes fetching A from memory as during inference, and not only from the cache.
+struct TuneBench {
+    TuneBench(long Nx, long Ny, long ne00, int typeA, const char * A, long strideA, int typeB, long nx) :
+        Nx(Nx), Ny(Ny), ne00(ne00), typeA(typeA), typeB(typeB), A(A), strideA(strideA), nx(nx), n_slices(Nx/nx),
+        strideB(ggml_row_size(ggml_type(typeB), ne00)), B(strideB*Ny), C(nx*Ny) {
+        std::vector<float> y(ne00);
+        std::mt19937 rng(1234);
+        std::normal_distribution<float> dist;
+        auto from_float = ggml_internal_get_type_traits(ggml_type(typeB)).from_float;
+        for (int iy = 0; iy < Ny; ++iy) {
+            for (auto& v : y) v = dist(rng);
+            from_float(y.data(), B.data() + iy*strideB, ne00);
+        }
+    }
+    double run(const iqk_mm_config& config) {
+        MulMat mm;
+        MulMat::prepare(typeA, typeB, ne00, mm, Ny);
+        apply_config(config, mm);
+        const int n_chunk = config.chunk_rows > 0 ? std::max(1L, nx/config.chunk_rows) : 1;
+        auto one = [&] () {
+            auto a = A + (slice++ % n_slices)*nx*strideA;
+            for (int chunk = 0; chunk < n_chunk; ++chunk) {
+                mul_mat_rows(mm, nx, Ny, ne00, typeA, a, strideA, B.data(), strideB, C.data(), nx, chunk, n_chunk);
+            }
+        };
+        one();
+        double best = HUGE_VAL;
+        for (int round = 0; round < 3; ++round) {
+            auto t1 = std::chrono::steady_clock::now();
+            double t = 0;
+            int n = 0;
+            do {
+                one(); ++n;
+                t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+            } while (t < 0.01);
+            best = std::min(best, t/n);
+        }
+        return best;
+    }
+
+    const long Nx, Ny, ne00;
+    const int  typeA, typeB;
+    const char * A;
+    const long strideA, nx, n_slices;
+    const size_t strideB;
+    std::vector<char>  B;
+    std::vector<float> C;
+    long slice = 0;
+};
+
+}
+
+bool iqk_tune_mul_mat(long Nx, long Ny, long ne00, int typeA, const void * A, long strideA, int typeB, int nth,
+        iqk_mm_config * config) {
+    MulMat mm;
+    if (Nx < 1 || Ny < 1 || nth < 1 || !MulMat::prepare(typeA, typeB, ne00, mm, Ny)) {
+        return false;
+    }
+    auto& tuned = TunedConfigs::instance();
+    if (auto cached = tuned.find(Nx, Ny, ne00, typeA, typeB, nth)) {
+        if (config) *config = *cached;
+        return true;
+    }
+    const long num_rows = MulMat::num_rows(ggml_type(typeA));
+    if (Nx%num_rows != 0 || !ggml_internal_get_type_traits(ggml_type(typeB)).from_float) {
+        return false;
+    }
+
+    // the rows of one thread, at most 256 so that tuning for large batches does not take too long
+    long nx = (Nx/num_rows + nth - 1)/nth * num_rows;
+    nx = std::min(nx, std::max(num_rows, 256/num_rows*num_rows));
+    TuneBench bench(Nx, Ny, ne00, typeA, (const char *)A, strideA, typeB, nx);
+
+    iqk_mm_config best = {mm.x_step, 0, 0};
+    double t_best = bench.run(best);
+
+    // the widest kernel is not always the fastest, e.g. when its accumulators spill
+    if (Ny > 1) {
+        int ny = mm.funcs.size();
+        while (ny > 0 && !mm.funcs[ny-1]) --ny;
+        for (int c_ny : {8, 6, 4, 2}) {
+            if (c_ny > Ny || c_ny > ny || (c_ny == ny && !mm.func16)) continue;
+            iqk_mm_config c = best;
+            c.ny = c_ny;
+            double t = bench.run(c);
+            if (t < t_best) { t_best = t; best = c; }
+        }
+    }
+
+    for (int x_step : {16, 32, 128, 256}) {
+        if (x_step%num_rows != 0 || x_step > nx || x_step == best.x_step) continue;
+        iqk_mm_config c = best;
+        c.x_step = x_step;
+        double t = bench.run(c);
+        if (t < t_best) { t_best = t; best = c; }
+    }
+
+    // Smaller chunks balance the load between threads better, but for large Ny each chunk goes through B again.
+    // Take the smallest chunk that loses less than 3% compared to doing all rows at once.
+    best.chunk_rows = nx;
+    for (int chunk_rows : {16, 32, 64, 128}) {
+        if (chunk_rows%num_rows != 0 || chunk_rows >= nx) continue;
+        iqk_mm_config c = best;
+        c.chunk_rows = chunk_rows;
+        if (bench.run(c) < 1.03*t_best) {
+            best.chunk_rows = chunk_rows;
+            break;
+        }
+    }
+
+    tuned.add({typeA, typeB, ne00, Nx, ny_class(Ny), nth, best});
+    if (config) *config = best;
+    return true;
+}
+
+int iqk_mul_mat_chunk_rows(long Nx, long Ny, long ne00, int typeA, int typeB, int nth) {
+    auto config = TunedConfigs::instance().find(Nx, Ny, ne00, typeA, typeB, nth);
+    return config ? config->chunk_rows : 0;
+}
+
+bool iqk_tune_load(const char * fname) {
+    FILE * f = fopen(fname, "r");
+    if (!f) {
+        return false;
+    }
+    auto type_from_name = [] (const char * name) {
+        for (int type = 0; type < GGML_TYPE_COUNT; ++type) {
+            auto type_name = ggml_type_name(ggml_type(type));
+            if (type_name && !strcmp(type_name, name)) return type;
+        }
+        return -1;
+    };
+    auto& tuned = TunedConfigs::instance();
+    bool ok = false;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') continue;
+        if (!strncmp(line, "cpu ", 4)) {
+            std::string model(line + 4);
+            model.erase(model.find_last_not_of("\r\n") + 1);
+            ok = model == cpu_model();
+            if (!ok) break;
+            continue;
+        }
+        char name_a[64], name_b[64];
+        TunedConfig e;
+        if (!ok || sscanf(line, "%63s %63s %ld %ld %d %d %d %d %d", name_a, name_b, &e.ne00, &e.Nx, &e.ny_class, &e.nth,
+                    &e.config.x_step, &e.config.ny, &e.config.chunk_rows) != 9) continue;
+        e.typeA = type_from_name(name_a);
+        e.typeB = type_from_name(name_b);
+        if (e.typeA < 0 || e.typeB < 0 || e.ny_class < 0 || e.ny_class > 2 || e.nth < 1) continue;
+        // the representative Ny of the class is enough for find()
+        long Ny = e.ny_class == 0 ? 1 : e.ny_class == 1 ? 2 : 16;
+        // a hand-edited or stale file must not select a kernel that does not exist or split the interleaved rows
+        MulMat mm;
+        if (e.ne00 < 1 || e.Nx < 1 || !MulMat::prepare(e.typeA, e.typeB, e.ne00, mm, Ny)) continue;
+        const int num_rows = MulMat::num_rows(ggml_type(e.typeA));
+        auto& c = e.config;
+        if (c.ny < 0 || c.ny > int(mm.funcs.size()) || (c.ny > 0 && !mm.funcs[c.ny-1])) continue;
+        if (c.x_step < 1 || c.x_step%num_rows != 0 || c.chunk_rows < 1 || c.chunk_rows%num_rows != 0) continue;
+        if (!tuned.find(e.Nx, Ny, e.ne00, e.typeA, e.typeB, e.nth)) tuned.add(e);
+    }
+    fclose(f);
+    return ok;
+}
+
+bool iqk_tune_save(const char * fname) {
+    FILE * f = fopen(fname, "w");
+    if (!f) {
+        return false;
+    }
+    auto& tuned = TunedConfigs::instance();
+    fprintf(f, "# iqk_mul_mat tile configurations: typeA typeB ne00 Nx ny_class nth x_step ny chunk_rows\n");
+    fprintf(f, "cpu %s\n", cpu_model().c_str());
+    for (int i = 0; i < tuned.size(); ++i) {
+        auto& e = tuned[i];
+        fprintf(f, "%s %s %ld %ld %d %d %d %d %d\n", ggml_type_name(ggml_type(e.typeA)), ggml_type_name(ggml_type(e.typeB)),
+                e.ne00, e.Nx, e.ny_class, e.nth, e.config.x_step, e.config.ny, e.config.chunk_rows);
+    }
+    return fclose(f) == 0;
+}
+
 namespace {
 inline uint32_t simple_gcd(uint32_t a, uint32_t b) {
     while (a != b) {
@@ -6385,7 +6784,7 @@ static void mul_mat_q8_k_r8_q8_k(int n, const void * vx, size_t bx, const DataIn
                 }
             }
 #ifdef HAVE_FANCY_SIMD
-            auto m4 = _mm256_mul_ps(d4, _mm256_set1_ps(-128.f));
+            auto m4 = _mm256_mul_ps(d4, _mm256_set1_ps(-127.f));
 #endif
             for (int iy = 0; iy < nrc_y; ++iy) {
                 auto d4y = _mm256_mul_ps(d4, _mm256_set1_ps(q8.scale(iy, ibl)));
@@ -9193,6 +9592,248 @@ template <typename Dequantizer> void MulMat::set_functions(MulMat& m) {
         }
 }
 
+#ifdef HAVE_AMX
+//
+// AMX kernels for the row-interleaved types. They compute 16 activation rows per call and are
+// installed as MulMat::func16 when the CPU has the tile units and the OS lets us use them.
+// The quants of Q8_0_R8, Q8_K_R8 and BF16_R16 are already stored in the VNNI layout expected
+// by the second tile operand, so the weights are loaded straight from the tensor data.
+//
+struct AmxSupport {
+    bool int8 = false;
+    bool bf16 = false;
+    AmxSupport() {
+        if (getenv("GGML_NO_AMX")) return;
+        uint32_t eax, ebx, ecx, edx;
+#ifdef _MSC_VER
+        int regs[4];
+        __cpuidex(regs, 7, 0);
+        edx = regs[3];
+        uint64_t xcr0 = _xgetbv(0);
+#else
+        if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return;
+        uint32_t xcr0_lo, xcr0_hi;
+        __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        uint64_t xcr0 = xcr0_lo | (uint64_t(xcr0_hi) << 32);
+#endif
+        // AMX-TILE in CPUID and the XTILECFG/XTILEDATA state enabled by the OS
+        if (!(edx & (1u << 24)) || (xcr0 & 0x60000) != 0x60000) return;
+#ifdef __linux__
+        // Linux only hands out the 8 KiB tile data state to processes that ask for it
+        // (ARCH_REQ_XCOMP_PERM, XFEATURE_XTILEDATA)
+        if (syscall(SYS_arch_prctl, 0x1023, 18) != 0) return;
+#endif
+#ifdef __AMX_INT8__
+        int8 = edx & (1u << 25);
+#endif
+#if defined __AMX_BF16__ && defined __AVX512BF16__
+        bf16 = edx & (1u << 22);
+#endif
+    }
+    static const AmxSupport& instance() {
+        static AmxSupport support;
+        return support;
+    }
+};
+
+// Tiles are loaded with a fixed row stride. Without a row mapping the 16 activation rows of a call are
+// consecutive rows of src1, else (MoE) they get copied next to each other first.
+inline const char * amx_src1_rows(const DataInfo& info) {
+    if (!info.row_mapping) return info.src1_row(0);
+    thread_local std::vector<char> buffer;
+    if (buffer.size() < 16*info.by) buffer.resize(16*info.by);
+    for (int iy = 0; iy < 16; ++iy) std::memcpy(buffer.data() + iy*info.by, info.src1_row(iy), info.by);
+    return buffer.data();
+}
+
+#ifdef __AMX_INT8__
+// The q8_2_x4 scales of 16 activation rows, transposed so that block ib has them at 16*ib
+inline const float * amx_q8_2_scales(const char * y, size_t by, int nb) {
+    thread_local std::vector<float> buffer;
+    if ((int)buffer.size() < 16*nb) buffer.resize(16*nb);
+    auto d = buffer.data();
+    for (int iy = 0; iy < 16; ++iy) {
+        auto y4 = (const block_q8_2_x4 *)(y + iy*by);
+        for (int ib4 = 0; ib4 < nb/4; ++ib4) {
+            for (int k = 0; k < 4; ++k) d[16*(4*ib4+k)+iy] = GGML_BF16_TO_FP32(ggml_bf16_t{y4[ib4].d[k]});
+        }
+        auto y1 = (const block_q8_2 *)(y + iy*by);
+        for (int ib = 4*(nb/4); ib < nb; ++ib) d[16*ib+iy] = GGML_BF16_TO_FP32(ggml_bf16_t{y1[ib].d});
+    }
+    return d;
+}
+inline const int8_t * amx_q8_2_quants(const char * y, int nb, int ib) {
+    return ib < 4*(nb/4) ? ((const block_q8_2_x4 *)y)[ib/4].qs + 32*(ib%4) : ((const block_q8_2 *)y)[ib].qs;
+}
+
+static void mul_mat_q8_0_r8_q8_2_amx(int n, const void * vx, size_t bx, const DataInfo& info, int nrc_x) {
+    GGML_ASSERT(nrc_x%16 == 0);
+    AmxTileConfig cfg;
+    cfg.set(0, 16, 32); // 16 activation rows x 32 quants
+    cfg.set(1,  8, 32); // 32 quants x 8 rows of q8l
+    cfg.set(2,  8, 32); // 32 quants x 8 rows of q8h
+    cfg.set(3, 16, 32); // int32 results for q8l
+    cfg.set(4, 16, 32); // int32 results for q8h
+    AmxTileState::load(cfg);
+    int nb = n / QK8_0;
+    auto y = amx_src1_rows(info);
+    auto dy = amx_q8_2_scales(y, info.by, nb);
+    alignas(64) int32_t sumi[16*16];
+    for (int ix = 0; ix < nrc_x; ix += 16) {
+        const block_q8_0_r8 * q8l = (const block_q8_0_r8 *)((const char *)vx + (ix+0)*bx);
+        const block_q8_0_r8 * q8h = (const block_q8_0_r8 *)((const char *)vx + (ix+8)*bx);
+        __m512 acc[16] = {};
+        for (int ib = 0; ib < nb; ++ib) {
+            _tile_zero(3);
+            _tile_zero(4);
+            _tile_loadd(0, amx_q8_2_quants(y, nb, ib), info.by);
+            _tile_loadd(1, q8l[ib].qs, 32);
+            _tile_loadd(2, q8h[ib].qs, 32);
+            _tile_dpbssd(3, 0, 1);
+            _tile_dpbssd(4, 0, 2);
+            _tile_stored(3, sumi+0, 64);
+            _tile_stored(4, sumi+8, 64);
+            auto scales1 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)q8l[ib].d));
+            auto scales2 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)q8h[ib].d));
+            auto scales  = _mm512_insertf32x8(_mm512_castps256_ps512(scales1), scales2, 1);
+            for (int iy = 0; iy < 16; ++iy) {
+                auto d = _mm512_mul_ps(scales, _mm512_set1_ps(dy[16*ib+iy]));
+                acc[iy] = _mm512_fmadd_ps(d, _mm512_cvtepi32_ps(_mm512_load_si512((const __m512i *)sumi + iy)), acc[iy]);
+            }
+        }
+        for (int iy = 0; iy < 16; ++iy) info.store(ix, iy, acc[iy]);
+    }
+}
+
+static void mul_mat_q4_0_r8_q8_2_amx(int n, const void * vx, size_t bx, const DataInfo& info, int nrc_x) {
+    GGML_ASSERT(nrc_x%16 == 0);
+    AmxTileConfig cfg;
+    cfg.set(0, 16, 32); // 16 activation rows x 32 quants
+    cfg.set(1,  8, 64); // 32 quants x 16 rows, unpacked to int8
+    cfg.set(2, 16, 64); // int32 results
+    AmxTileState::load(cfg);
+    auto m4 = _mm512_set1_epi8(0xf);
+    auto m8 = _mm512_set1_epi8(8);
+    int nb = n / QK4_NL;
+    auto y = amx_src1_rows(info);
+    auto dy = amx_q8_2_scales(y, info.by, nb);
+    alignas(64) int8_t  qx[8*64];
+    alignas(64) int32_t sumi[16*16];
+    for (int ix = 0; ix < nrc_x; ix += 16) {
+        const block_iq4_nl_r8 * iq4l = (const block_iq4_nl_r8 *)((const char *)vx + (ix+0)*bx);
+        const block_iq4_nl_r8 * iq4h = (const block_iq4_nl_r8 *)((const char *)vx + (ix+8)*bx);
+        __m512 acc[16] = {};
+        for (int ib = 0; ib < nb; ++ib) {
+            for (int j = 0; j < 4; ++j) {
+                auto bits = _mm512_inserti32x8(_mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *)iq4l[ib].qs+j)),
+                        _mm256_loadu_si256((const __m256i *)iq4h[ib].qs+j), 1);
+                _mm512_store_si512((__m512i *)qx + j + 0, _mm512_sub_epi8(_mm512_and_si512(bits, m4), m8));
+                _mm512_store_si512((__m512i *)qx + j + 4, _mm512_sub_epi8(_mm512_and_si512(_mm512_srli_epi16(bits, 4), m4), m8));
+            }
+            _tile_zero(2);
+            _tile_loadd(0, amx_q8_2_quants(y, nb, ib), info.by);
+            _tile_loadd(1, qx, 64);
+            _tile_dpbssd(2, 0, 1);
+            _tile_stored(2, sumi, 64);
+            auto scales1 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)iq4l[ib].d));
+            auto scales2 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)iq4h[ib].d));
+            auto scales  = _mm512_insertf32x8(_mm512_castps256_ps512(scales1), scales2, 1);
+            for (int iy = 0; iy < 16; ++iy) {
+                auto d = _mm512_mul_ps(scales, _mm512_set1_ps(dy[16*ib+iy]));
+                acc[iy] = _mm512_fmadd_ps(d, _mm512_cvtepi32_ps(_mm512_load_si512((const __m512i *)sumi + iy)), acc[iy]);
+            }
+        }
+        for (int iy = 0; iy < 16; ++iy) info.store(ix, iy, acc[iy]);
+    }
+}
+
+// Q8_K_R8 has a single scale per row and block of 256, so the whole block is accumulated in the tiles.
+// nrc_x is a multiple of 8 only; an odd group of 8 rows is computed twice and stored once.
+static void mul_mat_q8_k_r8_q8_k_amx(int n, const void * vx, size_t bx, const DataInfo& info, int nrc_x) {
+    GGML_ASSERT(nrc_x%8 == 0);
+    AmxTileConfig cfg;
+    cfg.set(0, 16, 64); // 16 activation rows x 64 quants
+    cfg.set(1, 16, 32); // 64 quants x 8 rows of q8l
+    cfg.set(2, 16, 32); // 64 quants x 8 rows of q8h
+    cfg.set(3, 16, 32); // int32 results for q8l
+    cfg.set(4, 16, 32); // int32 results for q8h
+    AmxTileState::load(cfg);
+    int nbl = n / QK_K;
+    auto y = amx_src1_rows(info);
+    alignas(64) int32_t sumi[16*16];
+    for (int ix = 0; ix < nrc_x; ix += 16) {
+        bool full = ix + 16 <= nrc_x;
+        const block_q8_k_r8 * q8l = (const block_q8_k_r8 *)((const char *)vx + (ix+0)*bx);
+        const block_q8_k_r8 * q8h = full ? (const block_q8_k_r8 *)((const char *)vx + (ix+8)*bx) : q8l;
+        __m512 acc[16] = {};
+        for (int ibl = 0; ibl < nbl; ++ibl) {
+            auto qy = ((const block_q8_K *)y)[ibl].qs;
+            _tile_zero(3);
+            _tile_zero(4);
+            for (int k = 0; k < QK_K/64; ++k) {
+                _tile_loadd(0, qy + 64*k, info.by);
+                _tile_loadd(1, q8l[ibl].qs + 512*k, 32);
+                _tile_loadd(2, q8h[ibl].qs + 512*k, 32);
+                _tile_dpbssd(3, 0, 1);
+                _tile_dpbssd(4, 0, 2);
+            }
+            _tile_stored(3, sumi+0, 64);
+            _tile_stored(4, sumi+8, 64);
+            auto scales1 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)q8l[ibl].d));
+            auto scales2 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)q8h[ibl].d));
+            auto scales  = _mm512_insertf32x8(_mm512_castps256_ps512(scales1), scales2, 1);
+            for (int iy = 0; iy < 16; ++iy) {
+                auto d = _mm512_mul_ps(scales, _mm512_set1_ps(((const block_q8_K *)(y + iy*info.by))[ibl].d));
+                acc[iy] = _mm512_fmadd_ps(d, _mm512_cvtepi32_ps(_mm512_load_si512((const __m512i *)sumi + iy)), acc[iy]);
+            }
+        }
+        for (int iy = 0; iy < 16; ++iy) {
+            if (full) info.store(ix, iy, acc[iy]);
+            else info.store(ix, iy, _mm512_castps512_ps256(acc[iy]));
+        }
+    }
+}
+#endif
+
+#if defined __AMX_BF16__ && defined __AVX512BF16__
+// The 32 rows of a step are computed as two 16 column tiles; an odd group of 16 rows is computed twice and stored once.
+static void mul_mat_bf16_r16_bf16_amx(int n, const void * vx, size_t bx, const DataInfo& info, int nrc_x) {
+    GGML_ASSERT(nrc_x%16 == 0);
+    GGML_ASSERT(n%32 == 0);
+    AmxTileConfig cfg;
+    cfg.set(0, 16, 64); // 16 activation rows x 32 bf16
+    cfg.set(1, 16, 64); // 32 bf16 x 16 rows of b8_1
+    cfg.set(2, 16, 64); // 32 bf16 x 16 rows of b8_2
+    cfg.set(3, 16, 64); // fp32 results for b8_1
+    cfg.set(4, 16, 64); // fp32 results for b8_2
+    AmxTileState::load(cfg);
+    auto y = amx_src1_rows(info);
+    alignas(64) float sum[16*32];
+    for (int ix = 0; ix < nrc_x; ix += 32) {
+        bool full = ix + 32 <= nrc_x;
+        const char * b8_1 = (const char *)vx + (ix+0)*bx;
+        const char * b8_2 = full ? (const char *)vx + (ix+16)*bx : b8_1;
+        _tile_zero(3);
+        _tile_zero(4);
+        for (int ib = 0; ib < n/32; ++ib) {
+            _tile_loadd(0, y + 64*ib, info.by);
+            _tile_loadd(1, b8_1 + 1024*ib, 64);
+            _tile_loadd(2, b8_2 + 1024*ib, 64);
+            _tile_dpbf16ps(3, 0, 1);
+            _tile_dpbf16ps(4, 0, 2);
+        }
+        _tile_stored(3, sum+ 0, 128);
+        _tile_stored(4, sum+16, 128);
+        for (int iy = 0; iy < 16; ++iy) {
+            info.store(ix, iy, _mm512_load_ps(sum + 32*iy));
+            if (full) info.store(ix+16, iy, _mm512_load_ps(sum + 32*iy + 16));
+        }
+    }
+}
+#endif
+
+#endif // HAVE_AMX
+
 template <typename FloatX, typename FloatY>
 void set_mul_mat_f(MulMat& mm) {
     for (auto& f : mm.funcs) f = nullptr;
@@ -9254,6 +9895,9 @@ bool MulMat::prepare(int typeA, int typeB, int ne00, MulMat& mm, int Ny) {
 #endif
             default: return false;
         }
+#if defined HAVE_AMX && defined __AMX_BF16__ && defined __AVX512BF16__
+        if (ne00 % 32 == 0 && AmxSupport::instance().bf16) mm.func16 = mul_mat_bf16_r16_bf16_amx;
+#endif
         return true;
     }
 
@@ -9614,6 +10258,9 @@ bool MulMat::prepare(int typeA, int typeB, int ne00, MulMat& mm, int Ny) {
             mm.funcs[7] = mul_mat_q8_k_r8_q8_k<8>;
 #ifdef HAVE_FANCY_SIMD
             mm.func16 = mul_mat_q8_k_r8_q8_k<16>;
+#endif
+#if defined HAVE_AMX && defined __AMX_INT8__
+            if (AmxSupport::instance().int8) mm.func16 = mul_mat_q8_k_r8_q8_k_amx;
 #endif
             expected_typeB = GGML_TYPE_Q8_KR8;
             break;
@@ -9709,6 +10356,9 @@ bool MulMat::prepare(int typeA, int typeB, int ne00, MulMat& mm, int Ny) {
             mm.funcs[7] = mul_mat_q4_0_r8_q8_2<8>;
 #ifdef HAVE_FANCY_SIMD
             mm.func16 = mul_mat_q4_0_r8_q8_2<16>;
+#endif
+#if defined HAVE_AMX && defined __AMX_INT8__
+            if (AmxSupport::instance().int8) mm.func16 = mul_mat_q4_0_r8_q8_2_amx;
 #endif
             expected_typeB = GGML_TYPE_Q8_2_X4;
             break;
@@ -9746,6 +10396,9 @@ bool MulMat::prepare(int typeA, int typeB, int ne00, MulMat& mm, int Ny) {
             mm.funcs[5] = mul_mat_q8_0_r8_q8_2<6>;
             mm.funcs[6] = mul_mat_q8_0_r8_q8_2<7>;
             mm.funcs[7] = mul_mat_q8_0_r8_q8_2<8>;
+#if defined HAVE_AMX && defined __AMX_INT8__
+            if (AmxSupport::instance().int8) mm.func16 = mul_mat_q8_0_r8_q8_2_amx;
+#endif
             expected_typeB = GGML_TYPE_Q8_2_X4;
             break;
         case GGML_TYPE_IQ1_S:
@@ -14484,6 +15137,286 @@ void mul_mat_q8_0_r8_q8_0(int n, const void * vx, size_t bx, const DataInfo& inf
     }
 }
 
+#ifdef HAVE_SVE
+// SVE kernels, for any vector length. The _r8 kernels work on 256 bits at a time, 4 quants from each of the 8 rows
+// of an _r8 block: with 128-bit vectors rows 0...3 and 4...7 are done in two passes, longer vectors only use their
+// first 256 bits. The IQK kernels unpack a QK_K block to int8 with NEON and step through it one vector at a time.
+// They replace the NEON kernels when the CPU has SVE, GGML_NO_SVE keeps the NEON ones (e.g. to compare the two).
+struct SveSupport {
+    bool available = false;
+    SveSupport() {
+        if (getenv("GGML_NO_SVE")) return;
+#ifdef IQK_SVE_TARGET
+        available = getauxval(AT_HWCAP) & HWCAP_SVE;
+#else
+        available = true;
+#endif
+    }
+    static const SveSupport& instance() {
+        static SveSupport support;
+        return support;
+    }
+};
+
+#ifdef IQK_SVE_TARGET
+#if defined __clang__
+#pragma clang attribute push(__attribute__((target("sve"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("+sve")
+#endif
+#endif
+
+// The number of bytes of a group of 4 quants of the 8 rows (32 bytes) that a pass over an _r8 block handles.
+inline int iqk_sve_r8_step() { const int vl = svcntb(); return vl < 32 ? vl : 32; }
+
+// One block of 8 interleaved rows (Q8_0_R8 layout: 32 bytes per group of 4 quants, 4 bytes per row), or of the
+// 4 rows starting at qx with 128-bit vectors.
+inline svint32_t q8_0_r8_dot_sve(svbool_t pg, const int8_t * qx, const int8_t * qy) {
+    auto y1 = svld1rq_s8(pg, qy);
+    auto y2 = svld1rq_s8(pg, qy+16);
+    auto sumi = svdup_n_s32(0);
+    sumi = svdot_lane_s32(sumi, svld1_s8(pg, qx+  0), y1, 0);
+    sumi = svdot_lane_s32(sumi, svld1_s8(pg, qx+ 32), y1, 1);
+    sumi = svdot_lane_s32(sumi, svld1_s8(pg, qx+ 64), y1, 2);
+    sumi = svdot_lane_s32(sumi, svld1_s8(pg, qx+ 96), y1, 3);
+    sumi = svdot_lane_s32(sumi, svld1_s8(pg, qx+128), y2, 0);
+    sumi = svdot_lane_s32(sumi, svld1_s8(pg, qx+160), y2, 1);
+    sumi = svdot_lane_s32(sumi, svld1_s8(pg, qx+192), y2, 2);
+    sumi = svdot_lane_s32(sumi, svld1_s8(pg, qx+224), y2, 3);
+    return sumi;
+}
+
+inline svfloat32_t load_r8_scales_sve(svbool_t pg, const ggml_half * d) {
+    return svcvt_f32_f16_x(pg, svreinterpret_f16_u32(svld1uh_u32(pg, (const uint16_t *)d)));
+}
+
+struct Q8_0_R8_SveUnpacker {
+    Q8_0_R8_SveUnpacker(const void * vx, size_t bx) : cx((const char *)vx), bx(bx) {}
+    inline void new_row(int ix) { iq8 = (const block_q8_0_r8 *)(cx + ix*bx); }
+    inline const int8_t * prepare(int ib, int8_t *) const { return iq8[ib].qs; }
+    inline const ggml_half * scales(int ib) const { return iq8[ib].d; }
+
+    const char * cx;
+    const size_t bx;
+    const block_q8_0_r8 * iq8;
+};
+
+struct Q4_0_R8_SveUnpacker {
+    Q4_0_R8_SveUnpacker(const void * vx, size_t bx) : cx((const char *)vx), bx(bx) {}
+    inline void new_row(int ix) { iq4 = (const block_iq4_nl_r8 *)(cx + ix*bx); }
+    // The low nibbles of each 32 byte chunk j hold quants 4j...4j+3 of the 8 rows, the high nibbles
+    // quants 16+4j...16+4j+3, so unpacking to int8 gives the Q8_0_R8 layout.
+    inline const int8_t * prepare(int ib, int8_t * qx) const {
+        for (int k = 0; k < 128; k += svcntb()) {
+            auto pg = svwhilelt_b8(k, 128);
+            auto bits = svld1_u8(pg, iq4[ib].qs + k);
+            svst1_s8(pg, qx + k +   0, svsub_n_s8_x(pg, svreinterpret_s8_u8(svand_n_u8_x(pg, bits, 0xf)), 8));
+            svst1_s8(pg, qx + k + 128, svsub_n_s8_x(pg, svreinterpret_s8_u8(svlsr_n_u8_x(pg, bits, 4)), 8));
+        }
+        return qx;
+    }
+    inline const ggml_half * scales(int ib) const { return iq4[ib].d; }
+
+    const char * cx;
+    const size_t bx;
+    const block_iq4_nl_r8 * iq4;
+};
+
+template <typename Unpacker, int nrc_y>
+void mul_mat_qx_r8_q8_0_sve(int n, const void * vx, size_t bx, const DataInfo& info, int nrc_x) {
+    GGML_ASSERT(nrc_x%8 == 0);
+    Q8<nrc_y, block_q8_0_x4> q8(info);
+    Unpacker deq(vx, bx);
+    const int nb = n / QK8_0;
+    const int step = iqk_sve_r8_step();
+    const auto pg  = svwhilelt_b8 (0, step);
+    const auto pgf = svwhilelt_b32(0, step/4);
+    int8_t aux[256];
+    float  acc[8*nrc_y];
+    for (int ix = 0; ix < nrc_x; ix += 8) {
+        deq.new_row(ix);
+        std::memset(acc, 0, sizeof(acc));
+        for (int ib = 0; ib < nb; ++ib) {
+            auto qx = deq.prepare(ib, aux);
+            // h is the first byte of the rows of the pass within a group, so the rows are h/4...h/4+step/4-1
+            for (int h = 0; h < 32; h += step) {
+                auto scales = load_r8_scales_sve(pgf, deq.scales(ib) + h/4);
+                for (int iy = 0; iy < nrc_y; ++iy) {
+                    const int8_t * qy;
+                    float dy;
+                    if (ib < 4*(nb/4)) {
+                        qy = q8.y[iy][ib/4].qs + 32*(ib%4);
+                        dy = GGML_FP16_TO_FP32(q8.y[iy][ib/4].d[ib%4]);
+                    } else {
+                        auto y = (const block_q8_0 *)q8.y[iy];
+                        qy = y[ib].qs;
+                        dy = GGML_FP16_TO_FP32(y[ib].d);
+                    }
+                    auto sumi = q8_0_r8_dot_sve(pg, qx + h, qy);
+                    auto a = svld1_f32(pgf, acc + 8*iy + h/4);
+                    svst1_f32(pgf, acc + 8*iy + h/4, svmla_f32_x(pgf, a, svmul_n_f32_x(pgf, scales, dy), svcvt_f32_s32_x(pgf, sumi)));
+                }
+            }
+        }
+        for (int iy = 0; iy < nrc_y; ++iy) {
+            for (int k = 0; k < 8; ++k) info.store(ix+k, iy, acc[8*iy+k]);
+        }
+    }
+}
+
+// The non-interleaved IQK quants: prepare() unpacks a QK_K block to the int8 values of the non-linear table and sets
+// the scale of each group of 4 quants. The table index of a quant includes the offset ("extra") of its sub-block.
+inline void iqk_sve_lookup_16(const int8x16x2_t& values, uint8x16_t idx, int32_t ls, int8_t * qx, int32_t * scales) {
+    vst1q_s8(qx, vqtbl2q_s8(values, idx));
+    vst1q_s32(scales, vdupq_n_s32(ls));
+}
+
+struct SveDequantizerIQ4KS final : public BaseDequantizer<block_iq4_ks, true> {
+    SveDequantizerIQ4KS(const void * vx, size_t bx, int nrc) : BaseDequantizer(vx, bx, nrc) {}
+    inline float prepare(int i, const int8x16x2_t& values, int8_t * qx, int32_t * scales) const {
+        const auto m4 = vdupq_n_u8(0xf);
+        for (int ib = 0; ib < QK_K/32; ++ib) {
+            const int32_t ls = (x[i].scales[ib] & 254) - 127;
+            const auto ex = vdupq_n_u8((x[i].scales[ib] & 1) << 4);
+            const auto bits = vld1q_u8(x[i].qs + 16*ib);
+            iqk_sve_lookup_16(values, vorrq_u8(vandq_u8(bits, m4), ex), ls, qx + 32*ib +  0, scales + 8*ib + 0);
+            iqk_sve_lookup_16(values, vorrq_u8(vshrq_n_u8(bits, 4), ex), ls, qx + 32*ib + 16, scales + 8*ib + 4);
+        }
+        return d;
+    }
+    static inline const int8_t * values() { return iq4k_values; }
+    constexpr static int num_values() { return 32; }
+};
+
+struct SveDequantizerIQ4K final : public BaseDequantizer<block_iq4_k> {
+    SveDequantizerIQ4K(const void * vx, size_t bx, int nrc) : BaseDequantizer(vx, bx, nrc) {}
+    inline float prepare(int i, const int8x16x2_t& values, int8_t * qx, int32_t * scales) const {
+        const auto m4 = vdupq_n_u8(0xf);
+        uint16_t extra = x[i].extra;
+        for (int ib = 0; ib < QK_K/32; ++ib) {
+            const uint8_t sh = x[i].scales_h[ib/2] >> 4*(ib%2);
+            const int32_t ls1 = ((x[i].scales_l[ib] & 0xf) | ((sh << 4) & 0x30)) - 32;
+            const int32_t ls2 = ((x[i].scales_l[ib] >>  4) | ((sh << 2) & 0x30)) - 32;
+            const auto bits = vld1q_u8(x[i].qs + 16*ib);
+            iqk_sve_lookup_16(values, vorrq_u8(vandq_u8(bits, m4), vdupq_n_u8((extra & 1) << 4)), ls1, qx + 32*ib +  0, scales + 8*ib + 0);
+            iqk_sve_lookup_16(values, vorrq_u8(vshrq_n_u8(bits, 4), vdupq_n_u8((extra & 2) << 3)), ls2, qx + 32*ib + 16, scales + 8*ib + 4);
+            extra >>= 2;
+        }
+        return GGML_FP16_TO_FP32(x[i].d);
+    }
+    static inline const int8_t * values() { return iq4k_values; }
+    constexpr static int num_values() { return 32; }
+};
+
+struct SveDequantizerIQ2K final : public BaseDequantizer<block_iq2_k> {
+    SveDequantizerIQ2K(const void * vx, size_t bx, int nrc) : BaseDequantizer(vx, bx, nrc) {}
+    inline float prepare(int i, const int8x16x2_t& values, int8_t * qx, int32_t * scales) const {
+        const auto m3 = vdupq_n_u8(3);
+        uint16_t extra = x[i].extra;
+        for (int ib = 0; ib < QK_K/32; ++ib) {
+            const int32_t ls1 = (x[i].scales[ib] & 0xf) - 8;
+            const int32_t ls2 = (x[i].scales[ib] >>  4) - 8;
+            // 32 bytes of bits hold 4 sub-blocks of 32 quants, 2 bits each
+            auto bits1 = vld1q_u8(x[i].qs + 32*(ib/4) +  0);
+            auto bits2 = vld1q_u8(x[i].qs + 32*(ib/4) + 16);
+            const auto shift = vdupq_n_s8(-2*(ib%4));
+            bits1 = vandq_u8(vshlq_u8(bits1, shift), m3);
+            bits2 = vandq_u8(vshlq_u8(bits2, shift), m3);
+            iqk_sve_lookup_16(values, vorrq_u8(bits1, vdupq_n_u8((extra & 1) << 2)), ls1, qx + 32*ib +  0, scales + 8*ib + 0);
+            iqk_sve_lookup_16(values, vorrq_u8(bits2, vdupq_n_u8((extra & 2) << 1)), ls2, qx + 32*ib + 16, scales + 8*ib + 4);
+            extra >>= 2;
+        }
+        return GGML_FP16_TO_FP32(x[i].d);
+    }
+    static inline const int8_t * values() { return iq2nl_values; }
+    constexpr static int num_values() { return 8; }
+};
+
+struct SveDequantizerIQ3K final : public BaseDequantizer<block_iq3_k> {
+    SveDequantizerIQ3K(const void * vx, size_t bx, int nrc) : BaseDequantizer(vx, bx, nrc) {}
+    inline float prepare(int i, const int8x16x2_t& values, int8_t * qx, int32_t * scales) const {
+        const auto m3 = vdupq_n_u8(3), m4 = vdupq_n_u8(4);
+        uint16_t extra = x[i].extra;
+        uint16_t sh = x[i].scales_h;
+        auto hbits1 = vld1q_u8(x[i].qh +  0);
+        auto hbits2 = vld1q_u8(x[i].qh + 16);
+        for (int ib = 0; ib < QK_K/32; ++ib) {
+            const int32_t ls1 = (2*(x[i].scales_l[ib] & 0xf) + 1) * (sh & 1 ? -1 : 1);
+            const int32_t ls2 = (2*(x[i].scales_l[ib] >>  4) + 1) * (sh & 2 ? -1 : 1);
+            auto bits1 = vld1q_u8(x[i].qs + 32*(ib/4) +  0);
+            auto bits2 = vld1q_u8(x[i].qs + 32*(ib/4) + 16);
+            const auto shift = vdupq_n_s8(-2*(ib%4));
+            bits1 = vorrq_u8(vandq_u8(vshlq_u8(bits1, shift), m3), vandq_u8(vshlq_n_u8(hbits1, 2), m4));
+            bits2 = vorrq_u8(vandq_u8(vshlq_u8(bits2, shift), m3), vandq_u8(vshlq_n_u8(hbits2, 2), m4));
+            hbits1 = vshrq_n_u8(hbits1, 1);
+            hbits2 = vshrq_n_u8(hbits2, 1);
+            iqk_sve_lookup_16(values, vorrq_u8(bits1, vdupq_n_u8((extra & 1) << 3)), ls1, qx + 32*ib +  0, scales + 8*ib + 0);
+            iqk_sve_lookup_16(values, vorrq_u8(bits2, vdupq_n_u8((extra & 2) << 2)), ls2, qx + 32*ib + 16, scales + 8*ib + 4);
+            extra >>= 2; sh >>= 2;
+        }
+        return GGML_FP16_TO_FP32(x[i].d);
+    }
+    static inline const int8_t * values() { return iq3nl_values; }
+    constexpr static int num_values() { return 16; }
+};
+
+template <typename Dequantizer, int nrc_y>
+void mul_mat_qX_K_q8_K_sve(int n, const void * vx, size_t bx, const DataInfo& info, int nrc_x) {
+    assert(n % QK_K == 0);
+    const int nb = n / QK_K;
+
+    Q8<nrc_y, block_q8_K> q8(info);
+
+    Dequantizer deq(vx, bx, nrc_y);
+
+    int8_t table[32] = {};
+    std::memcpy(table, Dequantizer::values(), Dequantizer::num_values());
+    const int8x16x2_t values = { vld1q_s8(table), vld1q_s8(table + 16) };
+
+    const int  vl   = svcntb();
+    const auto pt32 = svptrue_b32();
+
+    int8_t  qx[QK_K];
+    int32_t scales[QK_K/4];
+    float   acc[nrc_y];
+
+    for (int ix = 0; ix < nrc_x; ++ix) {
+
+        deq.new_row(ix);
+        for (int iy = 0; iy < nrc_y; ++iy) acc[iy] = 0;
+
+        for (int i = 0; i < nb; ++i) {
+
+            float d = deq.prepare(i, values, qx, scales);
+
+            for (int iy = 0; iy < nrc_y; ++iy) {
+                auto sumi = svdup_n_s32(0);
+                for (int j = 0; j < QK_K; j += vl) {
+                    // the lanes past the end of the block load as 0
+                    auto pg = svwhilelt_b8(j, QK_K);
+                    auto dot = svdot_s32(svdup_n_s32(0), svld1_s8(pg, qx + j), svld1_s8(pg, q8.y[iy][i].qs + j));
+                    sumi = svmla_s32_x(pt32, sumi, dot, svld1_s32(svwhilelt_b32(j/4, QK_K/4), scales + j/4));
+                }
+                acc[iy] += d*q8.scale(iy, i)*svaddv_s32(pt32, sumi);
+            }
+        }
+
+        for (int iy = 0; iy < nrc_y; ++iy) {
+            info.store(ix, iy, acc[iy]);
+        }
+    }
+}
+
+#ifdef IQK_SVE_TARGET
+#if defined __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif
+#endif // HAVE_SVE
+
 #define SET_MUL_MAT_FUNCTIONS_T(m, func, Dequantizer) \
             m.funcs[0] = func<Dequantizer, 1>;\
             m.funcs[1] = func<Dequantizer, 2>;\
@@ -14565,6 +15498,11 @@ bool MulMat::prepare(int typeA, int typeB, int ne00, MulMat& m, int /*Ny*/) {
             break;
         case GGML_TYPE_IQ4_KS:
             MulMat::set_functions<DequantizerIQ4KS>(m);
+#ifdef HAVE_SVE
+            if (SveSupport::instance().available) {
+                SET_MUL_MAT_FUNCTIONS_T(m, mul_mat_qX_K_q8_K_sve, SveDequantizerIQ4KS)
+            }
+#endif
             break;
         case GGML_TYPE_IQ4_KSS:
             MulMat::set_functions<DequantizerIQ4KSS>(m);
@@ -14574,6 +15512,11 @@ bool MulMat::prepare(int typeA, int typeB, int ne00, MulMat& m, int /*Ny*/) {
             break;
         case GGML_TYPE_IQ4_K:
             MulMat::set_functions<DequantizerIQ4K>(m);
+#ifdef HAVE_SVE
+            if (SveSupport::instance().available) {
+                SET_MUL_MAT_FUNCTIONS_T(m, mul_mat_qX_K_q8_K_sve, SveDequantizerIQ4K)
+            }
+#endif
             break;
         case GGML_TYPE_IQ5_K:
             MulMat::set_functions<DequantizerIQ5K>(m);
@@ -14583,9 +15526,19 @@ bool MulMat::prepare(int typeA, int typeB, int ne00, MulMat& m, int /*Ny*/) {
             break;
         case GGML_TYPE_IQ2_K:
             MulMat::set_functions<DequantizerIQ2K>(m);
+#ifdef HAVE_SVE
+            if (SveSupport::instance().available) {
+                SET_MUL_MAT_FUNCTIONS_T(m, mul_mat_qX_K_q8_K_sve, SveDequantizerIQ2K)
+            }
+#endif
             break;
         case GGML_TYPE_IQ3_K:
             MulMat::set_functions<DequantizerIQ3K>(m);
+#ifdef HAVE_SVE
+            if (SveSupport::instance().available) {
+                SET_MUL_MAT_FUNCTIONS_T(m, mul_mat_qX_K_q8_K_sve, SveDequantizerIQ3K)
+            }
+#endif
             break;
         case GGML_TYPE_IQ2_XXS:
             MulMat::set_functions<DequantizerIQ2XXS>(m);
@@ -14754,6 +15707,11 @@ bool MulMat::prepare(int typeA, int typeB, int ne00, MulMat& m, int /*Ny*/) {
             break;
         case GGML_TYPE_Q4_0_R8:
             SET_MUL_MAT_FUNCTIONS_T(m, mul_mat_qx_r8_q8_0, Q4_0_R8_Dequantizer);
+#ifdef HAVE_SVE
+            if (SveSupport::instance().available) {
+                SET_MUL_MAT_FUNCTIONS_T(m, mul_mat_qx_r8_q8_0_sve, Q4_0_R8_SveUnpacker)
+            }
+#endif
             expected_Btype = GGML_TYPE_Q8_0_X4;
             break;
         case GGML_TYPE_Q5_0_R4:
@@ -14766,6 +15724,11 @@ bool MulMat::prepare(int typeA, int typeB, int ne00, MulMat& m, int /*Ny*/) {
             break;
         case GGML_TYPE_Q8_0_R8:
             SET_MUL_MAT_FUNCTIONS(m, mul_mat_q8_0_r8_q8_0);
+#ifdef HAVE_SVE
+            if (SveSupport::instance().available) {
+                SET_MUL_MAT_FUNCTIONS_T(m, mul_mat_qx_r8_q8_0_sve, Q8_0_R8_SveUnpacker)
+            }
+#endif
             expected_Btype = GGML_TYPE_Q8_0_X4;
             break;
         default:
@@ -15310,24 +16273,52 @@ struct HelperQ80R8 : public BaseHelper<step> {
     constexpr static int block_size_q = QK8_0;
     using block_q8 = block_q8_0;
 #endif
-    HelperQ80R8(int nk, const HelperQ80<D, step>& q8) : Base(q8.data, q8.stride) {
-        r4 = repack(nk, q8);
+    // With stream, only the step rows of the current block are repacked, by reset_block() and next_block(), instead of
+    // all nk rows up front (MLA token generation, where that would be an extra pass over the cache on every call).
+    HelperQ80R8(int nk, const HelperQ80<D, step>& q8, bool stream = false) : Base(q8.data, q8.stride) {
+        if (stream) {
+            src = q8.data;
+            src_stride = q8.stride;
+            n_step = nk/step;
+            r4.resize((D/QK8_0)*step/8);
+        } else {
+            r4 = repack(nk, q8);
+        }
         Base::data = (const char *)r4.data();
         Base::stride = (D/QK8_0)*sizeof(block_q8_0);
     }
 
+    inline void reset_block() {
+        Base::reset_block();
+        if (src) {
+            i_step = 0;
+            repack(step, src, src_stride, r4.data());
+        }
+    }
+    inline void next_block() {
+        if (!src) {
+            Base::next_block();
+        } else if (++i_step < n_step) {
+            repack(step, src + i_step*step*src_stride, src_stride, r4.data());
+        }
+    }
+
     static std::vector<block_q8_0_r8> repack(int nk, const HelperQ80<D, step>& q8) {
+        std::vector<block_q8_0_r8> result((D/QK8_0) * nk/8);
+        repack(nk, q8.data, q8.stride, result.data());
+        return result;
+    }
+
+    static void repack(int nk, const char * data, int stride, block_q8_0_r8 * y) {
         static_assert(D%QK8_0 == 0);
         GGML_ASSERT(nk%8 == 0);
         constexpr int nblock = D/QK8_0;
-        std::vector<block_q8_0_r8> result(nblock * nk/8);
-        auto y = result.data();
         const block_q8_0 * x8[8];
 #ifdef __ARM_NEON
         int8x16x2_t m0, m1, m2, m3;
 #endif
         for (int row = 0; row < nk; row += 8) {
-            for (int k = 0; k < 8; ++k) x8[k] = (const block_q8_0 *)(q8.data + (row + k)*q8.stride);
+            for (int k = 0; k < 8; ++k) x8[k] = (const block_q8_0 *)(data + (row + k)*stride);
             for (int ib = 0; ib < nblock; ++ib) {
                 for (int k = 0; k < 8; ++k) y[ib].d[k] = x8[k][ib].d;
 #ifdef __AVX2__
@@ -15409,10 +16400,11 @@ struct HelperQ80R8 : public BaseHelper<step> {
             }
             y += nblock;
         }
-        return result;
     }
 
     std::vector<block_q8_0_r8> r4;
+    const char * src = nullptr;
+    int src_stride = 0, n_step = 0, i_step = 0;
 };
 
 // TODO: unite this with the above
@@ -15427,24 +16419,51 @@ struct HelperQ8KVR8 : public BaseHelper<step> {
         int8_t qs[8*D];
     };
 
-    HelperQ8KVR8(int nk, const HelperQ8KV<D, step>& q8) : Base(q8.data, q8.stride) {
-        r4 = repack(nk, q8);
+    // stream: see HelperQ80R8
+    HelperQ8KVR8(int nk, const HelperQ8KV<D, step>& q8, bool stream = false) : Base(q8.data, q8.stride) {
+        if (stream) {
+            src = q8.data;
+            src_stride = q8.stride;
+            n_step = nk/step;
+            r4.resize(step/8);
+        } else {
+            r4 = repack(nk, q8);
+        }
         Base::data = (const char *)r4.data();
         Base::stride = sizeof(block_q8_KV_r8)/8;
     }
 
+    inline void reset_block() {
+        Base::reset_block();
+        if (src) {
+            i_step = 0;
+            repack(step, src, src_stride, r4.data());
+        }
+    }
+    inline void next_block() {
+        if (!src) {
+            Base::next_block();
+        } else if (++i_step < n_step) {
+            repack(step, src + i_step*step*src_stride, src_stride, r4.data());
+        }
+    }
+
     static std::vector<block_q8_KV_r8> repack(int nk, const HelperQ8KV<D, step>& q8) {
+        std::vector<block_q8_KV_r8> result(nk/8);
+        repack(nk, q8.data, q8.stride, result.data());
+        return result;
+    }
+
+    static void repack(int nk, const char * data, int stride, block_q8_KV_r8 * y) {
         static_assert(D%32 == 0);
         GGML_ASSERT(nk%8 == 0);
-        std::vector<block_q8_KV_r8> result(nk/8);
-        auto y = result.data();
 #ifdef __ARM_NEON
         int8x16x2_t m0, m1, m2, m3;
 #endif
         const int8_t * x8[8];
         for (int ix = 0; ix < nk/8; ++ix) {
             for (int k = 0; k < 8; ++k) {
-                auto dptr = (const float *)(q8.data + (8*ix + k)*q8.stride);
+                auto dptr = (const float *)(data + (8*ix + k)*stride);
                 y[ix].d[k] = dptr[0];
                 x8[k] = (const int8_t *)(dptr + 2);
             }
@@ -15505,10 +16524,11 @@ struct HelperQ8KVR8 : public BaseHelper<step> {
 #endif
             }
         }
-        return result;
     }
 
     std::vector<block_q8_KV_r8> r4;
+    const char * src = nullptr;
+    int src_stride = 0, n_step = 0, i_step = 0;
 };
 
 template <int D, int step>
@@ -17362,6 +18382,136 @@ inline bool iqk_deepseek_helper(ggml_type type_k,
     return false;
 }
 
+
+// the q rows converted for the K*Q product: quantized for the quantized caches, as is for fp16
+template <typename KHelper, bool is_q> struct MLAQBlock {
+    using type = float;
+    static constexpr int row_size = 576;
+};
+template <typename KHelper> struct MLAQBlock<KHelper, true> {
+    using type = typename KHelper::block_q8;
+    static constexpr int row_size = 576/KHelper::block_size_q;
+};
+
+// MLA token generation: every head has a single q row, and all heads attend to the same rows of the latent cache,
+// which hold K = [c^KV, k_rope] (576) and, as its first 512 elements, V = c^KV. FlashAttn processes q_step heads at a
+// time and streams the cache once per q_step heads. Here the loops are swapped: for each k_step cache rows, the KQ,
+// softmax and V accumulation of all heads is done while the rows are still in the cache, so the cache is read from
+// memory once. The state of each q_step heads is kept in its own FlashMS/FlashQKV.
+template <int q_step, int k_step, typename KHelper, typename VHelper>
+void compute_mla_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, int stride_qkv,
+        float scale, float softcap, const float * q, const char * mask, float * qkv, float * M, float * S) {
+    constexpr int Dk = 576, Dv = 512;
+    using KQHelper = FlashQKfp32<Dk, q_step, k_step>;
+
+    const int n_group = (nq1 + q_step - 1)/q_step;
+
+    std::vector<FlashMS<q_step, k_step>>      fms(n_group, FlashMS<q_step, k_step>(scale, softcap));
+    std::vector<FlashQKV<Dv, q_step, k_step>> fqkv(n_group);
+
+    constexpr bool is_q = !std::is_same_v<KHelper, HelperF16<Dk, k_step>>;
+    using q_block_t = typename MLAQBlock<KHelper, is_q>::type;
+    constexpr int q_row_size = MLAQBlock<KHelper, is_q>::row_size;
+    std::vector<q_block_t> q_conv;
+#ifdef __aarch64__
+    std::vector<float16_t> q_f16;
+#endif
+
+    if constexpr (is_q) {
+        q_conv.resize(nq1*q_row_size);
+        for (int g = 0; g < n_group; ++g) {
+            const int nq = std::min(q_step, nq1 - g*q_step);
+            HelperQ80<Dk, QK8_0>::convert(nq, stride_q, q + g*q_step*stride_q, q_conv.data() + g*q_step*q_row_size);
+        }
+    } else {
+#ifdef __aarch64__
+        q_f16.resize(nq1*Dk);
+        for (int g = 0; g < n_group; ++g) {
+            const int nq = std::min(q_step, nq1 - g*q_step);
+            KQHelper::convert(nq, stride_q, q + g*q_step*stride_q, q_f16.data() + g*q_step*Dk);
+        }
+#endif
+    }
+
+    for (auto & f : fms) f.init_qstep();
+    kh.reset_block();
+    vh.reset_block();
+
+    auto mr = mask;
+    for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+        for (int g = 0; g < n_group; ++g) {
+            const int nq = std::min(q_step, nq1 - g*q_step);
+            // all heads use the same mask row
+            if constexpr (is_q) {
+                auto qg = q_conv.data() + g*q_step*q_row_size;
+                if (nq == q_step) KQHelper::mul_mask_kq(kh, 0, qg, mr, fms[g]);
+                else KQHelper::mul_mask_kq(nq, kh, 0, qg, mr, fms[g]);
+            } else {
+#ifdef __aarch64__
+                auto qg = q_f16.data() + g*q_step*Dk;
+                if (nq == q_step) KQHelper::multiply_mask_kq(kh, Dk, 0, qg, mr, fms[g]);
+                else KQHelper::multiply_mask_kq(nq, kh, Dk, 0, qg, mr, fms[g]);
+#else
+                auto qg = q + g*q_step*stride_q;
+                if (nq == q_step) KQHelper::multiply_mask_kq(kh, stride_q, 0, qg, mr, fms[g]);
+                else KQHelper::multiply_mask_kq(nq, kh, stride_q, 0, qg, mr, fms[g]);
+#endif
+            }
+            if (nq == q_step) fqkv[g].accumulate_qkv(vh, fms[g]);
+            else fqkv[g].accumulate_qkv(nq, vh, fms[g]);
+        }
+        kh.next_block();
+        vh.next_block();
+        mr += k_step*sizeof(ggml_half);
+    }
+
+    for (int g = 0; g < n_group; ++g) {
+        const int nq = std::min(q_step, nq1 - g*q_step);
+        auto Mg = M ? M + g*q_step : nullptr;
+        auto Sg = S ? S + g*q_step : nullptr;
+        fqkv[g].normalize_and_store(fms[g], nq, stride_qkv, qkv + g*q_step*stride_qkv, Mg, Sg);
+    }
+}
+
+template <int step_k>
+inline bool iqk_mla_helper(ggml_type type_kv, int nq1, int nk1, int stride_q, int stride_kv, int stride_qkv,
+                        const float * q, const char * kv, const char * mask,
+                        float scale, float softcap, float * qkv, float * M, float * S) {
+    if (type_kv == GGML_TYPE_Q8_0) {
+        HelperQ80<576, step_k> kh(kv, stride_kv);
+        HelperQ80<512, step_k> vh(kv, stride_kv);
+        if (nq1 >= 8) {
+            HelperQ80R8<576, step_k> khr8(nk1, kh, /* stream */ true);
+            compute_mla_helper<8, step_k>(khr8, vh, nq1, nk1, stride_q, stride_qkv, scale, softcap, q, mask, qkv, M, S);
+        } else {
+            compute_mla_helper<1, step_k>(kh, vh, nq1, nk1, stride_q, stride_qkv, scale, softcap, q, mask, qkv, M, S);
+        }
+        return true;
+    }
+    if (type_kv == GGML_TYPE_Q8_KV) {
+        HelperQ8KV<576, step_k> kh(kv, stride_kv);
+        HelperQ8KV<512, step_k> vh(kv, stride_kv);
+        if (nq1 >= 8) {
+            HelperQ8KVR8<576, step_k> khr8(nk1, kh, /* stream */ true);
+            compute_mla_helper<8, step_k>(khr8, vh, nq1, nk1, stride_q, stride_qkv, scale, softcap, q, mask, qkv, M, S);
+        } else {
+            compute_mla_helper<1, step_k>(kh, vh, nq1, nk1, stride_q, stride_qkv, scale, softcap, q, mask, qkv, M, S);
+        }
+        return true;
+    }
+    if (type_kv == GGML_TYPE_F16) {
+        HelperF16<576, step_k> kh(kv, stride_kv);
+        HelperF16<512, step_k> vh(kv, stride_kv);
+        if (nq1 >= 8) {
+            compute_mla_helper<8, step_k>(kh, vh, nq1, nk1, stride_q, stride_qkv, scale, softcap, q, mask, qkv, M, S);
+        } else {
+            compute_mla_helper<1, step_k>(kh, vh, nq1, nk1, stride_q, stride_qkv, scale, softcap, q, mask, qkv, M, S);
+        }
+        return true;
+    }
+    return false;
+}
+
 }
 
 #include "iqk_flash_impl.h"
@@ -17496,12 +18646,45 @@ bool iqk_flash_attn_impl(int int_type_k,         // type of k
     return true;
 }
 
+bool iqk_flash_attn_mla_supported(int int_type_kv) {
+    auto type_kv = ggml_type(int_type_kv);
+    return type_kv == GGML_TYPE_Q8_0 || type_kv == GGML_TYPE_Q8_KV || type_kv == GGML_TYPE_F16;
+}
+
+bool iqk_flash_attn_mla(int int_type_kv,        // type of the latent cache
+                        int nq1,                // number of heads (one q row each)
+                        int nk1,                // number of cache rows
+                        int stride_q,           // distance between the q rows of the heads in bytes
+                        int stride_kv,          // distance between cache rows in bytes
+                        int stride_qkv,         // distance between the result rows of the heads in floats
+                        const float * q,        // q = [q_nope*wk_b, q_rope], 576 x nq1
+                        const void  * kv,       // cache rows [c^KV, k_rope], K is the whole row, V its first 512 elements
+                        const void  * mask,     // fp16 mask row, shared by all heads
+                        float         scale,    // scale applied before softmax
+                        float         softcap,  // if > 0, a "soft-cap" operation is applied before softmax
+                        float       * qkv,      // v*softmax(scale*(k*q)), 512 x nq1
+                        float * M, float * S) {
+
+    if (!mask || nk1%32 != 0) return false;
+
+    return iqk_mla_helper<32>(ggml_type(int_type_kv), nq1, nk1, stride_q/int(sizeof(float)), stride_kv, stride_qkv,
+            q, (const char *)kv, (const char *)mask, scale, softcap, qkv, M, S);
+}
+
 #else  // IQK_IMPLEMENT
 
 bool iqk_mul_mat(int, long, long, long, int, const void *, long, int, const void *, long, float *, long, int, int) {
     return false;
 }
 
+int iqk_mul_mat_row_step(long /*ne00*/, int /*typeA*/, int /*typeB*/) {
+    return 0;
+}
+
+int iqk_mul_mat_tile(long /*ne00*/, int /*typeA*/, int /*typeB*/, long /*Ny*/) {
+    return 0;
+}
+
 bool iqk_mul_mat_4d(long /*Nx*/, long /*Ny*/, long /*ne00*/,
         long /*ne02*/, long /*ne03*/, long /*ne12*/, long /*ne13*/,
         long /*nb02*/, long /*nb03*/, long /*nb12*/, long /*nb13*/, long /*nb2*/, long /*nb3*/,
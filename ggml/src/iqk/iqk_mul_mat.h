@@ -16,6 +16,40 @@ bool iqk_mul_mat(long Nx, long Ny, long ne00,
         int typeB, const void * B, long strideB,
         float * C, long stride_C, int ith, int nth);
 
+// Number of rows of A that are processed together (> 1 for the row-interleaved _R4/_R8/_R16 types),
+// Nx is split between ith/nth in multiples of it. Returns 0 if there is no kernel for the type pair.
+int iqk_mul_mat_row_step(long ne00, int typeA, int typeB);
+
+// Number of columns of B that the kernel selected for Ny columns processes at once (the nrc_y tile).
+// Returns 0 if there is no kernel for the type pair.
+int iqk_mul_mat_tile(long ne00, int typeA, int typeB, long Ny);
+
+// Tile configuration of iqk_mul_mat for a matrix shape, found by iqk_tune_mul_mat:
+//   x_step     - rows of A per block of the x loop
+//   ny         - max. number of columns of B per kernel call (0 - no limit)
+//   chunk_rows - smallest chunk of rows of A that keeps the single thread throughput when the rows are split into chunks
+struct iqk_mm_config {
+    int x_step;
+    int ny;
+    int chunk_rows;
+};
+
+// Benchmarks the candidate tile configurations of A*B for Ny columns of B on the rows of A one of nth threads gets
+// (using the data of A, B is random), and installs the fastest for the shape. The configuration is used by iqk_mul_mat
+// for this Nx, ne00, typeA, typeB and any Ny of the same class (1, 2...15, >= 16). Does not benchmark again if the shape
+// is already tuned. Returns false if there is no kernel for the type pair.
+bool iqk_tune_mul_mat(long Nx, long Ny, long ne00, int typeA, const void * A, long strideA, int typeB, int nth,
+        struct iqk_mm_config * config);
+
+// The tuned chunk_rows for the shape and number of threads, 0 if it has not been tuned.
+int iqk_mul_mat_chunk_rows(long Nx, long Ny, long ne00, int typeA, int typeB, int nth);
+
+// Reads/writes the tuned configurations from/to a text file. The file records the CPU model, the entries of a file
+// written on a different CPU model are not loaded (iqk_tune_load returns false). Entries that do not parse, or whose
+// configuration is not valid for the kernels of this build, are skipped.
+bool iqk_tune_load(const char * fname);
+bool iqk_tune_save(const char * fname);
+
 bool iqk_mul_mat_4d(long Nx, long Ny, long ne00,
         long ne02, long ne03, long ne12, long ne13,
         long nb02, long nb03, long nb12, long nb13, long nb2, long nb3,
@@ -60,6 +94,10 @@ bool iqk_flash_attn_noalibi(int type_q, int type_mask, float max_bias,
                             void * work_buffer, barrier_t barrier, void * barrier_data,
                             int ith, int nth);
 
+// Number of slices the KV length is split into by iqk_flash_attn_noalibi (1 = no split).
+// When > 1, the work buffer must hold n_split*neq2*(Dv + 16) floats.
+int iqk_flash_attn_split_k(int neq3, int neq2, int nek3, int nek2, int nev2, int neq1, int nek1, int nth);
+
 #ifdef __cplusplus
 }
 #endif
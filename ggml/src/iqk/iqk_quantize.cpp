@@ -6945,6 +6945,10 @@ int iqk_repacked_type(const struct ggml_tensor * tensor) {
 }
 
 void iqk_repack_tensor(struct ggml_tensor * tensor) {
+    iqk_repack_tensor_nthread(tensor, 0);
+}
+
+void iqk_repack_tensor_nthread(struct ggml_tensor * tensor, int max_thread) {
     constexpr int kChunk = 8;
     if (!tensor) return;
     if (!ggml_is_contiguous(tensor)) return;
@@ -6959,7 +6963,7 @@ void iqk_repack_tensor(struct ggml_tensor * tensor) {
 
     auto nrows = ggml_nrows(tensor);
 
-    int max_thread = std::max(1, int(std::thread::hardware_concurrency()/2));
+    if (max_thread <= 0) max_thread = std::max(1, int(std::thread::hardware_concurrency()/2));
     int num_chunks = (nrows + kChunk*r.num_rows - 1)/(kChunk*r.num_rows);
     int nthread = std::min(num_chunks, max_thread);
 
@@ -322,6 +322,12 @@ extern "C" {
         ggml_backend_buffer_type_t buft;
     };
 
+    // the K and V cache tensors whose name (cache_k_l%d, cache_v_l%d) matches the pattern use this type
+    struct llama_kv_cache_type_override {
+        const char * pattern;
+        enum ggml_type type;
+    };
+
     struct llama_model_params {
         int32_t n_gpu_layers; // number of layers to store in VRAM
         enum llama_split_mode split_mode; // how to split the model across multiple GPUs
@@ -351,13 +357,26 @@ extern "C" {
 
         const struct llama_model_tensor_buft_override * tensor_buft_overrides;
 
+        // directory of the run-time repack cache (NULL = no cache): with repack_tensors, the repacked model is written
+        // there on the first load and memory mapped on later loads
+        const char * repack_cache;
+
+        // name of the POSIX shared memory segment of the model (NULL = none, linux only): the first process publishes the
+        // loaded (and repacked) model there, the others with the same parameters map it read-only and share its pages
+        const char * shm_model;
+
+        // with expert_paging, the most used experts are locked in RAM up to this many MiB (0 = none)
+        uint32_t expert_pin_mb;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
         bool repack_tensors;// repack if available
-        bool use_thp;       // uase transparent huge pages (linux only)
+        bool use_thp;       // use huge pages for the weights, the KV cache and the compute buffers (linux only)
+        bool fused_qkv;     // merge wq, wk, wv into a single tensor at load time (LLaMA, Qwen2, Gemma; disables mmap)
+        bool expert_paging; // count, prefetch and pin the routed experts of MoE models (for mmap with less RAM than the model)
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -370,6 +389,8 @@ extern "C" {
         uint32_t n_seq_max;         // max number of sequences (i.e. distinct states for recurrent models)
         uint32_t n_threads;         // number of threads to use for generation
         uint32_t n_threads_batch;   // number of threads to use for batch processing
+        int32_t  poll;              // polling level of the CPU thread pool (0 - no polling, 100 - aggressive polling), < 0 - no persistent thread pool (default)
+        const bool * cpu_mask;      // CPU affinity of the thread pool threads (GGML_MAX_N_THREADS entries), NULL - no affinity
 
         enum llama_rope_scaling_type rope_scaling_type; // RoPE scaling type, from `enum llama_rope_scaling_type`
         enum llama_pooling_type      pooling_type;      // whether to pool (sum) embedding results by sequence id
@@ -384,6 +405,11 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t defrag_max_cells; // move at most this many KV cells per defragmentation step, the next steps continue, 0 = no limit (default)
+        uint32_t kv_block_size;    // hand out KV cells to the sequences in blocks of this size, 0 = contiguous ring (default)
+        uint32_t kv_budget;        // evict the KV cells with the least attention from the sequences with more cells, 0 = disabled (default)
+        uint32_t kv_budget_sink;   // the first cells of a sequence are never evicted
+        uint32_t kv_budget_recent; // the last cells of a sequence are never evicted
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -391,14 +417,23 @@ extern "C" {
         enum ggml_type type_k; // data type for K cache [EXPERIMENTAL]
         enum ggml_type type_v; // data type for V cache [EXPERIMENTAL]
 
+        // per layer K/V cache types, the first matching pattern wins, terminated by a NULL pattern (NULL = none)
+        const struct llama_kv_cache_type_override * kv_type_overrides;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool logits_all;  // the llama_decode() call computes all logits, not just the last one (DEPRECATED - set llama_batch.logits instead)
         bool embeddings;  // if true, extract embeddings (together with logits)
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
+        bool cpu_strict;  // pin each thread pool thread to a single CPU from cpu_mask
+        bool dep_barriers; // only synchronize the CPU threads between graph nodes that depend on each other
+        bool graph_reuse;  // keep the graph of a single token decode and replay it for the next tokens (CPU only)
+        bool defrag_async; // move the KV data of the defragmentation steps on a separate thread, from the end of llama_decode until the next graph computes (host KV cache only)
+        bool profile;      // record a per-op profile of the graphs computed on the CPU, see llama_get_profile()
         int  mla_attn;    // whether to use MLA attention [EXPERIMENTAL]
         int  attn_max_batch;    // maximum batch size for attention computations [EXPERIMENTAL]
         bool fused_moe_up_gate; // whether to use fused MoE up/down op [EXPERIMENTAL]
+        bool fused_attn_out;    // fuse the attention output projection with the residual add (CPU)
         int  min_experts;
         float thresh_experts;
 
@@ -698,6 +733,9 @@ extern "C" {
     // Returns the number of used KV cells (i.e. have at least one sequence assigned to them)
     LLAMA_API int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx);
 
+    // Returns the size of the blocks in which KV cells are handed out to the sequences, 0 if the cache is a contiguous ring
+    LLAMA_API uint32_t llama_get_kv_cache_block_size(const struct llama_context * ctx);
+
     // Clear the KV cache - both cell info is erased and KV data is zeroed
     LLAMA_API void llama_kv_cache_clear(
             struct llama_context * ctx);
@@ -923,6 +961,16 @@ extern "C" {
     // Get the number of threads used for prompt and batch processing (multiple token).
     LLAMA_API uint32_t llama_n_threads_batch(struct llama_context * ctx);
 
+    // Pause/resume the persistent CPU thread pool of the context (no-op without one)
+    // A paused pool does not spin while waiting for work. It is resumed automatically by the next llama_decode()
+    LLAMA_API void llama_pause_threadpool (struct llama_context * ctx);
+    LLAMA_API void llama_resume_threadpool(struct llama_context * ctx);
+
+    // Autotune the CPU (iqk) matmul tile and row chunk configurations for the weight shapes of the model, for token
+    // generation with n_threads and for batches of up to n_ubatch tokens with n_threads_batch. If cache_file is not
+    // NULL, configurations found there for this CPU model are used without benchmarking and the results are saved to it.
+    LLAMA_API void llama_iqk_tune(struct llama_context * ctx, const char * cache_file);
+
     // Set whether the model is in embeddings mode or not
     // If true, embeddings will be returned but logits will not
     LLAMA_API void llama_set_embeddings(struct llama_context * ctx, bool embeddings);
@@ -1255,6 +1303,10 @@ extern "C" {
     LLAMA_API void llama_print_timings(struct llama_context * ctx);
     LLAMA_API void llama_reset_timings(struct llama_context * ctx);
 
+    // Per-op profile of the CPU backend (NULL unless llama_context_params.profile is set)
+    // Print it with ggml_profile_print(), write it with ggml_profile_write() and clear it with ggml_profile_reset()
+    LLAMA_API struct ggml_profile * llama_get_profile(struct llama_context * ctx);
+
     // Print system information
     LLAMA_API const char * llama_print_system_info(void);
 
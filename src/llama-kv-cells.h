@@ -0,0 +1,367 @@
+#pragma once
+
+#include "llama-impl.h"
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <set>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//
+// The cells of the KV cache, stored as a structure of arrays.
+//
+// The sequences a cell belongs to are kept in a 64-bit mask. Sequence ids outside [0, 64) are rare (n_seq_max is
+// usually small), they spill into a per-cell set. The free cells (pos < 0) are tracked in a two-level bitmap, so
+// finding room for a batch only looks at the cells it is going to use plus one bit per 64 cells elsewhere.
+//
+
+struct llama_kv_cells {
+    static constexpr int n_seq_bits = 64;
+
+    uint32_t size() const { return (uint32_t) pos_.size(); }
+
+    // all cells become free
+    void resize(uint32_t n) {
+        pos_.assign(n, -1);
+        delta_.assign(n, 0);
+        src_.assign(n, 0);
+        score_.assign(n, 0.0f);
+        seq_.assign(n, 0);
+        spill_.clear();
+
+        const uint32_t n_words = (n + 63)/64;
+        used_.assign(n_words, 0);
+        if (n%64) {
+            // the bits past the end are marked as used, so they are never handed out
+            used_.back() = ~0ull << (n%64);
+        }
+        full_.assign((n_words + 63)/64, 0);
+        if (n_words%64) {
+            full_.back() = ~0ull << (n_words%64);
+        }
+        for (uint32_t w = 0; w < n_words; ++w) update_full(w);
+    }
+
+    void clear() {
+        resize(size());
+    }
+
+    llama_pos pos  (uint32_t i) const { return pos_[i]; }
+    llama_pos delta(uint32_t i) const { return delta_[i]; }
+    int32_t   src  (uint32_t i) const { return src_[i]; }
+    float     score(uint32_t i) const { return score_[i]; }
+
+    // a cell that comes into use starts with a zero score
+    void set_pos(uint32_t i, llama_pos p) {
+        const bool was_used = pos_[i] >= 0;
+        pos_[i] = p;
+        if (was_used != (p >= 0)) {
+            used_[i/64] ^= 1ull << (i%64);
+            update_full(i/64);
+            score_[i] = 0.0f;
+        }
+    }
+    void set_delta(uint32_t i, llama_pos d) { delta_[i] = d; }
+    void set_src  (uint32_t i, int32_t   s) { src_[i]   = s; }
+    void add_score(uint32_t i, float     s) { score_[i] += s; }
+
+    // the cell is reset to its initial state (free, no sequences)
+    void reset(uint32_t i) {
+        set_pos(i, -1);
+        delta_[i] = 0;
+        src_[i]   = 0;
+        seq_clear(i);
+    }
+
+    // the meta data of cell i_src moves to i_dst, i_src becomes free
+    void move(uint32_t i_dst, uint32_t i_src) {
+        set_pos(i_dst, pos_[i_src]);
+        delta_[i_dst] = delta_[i_src];
+        src_[i_dst]   = src_[i_src];
+        score_[i_dst] = score_[i_src];
+        seq_[i_dst]   = seq_[i_src];
+        spill_.erase(i_dst);
+        auto it = spill_.find(i_src);
+        if (it != spill_.end()) {
+            spill_[i_dst] = std::move(it->second);
+            spill_.erase(it);
+        }
+        seq_[i_src] = 0;
+        reset(i_src);
+    }
+
+    //
+    // sequences of a cell
+    //
+
+    bool has_seq_id(uint32_t i, llama_seq_id id) const {
+        if (0 <= id && id < n_seq_bits) {
+            return (seq_[i] >> id) & 1;
+        }
+        if (spill_.empty()) return false;
+        auto it = spill_.find(i);
+        return it != spill_.end() && it->second.count(id);
+    }
+
+    bool is_empty(uint32_t i) const {
+        return !seq_[i] && (spill_.empty() || spill_.find(i) == spill_.end());
+    }
+
+    bool is_same_seq(uint32_t i, uint32_t j) const {
+        if (seq_[i] != seq_[j]) return false;
+        if (spill_.empty()) return true;
+        auto it_i = spill_.find(i);
+        auto it_j = spill_.find(j);
+        if (it_i == spill_.end() || it_j == spill_.end()) return it_i == it_j;
+        return it_i->second == it_j->second;
+    }
+
+    uint32_t seq_count(uint32_t i) const {
+        uint32_t n = popcount(seq_[i]);
+        if (!spill_.empty()) {
+            auto it = spill_.find(i);
+            if (it != spill_.end()) n += it->second.size();
+        }
+        return n;
+    }
+
+    void seq_add(uint32_t i, llama_seq_id id) {
+        if (0 <= id && id < n_seq_bits) {
+            seq_[i] |= 1ull << id;
+        } else {
+            spill_[i].insert(id);
+        }
+    }
+
+    void seq_rm(uint32_t i, llama_seq_id id) {
+        if (0 <= id && id < n_seq_bits) {
+            seq_[i] &= ~(1ull << id);
+        } else if (!spill_.empty()) {
+            auto it = spill_.find(i);
+            if (it != spill_.end()) {
+                it->second.erase(id);
+                if (it->second.empty()) spill_.erase(it);
+            }
+        }
+    }
+
+    void seq_clear(uint32_t i) {
+        seq_[i] = 0;
+        if (!spill_.empty()) spill_.erase(i);
+    }
+
+    // calls f(seq_id) for the sequences of cell i in ascending order
+    template <typename F>
+    void seq_for_each(uint32_t i, F f) const {
+        auto it = spill_.empty() ? spill_.end() : spill_.find(i);
+        if (it != spill_.end()) {
+            for (auto id : it->second) if (id < 0) f(id);
+        }
+        for (uint64_t bits = seq_[i]; bits; bits &= bits - 1) {
+            f((llama_seq_id) ctz(bits));
+        }
+        if (it != spill_.end()) {
+            for (auto id : it->second) if (id >= n_seq_bits) f(id);
+        }
+    }
+
+    //
+    // free cells
+    //
+
+    // index of the first free cell >= i0, size() if there is none
+    uint32_t find_free(uint32_t i0) const {
+        const uint32_t n = size();
+        if (i0 >= n) return n;
+        uint32_t w = i0/64;
+        uint64_t free_bits = ~used_[w] & (~0ull << (i0%64));
+        if (free_bits) return w*64 + ctz(free_bits);
+        // skip the words without free cells using the second level
+        ++w;
+        for (uint32_t l = w/64; l < full_.size(); ++l) {
+            uint64_t not_full = ~full_[l];
+            if (l == w/64) not_full &= ~0ull << (w%64);
+            if (not_full) {
+                const uint32_t wf = l*64 + ctz(not_full);
+                return wf*64 + ctz(~used_[wf]);
+            }
+        }
+        return n;
+    }
+
+    // index of the first used cell >= i0 and < i1, i1 if there is none
+    uint32_t find_used(uint32_t i0, uint32_t i1) const {
+        for (uint32_t w = i0/64; w*64 < i1; ++w) {
+            uint64_t used_bits = used_[w];
+            if (w == i0/64) used_bits &= ~0ull << (i0%64);
+            if (used_bits) {
+                const uint32_t i = w*64 + ctz(used_bits);
+                return i < i1 ? i : i1;
+            }
+        }
+        return i1;
+    }
+
+    // first i >= i0 such that the cells [i, i + n) are free, size() if there is none
+    uint32_t find_free_range(uint32_t i0, uint32_t n) const {
+        const uint32_t n_cells = size();
+        while (true) {
+            const uint32_t i = find_free(i0);
+            if (i + n > n_cells) return n_cells;
+            const uint32_t j = find_used(i, i + n);
+            if (j == i + n) return i;
+            i0 = j + 1;
+        }
+    }
+
+    bool range_is_free(uint32_t i0, uint32_t i1) const {
+        return find_used(i0, i1) == i1;
+    }
+
+    // one past the last cell that is in use, 0 if the cache is empty
+    uint32_t used_max() const {
+        for (uint32_t w = used_.size(); w > 0; --w) {
+            uint64_t used_bits = used_[w-1];
+            if (w == used_.size() && size()%64) used_bits &= ~(~0ull << (size()%64));
+            for (; used_bits; ) {
+                const uint32_t i = (w-1)*64 + 63 - clz(used_bits);
+                if (!is_empty(i)) return i + 1;
+                used_bits &= ~(1ull << (i%64));
+            }
+        }
+        return 0;
+    }
+
+    //
+    // whole cache operations on the cells of a sequence (seq_id < 0 - all sequences)
+    // they return the number of cells that became free and the index of the first of them in first_freed
+    //
+
+    uint32_t remove_seq(llama_seq_id seq_id, llama_pos p0, llama_pos p1, uint32_t & first_freed) {
+        uint32_t n_freed = 0;
+        first_freed = size();
+        const bool bit = 0 <= seq_id && seq_id < n_seq_bits;
+        const uint64_t mask = bit ? 1ull << seq_id : 0;
+        for (uint32_t i = 0; i < size(); ++i) {
+            if (bit && !(seq_[i] & mask)) continue;
+            if (pos_[i] < p0 || pos_[i] >= p1) continue;
+            if (seq_id < 0) {
+                seq_clear(i);
+            } else if (bit) {
+                seq_[i] &= ~mask;
+            } else if (has_seq_id(i, seq_id)) {
+                seq_rm(i, seq_id);
+            } else {
+                continue;
+            }
+            if (is_empty(i)) {
+                if (pos_[i] >= 0) ++n_freed;
+                set_pos(i, -1);
+                if (first_freed == size()) first_freed = i;
+            }
+        }
+        return n_freed;
+    }
+
+    void copy_seq(llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+        for (uint32_t i = 0; i < size(); ++i) {
+            if (pos_[i] >= p0 && pos_[i] < p1 && has_seq_id(i, seq_id_src)) {
+                seq_add(i, seq_id_dst);
+            }
+        }
+    }
+
+    // first_freed is the first cell that does not belong to seq_id, free or not
+    uint32_t keep_seq(llama_seq_id seq_id, uint32_t & first_freed) {
+        uint32_t n_freed = 0;
+        first_freed = size();
+        for (uint32_t i = 0; i < size(); ++i) {
+            if (!has_seq_id(i, seq_id)) {
+                if (pos_[i] >= 0) ++n_freed;
+                set_pos(i, -1);
+                seq_clear(i);
+                if (first_freed == size()) first_freed = i;
+            } else {
+                seq_clear(i);
+                seq_add(i, seq_id);
+            }
+        }
+        return n_freed;
+    }
+
+    llama_pos seq_pos_max(llama_seq_id seq_id) const {
+        llama_pos result = 0;
+        for (uint32_t i = 0; i < size(); ++i) {
+            if (pos_[i] > result && has_seq_id(i, seq_id)) {
+                result = pos_[i];
+            }
+        }
+        return result;
+    }
+
+    // row of the causal KQ mask for a token of sequence seq_id at position pos:
+    // 0 for the cells in [0, n) the token attends to, -INFINITY for the rest
+    void mask_row(llama_seq_id seq_id, llama_pos pos, uint32_t n, float * row) const {
+        if (0 <= seq_id && seq_id < n_seq_bits) {
+            const uint64_t mask = 1ull << seq_id;
+            for (uint32_t i = 0; i < n; ++i) {
+                row[i] = (seq_[i] & mask) && pos_[i] <= pos ? 0.0f : -INFINITY;
+            }
+        } else {
+            for (uint32_t i = 0; i < n; ++i) {
+                row[i] = has_seq_id(i, seq_id) && pos_[i] <= pos ? 0.0f : -INFINITY;
+            }
+        }
+    }
+
+private:
+    std::vector<llama_pos> pos_;
+    std::vector<llama_pos> delta_;
+    std::vector<int32_t>   src_;   // used by recurrent state models to copy states
+    std::vector<float>     score_; // accumulated attention to the cell, used by the KV budget
+    std::vector<uint64_t>  seq_;   // bit s is set if the cell belongs to sequence s < n_seq_bits
+    std::map<uint32_t, std::set<llama_seq_id>> spill_; // sequences outside [0, n_seq_bits)
+
+    std::vector<uint64_t> used_;   // bit i%64 of word i/64 is set if pos[i] >= 0
+    std::vector<uint64_t> full_;   // bit w%64 of word w/64 is set if all cells of used_[w] are in use
+
+    void update_full(uint32_t w) {
+        if (used_[w] == ~0ull) {
+            full_[w/64] |=   1ull << (w%64);
+        } else {
+            full_[w/64] &= ~(1ull << (w%64));
+        }
+    }
+
+    static uint32_t ctz(uint64_t x) {
+#ifdef _MSC_VER
+        unsigned long r;
+        _BitScanForward64(&r, x);
+        return r;
+#else
+        return __builtin_ctzll(x);
+#endif
+    }
+    static uint32_t clz(uint64_t x) {
+#ifdef _MSC_VER
+        unsigned long r;
+        _BitScanReverse64(&r, x);
+        return 63 - r;
+#else
+        return __builtin_clzll(x);
+#endif
+    }
+    static uint32_t popcount(uint64_t x) {
+#ifdef _MSC_VER
+        return (uint32_t) __popcnt64(x);
+#else
+        return __builtin_popcountll(x);
+#endif
+    }
+};
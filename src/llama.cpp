@@ -9,6 +9,7 @@
 #include "llama-vocab.h"
 #include "llama-grammar.h"
 #include "llama-sampling.h"
+#include "llama-kv-cells.h"
 
 #include "unicode.h"
 
@@ -74,6 +75,13 @@
     #include <io.h>
 #endif
 
+#include <sys/stat.h>
+
+#ifdef __linux__
+    #include <dirent.h>
+    #include <sys/file.h>
+#endif
+
 #if __cplusplus >= 202000L
     #define LU8(x) (const char*)(u8##x)
 #else
@@ -106,6 +114,7 @@
 #include <set>
 #include <sstream>
 #include <thread>
+#include <tuple>
 #include <type_traits>
 #include <unordered_map>
 #include <regex>
@@ -118,6 +127,12 @@
 #define LLAMA_MAX_LAYERS  512
 #define LLAMA_MAX_EXPERTS 256  // DeepSeekV2
 
+// the attention of the last tokens of a batch to the KV cells is accumulated into the cell scores for the KV budget
+#define LLAMA_KV_SCORE_N_OBS 32
+// with flash attention it costs an extra F32 K*Q and softmax over all the cells, so of the token generation
+// ubatches only one in LLAMA_KV_SCORE_TG_PERIOD is observed (all the prompt ubatches are)
+#define LLAMA_KV_SCORE_TG_PERIOD 16
+
 //
 // helpers
 //
@@ -1751,6 +1766,27 @@ public:
         } ;
     }
 
+    // reads at the given offset, can be called from several threads at once (the file position is not used)
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED ov = {};
+            ov.Offset     = DWORD((offset + bytes_read) & 0xffffffff);
+            ov.OffsetHigh = DWORD((uint64_t(offset + bytes_read)) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &ov);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read < chunk_size || chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -1838,6 +1874,25 @@ public:
         }
     }
 
+    // reads at the given offset, can be called from several threads at once (the file position is not used)
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        const int fd = fileno(fp);
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = pread(fd, (char *) ptr + bytes_read, len - bytes_read, (off_t) (offset + bytes_read));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+            bytes_read += ret;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -1899,7 +1954,15 @@ struct llama_mmap {
             auto size = huge*((file->size + huge - 1)/huge);
             addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
             if (addr != MAP_FAILED) {
-                printf("%s: using THP with page size %zu MiB ", __func__, huge/(1024*1024));
+                mapped_page_size = huge;
+            } else {
+                // not enough pages in the hugetlbfs pool: use an anonymous mapping aligned to the huge page size and
+                // advised for transparent huge pages instead
+                fprintf(stderr, "%s: mmap with huge page size %zu MiB failed (%s), using transparent huge pages\n", __func__, huge/(1024*1024), strerror(errno));
+                addr = map_thp(file->size, huge);
+            }
+            if (addr != MAP_FAILED) {
+                printf("%s: using %s huge pages of %zu MiB ", __func__, mapped_page_size > 0 ? "hugetlbfs" : "transparent", huge/(1024*1024));
                 fflush(stdout);
                 size_t tot = 0;
                 while (tot < file->size) {
@@ -1910,12 +1973,9 @@ struct llama_mmap {
                 }
                 printf(" done\n");
                 mapped_fragments.emplace_back(0, file->size);
-                mapped_page_size = huge;
                 return;
             }
-            else {
-                fprintf(stderr, "%s: mmap with huge page size %zu MiB failed (%s)\n", __func__, huge/(1024*1024), strerror(errno));
-            }
+            fprintf(stderr, "%s: anonymous mmap of %zu bytes failed (%s)\n", __func__, file->size, strerror(errno));
         }
 #endif
         addr = mmap(NULL, file->size, PROT_READ, flags, fd, 0);
@@ -2004,6 +2064,24 @@ struct llama_mmap {
     }
 
 #ifdef __linux__
+    // anonymous mapping of size bytes that starts at a multiple of huge, advised for transparent huge pages
+    static void * map_thp(size_t size, size_t huge) {
+        size = GGML_PAD(size, sysconf(_SC_PAGESIZE));
+        char * base = (char *) mmap(nullptr, size + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return MAP_FAILED;
+        }
+        char * aligned = (char *) GGML_PAD((uintptr_t) base, huge);
+        if (aligned > base) {
+            munmap(base, aligned - base);
+        }
+        munmap(aligned + size, base + huge - aligned);
+        if (madvise(aligned, size, MADV_HUGEPAGE)) {
+            LLAMA_LOG_WARN("warning: madvise(.., MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+        }
+        return aligned;
+    }
+
     static int get_default_huge_page_size() {
         int pg_size = 2048;
         std::ifstream in("/proc/meminfo");
@@ -2027,7 +2105,10 @@ struct llama_mmap {
 
     ~llama_mmap() {
         for (const auto & frag : mapped_fragments) {
-            if (munmap((char *) addr + frag.first, frag.second - frag.first)) {
+            // hugetlbfs mappings can only be unmapped in whole huge pages
+            size_t len = frag.second - frag.first;
+            if (mapped_page_size > 0) len = GGML_PAD(len, mapped_page_size);
+            if (munmap((char *) addr + frag.first, len)) {
                 LLAMA_LOG_WARN("warning: munmap failed: %s\n", strerror(errno));
             }
         }
@@ -2283,7 +2364,7 @@ static std::string llama_token_to_piece(const struct llama_model * model, llama_
     return piece;
 }
 
-static ggml_backend_buffer_type_t llama_default_buffer_type_cpu(bool host_buffer) {
+static ggml_backend_buffer_type_t llama_default_buffer_type_cpu(bool host_buffer, bool huge_pages = false) {
     ggml_backend_buffer_type_t buft = nullptr;
 
 #if defined(GGML_USE_CUDA)
@@ -2304,7 +2385,7 @@ static ggml_backend_buffer_type_t llama_default_buffer_type_cpu(bool host_buffer
 #endif
 
     if (buft == nullptr) {
-        buft = ggml_backend_cpu_buffer_type();
+        buft = huge_pages ? ggml_backend_cpu_huge_buffer_type() : ggml_backend_cpu_buffer_type();
     }
     return buft;
 
@@ -2631,6 +2712,12 @@ struct llama_cparams {
     float yarn_beta_fast;
     float yarn_beta_slow;
     float defrag_thold;
+    uint32_t defrag_max_cells;
+    bool     defrag_async;
+    uint32_t kv_block_size;
+    uint32_t kv_budget;
+    uint32_t kv_budget_sink;
+    uint32_t kv_budget_recent;
 
     bool embeddings;
     bool causal_attn;
@@ -2639,8 +2726,10 @@ struct llama_cparams {
     int  mla_attn;
     int  attn_max_batch;
     bool fused_moe_up_gate;
+    bool fused_attn_out;
     int  min_experts;
     float thresh_experts;
+    bool graph_reuse;
 
     enum llama_pooling_type pooling_type;
 
@@ -2771,24 +2860,11 @@ struct llama_layer {
     std::unique_ptr<ggml_tensor> computed_wv_b;
 };
 
-struct llama_kv_cell {
-    llama_pos pos   = -1;
-    llama_pos delta = 0;
-    int32_t   src   = 0; // used by recurrent state models to copy states
-
-    std::set<llama_seq_id> seq_id;
-
-    bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
-    }
-
-    bool is_empty() const {
-        return seq_id.empty();
-    }
-
-    bool is_same_seq(const llama_kv_cell & other) const {
-        return seq_id == other.seq_id;
-    }
+// a range of consecutive cells that receives consecutive tokens of the batch being evaluated
+struct llama_kv_run {
+    uint32_t i_token;
+    uint32_t i_cell;
+    uint32_t n;
 };
 
 // ring-buffer of cached KV data
@@ -2806,13 +2882,25 @@ struct llama_kv_cache {
     uint32_t size = 0;
     uint32_t used = 0; // used cells (i.e. at least one seq_id)
 
+    // the cells [shift_lo, shift_hi) contain all the cells with a pending K-shift, only they are rotated
+    uint32_t shift_lo = 0;
+    uint32_t shift_hi = 0;
+
     // computed before each graph build
     uint32_t n = 0;
 
     ggml_type type_k = GGML_TYPE_F16;
     ggml_type type_v = GGML_TYPE_F16;
 
-    std::vector<llama_kv_cell> cells;
+    llama_kv_cells cells;
+
+    // paged layout: the cells are handed out to the sequences in blocks of block_size cells, so the tokens
+    // of a batch do not need a contiguous range of free cells. Attention still covers cells [0, n), the KQ
+    // mask takes care of which cells belong to which sequence.
+    uint32_t block_size = 0; // 0 - contiguous ring
+    std::vector<llama_seq_id> block_seq; // the sequence a block was last handed out to, -1 if never
+    std::map<llama_seq_id, std::vector<uint32_t>> seq_blocks; // per sequence block table
+    std::vector<llama_kv_run> runs; // where the tokens of the current batch go, empty if [head, head + n_tokens)
 
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
@@ -2938,6 +3026,12 @@ struct llama_model {
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
+    // the CPU buffers (weights that are not memory mapped, KV cache, compute buffers) use huge pages
+    bool use_thp = false;
+
+    // the registry of the paged experts (params.expert_paging)
+    struct ggml_expert_paging * expert_paging = nullptr;
+
     int64_t t_load_us = 0;
     int64_t t_start_us = 0;
 
@@ -2945,6 +3039,8 @@ struct llama_model {
     std::set<struct llama_lora_adapter *> lora_adapters;
 
     ~llama_model() {
+        // unlocks the experts, before the weights go
+        ggml_expert_paging_free(expert_paging);
         for (struct ggml_context * ctx : ctxs) {
             ggml_free(ctx);
         }
@@ -2962,6 +3058,28 @@ struct llama_model {
     }
 };
 
+// The graph of a single token decode, kept to be replayed for the next tokens. Apart from the inputs, the only
+// thing that changes from token to token is where the new K and V are stored in the cache, so the views of the
+// cache that are the destinations of these copies are patched for the new kv_self.head. The graph is rebuilt
+// when anything else changes (most often kv_self.n, which grows in steps of the KV cache padding).
+struct llama_graph_cache {
+    struct ggml_cgraph * gf = nullptr; // lives in buf_compute_meta, so building any other graph invalidates it
+
+    uint32_t n_kv       = 0;
+    int32_t  n_outputs  = 0;
+    bool     embd_inp   = false;
+    bool     warmup     = false;
+    bool     kq_observe = false;
+
+    // the views of the KV cache that the new K and V are copied into, and their offset per KV cell
+    std::vector<std::pair<struct ggml_tensor *, size_t>> kv_views;
+
+    void reset() {
+        gf = nullptr;
+        kv_views.clear();
+    }
+};
+
 struct llama_context {
     llama_context(const llama_model & model)
         : model(model)
@@ -2970,12 +3088,19 @@ struct llama_context {
         , t_load_us(model.t_load_us) {}
 
     ~llama_context() {
+        if (defrag_worker.joinable()) {
+            defrag_worker.join();
+        }
+
         ggml_backend_sched_free(sched);
 
         for (ggml_backend_t backend : backends) {
             ggml_backend_free(backend);
         }
 
+        ggml_threadpool_free(threadpool);
+        ggml_profile_free(profile);
+
         ggml_backend_buffer_free(buf_output);
     }
 
@@ -2999,6 +3124,13 @@ struct llama_context {
 #endif
     ggml_backend_t backend_cpu = nullptr;
 
+    // persistent CPU threads, sized for max(n_threads, n_threads_batch)
+    ggml_threadpool * threadpool = nullptr;
+    ggml_threadpool_params threadpool_params;
+
+    // see llama_context_params.profile
+    ggml_profile * profile = nullptr;
+
     bool has_evaluated_once = false;
 
     int64_t t_start_us;
@@ -3045,6 +3177,13 @@ struct llama_context {
     std::vector<uint8_t> buf_compute_meta;
     ggml_backend_sched_t sched = nullptr;
 
+    // see cparams.graph_reuse
+    llama_graph_cache graph_cache;
+
+    // see cparams.defrag_async: copies the KV data of a defrag step between two llama_decode graphs
+    std::thread           defrag_worker;
+    std::vector<uint32_t> defrag_ids; // the moves of the step, read by defrag_worker
+
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
@@ -3065,6 +3204,12 @@ struct llama_context {
     struct ggml_tensor * inp_embd_enc;      // F32 [n_embd, n_outputs_enc]
     struct ggml_tensor * inp_KQ_mask_cross; // F32 [n_outputs_enc, n_batch]
     struct ggml_tensor * inp_scale = nullptr; // F32 [n_tokens]
+
+    // output of the graph for the KV budget
+    struct ggml_tensor * kq_score = nullptr; // F32 [n_kv], the attention the last tokens of the batch give to the cells
+    std::vector<float>   buf_kq_score;
+    bool     kq_observe = true; // whether the graph of the ubatch observes the attention (true for the worst case graph)
+    uint32_t n_kq_tg    = 0;    // token generation ubatches, for LLAMA_KV_SCORE_TG_PERIOD
 };
 
 struct llama_lora_weight {
@@ -3157,7 +3302,7 @@ static ggml_backend_buffer_type_t llama_default_buffer_type_offload(const llama_
 #endif
 
     if (buft == nullptr) {
-        buft = llama_default_buffer_type_cpu(true);
+        buft = llama_default_buffer_type_cpu(true, model.use_thp);
     }
     return buft;
     GGML_UNUSED(model);
@@ -3230,13 +3375,26 @@ static size_t llama_get_device_memory(const llama_model & model, int device) {
 // kv cache helpers
 //
 
+// the type of the K or V cache tensor name: the type of the first override whose pattern matches, type otherwise
+static ggml_type llama_kv_cache_tensor_type(const llama_kv_cache_type_override * overrides, const char * name, ggml_type type) {
+    if (overrides) {
+        for (const auto * override = overrides; override->pattern != nullptr; ++override) {
+            if (std::regex_search(name, std::regex(override->pattern))) {
+                return override->type;
+            }
+        }
+    }
+    return type;
+}
+
 static bool llama_kv_cache_init(
-             struct llama_kv_cache & cache,
-               const llama_context * ctx,
-                         ggml_type   type_k,
-                         ggml_type   type_v,
-                          uint32_t   kv_size,
-                              bool   offload) {
+                     struct llama_kv_cache & cache,
+                       const llama_context * ctx,
+                                 ggml_type   type_k,
+                                 ggml_type   type_v,
+        const llama_kv_cache_type_override * type_overrides,
+                                  uint32_t   kv_size,
+                                      bool   offload) {
     const llama_model & model = ctx->model;
     const llama_cparams & cparams = ctx->cparams;
 
@@ -3245,6 +3403,8 @@ static bool llama_kv_cache_init(
     const int64_t  n_layer = hparams.n_layer;
 
     cache.has_shift = false;
+    cache.shift_lo  = 0;
+    cache.shift_hi  = 0;
 
     // TODO: find a nicer way to add other recurrent model architectures
     cache.recurrent = model.arch == LLM_ARCH_MAMBA;
@@ -3257,13 +3417,26 @@ static bool llama_kv_cache_init(
     cache.type_k  = type_k;
     cache.type_v  = type_v;
 
-    cache.cells.clear();
     cache.cells.resize(kv_size);
 
+    cache.block_size = 0;
+    cache.block_seq.clear();
+    cache.seq_blocks.clear();
+    cache.runs.clear();
+    if (cparams.kv_block_size > 0) {
+        if (cache.recurrent || cparams.mla_attn) {
+            LLAMA_LOG_WARN("%s: paged KV cache is not supported with recurrent models or MLA, using a contiguous cache\n", __func__);
+        } else {
+            cache.block_size = std::min(cparams.kv_block_size, kv_size);
+            cache.block_seq.resize((kv_size + cache.block_size - 1)/cache.block_size, -1);
+            LLAMA_LOG_INFO("%s: paged KV cache with %d blocks of %u cells\n", __func__, (int) cache.block_seq.size(), cache.block_size);
+        }
+    }
+
     if (cache.recurrent) {
         // init state copy sources
         for (uint32_t i = 0; i < cache.size; ++i) {
-            cache.cells[i].src = i;
+            cache.cells.set_src(i, i);
         }
     }
 
@@ -3274,7 +3447,7 @@ static bool llama_kv_cache_init(
             buft_layer_count[model.buft_layer[i].buft]++;
         }
     } else {
-        buft_layer_count[llama_default_buffer_type_cpu(true)] = n_layer;
+        buft_layer_count[llama_default_buffer_type_cpu(true, model.use_thp)] = n_layer;
     }
 
     // create a context for each buffer type
@@ -3343,10 +3516,27 @@ static bool llama_kv_cache_init(
             n_mla++;
         }
         else {
-            k = ggml_new_tensor_2d(ctx, type_k, n_embd_head_k, n_head_kv*kv_size);
-            v = ggml_new_tensor_1d(ctx, type_v, n_embd_v_gqa*kv_size);
-            ggml_format_name(k, "cache_k_l%d", i);
-            ggml_format_name(v, "cache_v_l%d", i);
+            char name_k[GGML_MAX_NAME];
+            char name_v[GGML_MAX_NAME];
+            snprintf(name_k, sizeof(name_k), "cache_k_l%d", i);
+            snprintf(name_v, sizeof(name_v), "cache_v_l%d", i);
+            const ggml_type type_k_l = llama_kv_cache_tensor_type(type_overrides, name_k, type_k);
+            const ggml_type type_v_l = llama_kv_cache_tensor_type(type_overrides, name_v, type_v);
+            if (type_k_l != type_k || type_v_l != type_v) {
+                LLAMA_LOG_INFO("%s: layer %d: K type %s, V type %s\n", __func__, i, ggml_type_name(type_k_l), ggml_type_name(type_v_l));
+            }
+            if (hparams.n_embd_head_k % ggml_blck_size(type_k_l) != 0 || hparams.n_embd_head_v % ggml_blck_size(type_v_l) != 0) {
+                LLAMA_LOG_ERROR("%s: layer %d: the head size is not a multiple of the block size of the K or V cache type\n", __func__, i);
+                return false;
+            }
+            if (type_v_l != GGML_TYPE_F16 && type_v_l != GGML_TYPE_BF16 && !cparams.flash_attn) {
+                LLAMA_LOG_ERROR("%s: layer %d: V cache quantization requires flash_attn\n", __func__, i);
+                return false;
+            }
+            k = ggml_new_tensor_2d(ctx, type_k_l, n_embd_head_k, n_head_kv*kv_size);
+            v = ggml_new_tensor_1d(ctx, type_v_l, n_embd_v_gqa*kv_size);
+            ggml_set_name(k, name_k);
+            ggml_set_name(v, name_v);
             cache.k_l.push_back(k);
             cache.v_l.push_back(v);
         }
@@ -3402,16 +3592,16 @@ static bool llama_kv_cache_find_slot(
                         min = seq_id;
                     }
                     // Assuming the tokens are in-order
-                    if (batch.pos[i] != cache.cells[seq_id].pos + 1) {
+                    if (batch.pos[i] != cache.cells.pos(seq_id) + 1) {
                         // What should happen when the pos backtracks or skips a value?
                         // Clearing the state mid-batch would require special-casing which isn't done.
                         LLAMA_LOG_WARN("%s: non-consecutive token position %d after %d for sequence %d\n",
-                            __func__, batch.pos[i], cache.cells[seq_id].pos, seq_id);
+                            __func__, batch.pos[i], cache.cells.pos(seq_id), seq_id);
                     }
-                    if (cache.cells[seq_id].pos < 0 && 0 <= batch.pos[i]) {
+                    if (cache.cells.pos(seq_id) < 0 && 0 <= batch.pos[i]) {
                         cache.used += 1;
                     }
-                    cache.cells[seq_id].pos = batch.pos[i];
+                    cache.cells.set_pos(seq_id, batch.pos[i]);
                     // NOTE: seq_ids are not inserted here; they are handled when the input tensors are set
                 } else {
                     // too big seq_id
@@ -3436,69 +3626,138 @@ static bool llama_kv_cache_find_slot(
         return false;
     }
 
-    uint32_t n_tested = 0;
+    // first free range at or after head, then from the beginning of the cache
+    uint32_t head = cache.cells.find_free_range(cache.head, n_tokens);
+    if (head == cache.size) {
+        head = cache.cells.find_free_range(0, n_tokens);
+    }
+    if (head == cache.size) {
+        //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+        return false;
+    }
+    cache.head = head;
+
+    for (uint32_t i = 0; i < n_tokens; i++) {
+        cache.cells.set_pos(cache.head + i, batch.pos[i]);
 
-    while (true) {
-        if (cache.head + n_tokens > cache.size) {
-            n_tested += cache.size - cache.head;
-            cache.head = 0;
-            continue;
+        for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
+            cache.cells.seq_add(cache.head + i, batch.seq_id[i][j]);
         }
+    }
 
-        bool found = true;
-        for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cache.cells[cache.head + i].pos >= 0) {
-                found = false;
-                cache.head += i + 1;
-                n_tested   += i + 1;
-                break;
+    cache.used += n_tokens;
+    cache.runs.clear();
+
+    return true;
+}
+
+// paged version of llama_kv_cache_find_slot: each token goes to the block its (first) sequence is currently
+// filling, a sequence without room in its last block gets the lowest empty block. If there is no empty block
+// left, any free cell is used. The resulting ranges of cells are recorded in cache.runs.
+static bool llama_kv_cache_find_slot_paged(
+           struct llama_kv_cache & cache,
+        const struct llama_batch & batch) {
+    const uint32_t n_tokens = batch.n_tokens;
+    const uint32_t bs       = cache.block_size;
+    const uint32_t n_blocks = cache.block_seq.size();
+
+    if (n_tokens > cache.size - cache.used) {
+        return false;
+    }
+
+    auto free_cell_in_block = [&cache, bs](uint32_t ib) -> int32_t {
+        const uint32_t i = cache.cells.find_free(ib*bs);
+        return i < std::min(cache.size, (ib + 1)*bs) ? (int32_t) i : -1;
+    };
+
+    std::vector<uint32_t> cell_ids(n_tokens);
+    std::set<llama_seq_id> pruned;
+
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        const llama_seq_id seq_id = batch.n_seq_id[i] > 0 ? batch.seq_id[i][0] : 0;
+
+        auto & blocks = cache.seq_blocks[seq_id];
+        if (pruned.insert(seq_id).second) {
+            // blocks that were emptied and handed out to another sequence in the meantime
+            blocks.erase(std::remove_if(blocks.begin(), blocks.end(),
+                        [&cache, seq_id](uint32_t ib) { return cache.block_seq[ib] != seq_id; }), blocks.end());
+        }
+
+        int32_t cell = blocks.empty() ? -1 : free_cell_in_block(blocks.back());
+        if (cell < 0) {
+            for (uint32_t j = cache.cells.find_free(0); j < cache.size; j = cache.cells.find_free((j/bs + 1)*bs)) {
+                const uint32_t ib = j/bs;
+                if (j == ib*bs && cache.cells.range_is_free(j, std::min(cache.size, j + bs))) {
+                    if (cache.block_seq[ib] != seq_id) {
+                        cache.block_seq[ib] = seq_id;
+                        blocks.push_back(ib);
+                    } else {
+                        // an emptied block of the same sequence becomes its last block
+                        auto it = std::find(blocks.begin(), blocks.end(), ib);
+                        if (it != blocks.end()) blocks.erase(it);
+                        blocks.push_back(ib);
+                    }
+                    cell = ib*bs;
+                    break;
+                }
             }
         }
-
-        if (found) {
-            break;
+        if (cell < 0) {
+            // no empty block left, take whatever is free
+            const uint32_t j = cache.cells.find_free(0);
+            if (j < cache.size) {
+                cell = j;
+            }
         }
-
-        if (n_tested >= cache.size) {
-            //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+        if (cell < 0) {
+            for (uint32_t j = 0; j < i; ++j) {
+                cache.cells.set_pos(cell_ids[j], -1);
+            }
             return false;
         }
-    }
 
-    for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
+        cell_ids[i] = cell;
+        cache.cells.set_pos(cell, batch.pos[i]);
+    }
 
+    cache.runs.clear();
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        const uint32_t cell = cell_ids[i];
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+            cache.cells.seq_add(cell, batch.seq_id[i][j]);
+        }
+        if (!cache.runs.empty() && cache.runs.back().i_cell + cache.runs.back().n == cell) {
+            ++cache.runs.back().n;
+        } else {
+            cache.runs.push_back({i, cell, 1});
         }
     }
 
+    cache.head  = cell_ids[0];
     cache.used += n_tokens;
 
+    if (cache.runs.size() == 1) {
+        // same as the contiguous case
+        cache.runs.clear();
+    }
+
     return true;
 }
 
 // find how many cells are currently in use
 static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
-    for (uint32_t i = cache.size; i > 0; --i) {
-        const llama_kv_cell & cell = cache.cells[i - 1];
-
-        if (cell.pos >= 0 && !cell.is_empty()) {
-            return i;
-        }
-    }
-
-    return 0;
+    return cache.cells.used_max();
 }
 
 static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
-    for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
-        cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
-    }
+    cache.cells.clear();
     cache.head = 0;
     cache.used = 0;
 
+    std::fill(cache.block_seq.begin(), cache.block_seq.end(), -1);
+    cache.seq_blocks.clear();
+    cache.runs.clear();
+
     for (auto & buf : cache.bufs) {
         ggml_backend_buffer_clear(buf, 0);
     }
@@ -3522,7 +3781,7 @@ static bool llama_kv_cache_seq_rm(
         }
         if (0 <= seq_id) {
             // partial intersection is invalid
-            if ((0 < p0 && p0 <= cache.cells[seq_id].pos) || (0 < p1 && p1 <= cache.cells[seq_id].pos)) {
+            if ((0 < p0 && p0 <= cache.cells.pos(seq_id)) || (0 < p1 && p1 <= cache.cells.pos(seq_id))) {
                 return false;
             }
         } else {
@@ -3533,29 +3792,74 @@ static bool llama_kv_cache_seq_rm(
         }
     }
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
-            } else {
-                continue;
+    // keep count of the number of used cells
+    cache.used -= cache.cells.remove_seq(seq_id, p0, p1, new_head);
+
+    // If we freed up a slot, set head to it so searching can start there.
+    if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+
+    return true;
+}
+
+// makes room for the batch in the sequences that would end up with more than kv_budget cells: their cells with the
+// lowest attention score are evicted, except for the kv_budget_sink first and the kv_budget_recent last ones
+static void llama_kv_cache_budget_evict(
+        struct llama_kv_cache & cache,
+        const llama_cparams   & cparams,
+        const llama_batch     & batch) {
+    if (cache.used + batch.n_tokens <= cparams.kv_budget) {
+        // no sequence can be over the budget
+        return;
+    }
+
+    std::map<llama_seq_id, uint32_t> n_new;
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+            n_new[batch.seq_id[i][s]]++;
+        }
+    }
+
+    uint32_t new_head = cache.size;
+
+    std::vector<uint32_t> cells;
+    for (const auto & it : n_new) {
+        const llama_seq_id seq_id = it.first;
+
+        cells.clear();
+        for (uint32_t i = 0; i < cache.size; ++i) {
+            if (cache.cells.pos(i) >= 0 && cache.cells.has_seq_id(i, seq_id)) {
+                cells.push_back(i);
             }
-            if (cache.cells[i].is_empty()) {
-                // keep count of the number of used cells
-                if (cache.cells[i].pos >= 0) cache.used--;
+        }
+
+        const size_t n_protected = cparams.kv_budget_sink + cparams.kv_budget_recent;
+        if (cells.size() + it.second <= cparams.kv_budget || cells.size() <= n_protected) {
+            continue;
+        }
+
+        // the candidates are between the sink and the recent cells in position order
+        std::sort(cells.begin(), cells.end(), [&](uint32_t a, uint32_t b) {
+            return cache.cells.pos(a) < cache.cells.pos(b);
+        });
+        auto first = cells.begin() + cparams.kv_budget_sink;
+        auto last  = cells.end()   - cparams.kv_budget_recent;
+
+        const size_t n_evict = std::min<size_t>(cells.size() + it.second - cparams.kv_budget, last - first);
+        std::nth_element(first, first + n_evict, last, [&](uint32_t a, uint32_t b) {
+            return cache.cells.score(a) < cache.cells.score(b);
+        });
 
-                cache.cells[i].pos = -1;
-                if (new_head == cache.size) new_head = i;
+        for (auto c = first; c != first + n_evict; ++c) {
+            cache.cells.seq_rm(*c, seq_id);
+            if (cache.cells.is_empty(*c)) {
+                cache.cells.set_pos(*c, -1);
+                cache.used--;
+                new_head = std::min(new_head, *c);
             }
         }
     }
 
-    // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
-
-    return true;
 }
 
 static void llama_kv_cache_seq_cp(
@@ -3569,22 +3873,22 @@ static void llama_kv_cache_seq_cp(
 
     if (cache.recurrent) {
         if ((uint32_t) seq_id_dst < cache.size && (uint32_t) seq_id_src < cache.size) {
-            seq_id_src = cache.cells[seq_id_src].src;
+            seq_id_src = cache.cells.src(seq_id_src);
             GGML_ASSERT((uint32_t) seq_id_src < cache.size);
             // intent to "copy from"
             // supports copy chains thanks to taking the source of the source
-            cache.cells[seq_id_dst].src = seq_id_src;
+            cache.cells.set_src(seq_id_dst, seq_id_src);
 
             // preserve the "keep or clear" status of the copied sequence
-            if (cache.cells[seq_id_src].has_seq_id(seq_id_src)) {
-                cache.cells[seq_id_dst].seq_id.insert(seq_id_dst);
+            if (cache.cells.has_seq_id(seq_id_src, seq_id_src)) {
+                cache.cells.seq_add(seq_id_dst, seq_id_dst);
             } else {
-                cache.cells[seq_id_dst].seq_id.erase(seq_id_dst);
+                cache.cells.seq_rm(seq_id_dst, seq_id_dst);
             }
 
             cache.do_copy = true;
 
-            cache.cells[seq_id_dst].pos = cache.cells[seq_id_src].pos;
+            cache.cells.set_pos(seq_id_dst, cache.cells.pos(seq_id_src));
         }
         return;
     }
@@ -3592,32 +3896,30 @@ static void llama_kv_cache_seq_cp(
 
     cache.head = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
-        }
-    }
+    cache.cells.copy_seq(seq_id_src, seq_id_dst, p0, p1);
 }
 
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     uint32_t new_head = cache.size;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (!cache.cells[i].has_seq_id(seq_id)) {
-            if (cache.cells[i].pos >= 0) cache.used--;
-            cache.cells[i].pos = -1;
-            cache.cells[i].seq_id.clear();
-            if (new_head == cache.size) new_head = i;
-        } else {
-            cache.cells[i].seq_id.clear();
-            cache.cells[i].seq_id.insert(seq_id);
-        }
-    }
+    cache.used -= cache.cells.keep_seq(seq_id, new_head);
 
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
 }
 
+// cell i is going to get a pending K-shift
+static void llama_kv_cache_shift_range(struct llama_kv_cache & cache, uint32_t i) {
+    if (!cache.has_shift) {
+        cache.has_shift = true;
+        cache.shift_lo  = i;
+        cache.shift_hi  = i + 1;
+    } else {
+        cache.shift_lo  = std::min(cache.shift_lo, i);
+        cache.shift_hi  = std::max(cache.shift_hi, i + 1);
+    }
+}
+
 static void llama_kv_cache_seq_add(
         struct llama_kv_cache & cache,
                  llama_seq_id   seq_id,
@@ -3634,26 +3936,27 @@ static void llama_kv_cache_seq_add(
     if (cache.recurrent) {
         // for Mamba-like models, only the pos needs to be shifted
         if (0 <= seq_id && seq_id < (int64_t) cache.size) {
-            llama_kv_cell & cell = cache.cells[seq_id];
-            if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
-                cell.pos += delta;
+            const llama_pos pos = cache.cells.pos(seq_id);
+            if (cache.cells.has_seq_id(seq_id, seq_id) && p0 <= pos && pos < p1) {
+                cache.cells.set_pos(seq_id, pos + delta);
             }
         }
         return;
     }
 
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.has_shift = true;
-            cache.cells[i].pos   += delta;
-            cache.cells[i].delta += delta;
-
-            if (cache.cells[i].pos < 0) {
-                if (!cache.cells[i].is_empty()) {
+        const llama_pos pos = cache.cells.pos(i);
+        if (pos >= p0 && pos < p1 && cache.cells.has_seq_id(i, seq_id)) {
+            llama_kv_cache_shift_range(cache, i);
+            cache.cells.set_pos  (i, pos + delta);
+            cache.cells.set_delta(i, cache.cells.delta(i) + delta);
+
+            if (pos + delta < 0) {
+                if (!cache.cells.is_empty(i)) {
                     cache.used--;
                 }
-                cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
+                cache.cells.set_pos(i, -1);
+                cache.cells.seq_clear(i);
                 if (new_head == cache.size) {
                     new_head = i;
                 }
@@ -3680,37 +3983,29 @@ static void llama_kv_cache_seq_div(
     if (cache.recurrent) {
         // for Mamba-like models, only the pos needs to be changed
         if (0 <= seq_id && seq_id < (int64_t) cache.size) {
-            llama_kv_cell & cell = cache.cells[seq_id];
-            if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
-                cell.pos /= d;
+            const llama_pos pos = cache.cells.pos(seq_id);
+            if (cache.cells.has_seq_id(seq_id, seq_id) && p0 <= pos && pos < p1) {
+                cache.cells.set_pos(seq_id, pos / d);
             }
         }
         return;
     }
 
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.has_shift = true;
+        const llama_pos pos = cache.cells.pos(i);
+        if (pos >= p0 && pos < p1 && cache.cells.has_seq_id(i, seq_id)) {
+            llama_kv_cache_shift_range(cache, i);
 
             {
-                llama_pos p_old = cache.cells[i].pos;
-                cache.cells[i].pos   /= d;
-                cache.cells[i].delta += cache.cells[i].pos - p_old;
+                cache.cells.set_pos  (i, pos / d);
+                cache.cells.set_delta(i, cache.cells.delta(i) + pos / d - pos);
             }
         }
     }
 }
 
 static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama_seq_id seq_id) {
-    llama_pos result = 0;
-
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id)) {
-            result = std::max(result, cache.cells[i].pos);
-        }
-    }
-
-    return result;
+    return cache.cells.seq_pos_max(seq_id);
 }
 
 static void llama_kv_cache_defrag(struct llama_kv_cache & cache) {
@@ -3950,6 +4245,8 @@ struct llama_model_loader {
     bool repack_tensors = false;
     bool use_thp = false;
 
+    int n_repacked = 0; // tensors repacked while loading
+
     llama_files files;
     llama_ftype ftype;
     llama_fver  fver;
@@ -4685,15 +4982,132 @@ struct llama_model_loader {
         }
 #endif
 
+        // Without mmap, the tensors in host buffers are read by a pool of threads with positional reads, in chunks so
+        // that the large tensors are spread over the threads too. The thread that reads the last chunk of a tensor
+        // validates and repacks it, overlapping this with the reading of the other tensors. In the meantime the main
+        // thread reads and uploads the tensors in device buffers, and then joins the pool.
+        struct host_tensor {
+            ggml_tensor * tensor;
+            const llama_tensor_weight * weight;
+        };
+        struct host_chunk {
+            int    idx;  // index into host_tensors
+            size_t offs; // offset within the tensor
+            size_t size;
+        };
+        std::vector<host_tensor> host_tensors;
+        std::vector<host_chunk>  host_chunks;
+        if (!use_mmap) {
+            constexpr size_t k_chunk_size = 32*1024*1024;
+            for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+                const auto * weight = get_weight(ggml_get_name(cur));
+                if (weight == nullptr || !ggml_backend_buffer_is_host(cur->buffer)) {
+                    continue;
+                }
+                GGML_ASSERT(weight->idx < files.size());
+                const size_t n_size = ggml_nbytes(cur);
+                for (size_t offs = 0; offs < n_size; offs += k_chunk_size) {
+                    host_chunks.push_back({ int(host_tensors.size()), offs, std::min(k_chunk_size, n_size - offs) });
+                }
+                host_tensors.push_back({ cur, weight });
+            }
+        }
+
+        std::unique_ptr<std::atomic<int>[]> chunks_left(new std::atomic<int>[host_tensors.size()]);
+        for (size_t i = 0; i < host_tensors.size(); ++i) chunks_left[i] = 0;
+        for (const auto & chunk : host_chunks) ++chunks_left[chunk.idx];
+
+        std::atomic<int>    next_chunk(0);
+        std::atomic<size_t> host_size_done(0);
+        std::atomic<int>    n_host_repacked(0);
+        std::atomic<bool>   host_abort(false);
+        std::mutex          host_mutex;
+        std::string         host_error;
+        std::vector<const ggml_tensor *> host_invalid;
+
+        // the DeepSeek attn_kv_b tensors are needed in their original type to compute attn_k_b/attn_v_b after loading,
+        // they get repacked in llm_load_tensors
+        const bool defer_kv_b = get_arch() == LLM_ARCH_DEEPSEEK2;
+
+        auto finish_host_tensor = [&](ggml_tensor * cur) {
+            if (check_tensors && !ggml_validate_row_data(cur->type, cur->data, ggml_nbytes(cur))) {
+                std::lock_guard<std::mutex> lock(host_mutex);
+                host_invalid.push_back(cur);
+                return;
+            }
+            if (repack_tensors && !cur->view_src && !(defer_kv_b && strstr(cur->name, "attn_kv_b"))) {
+                const auto orig_type = cur->type;
+                // the loader threads already repack several tensors at once
+                iqk_repack_tensor_nthread(cur, 1);
+                if (cur->type != orig_type) ++n_host_repacked;
+            }
+        };
+
+        // returns false if the progress callback cancelled the loading
+        auto load_host_chunks = [&](bool is_main) {
+            while (!host_abort) {
+                if (is_main && progress_callback) {
+                    if (!progress_callback((float) (size_done + host_size_done) / size_data, progress_callback_user_data)) {
+                        host_abort = true;
+                        return false;
+                    }
+                }
+                const int i = next_chunk++;
+                if (i >= (int) host_chunks.size()) {
+                    break;
+                }
+                const auto & chunk = host_chunks[i];
+                const auto & ht = host_tensors[chunk.idx];
+                try {
+                    files.at(ht.weight->idx)->read_raw_at((char *) ht.tensor->data + chunk.offs, chunk.size, ht.weight->offs + chunk.offs);
+                    host_size_done += chunk.size;
+                    if (--chunks_left[chunk.idx] == 0) {
+                        finish_host_tensor(ht.tensor);
+                    }
+                } catch (const std::exception & err) {
+                    std::lock_guard<std::mutex> lock(host_mutex);
+                    if (host_error.empty()) {
+                        host_error = format("tensor '%s': %s", ggml_get_name(ht.tensor), err.what());
+                    }
+                    host_abort = true;
+                }
+            }
+            return true;
+        };
+
+        std::vector<std::thread> host_workers;
+        // stops and joins the workers if we leave early because of an error or a cancellation
+        struct host_workers_guard {
+            std::vector<std::thread> & workers;
+            std::atomic<bool>        & abort;
+            ~host_workers_guard() {
+                abort = true;
+                for (auto & w : workers) {
+                    w.join();
+                }
+            }
+        } host_guard{host_workers, host_abort};
+        if (!host_chunks.empty()) {
+            const int n_workers = std::min<int>(std::max(1u, std::thread::hardware_concurrency()/2), host_chunks.size());
+            // the main thread is one of the workers once it is done with the device tensors
+            for (int i = 0; i < n_workers - 1; ++i) {
+                host_workers.emplace_back(load_host_chunks, false);
+            }
+        }
+
         for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
             const auto * weight = get_weight(ggml_get_name(cur));
             if (weight == nullptr) {
                 // this can happen with split experts models
                 continue;
             }
+            if (!use_mmap && ggml_backend_buffer_is_host(cur->buffer)) {
+                // loaded by the host workers
+                continue;
+            }
 
             if (progress_callback) {
-                if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
+                if (!progress_callback((float) (size_done + host_size_done) / size_data, progress_callback_user_data)) {
                     return false;
                 }
             }
@@ -4731,45 +5145,32 @@ struct llama_model_loader {
             } else {
                 GGML_ASSERT(weight->idx < files.size());
                 const auto & file = files.at(weight->idx);
-                if (ggml_backend_buffer_is_host(cur->buffer)) {
-                    file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(cur->data, n_size);
-                    if (check_tensors) {
-                        validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                            return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
-                        }));
-                    }
-                } else {
 #if defined(GGML_USE_CUDA)
-                    // If cuda_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
-                    if (cuda_backend) {
-                        file->seek(weight->offs, SEEK_SET);
+                // If cuda_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
+                if (cuda_backend) {
+                    size_t bytes_read = 0;
 
-                        size_t bytes_read = 0;
+                    while (bytes_read < n_size) {
+                        size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
 
-                        while (bytes_read < n_size) {
-                            size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
+                        ggml_backend_event_synchronize(events[buffer_idx]);
+                        file->read_raw_at(host_ptrs[buffer_idx], read_iteration, weight->offs + bytes_read);
+                        ggml_backend_tensor_set_async(cuda_backend, cur, host_ptrs[buffer_idx], bytes_read, read_iteration);
+                        ggml_backend_event_record(events[buffer_idx]);
 
-                            ggml_backend_event_synchronize(events[buffer_idx]);
-                            file->read_raw(host_ptrs[buffer_idx], read_iteration);
-                            ggml_backend_tensor_set_async(cuda_backend, cur, host_ptrs[buffer_idx], bytes_read, read_iteration);
-                            ggml_backend_event_record(events[buffer_idx]);
-
-                            bytes_read += read_iteration;
-                            ++buffer_idx;
-                            buffer_idx %= n_buffers;
-                        }
+                        bytes_read += read_iteration;
+                        ++buffer_idx;
+                        buffer_idx %= n_buffers;
                     }
-                    else
+                }
+                else
 #endif
-                    {
-                        read_buf.resize(n_size);
-                        file->seek(weight->offs, SEEK_SET);
-                        file->read_raw(read_buf.data(), n_size);
-                        ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
-                        if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
-                            throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
-                        }
+                {
+                    read_buf.resize(n_size);
+                    file->read_raw_at(read_buf.data(), n_size, weight->offs);
+                    ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
+                    if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
+                        throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
                     }
                 }
             }
@@ -4777,6 +5178,23 @@ struct llama_model_loader {
             size_done += n_size;
         }
 
+        const bool host_completed = load_host_chunks(true);
+        for (auto & w : host_workers) {
+            w.join();
+        }
+        host_workers.clear();
+        size_done  += host_size_done;
+        n_repacked += n_host_repacked;
+        if (!host_error.empty()) {
+            throw std::runtime_error(host_error);
+        }
+        if (!host_completed) {
+            return false;
+        }
+        for (const auto * cur : host_invalid) {
+            LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(cur));
+        }
+
 #if defined(GGML_USE_CUDA)
         // free temporary resources used for async cuda uploads
         if (cuda_backend) {
@@ -4790,7 +5208,7 @@ struct llama_model_loader {
 #endif
 
         // check validation results
-        bool validation_failed = false;
+        bool validation_failed = !host_invalid.empty();
         for (auto & future : validation_result) {
             auto result = future.get();
             if (!result.second) {
@@ -6485,6 +6903,7 @@ static bool llm_load_tensors(
         int main_gpu,
         const float * tensor_split,
         bool use_mlock,
+        bool fused_qkv,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = ggml_time_us();
@@ -6494,19 +6913,20 @@ static bool llm_load_tensors(
     model.split_mode   = split_mode;
     model.main_gpu     = main_gpu;
     model.n_gpu_layers = n_gpu_layers;
+    model.use_thp      = ml.use_thp;
 
     const int n_layer     = hparams.n_layer;
     const int i_gpu_start = std::max((int) hparams.n_layer - n_gpu_layers, (int) 0);
     bool use_mmap_buffer = true;
 
     // there is very little benefit to offloading the input layer, so always keep it on the CPU
-    model.buft_input = llama_default_buffer_type_cpu(true);
+    model.buft_input = llama_default_buffer_type_cpu(true, model.use_thp);
 
     model.buft_layer.resize(n_layer);
 
     // assign cpu layers
     for (int i = 0; i < i_gpu_start; ++i) {
-        model.buft_layer[i] = llama_default_buffer_type_cpu(true);
+        model.buft_layer[i] = llama_default_buffer_type_cpu(true, model.use_thp);
     }
 
     if (split_mode == LLAMA_SPLIT_MODE_LAYER) {
@@ -6544,7 +6964,7 @@ static bool llm_load_tensors(
             int layer_gpu = std::upper_bound(splits.begin(), splits.begin() + device_count, float(act_gpu_layers - 1)/act_gpu_layers) - splits.begin();
             model.buft_output = llama_default_buffer_type_offload(model, layer_gpu);
         } else {
-            model.buft_output = llama_default_buffer_type_cpu(true);
+            model.buft_output = llama_default_buffer_type_cpu(true, model.use_thp);
         }
     } else {
         ggml_backend_buffer_type_t split_buft;
@@ -6568,7 +6988,7 @@ static bool llm_load_tensors(
                 llama_default_buffer_type_offload(model, main_gpu)
             };
         } else {
-            model.buft_output = llama_default_buffer_type_cpu(true);
+            model.buft_output = llama_default_buffer_type_cpu(true, model.use_thp);
         }
     }
 
@@ -6585,6 +7005,9 @@ static bool llm_load_tensors(
 
     // create one context per buffer type
     size_t ctx_size = ggml_tensor_overhead()*(ml.n_tensors + 1); // +1 for models where tok_embd is duplicated as output
+    if (fused_qkv) {
+        ctx_size += ggml_tensor_overhead()*2*hparams.n_layer; // the merged wqkv and bqkv
+    }
 
     // for moe merged tensors
     ctx_size += ggml_tensor_overhead()*n_layer*3;
@@ -6673,6 +7096,68 @@ static bool llm_load_tensors(
         };
 
         const auto tn = LLM_TN(model.arch);
+
+        // With fused_qkv, wq, wk and wv (and their biases, if any) are loaded into views of a merged wqkv (bqkv),
+        // so that the graph computes Q, K and V with a single matmul and a single conversion of the activations.
+        // Like the merging of split experts this requires disabling mmap. Returns false, without creating any
+        // tensors, if the three weights do not have the same type or are not all kept in the buffer of the layer.
+        auto create_fused_qkv = [&](llama_layer & layer, int i, ggml_context * ctx_layer, ggml_context * ctx_split,
+                int64_t n_embd_q, int64_t n_embd_k, int64_t n_embd_v) {
+            if (!fused_qkv || split_mode == LLAMA_SPLIT_MODE_ROW) {
+                return false;
+            }
+            const llm_tensor   parts[3] = { LLM_TENSOR_ATTN_Q, LLM_TENSOR_ATTN_K, LLM_TENSOR_ATTN_V };
+            const int64_t     n_rows[3] = { n_embd_q, n_embd_k, n_embd_v };
+            const ggml_tensor * w_meta[3];
+            int n_bias = 0;
+            for (int j = 0; j < 3; ++j) {
+                const std::string name = tn(parts[j], "weight", i);
+                w_meta[j] = ml.get_tensor_meta(name.c_str());
+                if (!w_meta[j] || w_meta[j]->type != w_meta[0]->type) {
+                    return false;
+                }
+                if (ml.tensor_buft_overrides) {
+                    for (const auto * overrides = ml.tensor_buft_overrides; overrides->pattern != nullptr; ++overrides) {
+                        if (std::regex_search(name, std::regex(overrides->pattern))) {
+                            return false;
+                        }
+                    }
+                }
+                const ggml_tensor * b_meta = ml.get_tensor_meta(tn(parts[j], "bias", i).c_str());
+                if (b_meta) {
+                    if (b_meta->type != GGML_TYPE_F32) {
+                        return false;
+                    }
+                    ++n_bias;
+                }
+            }
+            if ((n_bias != 0 && n_bias != 3) || (n_bias > 0 && hparams.f_attention_scale != 0)) {
+                // (the attention scale of Granite is applied before the bias of Q)
+                return false;
+            }
+
+            use_mmap_buffer = false;
+
+            layer.wqkv = ggml_new_tensor_2d(ctx_split, w_meta[0]->type, n_embd, n_embd_q + n_embd_k + n_embd_v);
+            ggml_set_name(layer.wqkv, tn(LLM_TENSOR_ATTN_QKV, "weight", i).c_str());
+            if (n_bias == 3) {
+                layer.bqkv = ggml_new_tensor_1d(ctx_layer, GGML_TYPE_F32, n_embd_q + n_embd_k + n_embd_v);
+                ggml_set_name(layer.bqkv, tn(LLM_TENSOR_ATTN_QKV, "bias", i).c_str());
+            }
+
+            ggml_tensor ** w[3] = { &layer.wq, &layer.wk, &layer.wv };
+            ggml_tensor ** b[3] = { &layer.bq, &layer.bk, &layer.bv };
+            int64_t offset = 0;
+            for (int j = 0; j < 3; ++j) {
+                *w[j] = ml.create_tensor_as_view(ctx_split, layer.wqkv, tn(parts[j], "weight", i), {n_embd, n_rows[j]}, offset*layer.wqkv->nb[1]);
+                if (layer.bqkv) {
+                    *b[j] = ml.create_tensor_as_view(ctx_layer, layer.bqkv, tn(parts[j], "bias", i), {n_rows[j]}, offset*sizeof(float));
+                }
+                offset += n_rows[j];
+            }
+            return true;
+        };
+
         switch (model.arch) {
             case LLM_ARCH_LLAMA:
             case LLM_ARCH_REFACT:
@@ -6701,15 +7186,17 @@ static bool llm_load_tensors(
 
                         layer.attn_norm = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_NORM, "weight", i), {n_embd});
 
-                        layer.wq = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head});
-                        layer.wk = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa});
-                        layer.wv = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa});
-                        layer.wo = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd_head_k * n_head, n_embd});
+                        if (!create_fused_qkv(layer, i, ctx_layer, ctx_split, n_embd_head_k * n_head, n_embd_k_gqa, n_embd_v_gqa)) {
+                            layer.wq = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head});
+                            layer.wk = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa});
+                            layer.wv = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa});
 
-                        // optional bias tensors
-                        layer.bq = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_Q,   "bias", i), {n_embd},     llama_model_loader::TENSOR_NOT_REQUIRED);
-                        layer.bk = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_K,   "bias", i), {n_embd_gqa}, llama_model_loader::TENSOR_NOT_REQUIRED);
-                        layer.bv = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_V,   "bias", i), {n_embd_gqa}, llama_model_loader::TENSOR_NOT_REQUIRED);
+                            // optional bias tensors
+                            layer.bq = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_Q,   "bias", i), {n_embd},     llama_model_loader::TENSOR_NOT_REQUIRED);
+                            layer.bk = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_K,   "bias", i), {n_embd_gqa}, llama_model_loader::TENSOR_NOT_REQUIRED);
+                            layer.bv = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_V,   "bias", i), {n_embd_gqa}, llama_model_loader::TENSOR_NOT_REQUIRED);
+                        }
+                        layer.wo = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd_head_k * n_head, n_embd});
                         layer.bo = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_OUT, "bias", i), {n_embd},     llama_model_loader::TENSOR_NOT_REQUIRED);
 
                         layer.ffn_norm = create_tensor(ctx_layer, tn(LLM_TENSOR_FFN_NORM, "weight", i), {n_embd});
@@ -7303,15 +7790,17 @@ static bool llm_load_tensors(
 
                         layer.attn_norm = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_NORM, "weight", i), {n_embd});
 
-                        layer.wq = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd});
-                        layer.wk = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_gqa});
-                        layer.wv = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_gqa});
-                        layer.wo = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd, n_embd});
+                        if (!create_fused_qkv(layer, i, ctx_layer, ctx_split, n_embd, n_embd_gqa, n_embd_gqa)) {
+                            layer.wq = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd});
+                            layer.wk = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_gqa});
+                            layer.wv = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_gqa});
 
-                        // optional bias tensors
-                        layer.bq = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_Q,   "bias", i), {n_embd});
-                        layer.bk = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_K,   "bias", i), {n_embd_gqa});
-                        layer.bv = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_V,   "bias", i), {n_embd_gqa});
+                            // optional bias tensors
+                            layer.bq = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_Q,   "bias", i), {n_embd});
+                            layer.bk = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_K,   "bias", i), {n_embd_gqa});
+                            layer.bv = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_V,   "bias", i), {n_embd_gqa});
+                        }
+                        layer.wo = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd, n_embd});
 
                         layer.ffn_norm = create_tensor(ctx_layer, tn(LLM_TENSOR_FFN_NORM, "weight", i), {n_embd});
 
@@ -7624,9 +8113,11 @@ static bool llm_load_tensors(
 
                         layer.attn_norm = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_NORM, "weight", i), {n_embd});
 
-                        layer.wq = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head});
-                        layer.wk = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa});
-                        layer.wv = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa});
+                        if (!create_fused_qkv(layer, i, ctx_layer, ctx_split, n_embd_head_k * n_head, n_embd_k_gqa, n_embd_v_gqa)) {
+                            layer.wq = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head});
+                            layer.wk = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa});
+                            layer.wv = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa});
+                        }
                         layer.wo = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd_head_k * n_head, n_embd});
 
                         layer.ffn_norm = create_tensor(ctx_layer, tn(LLM_TENSOR_FFN_NORM, "weight", i), {n_embd});
@@ -7651,9 +8142,11 @@ static bool llm_load_tensors(
 
                         layer.attn_norm = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_NORM, "weight", i), {n_embd});
 
-                        layer.wq = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head});
-                        layer.wk = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa});
-                        layer.wv = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa});
+                        if (!create_fused_qkv(layer, i, ctx_layer, ctx_split, n_embd_head_k * n_head, n_embd_k_gqa, n_embd_v_gqa)) {
+                            layer.wq = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head});
+                            layer.wk = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa});
+                            layer.wv = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa});
+                        }
                         layer.wo = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd_head_k * n_head, n_embd});
                         layer.attn_post_norm = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_POST_NORM, "weight", i), {n_embd});
 
@@ -8279,6 +8772,14 @@ static bool llm_load_tensors(
 
     ml.done_getting_tensors();
 
+    if (fused_qkv) {
+        int n_fused = 0;
+        for (const auto & layer : model.layers) {
+            if (layer.wqkv && layer.wq) ++n_fused;
+        }
+        LLAMA_LOG_INFO("%s: merged wq, wk, wv into wqkv for %d/%d layers\n", __func__, n_fused, n_layer);
+    }
+
     ml.init_mappings(true, use_mlock ? &model.mlock_mmaps : nullptr, ml.use_thp);
     model.mappings.reserve(ml.mappings.size());
 
@@ -8300,7 +8801,7 @@ static bool llm_load_tensors(
         // only the mmap region containing the tensors in the model is mapped to the backend buffer
         // this is important for metal with apple silicon: if the entire model could be mapped to a metal buffer, then we could just use metal for all layers
         // this allows using partial offloading when the model size exceeds the metal buffer size, but not the RAM size
-        if (ml.use_mmap && use_mmap_buffer && (buft == llama_default_buffer_type_cpu(true) || buft == ggml_backend_cpu_buffer_type())) {
+        if (ml.use_mmap && use_mmap_buffer && (buft == llama_default_buffer_type_cpu(true, model.use_thp) || buft == ggml_backend_cpu_buffer_type())) {
             for (uint32_t idx = 0; idx < ml.files.size(); idx++) {
                 void * addr = nullptr;
                 size_t first, last;
@@ -8556,7 +9057,8 @@ static bool llm_load_tensors(
     if (!ml.use_mmap) {
         int n_modified = 0;
         for (auto& it : model.tensors_by_name) {
-            if (ggml_backend_buffer_is_host(it.second->buffer)) {
+            // views (e.g., the wq, wk, wv of a merged wqkv) are handled with the tensor they are a view of
+            if (ggml_backend_buffer_is_host(it.second->buffer) && !it.second->view_src) {
                 if (iqk_modify_tensor(it.second)) ++n_modified;
             }
         }
@@ -8564,9 +9066,10 @@ static bool llm_load_tensors(
     }
 
     if (!ml.use_mmap && ml.repack_tensors) {
-        int n_repacked = 0;
+        // most tensors are repacked by load_all_data as soon as they are read, this handles the rest
+        int n_repacked = ml.n_repacked;
         for (auto& it : model.tensors_by_name) {
-            if (ggml_backend_buffer_is_host(it.second->buffer)) {
+            if (ggml_backend_buffer_is_host(it.second->buffer) && !it.second->view_src) {
                 auto orig_type = it.second->type;
                 iqk_repack_tensor(it.second);
                 if (it.second->type != orig_type) ++n_repacked;
@@ -8576,6 +9079,17 @@ static bool llm_load_tensors(
         if (n_repacked > 0) printf("============ Repacked %d tensors\n", n_repacked);
     }
 
+    if (ggml_is_numa()) {
+        // with --numa split, spread the rows (experts) of the matmul weights over the NUMA nodes
+        int n_distributed = 0;
+        for (auto& it : model.tensors_by_name) {
+            if (ggml_backend_buffer_is_host(it.second->buffer) && ggml_n_dims(it.second) >= 2 && !it.second->view_src) {
+                if (ggml_numa_distribute_tensor(it.second)) ++n_distributed;
+            }
+        }
+        if (n_distributed > 0) LLAMA_LOG_INFO("%s: distributed %d tensors over the NUMA nodes\n", __func__, n_distributed);
+    }
+
     if (model.arch == LLM_ARCH_BITNET) {
         auto set_scale = [] (ggml_tensor * w, ggml_tensor * s) {
             if (!s) {
@@ -8608,11 +9122,452 @@ static bool llm_load_tensors(
     return true;
 }
 
+static std::string llama_path_basename(const std::string & path) {
+    auto pos = path.find_last_of("/\\");
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+// The text that identifies a loaded model for the caches below: the model files (name, size and modification time), the
+// CPU features the repacking was built for, and the parameters that decide which tensors end up in host memory (only
+// those get repacked). Returns an empty string if the model files cannot be read.
+static std::string llama_model_cache_key(const std::string & fname, const llama_model_params & params) {
+    std::vector<std::string> paths = { fname };
+    {
+        struct gguf_init_params gguf_params = { /*.no_alloc = */ true, /*.ctx = */ nullptr };
+        struct gguf_context * ctx = gguf_init_from_file(fname.c_str(), gguf_params);
+        if (!ctx) {
+            return {};
+        }
+        const int kid = gguf_find_key(ctx, LLM_KV_NAMES.at(LLM_KV_SPLIT_COUNT));
+        const int n_split = kid >= 0 ? gguf_get_val_u16(ctx, kid) : 0;
+        gguf_free(ctx);
+        char split_prefix[PATH_MAX] = {0};
+        if (n_split > 1 && llama_split_prefix(split_prefix, sizeof(split_prefix), fname.c_str(), 0, n_split)) {
+            char split_path[PATH_MAX] = {0};
+            for (int idx = 1; idx < n_split; ++idx) {
+                llama_split_path(split_path, sizeof(split_path), split_prefix, idx, n_split);
+                paths.emplace_back(split_path);
+            }
+        }
+    }
+
+    std::string key;
+    for (const auto & path : paths) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            return {};
+        }
+        key += format("%s %lld %lld\n", llama_path_basename(path).c_str(), (long long) st.st_size, (long long) st.st_mtime);
+    }
+    key += llama_print_system_info();
+    key += format("\n%d %d %d", params.n_gpu_layers, (int) params.split_mode, params.main_gpu);
+    if (params.tensor_split) {
+        for (size_t i = 0; i < llama_max_devices(); ++i) {
+            key += format(" %g", params.tensor_split[i]);
+        }
+    }
+    key += format("\n%s\n", params.rpc_servers ? params.rpc_servers : "");
+    if (params.tensor_buft_overrides) {
+        for (const auto * o = params.tensor_buft_overrides; o->pattern; ++o) {
+            key += format("%s=%s\n", o->pattern, ggml_backend_buft_name(o->buft));
+        }
+    }
+    if (params.kv_overrides) {
+        for (const auto * o = params.kv_overrides; o->key[0] != 0; ++o) {
+            key += format("%s:%d:", o->key, (int) o->tag);
+            key += o->tag == LLAMA_KV_OVERRIDE_TYPE_STR ? std::string(o->val_str) : format("%lld", (long long) o->val_i64);
+            key += "\n";
+        }
+    }
+    return key;
+}
+
+// <model file name without .gguf>.<FNV-1a hash of key as 16 hex digits>
+static std::string llama_model_cache_name(const std::string & fname, const std::string & key) {
+    uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a
+    for (unsigned char c : key) {
+        hash = (hash ^ c) * 0x100000001b3ull;
+    }
+    std::string name = llama_path_basename(fname);
+    if (name.size() > 5 && name.compare(name.size() - 5, 5, ".gguf") == 0) {
+        name.resize(name.size() - 5);
+    }
+    return format("%s.%016llx", name.c_str(), (unsigned long long) hash);
+}
+
+// The run-time repacked model is cached in a GGUF file in params.repack_cache, so that later loads can mmap it instead
+// of reading and repacking the original model. The file name contains a hash of everything the repacked data depends
+// on (llama_model_cache_key).
+// Returns an empty string if the cache is not used.
+static std::string llama_repack_cache_path(const std::string & fname, const llama_model_params & params) {
+    if (!params.repack_tensors || !params.repack_cache || !params.repack_cache[0] || params.vocab_only) {
+        return {};
+    }
+    if (params.fused_qkv) {
+        // the merged Q/K/V tensors are not in the model file
+        LLAMA_LOG_WARN("%s: the repack cache cannot be used with fused Q/K/V, ignoring it\n", __func__);
+        return {};
+    }
+    const std::string key = llama_model_cache_key(fname, params);
+    if (key.empty()) {
+        return {};
+    }
+    std::string dir = params.repack_cache;
+    if (dir.back() != '/' && dir.back() != '\\') {
+        dir += '/';
+    }
+    return dir + llama_model_cache_name(fname, "repack cache v1\n" + key) + ".rtr.gguf";
+}
+
+// With params.shm_model, the model as it is after loading (repacked with repack_tensors) is published as a GGUF file in
+// the POSIX shared memory segment <shm_model>.<hash>.gguf (in /dev/shm), which the processes serving the same model
+// memory map read-only, so they share the physical pages instead of each holding a copy of the weights. The hash
+// (llama_model_cache_key and repack_tensors) keeps processes with different load parameters apart. The segment outlives
+// the processes; remove it from /dev/shm to free the memory. The segment is private to the user (mode 0600), and one
+// found in /dev/shm is only attached if it belongs to the user and no one else can write it.
+// Returns an empty string if no segment is used.
+static std::string llama_shm_model_path(const std::string & fname, const llama_model_params & params) {
+    if (!params.shm_model || !params.shm_model[0] || params.vocab_only) {
+        return {};
+    }
+#ifdef __linux__
+    if (strchr(params.shm_model, '/')) {
+        LLAMA_LOG_WARN("%s: the shared memory segment name %s must not contain '/', ignoring it\n", __func__, params.shm_model);
+        return {};
+    }
+    if (params.fused_qkv) {
+        LLAMA_LOG_WARN("%s: the shared memory model cannot be used with fused Q/K/V, ignoring it\n", __func__);
+        return {};
+    }
+    const std::string key = llama_model_cache_key(fname, params);
+    if (key.empty()) {
+        return {};
+    }
+    const std::string name = llama_model_cache_name(params.shm_model,
+            format("shm model v1\nrepack %d\n", (int) params.repack_tensors) + key);
+    return "/dev/shm/" + name + ".gguf";
+#else
+    LLAMA_LOG_WARN("%s: the shared memory model is only supported on Linux, ignoring it\n", __func__);
+    return {};
+#endif
+}
+
+#ifdef __linux__
+// Checks the shared memory segment before it is attached: /dev/shm is writable by everyone, so a segment that another
+// user created or can write could hold any weights.
+// Returns 1 if the segment can be used, 0 if there is none, and -1 if it is refused.
+static int llama_shm_model_check(const std::string & path) {
+    const int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct stat st;
+    const bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH));
+    close(fd);
+    if (!ok) {
+        LLAMA_LOG_WARN("%s: %s is not a file of this user or can be written by others, not using it\n", __func__, path.c_str());
+        return -1;
+    }
+    return 1;
+}
+
+// Held while a process checks for the shared memory model and publishes it, so that the processes that start together
+// publish it once: the others wait and attach to it.
+struct llama_shm_model_lock {
+    int fd = -1;
+
+    llama_shm_model_lock(const std::string & path) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            LLAMA_LOG_WARN("%s: failed to open %s: %s\n", __func__, path.c_str(), strerror(errno));
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_uid != geteuid()) {
+            LLAMA_LOG_WARN("%s: %s is not a file of this user, not using it\n", __func__, path.c_str());
+            release();
+            return;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            return;
+        }
+        LLAMA_LOG_INFO("%s: waiting for another process to publish the model\n", __func__);
+        int ret;
+        while ((ret = flock(fd, LOCK_EX)) != 0 && errno == EINTR) {}
+        if (ret != 0) {
+            LLAMA_LOG_WARN("%s: failed to lock %s: %s\n", __func__, path.c_str(), strerror(errno));
+            release();
+        }
+    }
+
+    ~llama_shm_model_lock() {
+        release();
+    }
+
+    void release() {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    bool locked() const {
+        return fd >= 0;
+    }
+};
+
+// Removes the temporary files of a publisher of the segment that did not finish (the caller holds the lock)
+static void llama_shm_model_remove_stale(const std::string & path) {
+    const std::string dir    = path.substr(0, path.rfind('/') + 1);
+    const std::string prefix = llama_path_basename(path) + ".";
+    DIR * d = opendir(dir.c_str());
+    if (!d) {
+        return;
+    }
+    while (const struct dirent * ent = readdir(d)) {
+        const std::string name = ent->d_name;
+        if (name.size() <= prefix.size() + 4 || name.compare(0, prefix.size(), prefix) != 0 ||
+            name.compare(name.size() - 4, 4, ".tmp") != 0) {
+            continue;
+        }
+        struct stat st;
+        if (lstat((dir + name).c_str(), &st) == 0 && st.st_uid == geteuid()) {
+            LLAMA_LOG_INFO("%s: removing %s left by a publisher that did not finish\n", __func__, (dir + name).c_str());
+            unlink((dir + name).c_str());
+        }
+    }
+    closedir(d);
+}
+#endif
+
+// Creates a new file that only this user can read and write, fails if the file exists
+static FILE * llama_create_private_file(const std::string & path) {
+#ifdef _WIN32
+    return ggml_fopen(path.c_str(), "wbx");
+#else
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return nullptr;
+    }
+    FILE * f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+    }
+    return f;
+#endif
+}
+
+// Returns the memory pages that lie entirely in [data, data + n) to the system, used by the publisher of the shared
+// memory model for the tensors it wrote, so that its private copy shrinks while the segment grows
+static void llama_discard_pages(const void * data, size_t n) {
+#ifdef __linux__
+    const uintptr_t page  = (uintptr_t) sysconf(_SC_PAGESIZE);
+    const uintptr_t begin = GGML_PAD((uintptr_t) data, page);
+    const uintptr_t end   = ((uintptr_t) data + n) / page * page;
+    if (end > begin) {
+        madvise((void *) begin, end - begin, MADV_DONTNEED);
+    }
+#else
+    GGML_UNUSED(data);
+    GGML_UNUSED(n);
+#endif
+}
+
+// Writes the model as it is after loading: the host tensors repacked, and (DeepSeek) the computed wk_b/wv_b tensors.
+// Used for the repack cache and the shared memory model. The file can only be read by this user.
+// With discard, the pages of the host tensors are released as they are written: the model must not be used afterwards.
+static void llama_repack_cache_save(const llama_model_loader & ml, const llama_model & model, const std::string & path,
+        bool discard = false) {
+    std::unordered_map<std::string, const ggml_tensor *> by_name;
+    for (const auto & it : model.tensors_by_name) {
+        auto res = by_name.emplace(it.first, it.second);
+        if (!res.second && res.first->second->type != it.second->type) {
+            LLAMA_LOG_WARN("%s: %s is loaded twice with different types, not writing %s\n", __func__, it.first.c_str(), path.c_str());
+            return;
+        }
+    }
+
+    std::vector<ggml_tensor> tensors;
+    for (int i = 0; i < ml.n_tensors; ++i) {
+        const char * name = ml.get_tensor_name(i);
+        auto it = by_name.find(name);
+        if (it == by_name.end() || it->second->view_src) {
+            LLAMA_LOG_WARN("%s: %s is not a tensor of its own, not writing %s\n", __func__, name, path.c_str());
+            return;
+        }
+        tensors.push_back(*it->second);
+    }
+    for (const auto & l : model.layers) {
+        for (const auto * t : { l.computed_wk_b.get(), l.computed_wv_b.get() }) {
+            if (!t) continue;
+            // stored with the 2D shape of the attn_k_b/attn_v_b tensors in model files
+            ggml_tensor t2d = *t;
+            t2d.ne[1] *= t2d.ne[2];
+            t2d.ne[2]  = 1;
+            t2d.nb[2]  = t2d.nb[1]*t2d.ne[1];
+            t2d.nb[3]  = t2d.nb[2];
+            tensors.push_back(t2d);
+        }
+    }
+
+    const size_t align = GGUF_DEFAULT_ALIGNMENT;
+    struct gguf_context * ctx_out = gguf_init_empty();
+    gguf_set_kv(ctx_out, ml.meta);
+    gguf_remove_key(ctx_out, ml.llm_kv(LLM_KV_SPLIT_NO).c_str());
+    gguf_remove_key(ctx_out, ml.llm_kv(LLM_KV_SPLIT_COUNT).c_str());
+    gguf_remove_key(ctx_out, ml.llm_kv(LLM_KV_SPLIT_TENSORS_COUNT).c_str());
+    gguf_remove_key(ctx_out, LLM_KV_NAMES.at(LLM_KV_GENERAL_ALIGNMENT));
+    for (auto & t : tensors) {
+        gguf_add_tensor(ctx_out, &t);
+    }
+
+    // written under a temporary name and renamed when complete, so a partial file is never picked up
+    const std::string tmp_path = format("%s.%lld.tmp", path.c_str(), (long long) ggml_time_us());
+    FILE * fout = llama_create_private_file(tmp_path);
+    if (!fout) {
+        LLAMA_LOG_WARN("%s: failed to create %s: %s\n", __func__, tmp_path.c_str(), strerror(errno));
+        gguf_free(ctx_out);
+        return;
+    }
+    size_t n_bytes = 0;
+    std::vector<uint8_t> meta(gguf_get_meta_size(ctx_out));
+    gguf_get_meta_data(ctx_out, meta.data());
+    gguf_free(ctx_out);
+    bool ok = std::fwrite(meta.data(), 1, meta.size(), fout) == meta.size();
+    const std::vector<uint8_t> pad(align, 0);
+    std::vector<uint8_t> read_buf;
+    for (size_t i = 0; i < tensors.size() && ok; ++i) {
+        const auto & t = tensors[i];
+        const size_t n = ggml_nbytes(&t);
+        const void * data = t.data;
+        const bool is_host = ggml_backend_buffer_is_host(t.buffer);
+        if (!is_host) {
+            read_buf.resize(n);
+            ggml_backend_tensor_get(&t, read_buf.data(), 0, n);
+            data = read_buf.data();
+        }
+        ok = std::fwrite(data, 1, n, fout) == n &&
+             std::fwrite(pad.data(), 1, GGML_PAD(n, align) - n, fout) == GGML_PAD(n, align) - n;
+        if (ok && discard && is_host) {
+            llama_discard_pages(data, n);
+        }
+        n_bytes += GGML_PAD(n, align);
+    }
+    ok = std::fclose(fout) == 0 && ok;
+    if (!ok) {
+        LLAMA_LOG_WARN("%s: failed to write %s: %s\n", __func__, tmp_path.c_str(), strerror(errno));
+        std::remove(tmp_path.c_str());
+        return;
+    }
+
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LLAMA_LOG_WARN("%s: failed to rename %s to %s\n", __func__, tmp_path.c_str(), path.c_str());
+        std::remove(tmp_path.c_str());
+        return;
+    }
+    LLAMA_LOG_INFO("%s: wrote the model to %s (%.2f MiB)\n", __func__, path.c_str(), n_bytes/1024.0/1024.0);
+}
+
+// Logs how much of the process memory is backed by huge pages (memory that was not touched yet is not counted)
+static void llama_log_huge_pages(const char * func) {
+#ifdef __linux__
+    std::ifstream in("/proc/self/smaps_rollup");
+    size_t thp_kib = 0, hugetlb_kib = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t kib;
+        if (sscanf(line.c_str(), "AnonHugePages: %zu kB", &kib) == 1) thp_kib += kib;
+        else if (sscanf(line.c_str(), "Shared_Hugetlb: %zu kB", &kib) == 1 || sscanf(line.c_str(), "Private_Hugetlb: %zu kB", &kib) == 1) {
+            hugetlb_kib += kib;
+        }
+    }
+    if (!in.eof()) {
+        return;
+    }
+    LLAMA_LOG_INFO("%s: huge pages in use: %.2f MiB hugetlbfs, %.2f MiB transparent\n", func, hugetlb_kib/1024.0, thp_kib/1024.0);
+    if (hugetlb_kib + thp_kib == 0) {
+        LLAMA_LOG_WARN("%s: no huge pages are used, check /sys/kernel/mm/transparent_hugepage/enabled and vm.nr_hugepages\n", func);
+    }
+#else
+    GGML_UNUSED(func);
+#endif
+}
+
+// With params.expert_paging, the routed experts of the MoE layers in host memory are counted per layer, prefetched when
+// selected (and for the next layer), and the most used ones are locked in RAM within params.expert_pin_mb. This is
+// meant for memory mapped models that do not fit in RAM: the cold experts stay in the page cache.
+static void llama_model_expert_paging(llama_model & model, size_t pin_bytes) {
+    model.expert_paging = ggml_expert_paging_init(pin_bytes);
+    int n_paged = 0;
+    for (int il = 0; il < (int) model.layers.size(); ++il) {
+        auto & layer = model.layers[il];
+        for (auto * w : { layer.ffn_gate_exps, layer.ffn_up_exps, layer.ffn_down_exps }) {
+            if (w && w->buffer && ggml_backend_buffer_is_host(w->buffer) && !w->view_src) {
+                if (ggml_expert_paging_add(model.expert_paging, w, il)) ++n_paged;
+            }
+        }
+    }
+    if (n_paged > 0) {
+        LLAMA_LOG_INFO("%s: paging the experts of %d tensors, pinning up to %.1f MiB\n", __func__, n_paged, pin_bytes/1024.0/1024.0);
+    } else {
+        LLAMA_LOG_WARN("%s: no expert tensors to page\n", __func__);
+        ggml_expert_paging_free(model.expert_paging);
+        model.expert_paging = nullptr;
+    }
+}
+
 // Returns 0 on success, -1 on error, and -2 on cancellation via llama_progress_callback
-static int llama_model_load(const std::string & fname, llama_model & model, llama_model_params & params) {
+// If publish is not empty, the loaded model is written there (see llama_shm_model_path)
+static int llama_model_load(const std::string & fname, llama_model & model, llama_model_params & params, const std::string & publish = {}) {
     try {
-        llama_model_loader ml(fname, params.use_mmap, params.check_tensors,
-                params.repack_tensors, params.use_thp, params.kv_overrides, params.tensor_buft_overrides);
+        const std::string shm_model = llama_shm_model_path(fname, params);
+        bool use_shm_model = false;
+#ifdef __linux__
+        if (!shm_model.empty()) {
+            // <name>.<hash>.lock next to the segment
+            llama_shm_model_lock lock(shm_model.substr(0, shm_model.size() - 5) + ".lock");
+            int state = lock.locked() ? llama_shm_model_check(shm_model) : -1;
+            if (state == 0) {
+                // the first process loads the model into a model of its own, publishes it and frees it, so that it
+                // shares the pages of the segment with the later processes like they do
+                llama_shm_model_remove_stale(shm_model);
+                LLAMA_LOG_INFO("%s: publishing the model in %s\n", __func__, shm_model.c_str());
+                llama_model_params params_pub = params;
+                params_pub.shm_model     = nullptr;
+                params_pub.expert_paging = false;
+                params_pub.use_mlock     = false;
+                {
+                    llama_model model_pub;
+                    model_pub.rpc_servers = model.rpc_servers;
+                    const int status = llama_model_load(fname, model_pub, params_pub, shm_model);
+                    if (status != 0) {
+                        return status;
+                    }
+                }
+                state = llama_shm_model_check(shm_model);
+            }
+            use_shm_model = state > 0;
+            if (!use_shm_model) {
+                LLAMA_LOG_WARN("%s: cannot use the model in %s, loading it in private memory\n", __func__, shm_model.c_str());
+            }
+        }
+#endif
+
+        const std::string repack_cache = use_shm_model || !publish.empty() ? std::string() : llama_repack_cache_path(fname, params);
+        const bool use_repack_cache = !repack_cache.empty() && std::ifstream(repack_cache).good();
+        if (use_repack_cache) {
+            LLAMA_LOG_INFO("%s: loading the repacked model from %s\n", __func__, repack_cache.c_str());
+        }
+        if (use_shm_model) {
+            LLAMA_LOG_INFO("%s: attaching to the model in %s\n", __func__, shm_model.c_str());
+        }
+
+        // the cached and the published models are already repacked and can be memory mapped, the published one is
+        // always memory mapped (read-only) so that its pages are shared
+        const std::string & fname_load = use_shm_model ? shm_model : use_repack_cache ? repack_cache : fname;
+        llama_model_loader ml(fname_load, params.use_mmap || use_shm_model, params.check_tensors,
+                params.repack_tensors && !use_repack_cache && !use_shm_model, params.use_thp && !use_shm_model,
+                params.kv_overrides, params.tensor_buft_overrides);
 
         model.hparams.vocab_only = params.vocab_only;
 
@@ -8663,10 +9618,25 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
 
         if (!llm_load_tensors(
             ml, model, params.n_gpu_layers, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock,
-            params.progress_callback, params.progress_callback_user_data
+            params.fused_qkv, params.progress_callback, params.progress_callback_user_data
         )) {
             return -2;
         }
+
+        if (!publish.empty()) {
+            // the model is freed right after it is published
+            llama_repack_cache_save(ml, model, publish, /* discard */ true);
+        } else if (!repack_cache.empty() && !use_repack_cache) {
+            llama_repack_cache_save(ml, model, repack_cache);
+        }
+
+        if (params.expert_paging) {
+            llama_model_expert_paging(model, size_t(params.expert_pin_mb)*1024*1024);
+        }
+
+        if (params.use_thp) {
+            llama_log_huge_pages(__func__);
+        }
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error loading model: %s\n", __func__, err.what());
         return -1;
@@ -8756,6 +9726,35 @@ static void llm_build_kv_store(
 
     GGML_ASSERT(kv.size == n_ctx);
 
+    if (!kv.runs.empty()) {
+        // paged KV cache: the tokens are spread over several ranges of cells
+        GGML_ASSERT(kv.runs.back().i_token + kv.runs.back().n == (uint32_t) n_tokens);
+        if (!ggml_is_contiguous(k_cur)) k_cur = ggml_cont(ctx, k_cur);
+        if (!ggml_is_contiguous(v_cur)) v_cur = ggml_cont(ctx, v_cur);
+        const size_t k_cur_row = ggml_row_size(k_cur->type, n_embd_head_k);
+        const size_t v_cur_row = ggml_row_size(v_cur->type, n_embd_v_gqa);
+        const size_t k_row     = ggml_row_size(kv.k_l[il]->type, n_embd_head_k);
+        for (const auto & run : kv.runs) {
+            ggml_tensor * k_src = ggml_view_2d(ctx, k_cur, n_embd_head_k, run.n*n_head_kv, k_cur_row, run.i_token*n_head_kv*k_cur_row);
+            ggml_tensor * k_dst = ggml_view_2d(ctx, kv.k_l[il], n_embd_head_k, run.n*n_head_kv, k_row, run.i_cell*n_head_kv*k_row);
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, k_src, k_dst));
+
+            ggml_tensor * v_src = ggml_view_2d(ctx, v_cur, n_embd_v_gqa, run.n, v_cur_row, run.i_token*v_cur_row);
+            ggml_tensor * v_dst;
+            if (cparams.flash_attn) {
+                v_dst = ggml_view_1d(ctx, kv.v_l[il], run.n*n_embd_v_gqa,
+                        run.i_cell*ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa));
+            } else {
+                v_dst = ggml_view_2d(ctx, kv.v_l[il], run.n, n_embd_v_gqa,
+                        n_ctx*ggml_element_size(kv.v_l[il]), run.i_cell*ggml_element_size(kv.v_l[il]));
+                v_src = ggml_transpose(ctx, v_src);
+            }
+            cb(v_dst, "v_cache_view", il);
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, v_src, v_dst));
+        }
+        return;
+    }
+
     //struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa,
     //        (ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa))*kv_head);
     //cb(k_cache_view, "k_cache_view", il);
@@ -8785,13 +9784,13 @@ static void llm_build_kv_store(
     ggml_build_forward_expand(graph, ggml_cpy(ctx, v_cur, v_cache_view));
 }
 
-// do mat_mul, while optionally apply lora
-static struct ggml_tensor * llm_build_lora_mm(
+// add the products of the lora adapters of w with cur to res, the product of w with cur
+static struct ggml_tensor * llm_build_lora_add(
         struct llama_context & lctx,
          struct ggml_context * ctx0,
           struct ggml_tensor * w,
-          struct ggml_tensor * cur) {
-    struct ggml_tensor * res = ggml_mul_mat(ctx0, w, cur);
+          struct ggml_tensor * cur,
+          struct ggml_tensor * res) {
     for (auto & it : lctx.lora_adapters) {
         struct llama_lora_weight * lora = it.first->get_weight(w);
         if (lora == nullptr) {
@@ -8810,6 +9809,15 @@ static struct ggml_tensor * llm_build_lora_mm(
     return res;
 }
 
+// do mat_mul, while optionally apply lora
+static struct ggml_tensor * llm_build_lora_mm(
+        struct llama_context & lctx,
+         struct ggml_context * ctx0,
+          struct ggml_tensor * w,
+          struct ggml_tensor * cur) {
+    return llm_build_lora_add(lctx, ctx0, w, cur, ggml_mul_mat(ctx0, w, cur));
+}
+
 // do mat_mul_id, while optionally apply lora
 static struct ggml_tensor * llm_build_lora_mm_id(
         struct llama_context & lctx,
@@ -9156,6 +10164,64 @@ llm_expert_gating_func_type   gating_op,
     //return moe_out;
 }
 
+// adds the attention of the last tokens of the batch to the KV cells, kq [n_kv, n_obs, n_head], to lctx.kq_score
+static void llm_build_kq_score(
+        struct ggml_context * ctx,
+       struct llama_context & lctx,
+         struct ggml_cgraph * graph,
+         struct ggml_tensor * kq,
+         const llm_build_cb & cb,
+                    int       il) {
+    const int64_t n_kv = kq->ne[0];
+
+    // sum over the tokens and the heads
+    struct ggml_tensor * score = ggml_cont(ctx, ggml_permute(ctx, kq, 2, 0, 1, 3));
+    score = ggml_sum_rows(ctx, ggml_reshape_2d(ctx, score, score->ne[0]*score->ne[1], n_kv));
+    score = ggml_reshape_1d(ctx, score, n_kv);
+
+    if (lctx.kq_score) {
+        score = ggml_add(ctx, lctx.kq_score, score);
+    }
+    cb(score, "kq_score", il);
+    ggml_set_output(score);
+    ggml_build_forward_expand(graph, score);
+
+    lctx.kq_score = score;
+}
+
+// the attention probabilities of the last tokens of the batch, for the KV budget when they are not computed anyway
+static struct ggml_tensor * llm_build_kq_obs(
+        struct ggml_context * ctx,
+       struct llama_context & lctx,
+         struct ggml_tensor * k,
+         struct ggml_tensor * q,
+         struct ggml_tensor * kq_mask,
+                    int32_t   n_tokens,
+                    float     kq_scale) {
+    const llama_model   & model   = lctx.model;
+    const llama_hparams & hparams = model.hparams;
+
+    const int64_t n_obs = std::min<int64_t>(n_tokens, LLAMA_KV_SCORE_N_OBS);
+
+    struct ggml_tensor * q_obs = ggml_view_3d(ctx, q, q->ne[0], n_obs, q->ne[2], q->nb[1], q->nb[2], q->nb[1]*(n_tokens - n_obs));
+    struct ggml_tensor * mask  = ggml_view_2d(ctx, kq_mask, kq_mask->ne[0], n_obs, kq_mask->nb[1], kq_mask->nb[1]*(n_tokens - n_obs));
+
+    struct ggml_tensor * kq = ggml_mul_mat(ctx, k, q_obs);
+    ggml_mul_mat_set_prec(kq, GGML_PREC_F32);
+
+    if (model.arch == LLM_ARCH_GROK) {
+        kq = ggml_softcap(ctx, kq, 0.08838834764831845f/30.0f, 30.f);
+    }
+    if (hparams.attn_soft_cap) {
+        kq = ggml_softcap_max(ctx, kq, mask, kq_scale, hparams.f_max_alibi_bias,
+                1.0f / hparams.f_attn_logit_softcapping, hparams.f_attn_logit_softcapping);
+    } else {
+        kq = ggml_soft_max_ext(ctx, kq, mask, kq_scale, hparams.f_max_alibi_bias);
+    }
+
+    return kq;
+}
+
 static struct ggml_tensor * llm_build_kqv(
         struct ggml_context * ctx,
        struct llama_context & lctx,
@@ -9221,6 +10287,10 @@ static struct ggml_tensor * llm_build_kqv(
         //ggml_flash_attn_ext_set_prec(cur, GGML_PREC_F32);
 
         cur = ggml_reshape_2d(ctx, cur, n_embd_head_v*n_head, n_tokens);
+
+        if (cparams.kv_budget > 0 && lctx.kq_observe) {
+            llm_build_kq_score(ctx, lctx, graph, llm_build_kq_obs(ctx, lctx, k, q, kq_mask, n_tokens, kq_scale), cb, il);
+        }
     } else {
 
             // split cached v into n_head heads
@@ -9270,6 +10340,12 @@ static struct ggml_tensor * llm_build_kqv(
             }
             cb(kq, "kq_soft_max_ext", il);
 
+            if (cparams.kv_budget > 0 && lctx.kq_observe) {
+                const int64_t n_obs = std::min<int64_t>(n_tokens, LLAMA_KV_SCORE_N_OBS);
+                llm_build_kq_score(ctx, lctx, graph,
+                        ggml_view_3d(ctx, kq, n_kv, n_obs, kq->ne[2], kq->nb[1], kq->nb[2], kq->nb[1]*(n_tokens - n_obs)), cb, il);
+            }
+
             GGML_ASSERT(kv.size == n_ctx);
 
             struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
@@ -9323,6 +10399,10 @@ static struct ggml_tensor * llm_build_kqv(
             cb(kqv_merged, "kqv_merged", il);
             cur = ggml_cont_2d(ctx, kqv_merged, n_embd_head_v*n_head, n_tokens);
             cb(cur, "kqv_merged_cont", il);
+
+            if (cparams.kv_budget > 0 && lctx.kq_observe) {
+                llm_build_kq_score(ctx, lctx, graph, llm_build_kq_obs(ctx, lctx, k, q, kq_mask, n_tokens, kq_scale), cb, il);
+            }
         }
     }
 
@@ -9380,6 +10460,14 @@ static struct ggml_tensor * llm_build_kv(
     return cur;
 }
 
+// drops the graph kept for replay, see llama_graph_cache
+static void llama_graph_reuse_invalidate(llama_context & lctx) {
+    lctx.graph_cache.reset();
+    if (lctx.backend_cpu) {
+        ggml_backend_cpu_set_reuse_plan(lctx.backend_cpu, false);
+    }
+}
+
 struct llm_build_context {
     const llama_model    & model;
           llama_context  & lctx;
@@ -9421,6 +10509,7 @@ struct llm_build_context {
     const int  mla_attn;
     const int  attn_max_batch;
     const bool fused_moe_up_gate;
+    const bool fused_attn_out;
     const int  min_experts;
     const float thresh_experts;
 
@@ -9476,6 +10565,7 @@ struct llm_build_context {
         mla_attn         (cparams.mla_attn),
         attn_max_batch   (cparams.attn_max_batch),
         fused_moe_up_gate(cparams.fused_moe_up_gate),
+        fused_attn_out   (cparams.fused_attn_out),
         min_experts      (cparams.min_experts),
         thresh_experts   (cparams.thresh_experts),
         pooling_type     (cparams.pooling_type),
@@ -9492,6 +10582,9 @@ struct llm_build_context {
             /*.no_alloc   =*/ true,
         };
 
+        // the new graph overwrites the one kept for replay in buf_compute_meta
+        llama_graph_reuse_invalidate(lctx);
+
         ctx0 = ggml_init(params);
 
         lctx.inp_tokens      = nullptr;
@@ -9509,6 +10602,7 @@ struct llm_build_context {
         lctx.inp_pos_bucket    = nullptr;
         lctx.inp_embd_enc      = nullptr;
         lctx.inp_KQ_mask_cross = nullptr;
+        lctx.kq_score          = nullptr;
     }
 
     void free() {
@@ -9522,8 +10616,12 @@ struct llm_build_context {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
         GGML_ASSERT(kv_self.size == n_ctx);
+        GGML_ASSERT(kv_self.shift_lo < kv_self.shift_hi && kv_self.shift_hi <= n_ctx);
+
+        // only the cells that have a pending shift are rotated
+        const int64_t n_shift = kv_self.shift_hi - kv_self.shift_lo;
 
-        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ctx);
+        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_shift);
         cb(lctx.inp_K_shift, "K_shift", -1);
         ggml_set_input(lctx.inp_K_shift);
 
@@ -9531,16 +10629,27 @@ struct llm_build_context {
             const int64_t n_head_kv = hparams.n_head_kv(il);
             const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
             struct ggml_tensor * rope_factors = build_rope_factors(il);
-            struct ggml_tensor * tmp =
+            struct ggml_tensor * k = ggml_view_3d(ctx0, kv_self.k_l[il],
+                    n_embd_head_k, n_head_kv, n_shift,
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa)*kv_self.shift_lo);
+            struct ggml_tensor * tmp;
+            if (ggml_is_quantized(k->type)) {
+                // the layers with a quantized K cache are rotated in F32 and quantized again
+                tmp = ggml_cast(ctx0, k, GGML_TYPE_F32);
+                cb(tmp, "K_f32", il);
+                tmp = ggml_rope_ext_inplace(ctx0, tmp,
+                        lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                        ext_factor, attn_factor, beta_fast, beta_slow);
+                cb(tmp, "K_f32_shifted", il);
+                tmp = ggml_cpy(ctx0, tmp, k);
+            } else {
                 // we rotate only the first n_rot dimensions
-                ggml_rope_ext_inplace(ctx0,
-                        ggml_view_3d(ctx0, kv_self.k_l[il],
-                            n_embd_head_k, n_head_kv, n_ctx,
-                            ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
-                            ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                            0),
+                tmp = ggml_rope_ext_inplace(ctx0, k,
                         lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
+            }
 
             cb(tmp, "K_shifted", il);
             ggml_build_forward_expand(gf, tmp);
@@ -9670,6 +10779,104 @@ struct llm_build_context {
         return model.layers[il].rope_short;
     }
 
+    // Q, K and V of layer il from the normalized input cur, with the biases of the layer (if any) added. Q and K
+    // are returned as [n_embd_head_k, n_head(_kv), n_tokens], V as [n_embd_v_gqa, n_tokens]. If wq, wk and wv
+    // have been merged at load time (llama_model_params::fused_qkv), this is a single matmul and the results are
+    // non-contiguous views of its output. wq, wk and wv are then views of wqkv that are not multiplied themselves:
+    // with -rtr only wqkv is repacked and the views keep the type of the original data. When a LoRA adapter
+    // applies to wq, wk or wv, its product is added to a copy of the corresponding part of the output.
+    // q_scale != 0 scales Q (before the bias).
+    void build_qkv(int il, struct ggml_tensor * cur, struct ggml_tensor ** q, struct ggml_tensor ** k, struct ggml_tensor ** v,
+            float q_scale = 0.0f) {
+        const auto & layer = model.layers[il];
+
+        const int64_t n_embd_head_k = hparams.n_embd_head_k;
+        const int64_t n_head_l      = hparams.n_head(il);
+        const int64_t n_head_kv_l   = hparams.n_head_kv(il);
+
+        if (layer.wqkv && layer.wq) {
+            struct ggml_tensor * qkv = llm_build_lora_mm(lctx, ctx0, layer.wqkv, cur);
+            cb(qkv, "wqkv", il);
+            const size_t es = ggml_element_size(qkv);
+            if (has_lora_qkv(layer) || (q_scale != 0 && layer.bqkv)) {
+                auto part = [&](struct ggml_tensor * w, struct ggml_tensor * b, size_t offset, float scale) {
+                    struct ggml_tensor * t = ggml_cont(ctx0, ggml_view_2d(ctx0, qkv, w->ne[1], n_tokens, qkv->nb[1], offset));
+                    t = llm_build_lora_add(lctx, ctx0, w, cur, t);
+                    if (scale != 0) {
+                        t = ggml_scale(ctx0, t, scale);
+                    }
+                    if (b) {
+                        t = ggml_add(ctx0, t, b);
+                    }
+                    return t;
+                };
+                *q = part(layer.wq, layer.bq, 0, q_scale);
+                cb(*q, "Qcur", il);
+                *k = part(layer.wk, layer.bk, layer.wq->ne[1]*es, 0);
+                cb(*k, "Kcur", il);
+                *v = part(layer.wv, layer.bv, (layer.wq->ne[1] + layer.wk->ne[1])*es, 0);
+                cb(*v, "Vcur", il);
+                *q = ggml_reshape_3d(ctx0, *q, n_embd_head_k, n_head_l,    n_tokens);
+                *k = ggml_reshape_3d(ctx0, *k, n_embd_head_k, n_head_kv_l, n_tokens);
+                return;
+            }
+            if (layer.bqkv) {
+                qkv = ggml_add(ctx0, qkv, layer.bqkv);
+                cb(qkv, "bqkv", il);
+            }
+            *q = ggml_view_3d(ctx0, qkv, n_embd_head_k, n_head_l,    n_tokens, n_embd_head_k*es, qkv->nb[1], 0);
+            *k = ggml_view_3d(ctx0, qkv, n_embd_head_k, n_head_kv_l, n_tokens, n_embd_head_k*es, qkv->nb[1], layer.wq->ne[1]*es);
+            *v = ggml_view_2d(ctx0, qkv, layer.wv->ne[1], n_tokens, qkv->nb[1], (layer.wq->ne[1] + layer.wk->ne[1])*es);
+            if (q_scale != 0) {
+                *q = ggml_scale(ctx0, ggml_cont(ctx0, *q), q_scale);
+            }
+        } else {
+            *q = llm_build_lora_mm(lctx, ctx0, layer.wq, cur);
+            if (q_scale != 0) {
+                *q = ggml_scale(ctx0, *q, q_scale);
+            }
+            cb(*q, "Qcur", il);
+            if (layer.bq) {
+                *q = ggml_add(ctx0, *q, layer.bq);
+                cb(*q, "Qcur", il);
+            }
+            *k = llm_build_lora_mm(lctx, ctx0, layer.wk, cur);
+            cb(*k, "Kcur", il);
+            if (layer.bk) {
+                *k = ggml_add(ctx0, *k, layer.bk);
+                cb(*k, "Kcur", il);
+            }
+            *v = llm_build_lora_mm(lctx, ctx0, layer.wv, cur);
+            cb(*v, "Vcur", il);
+            if (layer.bv) {
+                *v = ggml_add(ctx0, *v, layer.bv);
+                cb(*v, "Vcur", il);
+            }
+            *q = ggml_reshape_3d(ctx0, *q, n_embd_head_k, n_head_l,    n_tokens);
+            *k = ggml_reshape_3d(ctx0, *k, n_embd_head_k, n_head_kv_l, n_tokens);
+        }
+    }
+
+    // whether a LoRA adapter applies to the Q, K or V projection of the layer
+    bool has_lora_qkv(const llama_layer & layer) const {
+        for (const auto & it : lctx.lora_adapters) {
+            for (auto * w : { layer.wq, layer.wk, layer.wv }) {
+                if (w && it.first->get_weight(w)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // whether the attention output projection of layer il is done together with the residual add that follows it
+    // (ggml_mul_mat_add, llama_context_params::fused_attn_out)
+    bool use_fused_attn_out(int il) const {
+        const auto & layer = model.layers[il];
+        return fused_attn_out && layer.wo && !layer.bo && lctx.lora_adapters.empty() &&
+               layer.wo->buffer && ggml_backend_buffer_is_host(layer.wo->buffer);
+    }
+
     struct ggml_tensor * build_inp_out_ids() {
         lctx.inp_out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_outputs);
         cb(lctx.inp_out_ids, "inp_out_ids", -1);
@@ -9858,6 +11065,9 @@ struct llm_build_context {
 
             bool use_rope = model.arch == LLM_ARCH_LLAMA4 ? (il + 1) % hparams.n_no_rope_layer_step != 0 : true;
 
+            // the residual scale of Granite is applied between Wo and the residual add
+            const bool fuse_out = use_fused_attn_out(il) && !hparams.f_residual_scale;
+
             // norm
             cur = llm_build_norm(ctx0, inpL, hparams,
                     model.layers[il].attn_norm, NULL,
@@ -9870,41 +11080,20 @@ struct llm_build_context {
                 struct ggml_tensor * rope_factors = build_rope_factors(il);
 
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wq, cur);
-                if (hparams.f_attention_scale != 0) {
-                    // Why is hparams.f_attention_scale not simply absorbed into model.layers[il].wq ?
-                    Qcur = ggml_scale(ctx0, Qcur, hparams.f_attention_scale);
-                }
-                cb(Qcur, "Qcur", il);
-                if (model.layers[il].bq) {
-                    Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
-                    cb(Qcur, "Qcur", il);
-                }
-
-                struct ggml_tensor * Kcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wk, cur);
-                cb(Kcur, "Kcur", il);
-                if (model.layers[il].bk) {
-                    Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
-                    cb(Kcur, "Kcur", il);
-                }
-
-                struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
-                cb(Vcur, "Vcur", il);
-                if (model.layers[il].bv) {
-                    Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
-                    cb(Vcur, "Vcur", il);
-                }
+                // Why is hparams.f_attention_scale not simply absorbed into model.layers[il].wq ?
+                struct ggml_tensor * Qcur, * Kcur, * Vcur;
+                build_qkv(il, cur, &Qcur, &Kcur, &Vcur, hparams.f_attention_scale);
 
                 if (use_rope) {
-                    Qcur = ggml_rope_ext(ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_factors,
+                    Qcur = ggml_rope_ext(ctx0, Qcur, inp_pos, rope_factors,
                             n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                             ext_factor, attn_factor, beta_fast, beta_slow);
 
-                    Kcur = ggml_rope_ext(ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_factors,
+                    Kcur = ggml_rope_ext(ctx0, Kcur, inp_pos, rope_factors,
                             n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                             ext_factor, attn_factor, beta_fast, beta_slow);
                 } else if (inp_attn_scale) {
-                    Qcur = ggml_mul(ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_attn_scale);
+                    Qcur = ggml_mul(ctx0, Qcur, inp_attn_scale);
                 }
 
                 cb(Qcur, "Qcur", il);
@@ -9920,7 +11109,7 @@ struct llm_build_context {
                 }
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
-                        model.layers[il].wo, model.layers[il].bo,
+                        fuse_out ? nullptr : model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, kq_scale, cb, il);
             }
 
@@ -9938,7 +11127,8 @@ struct llm_build_context {
                 cur = ggml_scale(ctx0, cur, hparams.f_residual_scale);
             }
 
-            struct ggml_tensor * ffn_inp = ggml_add(ctx0, cur, inpSA);
+            struct ggml_tensor * ffn_inp = fuse_out ? ggml_mul_mat_add(ctx0, model.layers[il].wo, cur, inpSA)
+                                                    : ggml_add(ctx0, cur, inpSA);
             cb(ffn_inp, "ffn_inp", il);
 
             // feed-forward network
@@ -11587,6 +12777,7 @@ struct llm_build_context {
 
         for (int il = 0; il < n_layer; ++il) {
             struct ggml_tensor * inpSA = inpL;
+            const bool fuse_out = use_fused_attn_out(il);
 
             // norm
             cur = llm_build_norm(ctx0, inpL, hparams,
@@ -11597,37 +12788,25 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wq, cur);
-                cb(Qcur, "Qcur", il);
-                Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
-                cb(Qcur, "Qcur", il);
-
-                struct ggml_tensor * Kcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wk, cur);
-                cb(Kcur, "Kcur", il);
-                Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
-                cb(Kcur, "Kcur", il);
-
-                struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
-                cb(Vcur, "Vcur", il);
-                Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
-                cb(Vcur, "Vcur", il);
+                struct ggml_tensor * Qcur, * Kcur, * Vcur;
+                build_qkv(il, cur, &Qcur, &Kcur, &Vcur);
 
                 Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
+                    ctx0, Qcur, inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
                 Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                    ctx0, Kcur, inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Kcur, "Kcur", il);
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
-                        model.layers[il].wo, model.layers[il].bo,
+                        fuse_out ? nullptr : model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
@@ -11638,7 +12817,8 @@ struct llm_build_context {
                 inpSA = ggml_get_rows(ctx0, inpSA, inp_out_ids);
             }
 
-            struct ggml_tensor * ffn_inp = ggml_add(ctx0, cur, inpSA);
+            struct ggml_tensor * ffn_inp = fuse_out ? ggml_mul_mat_add(ctx0, model.layers[il].wo, cur, inpSA)
+                                                    : ggml_add(ctx0, cur, inpSA);
             cb(ffn_inp, "ffn_inp", il);
 
             // feed-forward network
@@ -12798,6 +13978,8 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = build_inp_KQ_mask();
 
         for (int il = 0; il < n_layer; ++il) {
+            const bool fuse_out = use_fused_attn_out(il);
+
             // norm
             cur = llm_build_norm(ctx0, inpL, hparams,
                     model.layers[il].attn_norm, NULL,
@@ -12807,17 +13989,11 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wq, cur);
-                cb(Qcur, "Qcur", il);
-
-                struct ggml_tensor * Kcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wk, cur);
-                cb(Kcur, "Kcur", il);
-
-                struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
-                cb(Vcur, "Vcur", il);
+                struct ggml_tensor * Qcur, * Kcur, * Vcur;
+                build_qkv(il, cur, &Qcur, &Kcur, &Vcur);
 
                 Qcur = ggml_rope_ext(
-                        ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head_k, n_head,    n_tokens), inp_pos, nullptr,
+                        ctx0, Qcur, inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Qcur, "Qcur", il);
@@ -12826,13 +14002,13 @@ struct llm_build_context {
                 cb(Qcur, "Qcur_scaled", il);
 
                 Kcur = ggml_rope_ext(
-                        ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head_k, n_head_kv, n_tokens), inp_pos, nullptr,
+                        ctx0, Kcur, inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
-                        model.layers[il].wo, NULL,
+                        fuse_out ? nullptr : model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f, cb, il);
             }
 
@@ -12843,7 +14019,8 @@ struct llm_build_context {
                 inpL = ggml_get_rows(ctx0, inpL, inp_out_ids);
             }
 
-            struct ggml_tensor * sa_out = ggml_add(ctx0, cur, inpL);
+            struct ggml_tensor * sa_out = fuse_out ? ggml_mul_mat_add(ctx0, model.layers[il].wo, cur, inpL)
+                                                   : ggml_add(ctx0, cur, inpL);
             cb(sa_out, "sa_out", il);
 
             cur = llm_build_norm(ctx0, sa_out, hparams,
@@ -12920,17 +14097,11 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wq, cur);
-                cb(Qcur, "Qcur", il);
-
-                struct ggml_tensor * Kcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wk, cur);
-                cb(Kcur, "Kcur", il);
-
-                struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
-                cb(Vcur, "Vcur", il);
+                struct ggml_tensor * Qcur, * Kcur, * Vcur;
+                build_qkv(il, cur, &Qcur, &Kcur, &Vcur);
 
                 Qcur = ggml_rope_ext(
-                        ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head_k, n_head,    n_tokens), inp_pos, nullptr,
+                        ctx0, Qcur, inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Qcur, "Qcur", il);
@@ -12945,7 +14116,7 @@ struct llm_build_context {
                 cb(Qcur, "Qcur_scaled", il);
 
                 Kcur = ggml_rope_ext(
-                        ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head_k, n_head_kv, n_tokens), inp_pos, nullptr,
+                        ctx0, Kcur, inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
@@ -15563,14 +16734,14 @@ static struct ggml_cgraph * llama_build_graph(
 }
 
 static void llama_set_k_shift(llama_context & lctx) {
-    const int64_t kv_size = lctx.kv_self.size;
+    const auto & kv_self = lctx.kv_self;
 
     assert(ggml_backend_buffer_is_host(lctx.inp_K_shift->buffer));
 
     int32_t * data = (int32_t *) lctx.inp_K_shift->data;
 
-    for (int i = 0; i < kv_size; ++i) {
-        data[i] = lctx.kv_self.cells[i].delta;
+    for (uint32_t i = kv_self.shift_lo; i < kv_self.shift_hi; ++i) {
+        data[i - kv_self.shift_lo] = kv_self.cells.delta(i);
     }
 }
 
@@ -15582,7 +16753,7 @@ static void llama_set_s_copy(llama_context & lctx) {
     int32_t * data = (int32_t *) lctx.inp_s_copy->data;
 
     for (int i = 0; i < kv_size; ++i) {
-        data[i] = lctx.kv_self.cells[i].src;
+        data[i] = lctx.kv_self.cells.src(i);
     }
 }
 
@@ -15711,39 +16882,45 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
             // of the correct sequence for each token of the batch.
             // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
             for (int h = 0; h < 1; ++h) {
+                const auto & cells = lctx.kv_self.cells;
+
                 for (int j = 0; j < n_tokens; ++j) {
                     const llama_pos    pos    = batch.pos[j];
                     const llama_seq_id seq_id = batch.seq_id[j][0];
 
-                    for (int i = 0; i < n_kv; ++i) {
-                        float f;
-                        if (!lctx.kv_self.cells[i].has_seq_id(seq_id) || lctx.kv_self.cells[i].pos > pos) {
-                            f = -INFINITY;
-                        } else {
-                            if (hparams.use_alibi) {
-                                f = -std::abs(lctx.kv_self.cells[i].pos - pos);
-                            } else {
-                                f = 0.0f;
-                            }
-                        }
+                    float * row     = data     ? data     + h*(n_kv*n_tokens) + j*n_kv : nullptr;
+                    float * row_swa = data_swa ? data_swa + h*(n_kv*n_tokens) + j*n_kv : nullptr;
+
+                    // the cells of the sequence up to pos get 0, the rest -INFINITY
+                    cells.mask_row(seq_id, pos, n_kv, row ? row : row_swa);
+                    if (row && row_swa) {
+                        std::memcpy(row_swa, row, n_kv*sizeof(float));
+                    }
 
-                        if (data) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = f;
+                    if (hparams.use_alibi) {
+                        for (float * r : { row, row_swa }) {
+                            if (!r) continue;
+                            for (int i = 0; i < n_kv; ++i) {
+                                if (r[i] == 0.0f) r[i] = -std::abs(cells.pos(i) - pos);
+                            }
                         }
+                    }
 
-                        // may need to cut off old tokens for sliding window
-                        if (data_swa) {
-                            if (hparams.n_attn_chunk) {
-                                llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
-                                if (lctx.kv_self.cells[i].pos < pos_chunk_start || pos < pos_chunk_start) {
-                                    f = -INFINITY;
+                    // may need to cut off old tokens for sliding window
+                    if (row_swa) {
+                        if (hparams.n_attn_chunk) {
+                            llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
+                            for (int i = 0; i < n_kv; ++i) {
+                                if (cells.pos(i) < pos_chunk_start || pos < pos_chunk_start) {
+                                    row_swa[i] = -INFINITY;
                                 }
-                            } else {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
+                            }
+                        } else {
+                            for (int i = 0; i < n_kv; ++i) {
+                                if (pos - cells.pos(i) >= (int32_t)hparams.n_swa) {
+                                    row_swa[i] = -INFINITY;
                                 }
                             }
-                            data_swa[h*(n_kv*n_tokens) + j*n_kv + i] = f;
                         }
                     }
                 }
@@ -15894,15 +17071,14 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
 
             // states which are not affected by the current batch are left untouched
             for (int i = 0; i < n_kv; ++i) {
-                llama_seq_id    seq_id       = i + lctx.kv_self.head;
-                llama_kv_cell & kv_cell      = lctx.kv_self.cells[seq_id];
-                bool            has_self_seq = kv_cell.has_seq_id(seq_id);
+                llama_seq_id seq_id       = i + lctx.kv_self.head;
+                bool         has_self_seq = lctx.kv_self.cells.has_seq_id(seq_id, seq_id);
 
                 data[i] = (float) has_self_seq;
 
                 // ensure current sequences will be kept
-                if (!has_self_seq && kv_cell.pos >= 0) {
-                    kv_cell.seq_id.insert(seq_id);
+                if (!has_self_seq && lctx.kv_self.cells.pos(seq_id) >= 0) {
+                    lctx.kv_self.cells.seq_add(seq_id, seq_id);
                 }
             }
         }
@@ -15944,7 +17120,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
             for (int h = 0; h < 1; ++h) {
                 for (int j = 0; j < n_tokens; ++j) {
                     for (int i = 0; i < n_kv; ++i) {
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(lctx.kv_self.cells[i].pos, batch.pos[j], hparams.n_rel_attn_bkts, lctx.is_encoding);
+                        data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(lctx.kv_self.cells.pos(i), batch.pos[j], hparams.n_rel_attn_bkts, lctx.is_encoding);
                     }
                 }
             }
@@ -16042,7 +17218,7 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
             lctx.embd = nullptr;
         }
 
-        lctx.buf_output = ggml_backend_buft_alloc_buffer(llama_default_buffer_type_cpu(true), new_size);
+        lctx.buf_output = ggml_backend_buft_alloc_buffer(llama_default_buffer_type_cpu(true, lctx.model.use_thp), new_size);
         if (lctx.buf_output == nullptr) {
             LLAMA_LOG_ERROR("%s: failed to allocate output buffer of size %.2f MiB\n", __func__, new_size / (1024.0 * 1024.0));
             return 0;
@@ -16079,19 +17255,392 @@ static void llama_graph_compute(
     }
 #endif
 
-    if (lctx.backend_cpu != nullptr) {
-        ggml_backend_cpu_set_n_threads(lctx.backend_cpu, n_threads);
-        ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
+    if (lctx.backend_cpu != nullptr) {
+        ggml_backend_cpu_set_n_threads(lctx.backend_cpu, n_threads);
+        ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
+    }
+#ifdef GGML_USE_BLAS
+    if (lctx.backend_blas != nullptr) {
+        ggml_backend_blas_set_n_threads(lctx.backend_blas, n_threads);
+    }
+#endif
+
+    ggml_backend_sched_graph_compute_async(lctx.sched, gf);
+
+    // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
+}
+
+// accumulates the attention the batch gave to the KV cells into their scores
+static void llama_kv_cache_add_scores(llama_context & lctx) {
+    auto & kv_self = lctx.kv_self;
+
+    const int64_t n_kv = lctx.kq_score->ne[0];
+    GGML_ASSERT(n_kv <= kv_self.size);
+
+    ggml_backend_t backend = ggml_backend_sched_get_tensor_backend(lctx.sched, lctx.kq_score);
+    GGML_ASSERT(backend != nullptr);
+
+    lctx.buf_kq_score.resize(n_kv);
+    ggml_backend_tensor_get_async(backend, lctx.kq_score, lctx.buf_kq_score.data(), 0, n_kv*sizeof(float));
+    ggml_backend_synchronize(backend);
+
+    for (int64_t i = 0; i < n_kv; ++i) {
+        kv_self.cells.add_score(i, lctx.buf_kq_score[i]);
+    }
+}
+
+// whether the graph of this single token u_batch can be kept for replay (see llama_graph_cache)
+static bool llama_graph_reuse_supported(const llama_context & lctx, const llama_batch & u_batch) {
+    return lctx.cparams.graph_reuse && u_batch.n_tokens == 1 && lctx.cparams.causal_attn && lctx.model.hparams.causal_attn &&
+        !lctx.kv_self.recurrent && lctx.backend_cpu != nullptr && lctx.backends.size() == 1;
+}
+
+static bool llama_graph_reuse_is_warmup(const llama_context & lctx, const llama_batch & u_batch) {
+    // must match the warmup detection in llama_build_graph
+    return u_batch.n_tokens == 1 && u_batch.token && u_batch.token[0] == llama_token_bos_impl(*llama_get_vocab(&lctx));
+}
+
+// records the copies into the KV cache of a freshly built graph, returns false if the graph cannot be replayed
+static bool llama_graph_reuse_capture(llama_context & lctx, ggml_cgraph * gf, const llama_batch & u_batch) {
+    const auto & kv_self = lctx.kv_self;
+
+    std::set<const ggml_tensor *> cache_tensors;
+    for (auto * tensors : { &kv_self.k_l, &kv_self.v_l, &kv_self.kv_l, &kv_self.kvt_l }) {
+        for (auto * t : *tensors) {
+            if (t) cache_tensors.insert(t);
+        }
+    }
+
+    auto & cache = lctx.graph_cache;
+    cache.kv_views.clear();
+
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        ggml_tensor * node = gf->nodes[i];
+        if (node->op != GGML_OP_CPY || !node->view_src || !cache_tensors.count(node->view_src)) {
+            continue;
+        }
+        ggml_tensor * view    = node->src[1];
+        ggml_tensor * cache_t = node->view_src;
+
+        // the V cache (and the MLA kvt cache) is transposed without flash attention, a cell is then a column
+        const bool transposed = view->ne[0] == 1 && view->ne[1] > 1 && view->nb[1] == ggml_row_size(cache_t->type, kv_self.size);
+        const size_t cell_size = transposed ? ggml_row_size(cache_t->type, 1) : ggml_nbytes(cache_t)/kv_self.size;
+
+        if (view->view_src != cache_t || view->view_offs != cell_size*kv_self.head || node->view_offs != view->view_offs) {
+            // not a store at kv_self.head that we know how to move
+            cache.kv_views.clear();
+            return false;
+        }
+        cache.kv_views.emplace_back(view, cell_size);
+        cache.kv_views.emplace_back(node, cell_size);
+    }
+
+    if (cache.kv_views.empty()) {
+        return false;
+    }
+
+    cache.gf         = gf;
+    cache.n_kv       = kv_self.n;
+    cache.n_outputs  = lctx.n_outputs;
+    cache.embd_inp   = u_batch.embd != nullptr;
+    cache.warmup     = llama_graph_reuse_is_warmup(lctx, u_batch);
+    cache.kq_observe = lctx.kq_observe;
+
+    return true;
+}
+
+// returns the kept graph if it can compute u_batch, with its KV cache stores moved to kv_self.head
+static ggml_cgraph * llama_graph_reuse_replay(llama_context & lctx, const llama_batch & u_batch) {
+    auto & cache = lctx.graph_cache;
+    if (!cache.gf || cache.n_kv != lctx.kv_self.n || cache.n_outputs != lctx.n_outputs ||
+        cache.embd_inp != (u_batch.embd != nullptr) || cache.warmup != llama_graph_reuse_is_warmup(lctx, u_batch) ||
+        cache.kq_observe != lctx.kq_observe) {
+        return nullptr;
+    }
+
+    for (auto & kv_view : cache.kv_views) {
+        ggml_tensor * t = kv_view.first;
+        const size_t offs = kv_view.second*lctx.kv_self.head;
+        t->view_offs = offs;
+        t->data      = (char *) t->view_src->data + offs;
+        if (t->op == GGML_OP_VIEW) {
+            std::memcpy(t->op_params, &offs, sizeof(offs));
+        }
+    }
+
+    return cache.gf;
+}
+
+// find holes from the beginning of the KV cache and plan to fill them by moving data from the end of the cache
+//
+//  cell i moves to ids[i]
+//
+//  if ids[i] == i || ids[i] == n_kv, then cell i is not moved
+//
+// at most max_cells cells are moved (0 - no limit) in at most max_moves contiguous moves. The cell meta data is left
+// unchanged, see llama_kv_cache_defrag_apply.
+// returns the number of cells to move, done is set if no hole is left before the used cells afterwards
+static uint32_t llama_kv_cache_defrag_plan(
+        const struct llama_kv_cache & kv_self,
+                           uint32_t   max_moves,
+                           uint32_t   max_cells,
+              std::vector<uint32_t> & ids,
+                               bool & done) {
+    const uint32_t n_kv   = llama_kv_cache_cell_max(kv_self);
+    const uint32_t n_used = kv_self.used;
+
+    assert(n_used <= n_kv);
+
+    auto movable = [&](uint32_t i) {
+        return !kv_self.cells.is_empty(i) && ids[i] == n_kv;
+    };
+
+    // number of cells moved
+    uint32_t n_cells = 0;
+
+    // number of contiguous moves
+    uint32_t n_moves = 0;
+
+    done = false;
+
+    ids.assign(n_kv, n_kv);
+
+    uint32_t i0 = 0;
+    for (; i0 < n_used; ++i0) {
+        if (!kv_self.cells.is_empty(i0)) {
+            ids[i0] = i0;
+
+            continue;
+        }
+
+        // found a hole - fill it with data from the end of the cache
+
+        uint32_t nh = 1;
+
+        // determine the size of the hole
+        while (i0 + nh < n_used && kv_self.cells.is_empty(i0 + nh)) {
+            nh++;
+        }
+
+        if (max_cells > 0) {
+            nh = std::min(nh, max_cells - n_cells);
+        }
+
+        uint32_t nf = 0;
+        uint32_t is = n_kv - 1;
+
+        // starting from the end, find nh non-empty cells
+        // there are as many used cells at or after n_used as holes before it, so the sources are never holes to fill
+        for (; is >= n_used; --is) {
+            if (!movable(is)) {
+                continue;
+            }
+
+            // non-empty cell which is not yet moved
+            nf++;
+
+            if (nf == nh) {
+                break;
+            }
+        }
+
+        // this can only happen if `n_used` is not accurate, which would be a bug
+        GGML_ASSERT(nf == nh && "KV defrag bug: nf != nh");
+
+        nf = 0;
+
+        uint32_t i1 = is;
+
+        // are we moving a continuous block of memory?
+        bool cont = false;
+
+        // should we stop searching for the next move?
+        bool stop = false;
+
+        // go back and move the nf cells to the hole
+        for (; i1 < n_kv; ++i1) {
+            if (!movable(i1)) {
+                if (n_moves == max_moves) {
+                    stop = true;
+                    break;
+                }
+
+                cont = false;
+                continue;
+            }
+
+            // this cell goes to (i0 + nf)
+            ids[i1] = i0 + nf;
+
+            if (!cont) {
+                n_moves++;
+                cont = true;
+            }
+
+            nf++;
+
+            if (nf == nh) {
+                break;
+            }
+        }
+
+        n_cells += nf;
+
+        if (stop || nf < nh || n_moves == max_moves || n_cells == max_cells) {
+            break;
+        }
+
+        //LLAMA_LOG_INFO("(tmp log) KV defrag: move [%u, %u) to [%u, %u)\n", is, i1 + 1, i0, i0 + nh);
+
+        i0 += nh - 1;
+    }
+
+    done = i0 >= n_used;
+
+    return n_cells;
+}
+
+// moves the meta data of the cells as planned by llama_kv_cache_defrag_plan
+static void llama_kv_cache_defrag_apply(struct llama_kv_cache & kv_self, const std::vector<uint32_t> & ids) {
+    const uint32_t n_kv = ids.size();
+
+    for (uint32_t i = 0; i < n_kv; ++i) {
+        if (ids[i] != i && ids[i] != n_kv) {
+            // move the cell meta data, clear the old cell and move the head there
+            kv_self.cells.move(ids[i], i);
+        }
+    }
+
+    kv_self.head = kv_self.used;
+}
+
+// the CPU version of build_defrag for a KV cache in host memory, see cparams.defrag_async
+static void llama_kv_cache_defrag_copy(const struct llama_kv_cache & kv_self, const llama_hparams & hparams, const std::vector<uint32_t> & ids) {
+    const uint32_t n_kv    = ids.size();
+    const uint32_t n_layer = kv_self.k_l.size();
+
+    for (uint32_t i = 0; i < n_kv; ++i) {
+        const uint32_t id = ids[i];
+
+        if (i == id || id == n_kv) {
+            continue;
+        }
+
+        uint32_t nm = 1;
+
+        while (i + nm < n_kv && ids[i + nm] == id + nm) {
+            nm++;
+        }
+
+        // batch move [i, i+nm) to [id, id+nm)
+        for (uint32_t il = 0; il < n_layer; ++il) {
+            const ggml_tensor * k = kv_self.k_l[il];
+            const ggml_tensor * v = kv_self.v_l[il];
+
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+            // move keys
+            {
+                const size_t k_size_row = ggml_row_size(k->type, n_embd_k_gqa);
+
+                std::memcpy((char *) k->data + id*k_size_row, (const char *) k->data + i*k_size_row, nm*k_size_row);
+            }
+
+            // move values (note: they are transposed without flash attention)
+            if (kv_self.v_trans) {
+                const size_t v_size_el = ggml_type_size(v->type);
+
+                for (int64_t j = 0; j < n_embd_v_gqa; ++j) {
+                    std::memcpy((char *) v->data + (id + j*kv_self.size)*v_size_el,
+                          (const char *) v->data + (i  + j*kv_self.size)*v_size_el, nm*v_size_el);
+                }
+            } else {
+                const size_t v_size_row = ggml_row_size(v->type, n_embd_v_gqa);
+
+                std::memcpy((char *) v->data + id*v_size_row, (const char *) v->data + i*v_size_row, nm*v_size_row);
+            }
+        }
+
+        i += nm - 1;
+    }
+}
+
+// one step of the defragmentation, at most cparams.defrag_max_cells cells are moved, returns true when done
+static bool llama_kv_cache_defrag_internal(struct llama_context & lctx) {
+    auto & kv_self = lctx.kv_self;
+
+    const uint32_t n_layer = lctx.model.hparams.n_layer;
+
+    //const int64_t t_start = ggml_time_us();
+
+    // each move requires 6*n_layer tensors (see build_defrag)
+    //   - source view, destination view, copy operation
+    //   - x2 for keys and values
+    //const uint32_t max_moves = llama_model_max_nodes(model)/(6*n_layer);
+    // TODO: tmp fix https://github.com/ggerganov/llama.cpp/issues/6685#issuecomment-2057579516
+    const uint32_t max_moves = (llama_model_max_nodes(lctx.model) - 2*n_layer)/(6*n_layer);
+
+    std::vector<uint32_t> ids;
+
+    bool done;
+    const uint32_t n_cells = llama_kv_cache_defrag_plan(kv_self, max_moves, lctx.cparams.defrag_max_cells, ids, done);
+
+    if (n_cells == 0) {
+        return true;
+    }
+
+    //LLAMA_LOG_INFO("(tmp log) KV defrag cells moved: %u\n", n_cells);
+
+    llama_kv_cache_defrag_apply(kv_self, ids);
+
+    // ggml_graph defrag
+
+    ggml_backend_sched_reset(lctx.sched);
+
+    ggml_cgraph * gf = llama_build_graph_defrag(lctx, ids);
+
+    llama_graph_compute(lctx, gf, lctx.cparams.n_threads);
+
+    //const int64_t t_end = ggml_time_us();
+
+    //LLAMA_LOG_INFO("(tmp log) KV defrag time: %.3f ms\n", (t_end - t_start)/1000.0);
+
+    // without a limit the moves are only capped by the graph size, the next defrag is triggered by defrag_thold
+    return done || lctx.cparams.defrag_max_cells == 0;
+}
+
+// waits for the KV data of the defrag step started by llama_kv_cache_defrag_start, see cparams.defrag_async. Must be
+// called before anything reads or writes the K and V tensors.
+static void llama_kv_cache_defrag_wait(struct llama_context & lctx) {
+    if (lctx.defrag_worker.joinable()) {
+        lctx.defrag_worker.join();
     }
-#ifdef GGML_USE_BLAS
-    if (lctx.backend_blas != nullptr) {
-        ggml_backend_blas_set_n_threads(lctx.backend_blas, n_threads);
+
+    lctx.defrag_ids.clear();
+}
+
+// starts a defrag step after the graphs of llama_decode are done. The cell meta data is moved right away, so the next
+// batch is placed in the defragmented cache, and the KV data is moved on lctx.defrag_worker while the caller reads the
+// outputs and prepares the next batch, until llama_kv_cache_defrag_wait.
+static void llama_kv_cache_defrag_start(struct llama_context & lctx) {
+    auto & kv_self = lctx.kv_self;
+
+    llama_kv_cache_defrag_wait(lctx);
+
+    bool done;
+    const uint32_t n_cells = llama_kv_cache_defrag_plan(kv_self, UINT32_MAX, lctx.cparams.defrag_max_cells, lctx.defrag_ids, done);
+
+    kv_self.do_defrag = !done && lctx.cparams.defrag_max_cells > 0;
+
+    if (n_cells == 0) {
+        lctx.defrag_ids.clear();
+        return;
     }
-#endif
 
-    ggml_backend_sched_graph_compute_async(lctx.sched, gf);
+    llama_kv_cache_defrag_apply(kv_self, lctx.defrag_ids);
 
-    // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
+    lctx.defrag_worker = std::thread(llama_kv_cache_defrag_copy, std::cref(kv_self), std::cref(lctx.model.hparams), std::cref(lctx.defrag_ids));
 }
 
 // decode a batch of tokens by evaluating the transformer
@@ -16256,7 +17805,12 @@ static int llama_decode_internal(
                 kv_self.head = 0;
             }
 
-            if (!llama_kv_cache_find_slot(kv_self, u_batch)) {
+            if (cparams.kv_budget > 0) {
+                llama_kv_cache_budget_evict(kv_self, cparams, u_batch);
+                lctx.kq_observe = n_tokens > 1 || lctx.n_kq_tg++ % LLAMA_KV_SCORE_TG_PERIOD == 0;
+            }
+
+            if (!(kv_self.block_size ? llama_kv_cache_find_slot_paged(kv_self, u_batch) : llama_kv_cache_find_slot(kv_self, u_batch))) {
                 return 1;
             }
 
@@ -16272,10 +17826,21 @@ static int llama_decode_internal(
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-        ggml_backend_sched_reset(lctx.sched);
         ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
 
-        ggml_cgraph * gf = llama_build_graph(lctx, u_batch, false);
+        const bool graph_reuse = llama_graph_reuse_supported(lctx, u_batch);
+
+        ggml_cgraph * gf = graph_reuse ? llama_graph_reuse_replay(lctx, u_batch) : nullptr;
+        const bool replay = gf != nullptr;
+
+        if (replay) {
+            // the graph is still split and allocated by the scheduler, and its plan is kept by the CPU backend
+            ggml_backend_cpu_set_reuse_plan(lctx.backend_cpu, true);
+        } else {
+            ggml_backend_sched_reset(lctx.sched);
+
+            gf = llama_build_graph(lctx, u_batch, false);
+        }
 
         // the output is always the last tensor in the graph
         struct ggml_tensor * res  = gf->nodes[gf->n_nodes - 1];
@@ -16301,14 +17866,27 @@ static int llama_decode_internal(
         }
         // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
-        ggml_backend_sched_alloc_graph(lctx.sched, gf);
+        if (!replay) {
+            ggml_backend_sched_alloc_graph(lctx.sched, gf);
+
+            if (graph_reuse) {
+                llama_graph_reuse_capture(lctx, gf, u_batch);
+            }
+        }
 
         llama_set_inputs(lctx, u_batch);
 
+        llama_kv_cache_defrag_wait(lctx);
+
         llama_graph_compute(lctx, gf, n_threads);
 
+        if (lctx.kq_score) {
+            llama_kv_cache_add_scores(lctx);
+        }
+
         // update the kv ring buffer
         {
+            kv_self.runs.clear();
             kv_self.head += n_tokens;
 
             // Ensure kv cache head points to a valid index.
@@ -16401,9 +17979,16 @@ static int llama_decode_internal(
         }
     }
 
+    if (kv_self.do_defrag && cparams.defrag_async) {
+        llama_kv_cache_defrag_start(lctx);
+    }
+
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    ggml_backend_sched_reset(lctx.sched);
+    // A graph kept for replay stays allocated instead.
+    if (!lctx.graph_cache.gf) {
+        ggml_backend_sched_reset(lctx.sched);
+    }
 
     return 0;
 }
@@ -16590,227 +18175,6 @@ static int llama_encode_internal(
     return 0;
 }
 
-// find holes from the beginning of the KV cache and fill them by moving data from the end of the cache
-static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
-    auto & kv_self = lctx.kv_self;
-
-    const auto & hparams = lctx.model.hparams;
-
-    const uint32_t n_layer = hparams.n_layer;
-
-    const uint32_t n_kv   = llama_kv_cache_cell_max(kv_self);
-    const uint32_t n_used = kv_self.used;
-
-    assert(n_used <= n_kv);
-
-    //const int64_t t_start = ggml_time_us();
-
-    // number of cells moved
-    uint32_t n_moves = 0;
-
-    // each move requires 6*n_layer tensors (see build_defrag)
-    //   - source view, destination view, copy operation
-    //   - x2 for keys and values
-    //const uint32_t max_moves = llama_model_max_nodes(model)/(6*n_layer);
-    // TODO: tmp fix https://github.com/ggerganov/llama.cpp/issues/6685#issuecomment-2057579516
-    const uint32_t max_moves = (llama_model_max_nodes(lctx.model) - 2*n_layer)/(6*n_layer);
-
-    // determine which KV cells to move where
-    //
-    //  cell i moves to ids[i]
-    //
-    //  if ids[i] == i || ids[i] == n_kv, then cell i is not moved
-    //
-    std::vector<uint32_t> ids(n_kv, n_kv);
-
-    for (uint32_t i0 = 0; i0 < n_used; ++i0) {
-        const auto & cell0 = kv_self.cells[i0];
-
-        if (!cell0.is_empty()) {
-            ids[i0] = i0;
-
-            continue;
-        }
-
-        // found a hole - fill it with data from the end of the cache
-
-        uint32_t nh = 1;
-
-        // determine the size of the hole
-        while (i0 + nh < n_used && kv_self.cells[i0 + nh].is_empty()) {
-            nh++;
-        }
-
-        uint32_t nf = 0;
-        uint32_t is = n_kv - 1;
-
-        // starting from the end, find nh non-empty cells
-        for (; is > i0; --is) {
-            const auto & cell1 = kv_self.cells[is];
-
-            if (cell1.is_empty() || ids[is] != n_kv) {
-                continue;
-            }
-
-            // non-empty cell which is not yet moved
-            nf++;
-
-            if (nf == nh) {
-                break;
-            }
-        }
-
-        // this can only happen if `n_used` is not accurate, which would be a bug
-        GGML_ASSERT(nf == nh && "KV defrag bug: nf != nh");
-
-        nf = 0;
-
-        uint32_t i1 = is;
-
-        // are we moving a continuous block of memory?
-        bool cont = false;
-
-        // should we stop searching for the next move?
-        bool stop = false;
-
-        // go back and move the nf cells to the hole
-        for (; i1 < n_kv; ++i1) {
-            auto & cell1 = kv_self.cells[i1];
-
-            if (cell1.is_empty() || ids[i1] != n_kv) {
-                if (n_moves == max_moves) {
-                    stop = true;
-                    break;
-                }
-
-                cont = false;
-                continue;
-            }
-
-            // this cell goes to (i0 + nf)
-            ids[i1] = i0 + nf;
-
-            // move the cell meta data
-            kv_self.cells[i0 + nf] = cell1;
-
-            // clear the old cell and move the head there
-            cell1 = llama_kv_cell();
-            kv_self.head = n_used;
-
-            if (!cont) {
-                n_moves++;
-                cont = true;
-            }
-
-            nf++;
-
-            if (nf == nh) {
-                break;
-            }
-        }
-
-        if (stop || n_moves == max_moves) {
-            break;
-        }
-
-        //LLAMA_LOG_INFO("(tmp log) KV defrag: move [%u, %u) to [%u, %u)\n", is, i1 + 1, i0, i0 + nh);
-
-        i0 += nh - 1;
-    }
-
-    if (n_moves == 0) {
-        return;
-    }
-
-    //LLAMA_LOG_INFO("(tmp log) KV defrag cell moves: %u\n", n_moves);
-
-    //LLAMA_LOG_INFO("expected gf nodes: %u\n", 6*n_moves*n_layer);
-
-#if 0
-    // CPU defrag
-    //
-    // TODO: optimizations are possible:
-    //       - multiple threads
-    //       - avoid copying to the host memory when already there
-    //
-    // likely not worth the effort, as we have ggml_graph based defrag
-    //
-
-    const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa();
-    const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa();
-
-    const uint32_t kv_size = kv_self.size;
-
-    std::vector<uint8_t> buf_k;
-    std::vector<uint8_t> buf_v;
-
-    for (uint32_t il = 0; il < n_layer; ++il) {
-        const size_t k_size_row = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa);
-        const size_t k_size     = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*kv_size);
-
-        const size_t v_size_el = ggml_type_size(kv_self.v_l[il]->type);
-        const size_t v_size    = ggml_row_size (kv_self.v_l[il]->type, n_embd_v_gqa*kv_size);
-
-        buf_k.resize(k_size);
-        buf_v.resize(v_size);
-
-        ggml_backend_tensor_get(kv_self.k_l[il], buf_k.data(), 0, buf_k.size());
-        ggml_backend_tensor_get(kv_self.v_l[il], buf_v.data(), 0, buf_v.size());
-
-        // batch move [i, i+nm) to [id, id+nm)
-        // note: cells can move only to a lower index
-        for (uint32_t i = 0; i < n_kv; ++i) {
-            const uint32_t id = ids[i];
-
-            if (i == id || id == n_kv) {
-                continue;
-            }
-
-            uint32_t nm = 1;
-
-            while (i + nm < n_kv && ids[i + nm] == id + nm) {
-                nm++;
-            }
-
-            // move keys
-            {
-                const int64_t os =  i*k_size_row;
-                const int64_t od = id*k_size_row;
-
-                memcpy(buf_k.data() + od, buf_k.data() + os, nm*k_size_row);
-            }
-
-            // move values (note: they are transposed)
-            {
-                const int64_t os =  i;
-                const int64_t od = id;
-
-                for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                    memcpy(buf_v.data() + (od + j*kv_size)*v_size_el, buf_v.data() + (os + j*kv_size)*v_size_el, nm*v_size_el);
-                }
-            }
-
-            i += nm - 1;
-        }
-
-        ggml_backend_tensor_set(kv_self.k_l[il], buf_k.data(), 0, buf_k.size());
-        ggml_backend_tensor_set(kv_self.v_l[il], buf_v.data(), 0, buf_v.size());
-    }
-#else
-    // ggml_graph defrag
-
-    ggml_backend_sched_reset(lctx.sched);
-
-    ggml_cgraph * gf = llama_build_graph_defrag(lctx, ids);
-
-    llama_graph_compute(lctx, gf, lctx.cparams.n_threads);
-#endif
-
-    //const int64_t t_end = ggml_time_us();
-
-    //LLAMA_LOG_INFO("(tmp log) KV defrag time: %.3f ms\n", (t_end - t_start)/1000.0);
-}
-
 static void llama_kv_cache_update_internal(struct llama_context & lctx) {
     bool need_reserve = false;
 
@@ -16820,6 +18184,8 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
             GGML_ABORT("Deepseek2 does not support K-shift");
         }
 
+        llama_kv_cache_defrag_wait(lctx);
+
         {
             ggml_backend_sched_reset(lctx.sched);
 
@@ -16839,8 +18205,8 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
 
             kv_self.has_shift = false;
 
-            for (uint32_t i = 0; i < kv_self.size; ++i) {
-                kv_self.cells[i].delta = 0;
+            for (uint32_t i = kv_self.shift_lo; i < kv_self.shift_hi; ++i) {
+                kv_self.cells.set_delta(i, 0);
             }
         }
     }
@@ -16866,18 +18232,16 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
             kv_self.do_copy = false;
 
             for (uint32_t i = 0; i < kv_self.size; ++i) {
-                kv_self.cells[i].src = i;
+                kv_self.cells.set_src(i, i);
             }
         }
     }
 
-    // defragment the KV cache if needed
-    if (lctx.kv_self.do_defrag) {
-        llama_kv_cache_defrag_internal(lctx);
+    // defragment the KV cache if needed, with cparams.defrag_async this is done at the end of llama_decode
+    if (lctx.kv_self.do_defrag && !lctx.cparams.defrag_async) {
+        lctx.kv_self.do_defrag = !llama_kv_cache_defrag_internal(lctx);
 
         need_reserve = true;
-
-        lctx.kv_self.do_defrag = false;
     }
 
     // reserve a worst case graph again
@@ -18452,6 +19816,7 @@ int32_t llama_lora_adapter_set(
         return -1;
     }
     ctx->lora_adapters[adapter] = scale;
+    llama_graph_reuse_invalidate(*ctx);
     return 0;
 }
 
@@ -18461,6 +19826,7 @@ int32_t llama_lora_adapter_remove(
     auto pos = ctx->lora_adapters.find(adapter);
     if (pos != ctx->lora_adapters.end()) {
         ctx->lora_adapters.erase(pos);
+        llama_graph_reuse_invalidate(*ctx);
         return 0;
     }
     return -1;
@@ -18468,6 +19834,7 @@ int32_t llama_lora_adapter_remove(
 
 void llama_lora_adapter_clear(struct llama_context * ctx) {
     ctx->lora_adapters.clear();
+    llama_graph_reuse_invalidate(*ctx);
 }
 
 void llama_lora_adapter_free(struct llama_lora_adapter * adapter) {
@@ -18488,12 +19855,17 @@ struct llama_model_params llama_model_default_params() {
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
         /*.tensor_buft_overrides       =*/ nullptr,
+        /*.repack_cache                =*/ nullptr,
+        /*.shm_model                   =*/ nullptr,
+        /*.expert_pin_mb               =*/ 0,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
         /*.repack_tensors              =*/ false,
         /*.use_thp                     =*/ false,
+        /*.fused_qkv                   =*/ false,
+        /*.expert_paging               =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -18513,6 +19885,8 @@ struct llama_context_params llama_context_default_params() {
         /*.n_seq_max                   =*/ 1,
         /*.n_threads                   =*/ GGML_DEFAULT_N_THREADS, // TODO: better default
         /*.n_threads_batch             =*/ GGML_DEFAULT_N_THREADS,
+        /*.poll                        =*/ -1,
+        /*.cpu_mask                    =*/ nullptr,
         /*.rope_scaling_type           =*/ LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED,
         /*.pooling_type                =*/ LLAMA_POOLING_TYPE_UNSPECIFIED,
         /*.attention_type              =*/ LLAMA_ATTENTION_TYPE_UNSPECIFIED,
@@ -18524,17 +19898,29 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.defrag_max_cells            =*/ 0,
+        /*.kv_block_size               =*/ 0,
+        /*.kv_budget                   =*/ 0,
+        /*.kv_budget_sink              =*/ 4,
+        /*.kv_budget_recent            =*/ 64,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
+        /*.kv_type_overrides           =*/ nullptr,
         /*.logits_all                  =*/ false,
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
+        /*.cpu_strict                  =*/ false,
+        /*.dep_barriers                =*/ false,
+        /*.graph_reuse                 =*/ false,
+        /*.defrag_async                =*/ false,
+        /*.profile                     =*/ false,
         /*.mla_attn                    =*/ 0,
         /*.attn_max_batch              =*/ 0,
         /*.fused_moe_up_gate           =*/ false,
+        /*.fused_attn_out              =*/ false,
         /*.min_experts                 =*/ -1,
         /*.thtesh_experts              =*/ 0.0f,
         /*.abort_callback              =*/ nullptr,
@@ -18735,12 +20121,20 @@ struct llama_context * llama_new_context_with_model(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.defrag_max_cells = params.defrag_max_cells;
+    cparams.defrag_async     = params.defrag_async;
+    cparams.kv_block_size    = params.kv_block_size;
+    cparams.kv_budget        = params.kv_budget;
+    cparams.kv_budget_sink   = params.kv_budget_sink;
+    cparams.kv_budget_recent = params.kv_budget_recent;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.mla_attn         = params.mla_attn;
     cparams.attn_max_batch   = params.attn_max_batch;
     cparams.fused_moe_up_gate= params.fused_moe_up_gate;
+    cparams.fused_attn_out   = params.fused_attn_out;
+    cparams.graph_reuse      = params.graph_reuse;
     cparams.min_experts      = params.min_experts;
     cparams.thresh_experts   = params.thresh_experts;
 
@@ -18802,6 +20196,11 @@ struct llama_context * llama_new_context_with_model(
         cparams.causal_attn = params.attention_type == LLAMA_ATTENTION_TYPE_CAUSAL;
     }
 
+    if (cparams.kv_budget > 0 && (!cparams.causal_attn || (model->arch == LLM_ARCH_DEEPSEEK2 && cparams.mla_attn) || model->arch == LLM_ARCH_MAMBA)) {
+        LLAMA_LOG_WARN("%s: the KV budget needs a causal attention model without MLA - disabling it\n", __func__);
+        cparams.kv_budget = 0;
+    }
+
     if (params.seed == LLAMA_DEFAULT_SEED) {
         params.seed = time(NULL);
     }
@@ -18820,7 +20219,16 @@ struct llama_context * llama_new_context_with_model(
     LLAMA_LOG_INFO("%s: mla_attn   = %d\n",     __func__, cparams.mla_attn);
     LLAMA_LOG_INFO("%s: attn_max_b = %d\n",     __func__, cparams.attn_max_batch);
     LLAMA_LOG_INFO("%s: fused_moe  = %d\n",     __func__, cparams.fused_moe_up_gate);
+    LLAMA_LOG_INFO("%s: fused_out  = %d\n",     __func__, cparams.fused_attn_out);
     LLAMA_LOG_INFO("%s: ser        = %d, %g\n", __func__, cparams.min_experts, cparams.thresh_experts);
+    LLAMA_LOG_INFO("%s: graph_reuse= %d\n",     __func__, cparams.graph_reuse);
+    LLAMA_LOG_INFO("%s: kv_block   = %u\n",     __func__, cparams.kv_block_size);
+    if (cparams.defrag_max_cells > 0 || cparams.defrag_async) {
+        LLAMA_LOG_INFO("%s: defrag     = %u cells per step, async = %d\n", __func__, cparams.defrag_max_cells, cparams.defrag_async);
+    }
+    if (cparams.kv_budget > 0) {
+        LLAMA_LOG_INFO("%s: kv_budget  = %u, sink = %u, recent = %u\n", __func__, cparams.kv_budget, cparams.kv_budget_sink, cparams.kv_budget_recent);
+    }
     LLAMA_LOG_INFO("%s: freq_base  = %.1f\n",   __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale = %g\n",     __func__, cparams.rope_freq_scale);
 
@@ -18995,29 +20403,67 @@ struct llama_context * llama_new_context_with_model(
         }
         ctx->backends.push_back(ctx->backend_cpu);
 
-        if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size, cparams.offload_kqv)) {
+        ggml_backend_cpu_set_dep_barriers(ctx->backend_cpu, params.dep_barriers);
+
+        if (params.poll >= 0) {
+            auto & tpp = ctx->threadpool_params;
+            tpp = ggml_threadpool_params_default(std::min<int>(GGML_MAX_N_THREADS, std::max(cparams.n_threads, cparams.n_threads_batch)));
+            tpp.poll       = std::min(params.poll, 100);
+            tpp.strict_cpu = params.cpu_strict;
+            if (params.cpu_mask) {
+                std::copy(params.cpu_mask, params.cpu_mask + GGML_MAX_N_THREADS, tpp.cpumask);
+            }
+            ctx->threadpool = ggml_threadpool_new(&tpp);
+            ggml_backend_cpu_set_threadpool(ctx->backend_cpu, ctx->threadpool);
+        }
+
+        if (params.profile) {
+            // keep the timeline of the threads for about the first million nodes
+            ctx->profile = ggml_profile_init(1 << 20);
+            ggml_backend_cpu_set_profile(ctx->backend_cpu, ctx->profile);
+        }
+
+        // the recurrent state types are fixed
+        const auto * type_overrides = model->arch == LLM_ARCH_MAMBA ? nullptr : params.kv_type_overrides;
+
+        if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, type_overrides, kv_size, cparams.offload_kqv)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
         }
 
+        if (cparams.defrag_async) {
+            // the data of the async defrag is moved by the CPU
+            bool host = !ctx->kv_self.recurrent && !ctx->kv_self.k_l.empty();
+            for (auto * t : ctx->kv_self.k_l) host = host && ggml_backend_buffer_is_host(t->buffer);
+            for (auto * t : ctx->kv_self.v_l) host = host && ggml_backend_buffer_is_host(t->buffer);
+            if (!host) {
+                LLAMA_LOG_WARN("%s: the async KV defrag needs a K and V cache in host memory - disabling it\n", __func__);
+                cparams.defrag_async = false;
+            }
+        }
+
         {
             size_t memory_size_k = 0;
             size_t memory_size_v = 0;
+            bool   mixed_k = false;
+            bool   mixed_v = false;
 
             for (auto & k : ctx->kv_self.k_l) {
                 memory_size_k += ggml_nbytes(k);
+                mixed_k |= k->type != type_k;
             }
 
             for (auto & v : ctx->kv_self.v_l) {
                 memory_size_v += ggml_nbytes(v);
+                mixed_v |= v->type != type_v;
             }
 
             if (memory_size_k + memory_size_v > 0) {
                 LLAMA_LOG_INFO("%s: KV self size  = %7.2f MiB, K (%s): %7.2f MiB, V (%s): %7.2f MiB\n", __func__,
                         (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f),
-                        ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
-                        ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+                        mixed_k ? "mixed" : ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
+                        mixed_v ? "mixed" : ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
             }
         }
 
@@ -19074,7 +20520,7 @@ struct llama_context * llama_new_context_with_model(
             for (auto * backend : ctx->backends) {
                 if (ggml_backend_is_cpu(backend)) {
                     // use host buffers for the CPU backend compute buffer
-                    backend_buft.push_back(llama_default_buffer_type_cpu(true));
+                    backend_buft.push_back(llama_default_buffer_type_cpu(true, model->use_thp));
                 } else {
                     backend_buft.push_back(ggml_backend_get_default_buffer_type(backend));
                 }
@@ -19131,6 +20577,10 @@ struct llama_context * llama_new_context_with_model(
             LLAMA_LOG_INFO("%s: graph nodes  = %d\n", __func__, gf->n_nodes);
             LLAMA_LOG_INFO("%s: graph splits = %d\n", __func__, n_splits);
         }
+
+        if (model->use_thp) {
+            llama_log_huge_pages(__func__);
+        }
     }
 
     return ctx;
@@ -19432,6 +20882,8 @@ int32_t llama_control_vector_apply(struct llama_context * lctx, const float * da
     const llama_model & model = lctx->model;
     llama_control_vector & cvec = lctx->cvec;
 
+    llama_graph_reuse_invalidate(*lctx);
+
     if (data == nullptr) {
         // disable the current control vector (but leave allocated for later)
         cvec.layer_start = -1;
@@ -19501,7 +20953,7 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
         view->cells_sequences = (llama_seq_id *)p;
     }
 
-    const std::vector<llama_kv_cell> & kv_cells = ctx->kv_self.cells;
+    const llama_kv_cells & kv_cells = ctx->kv_self.cells;
     llama_kv_cache_view_cell * c_curr = view->cells;
     llama_seq_id * cs_curr = view->cells_sequences;
     int32_t used_cells = 0;
@@ -19511,9 +20963,9 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
     int32_t max_contig_idx = -1;
 
     for (int32_t i = 0; i < int32_t(ctx->kv_self.size); i++, c_curr++, cs_curr += view->n_seq_max) {
-        const size_t curr_size = kv_cells[i].seq_id.size();
+        const size_t curr_size = kv_cells.seq_count(i);
         token_count += curr_size;
-        c_curr->pos = kv_cells[i].pos + kv_cells[i].delta;
+        c_curr->pos = kv_cells.pos(i) + kv_cells.delta(i);
 
         if (curr_size > 0) {
             if (curr_contig_idx >= 0 && uint32_t(i - curr_contig_idx) > max_contig) {
@@ -19526,13 +20978,11 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
         }
 
         int seq_idx = 0;
-        for (const llama_seq_id it : kv_cells[i].seq_id) {
-            if (seq_idx >= view->n_seq_max) {
-                break;
+        kv_cells.seq_for_each(i, [&](llama_seq_id it) {
+            if (seq_idx < view->n_seq_max) {
+                cs_curr[seq_idx++] = it;
             }
-            cs_curr[seq_idx] = it;
-            seq_idx++;
-        }
+        });
         if (seq_idx != 0) {
             used_cells++;
         }
@@ -19558,7 +21008,7 @@ int32_t llama_get_kv_cache_token_count(const struct llama_context * ctx) {
     int result = 0;
 
     for (uint32_t i = 0; i < ctx->kv_self.size; i++) {
-        result += ctx->kv_self.cells[i].seq_id.size();
+        result += ctx->kv_self.cells.seq_count(i);
     }
 
     return result;
@@ -19568,7 +21018,12 @@ int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx) {
     return ctx->kv_self.used;
 }
 
+uint32_t llama_get_kv_cache_block_size(const struct llama_context * ctx) {
+    return ctx->kv_self.block_size;
+}
+
 void llama_kv_cache_clear(struct llama_context * ctx) {
+    llama_kv_cache_defrag_wait(*ctx);
     llama_kv_cache_clear(ctx->kv_self);
 }
 
@@ -19722,17 +21177,16 @@ struct llama_data_write {
 
         for (const auto & range : cell_ranges) {
             for (uint32_t i = range.first; i < range.second; ++i) {
-                const auto & cell = kv_self.cells[i];
-                const llama_pos pos      = cell.pos;
-                const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.size() : 0;
+                const llama_pos pos      = kv_self.cells.pos(i);
+                const uint32_t  n_seq_id = seq_id == -1 ? kv_self.cells.seq_count(i) : 0;
 
                 write(&pos,      sizeof(pos));
                 write(&n_seq_id, sizeof(n_seq_id));
 
                 if (n_seq_id) {
-                    for (auto seq_id : cell.seq_id) {
-                        write(&seq_id, sizeof(seq_id));
-                    }
+                    kv_self.cells.seq_for_each(i, [&](llama_seq_id id) {
+                        write(&id, sizeof(id));
+                    });
                 }
             }
         }
@@ -19830,8 +21284,7 @@ struct llama_data_write {
         // Find all the ranges of cells with this seq id (or all, when -1)
         uint32_t cell_range_begin = kv_self.size;
         for (uint32_t i = 0; i < kv_self.size; ++i) {
-            const auto & cell = kv_self.cells[i];
-            if ((seq_id == -1 && !cell.is_empty()) || cell.has_seq_id(seq_id)) {
+            if ((seq_id == -1 && !kv_self.cells.is_empty(i)) || kv_self.cells.has_seq_id(i, seq_id)) {
                 ++cell_count;
                 if (cell_range_begin == kv_self.size) {
                     cell_range_begin = i;
@@ -19985,10 +21438,10 @@ struct llama_data_read {
             // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
             // Assume that this is one contiguous block of cells
             GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
-            GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-            GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+            GGML_ASSERT(kv_self.cells.pos(kv_self.head) == batch.pos[0]);
+            GGML_ASSERT(kv_self.cells.pos(kv_self.head + cell_count - 1) == batch.pos[cell_count - 1]);
+            GGML_ASSERT(kv_self.cells.has_seq_id(kv_self.head, dest_seq_id));
+            GGML_ASSERT(kv_self.cells.has_seq_id(kv_self.head + cell_count - 1, dest_seq_id));
 
             // Cleanup
             llama_batch_free(batch);
@@ -20003,15 +21456,13 @@ struct llama_data_read {
             llama_kv_cache_clear(kv_self);
 
             for (uint32_t i = 0; i < cell_count; ++i) {
-                llama_kv_cell & cell = kv_self.cells[i];
-
                 llama_pos pos;
                 uint32_t  n_seq_id;
 
                 read_to(&pos,      sizeof(pos));
                 read_to(&n_seq_id, sizeof(n_seq_id));
 
-                cell.pos = pos;
+                kv_self.cells.set_pos(i, pos);
 
                 for (uint32_t j = 0; j < n_seq_id; ++j) {
                     llama_seq_id seq_id;
@@ -20022,7 +21473,7 @@ struct llama_data_read {
                         return false;
                     }
 
-                    cell.seq_id.insert(seq_id);
+                    kv_self.cells.seq_add(i, seq_id);
                 }
             }
 
@@ -20307,6 +21758,7 @@ struct llama_data_read_file : llama_data_read {
 */
 static size_t llama_state_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx) {
     llama_synchronize(ctx);
+    llama_kv_cache_defrag_wait(*ctx);
 
     data_ctx.write_model_info(ctx);
 
@@ -20346,6 +21798,7 @@ size_t llama_state_get_size(struct llama_context * ctx) {
 
 static size_t llama_state_set_data_internal(struct llama_context * ctx, llama_data_read & data_ctx) {
     llama_synchronize(ctx);
+    llama_kv_cache_defrag_wait(*ctx);
 
     data_ctx.read_model_info(ctx);
 
@@ -20452,6 +21905,7 @@ bool llama_state_save_file(struct llama_context * ctx, const char * path_session
 
 static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx, llama_seq_id seq_id) {
     llama_synchronize(ctx);
+    llama_kv_cache_defrag_wait(*ctx);
 
     data_ctx.write_kv_cache(ctx, seq_id);
 
@@ -20475,6 +21929,7 @@ size_t llama_state_seq_get_data(struct llama_context * ctx, uint8_t * dst, size_
 
 static size_t llama_state_seq_set_data_internal(struct llama_context * ctx, llama_data_read & data_ctx, llama_seq_id dest_seq_id) {
     llama_synchronize(ctx);
+    llama_kv_cache_defrag_wait(*ctx);
 
     data_ctx.read_kv_cache(ctx, dest_seq_id);
 
@@ -20574,6 +22029,73 @@ size_t llama_state_seq_load_file(struct llama_context * ctx, const char * filepa
 void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch) {
     ctx->cparams.n_threads       = n_threads;
     ctx->cparams.n_threads_batch = n_threads_batch;
+
+    // grow the thread pool if needed
+    const int n_threads_max = std::min<int>(GGML_MAX_N_THREADS, std::max(n_threads, n_threads_batch));
+    if (ctx->threadpool && ggml_threadpool_get_n_threads(ctx->threadpool) < n_threads_max) {
+        ggml_threadpool_free(ctx->threadpool);
+        ctx->threadpool_params.n_threads = n_threads_max;
+        ctx->threadpool = ggml_threadpool_new(&ctx->threadpool_params);
+        ggml_backend_cpu_set_threadpool(ctx->backend_cpu, ctx->threadpool);
+    }
+}
+
+void llama_pause_threadpool(struct llama_context * ctx) {
+    if (ctx->threadpool) {
+        ggml_threadpool_pause(ctx->threadpool);
+    }
+}
+
+void llama_resume_threadpool(struct llama_context * ctx) {
+    if (ctx->threadpool) {
+        ggml_threadpool_resume(ctx->threadpool);
+    }
+}
+
+void llama_iqk_tune(struct llama_context * ctx, const char * cache_file) {
+    const int64_t t_start_us = ggml_time_us();
+
+    if (cache_file && ggml_iqk_tune_load(cache_file)) {
+        LLAMA_LOG_INFO("%s: loaded tuned matmul configurations from %s\n", __func__, cache_file);
+    }
+
+    // the batch tuning uses at most 128 columns: the relative cost of the tile and chunk choices does not change
+    // much beyond that, and it keeps the benchmarks short
+    const int64_t n_batch = std::min<int64_t>(ctx->cparams.n_ubatch, 128);
+
+    // the 2D weights that are not the first operand of a matmul (looked up with ggml_get_rows, convolutions, ...)
+    const auto & model = ctx->model;
+    std::set<const ggml_tensor *> not_matmul = { model.type_embd, model.pos_embd };
+    if (model.tok_embd != model.output) {
+        not_matmul.insert(model.tok_embd);
+    }
+    for (const auto & layer : model.layers) {
+        not_matmul.insert(layer.ssm_conv1d);
+        not_matmul.insert(layer.ssm_a);
+    }
+
+    std::set<std::tuple<ggml_type, int64_t, int64_t>> shapes;
+    int n_shapes = 0;
+    for (const auto & it : model.tensors_by_name) {
+        const ggml_tensor * t = it.second;
+        if (ggml_n_dims(t) != 2 || !t->buffer || !ggml_backend_buffer_is_host(t->buffer) || not_matmul.count(t)) {
+            continue;
+        }
+        if (!shapes.insert({t->type, t->ne[0], t->ne[1]}).second) {
+            continue;
+        }
+        bool tuned = ggml_iqk_tune(t, 1, ctx->cparams.n_threads);
+        if (n_batch > 1) {
+            tuned = ggml_iqk_tune(t, n_batch, ctx->cparams.n_threads_batch) || tuned;
+        }
+        n_shapes += tuned;
+    }
+
+    if (cache_file && !ggml_iqk_tune_save(cache_file)) {
+        LLAMA_LOG_WARN("%s: failed to save the tuned matmul configurations to %s\n", __func__, cache_file);
+    }
+
+    LLAMA_LOG_INFO("%s: %d weight shapes tuned in %.2f s\n", __func__, n_shapes, (ggml_time_us() - t_start_us)/1e6);
 }
 
 uint32_t llama_n_threads(struct llama_context * ctx) {
@@ -20591,10 +22113,12 @@ void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)
 
 void llama_set_embeddings(struct llama_context * ctx, bool embeddings) {
     ctx->cparams.embeddings = embeddings;
+    llama_graph_reuse_invalidate(*ctx);
 }
 
 void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
     ctx->cparams.causal_attn = causal_attn;
+    llama_graph_reuse_invalidate(*ctx);
 }
 
 struct llama_batch llama_batch_get_one(
@@ -21646,6 +23170,10 @@ void llama_reset_timings(struct llama_context * ctx) {
     ctx->sampling.reset_timings();
 }
 
+struct ggml_profile * llama_get_profile(struct llama_context * ctx) {
+    return ctx->profile;
+}
+
 const char * llama_print_system_info(void) {
     static std::string s;
 
@@ -2487,6 +2487,78 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
     return false;
 }
 
+// GGML_OP_MUL_MAT_ADD fuses a GGML_OP_MUL_MAT with the GGML_OP_ADD of a residual, so it is checked against these on
+// the same backend (the result must be bit-identical), which also covers the CPU backend
+static bool test_mul_mat_add(ggml_backend_t backend, ggml_type type_a, int64_t m, int64_t n, int64_t k, int64_t bs) {
+    printf("  MUL_MAT_ADD(type_a=%s,m=%d,n=%d,k=%d,bs=%d): ", ggml_type_name(type_a), (int) m, (int) n, (int) k, (int) bs);
+    fflush(stdout);
+
+    ggml_init_params params = {
+        /* .mem_size = */ ggml_tensor_overhead()*16 + ggml_graph_overhead(),
+        /* .mem_base = */ NULL,
+        /* .no_alloc = */ true,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * a = ggml_new_tensor_3d(ctx, type_a,        k, m, bs);
+    ggml_tensor * b = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, k, n, bs);
+    ggml_tensor * c = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, m, n, bs);
+
+    ggml_tensor * out     = ggml_mul_mat_add(ctx, a, b, c);
+    ggml_tensor * out_ref = ggml_add(ctx, ggml_mul_mat(ctx, a, b), c);
+
+    if (!ggml_backend_supports_op(backend, out) || !ggml_backend_supports_op(backend, out_ref->src[0])) {
+        printf("not supported [%s]\n", ggml_backend_name(backend));
+        ggml_free(ctx);
+        return true;
+    }
+
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+    init_tensor_uniform(a);
+    init_tensor_uniform(b);
+    init_tensor_uniform(c);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+    ggml_build_forward_expand(gf, out_ref);
+    ggml_backend_graph_compute(backend, gf);
+
+    const std::vector<float> f     = tensor_to_float(out);
+    const std::vector<float> f_ref = tensor_to_float(out_ref);
+    const bool ok = memcmp(f.data(), f_ref.data(), f.size()*sizeof(float)) == 0;
+    if (!ok) {
+        printf("[MUL_MAT_ADD] differs from MUL_MAT + ADD, NMSE = %.9f ", nmse(f.data(), f_ref.data(), f.size()));
+    }
+
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx);
+
+    printf(ok ? "\033[1;32mOK\033[0m\n" : "\033[1;31mFAIL\033[0m\n");
+    return ok;
+}
+
+static bool test_fused_ops(ggml_backend_t backend, const char * op_name) {
+    if (op_name != nullptr && strcmp(op_name, "MUL_MAT_ADD") != 0) {
+        return true;
+    }
+
+    size_t n_ok = 0, n_tests = 0;
+    // on the CPU, the 2D products with a quantized src1 go through the iqk chunks, which add the residual to their rows,
+    // the batched ones and f32 through the pass over dst after the product; _R4/_R8 are the repacked types (-rtr)
+    for (ggml_type type_a : { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q4_0, GGML_TYPE_Q8_0, GGML_TYPE_Q4_K, GGML_TYPE_IQ4_K,
+                              GGML_TYPE_Q4_0_R8, GGML_TYPE_Q8_0_R8, GGML_TYPE_IQ4_K_R4, GGML_TYPE_Q8_K_R8 }) {
+        for (int64_t n : { 1, 7, 32 }) {
+            for (int64_t bs : { 1, 3 }) {
+                n_ok += test_mul_mat_add(backend, type_a, 256, n, 256, bs);
+                n_tests++;
+            }
+        }
+    }
+    printf("  %zu/%zu fused op tests passed\n", n_ok, n_tests);
+
+    return n_ok == n_tests;
+}
+
 static void usage(char ** argv) {
     printf("Usage: %s [mode] [-o op] [-b backend]\n", argv[0]);
     printf("  valid modes are: test (compare with CPU backend for correctness) or perf (performance evaluation)\n");
@@ -2541,7 +2613,13 @@ int main(int argc, char ** argv) {
         GGML_ASSERT(backend != NULL);
 
         if (backend_filter == NULL && ggml_backend_is_cpu(backend)) {
+            // the CPU backend is the reference of the others, only its fused ops are checked
             printf("  Skipping CPU backend\n");
+            if (mode == MODE_TEST && !test_fused_ops(backend, op_name_filter)) {
+                printf("  Backend %s: \033[1;31mFAIL\033[0m\n\n", ggml_backend_name(backend));
+                ggml_backend_free(backend);
+                continue;
+            }
             ggml_backend_free(backend);
             n_ok++;
             continue;
@@ -2550,6 +2628,9 @@ int main(int argc, char ** argv) {
         printf("  Backend name: %s\n", ggml_backend_name(backend));
 
         bool ok = test_backend(backend, mode, op_name_filter);
+        if (mode == MODE_TEST) {
+            ok = test_fused_ops(backend, op_name_filter) && ok;
+        }
 
         printf("  Backend %s: ", ggml_backend_name(backend));
         if (ok) {
@@ -0,0 +1,320 @@
+// Checks the CPU matrix multiplication kernels (iqk_mul_mat, including the AVX512/AMX/NEON/SVE variants the CPU has) against a
+// reference: the weights are dequantized with to_float and multiplied with the f32 activations in double precision.
+// The activations are quantized to the vec_dot_type by the kernels, so the results are compared with a tolerance.
+// Also checks the iqk flash attention for token generation, where the KV length is split between the threads, against
+// a reference and against the result of a single thread.
+
+#include "ggml.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <random>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+constexpr double MAX_NMSE = 2e-4;
+
+static const char* RESULT_STR[] = {"ok", "FAILED"};
+
+struct test_type {
+    ggml_type type;
+    int       packed_rows; // rows interleaved in a block (repacked _R4/_R8/_R16 types)
+    bool      saturates_avx512 = false; // mul_mat_iqX_k_q8_K_AVX512 overflows _mm512_maddubs_epi16 (see test-quantize-fns)
+};
+
+// the IQK quants and the row-interleaved types, whose kernels are not covered by test-quantize-fns
+static const test_type k_types[] = {
+    { GGML_TYPE_IQ2_K,    1 },
+    { GGML_TYPE_IQ3_K,    1 },
+    { GGML_TYPE_IQ4_K,    1, true },
+    { GGML_TYPE_IQ4_KS,   1, true },
+    { GGML_TYPE_IQ4_KSS,  1, true },
+    { GGML_TYPE_IQ4_XS,   1, true },
+    { GGML_TYPE_IQ5_K,    1, true },
+    { GGML_TYPE_IQ6_K,    1, true },
+    { GGML_TYPE_Q8_0_R8,  8 },
+    { GGML_TYPE_Q4_0_R8,  8 },
+    { GGML_TYPE_Q8_K_R8,  8 },
+    { GGML_TYPE_BF16_R16, 16 },
+};
+
+static void dequantize(ggml_type type, int packed_rows, const void * data, int64_t nrows, int64_t n_per_row, float * dst) {
+    if (type == GGML_TYPE_BF16_R16) {
+        // no to_float: pairs of values of 16 rows are interleaved
+        const ggml_bf16_t * x = (const ggml_bf16_t *) data;
+        for (int64_t row = 0; row < nrows; row += 16) {
+            for (int k = 0; k < 16; ++k) {
+                for (int64_t ib = 0; ib < n_per_row/2; ++ib) {
+                    dst[(row + k)*n_per_row + 2*ib + 0] = ggml_bf16_to_fp32(x[row*n_per_row + 32*ib + 2*k + 0]);
+                    dst[(row + k)*n_per_row + 2*ib + 1] = ggml_bf16_to_fp32(x[row*n_per_row + 32*ib + 2*k + 1]);
+                }
+            }
+        }
+        return;
+    }
+    auto qfns = ggml_internal_get_type_traits(type);
+    const size_t row_size = ggml_row_size(type, n_per_row);
+    for (int64_t row = 0; row < nrows; row += packed_rows) {
+        qfns.to_float((const char *) data + row*row_size, dst + row*n_per_row, packed_rows*n_per_row);
+    }
+}
+
+// normalized mean squared error of c vs ref
+static double nmse(const float * c, const double * ref, size_t n) {
+    double sum2 = 0, diff2 = 0;
+    for (size_t i = 0; i < n; ++i) {
+        sum2  += ref[i]*ref[i];
+        diff2 += (c[i] - ref[i])*(c[i] - ref[i]);
+    }
+    return sum2 > 0 ? diff2/sum2 : diff2;
+}
+
+// C = A*B for a weight of nrows x n_per_row and ny activation columns (GGML_OP_MUL_MAT), or, with n_expert > 0, the
+// experts selected by ids for n_used x ny activations (GGML_OP_MUL_MAT_ID)
+static double test_mul_mat(const test_type & tt, int64_t n_per_row, int64_t nrows, int64_t ny, int n_expert, int n_threads, std::mt19937 & rng) {
+    const int     n_mat  = n_expert > 0 ? n_expert : 1;
+    const int64_t n_used = n_expert > 0 ? 2 : 1;
+
+    std::normal_distribution<float> dist;
+    std::vector<float> wf(n_mat*nrows*n_per_row);
+    std::vector<float> yf(ny*n_used*n_per_row);
+    for (auto & x : wf) x = dist(rng);
+    for (auto & x : yf) x = dist(rng);
+
+    const size_t row_size = ggml_row_size(tt.type, n_per_row);
+    struct ggml_init_params params = {
+        /* .mem_size   = */ n_mat*nrows*row_size + 2*yf.size()*sizeof(float) + n_mat*nrows*ny*n_used*sizeof(float) + 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * a = n_expert > 0 ? ggml_new_tensor_3d(ctx, tt.type, n_per_row, nrows, n_mat)
+                                   : ggml_new_tensor_2d(ctx, tt.type, n_per_row, nrows);
+    for (int i = 0; i < n_mat; ++i) {
+        ggml_quantize_chunk(tt.type, wf.data() + i*nrows*n_per_row, (char *) a->data + i*nrows*row_size, 0, nrows, n_per_row, nullptr);
+    }
+
+    ggml_tensor * b = n_expert > 0 ? ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_per_row, n_used, ny)
+                                   : ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_per_row, ny);
+    memcpy(b->data, yf.data(), yf.size()*sizeof(float));
+
+    std::vector<int32_t> ids(n_used*ny);
+    ggml_tensor * c;
+    if (n_expert > 0) {
+        ggml_tensor * t_ids = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, n_used, ny);
+        for (int64_t i = 0; i < ny; ++i) {
+            // two different experts per token, the first one used by more tokens than the others
+            ids[n_used*i + 0] = i % 3 == 0 ? 0 : rng() % n_expert;
+            ids[n_used*i + 1] = (ids[n_used*i + 0] + 1 + rng() % (n_expert - 1)) % n_expert;
+        }
+        memcpy(t_ids->data, ids.data(), ids.size()*sizeof(int32_t));
+        c = ggml_mul_mat_id(ctx, a, b, t_ids);
+    } else {
+        c = ggml_mul_mat(ctx, a, b);
+    }
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, c);
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+    // reference with the dequantized weights
+    std::vector<float> wd(n_mat*nrows*n_per_row);
+    for (int i = 0; i < n_mat; ++i) {
+        dequantize(tt.type, tt.packed_rows, (const char *) a->data + i*nrows*row_size, nrows, n_per_row, wd.data() + i*nrows*n_per_row);
+    }
+    std::vector<double> ref(nrows*n_used*ny);
+    for (int64_t iy = 0; iy < ny; ++iy) {
+        for (int64_t iu = 0; iu < n_used; ++iu) {
+            const int     mat = n_expert > 0 ? ids[n_used*iy + iu] : 0;
+            const float * y   = yf.data() + (iy*n_used + iu)*n_per_row;
+            for (int64_t row = 0; row < nrows; ++row) {
+                const float * w = wd.data() + (mat*nrows + row)*n_per_row;
+                double sum = 0;
+                for (int64_t k = 0; k < n_per_row; ++k) sum += (double) w[k]*y[k];
+                ref[(iy*n_used + iu)*nrows + row] = sum;
+            }
+        }
+    }
+
+    const double result = nmse((const float *) c->data, ref.data(), ref.size());
+    ggml_free(ctx);
+    return result;
+}
+
+struct test_fa {
+    ggml_type type_kv;
+    int64_t   Dk, Dv;
+    int64_t   n_head, n_head_kv;
+    int64_t   n_kv, n_masked;
+    bool      shared_kv; // V is the first Dv elements of the K rows (MLA)
+};
+
+// softmax(scale*K*q + mask)*V for one token, n_head q heads sharing n_head_kv K/V heads. The last n_masked of the n_kv
+// cells are masked, so that whole slices of the split KV length do not contribute.
+// Returns the nmse vs the reference, *nmse_1 is the nmse vs the result of 1 thread.
+static double test_flash_attn(const test_fa & tf, int n_threads, std::mt19937 & rng, double * nmse_1) {
+    const int64_t n_pad  = GGML_PAD(1, GGML_KQ_MASK_PAD);
+    const int64_t n_rows = tf.n_kv*tf.n_head_kv;
+
+    std::normal_distribution<float> dist;
+    std::vector<float> qf(tf.Dk*tf.n_head), kf(tf.Dk*n_rows), vf(tf.shared_kv ? 0 : tf.Dv*n_rows);
+    std::vector<ggml_fp16_t> mh(tf.n_kv*n_pad);
+    for (auto & x : qf) x = dist(rng);
+    for (auto & x : kf) x = dist(rng);
+    for (auto & x : vf) x = dist(rng);
+    for (int64_t i = 0; i < tf.n_kv*n_pad; ++i) mh[i] = ggml_fp32_to_fp16(i%tf.n_kv < tf.n_kv - tf.n_masked ? 0.0f : -INFINITY);
+    const float scale = 1.0f/sqrtf(tf.Dk);
+
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 64*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    std::vector<float> results[2];
+    for (int pass = 0; pass < 2; ++pass) {
+        struct ggml_context * ctx = ggml_init(params);
+        ggml_tensor * q = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, tf.Dk, 1, tf.n_head);
+        ggml_tensor * k = ggml_new_tensor_3d(ctx, tf.type_kv, tf.Dk, tf.n_kv, tf.n_head_kv);
+        ggml_tensor * v = tf.shared_kv ? ggml_view_3d(ctx, k, tf.Dv, tf.n_kv, tf.n_head_kv, k->nb[1], k->nb[2], 0)
+                                       : ggml_new_tensor_3d(ctx, tf.type_kv, tf.Dv, tf.n_kv, tf.n_head_kv);
+        ggml_tensor * m = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, tf.n_kv, n_pad);
+        memcpy(q->data, qf.data(), qf.size()*sizeof(float));
+        ggml_quantize_chunk(tf.type_kv, kf.data(), k->data, 0, n_rows, tf.Dk, nullptr);
+        if (!tf.shared_kv) {
+            ggml_quantize_chunk(tf.type_kv, vf.data(), v->data, 0, n_rows, tf.Dv, nullptr);
+        }
+        memcpy(m->data, mh.data(), mh.size()*sizeof(ggml_fp16_t));
+        if (pass == 0) {
+            // the reference uses the K and V the kernels see
+            dequantize(tf.type_kv, 1, k->data, n_rows, tf.Dk, kf.data());
+            if (tf.shared_kv) {
+                vf.resize(tf.Dv*n_rows);
+                for (int64_t j = 0; j < n_rows; ++j) memcpy(vf.data() + j*tf.Dv, kf.data() + j*tf.Dk, tf.Dv*sizeof(float));
+            } else {
+                dequantize(tf.type_kv, 1, v->data, n_rows, tf.Dv, vf.data());
+            }
+        }
+        ggml_tensor * out = ggml_flash_attn_ext(ctx, q, k, v, m, scale, 0.0f, 0.0f);
+        struct ggml_cgraph * gf = ggml_new_graph(ctx);
+        ggml_build_forward_expand(gf, out);
+        ggml_graph_compute_with_ctx(ctx, gf, pass == 0 ? 1 : n_threads);
+        results[pass].assign((const float *) out->data, (const float *) out->data + tf.Dv*tf.n_head);
+        ggml_free(ctx);
+    }
+
+    std::vector<double> ref(tf.Dv*tf.n_head);
+    std::vector<double> kq(tf.n_kv);
+    for (int64_t h = 0; h < tf.n_head; ++h) {
+        const int64_t hk = h/(tf.n_head/tf.n_head_kv);
+        double max = -INFINITY;
+        for (int64_t j = 0; j < tf.n_kv - tf.n_masked; ++j) {
+            const float * kj = kf.data() + (hk*tf.n_kv + j)*tf.Dk;
+            double sum = 0;
+            for (int64_t i = 0; i < tf.Dk; ++i) sum += (double) qf[h*tf.Dk + i]*kj[i];
+            kq[j] = scale*sum;
+            max = std::max(max, kq[j]);
+        }
+        double sum_p = 0;
+        for (int64_t j = 0; j < tf.n_kv - tf.n_masked; ++j) {
+            const float * vj = vf.data() + (hk*tf.n_kv + j)*tf.Dv;
+            const double p = exp(kq[j] - max);
+            sum_p += p;
+            for (int64_t i = 0; i < tf.Dv; ++i) ref[h*tf.Dv + i] += p*vj[i];
+        }
+        for (int64_t i = 0; i < tf.Dv; ++i) ref[h*tf.Dv + i] /= sum_p;
+    }
+
+    *nmse_1 = nmse(results[1].data(), std::vector<double>(results[0].begin(), results[0].end()).data(), ref.size());
+    return nmse(results[1].data(), ref.data(), ref.size());
+}
+
+int main(int argc, char * argv[]) {
+    bool verbose = false;
+    int  n_threads = 2;
+
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-v") {
+            verbose = true;
+        } else if (arg == "-t" && i + 1 < argc) {
+            n_threads = std::stoi(argv[++i]);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    std::mt19937 rng(1234);
+
+    // 1...8 columns go through the per-column kernels, 16 and more through the 16 column kernels (AMX where available)
+    const int64_t n_per_row = 512;
+    const int64_t nrows     = 64;
+    const int64_t ny_list[] = { 1, 3, 8, 16, 37 };
+
+    int num_failed = 0;
+    for (const auto & tt : k_types) {
+        if (tt.saturates_avx512 && ggml_cpu_has_avx512() && ggml_cpu_has_avx512_vnni()) {
+            continue;
+        }
+        ggml_quantize_init(tt.type);
+        for (int n_expert : { 0, 4 }) {
+            for (int64_t ny : ny_list) {
+                const double err = test_mul_mat(tt, n_per_row, nrows, ny, n_expert, n_threads, rng);
+                const bool failed = !(err < MAX_NMSE);
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("%8s %-10s ny = %2d: %s (nmse = %g)\n", ggml_type_name(tt.type), n_expert > 0 ? "mul_mat_id" : "mul_mat",
+                            (int) ny, RESULT_STR[failed], err);
+                }
+            }
+        }
+    }
+
+    // The KV length is split in nth/gcd(n_head_kv, nth) slices: 2 KV heads with 3, 4, 6 threads give 3, 2, 3 slices, 4 KV
+    // heads with 3 and 6 threads 3 slices, the other cases are not split. The last slice is entirely masked.
+    for (int64_t n_head_kv : { 2, 4 }) {
+        for (int nth : { 2, 3, 4, 6 }) {
+            double err_1;
+            const double err = test_flash_attn({ GGML_TYPE_F16, 128, 128, 8, n_head_kv, 512, 288, false }, nth, rng, &err_1);
+            const bool failed = !(err < MAX_NMSE) || !(err_1 < 1e-10);
+            num_failed += failed;
+            if (failed || verbose) {
+                printf("flash_attn n_head_kv = %d, %d threads: %s (nmse = %g, vs 1 thread = %g)\n", (int) n_head_kv, nth,
+                        RESULT_STR[failed], err, err_1);
+            }
+        }
+    }
+
+    // MLA: K and V are the same rows of the latent cache, 1 thread streams all of it for all heads, more threads get a
+    // slice each. 4 heads go through the single head kernels, 16 through the 8 head kernels.
+    for (ggml_type type_kv : { GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q8_KV }) {
+        for (int64_t n_head : { 4, 16 }) {
+            for (int nth : { 1, 2, 3 }) {
+                double err_1;
+                const double err = test_flash_attn({ type_kv, 576, 512, n_head, 1, 512, 288, true }, nth, rng, &err_1);
+                const bool failed = !(err < MAX_NMSE) || !(err_1 < 1e-10);
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("flash_attn_mla %5s n_head = %2d, %d threads: %s (nmse = %g, vs 1 thread = %g)\n", ggml_type_name(type_kv),
+                            (int) n_head, nth, RESULT_STR[failed], err, err_1);
+                }
+            }
+        }
+    }
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    return num_failed > 0;
+}
@@ -0,0 +1,261 @@
+// Decodes the same sequences with differently configured KV caches and compares the logits. The model is a small
+// llama with random weights and the vocab of the gguf given as argument, written to a temporary file.
+// - the paged KV cache (kv_block_size) places the tokens of a sequence in its own blocks of cells instead of the
+//   contiguous ring, sequences are removed and new ones take over their blocks
+// - the defragmentation (defrag_thold, in bounded steps with defrag_max_cells, or with the KV data moved on a
+//   separate thread with defrag_async) fills the holes of the removed sequence while the others continue
+
+#include "llama.h"
+#include "common.h"
+#include "ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+constexpr int    n_embd    = 64;
+constexpr int    n_head    = 4;
+constexpr int    n_head_kv = 2;
+constexpr int    n_layer   = 2;
+constexpr int    n_ff      = 128;
+constexpr int    n_ctx     = 512;
+
+// the cells are attended in a different order, and with flash attention in different chunks
+constexpr double MAX_NMSE = 1e-5;
+
+static bool write_model(const char * fname_vocab, const char * fname) {
+    gguf_init_params params = { /*.no_alloc =*/ true, /*.ctx =*/ nullptr };
+    gguf_context * vocab = gguf_init_from_file(fname_vocab, params);
+    if (!vocab) {
+        fprintf(stderr, "%s: failed to read %s\n", __func__, fname_vocab);
+        return false;
+    }
+    const int n_vocab = gguf_get_arr_n(vocab, gguf_find_key(vocab, "tokenizer.ggml.tokens"));
+
+    gguf_context * gguf = gguf_init_empty();
+    gguf_set_kv(gguf, vocab);
+    gguf_set_val_str(gguf, "general.architecture", "llama");
+    gguf_set_val_u32(gguf, "llama.context_length", n_ctx);
+    gguf_set_val_u32(gguf, "llama.embedding_length", n_embd);
+    gguf_set_val_u32(gguf, "llama.block_count", n_layer);
+    gguf_set_val_u32(gguf, "llama.feed_forward_length", n_ff);
+    gguf_set_val_u32(gguf, "llama.attention.head_count", n_head);
+    gguf_set_val_u32(gguf, "llama.attention.head_count_kv", n_head_kv);
+    gguf_set_val_f32(gguf, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+    gguf_set_val_u32(gguf, "llama.rope.dimension_count", n_embd/n_head);
+
+    const int n_embd_gqa = n_embd/n_head*n_head_kv;
+    std::vector<std::pair<std::string, std::vector<int64_t>>> shapes = {
+        { "token_embd.weight",  { n_embd, n_vocab } },
+        { "output_norm.weight", { n_embd } },
+        { "output.weight",      { n_embd, n_vocab } },
+    };
+    for (int il = 0; il < n_layer; ++il) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+        shapes.push_back({ blk + "attn_norm.weight",   { n_embd } });
+        shapes.push_back({ blk + "attn_q.weight",      { n_embd, n_embd } });
+        shapes.push_back({ blk + "attn_k.weight",      { n_embd, n_embd_gqa } });
+        shapes.push_back({ blk + "attn_v.weight",      { n_embd, n_embd_gqa } });
+        shapes.push_back({ blk + "attn_output.weight", { n_embd, n_embd } });
+        shapes.push_back({ blk + "ffn_norm.weight",    { n_embd } });
+        shapes.push_back({ blk + "ffn_gate.weight",    { n_embd, n_ff } });
+        shapes.push_back({ blk + "ffn_up.weight",      { n_embd, n_ff } });
+        shapes.push_back({ blk + "ffn_down.weight",    { n_ff, n_embd } });
+    }
+
+    size_t mem_size = ggml_tensor_overhead()*shapes.size();
+    for (const auto & s : shapes) {
+        mem_size += ggml_row_size(GGML_TYPE_F32, s.second[0])*(s.second.size() > 1 ? s.second[1] : 1) + GGML_MEM_ALIGN;
+    }
+    ggml_init_params ctx_params = { mem_size, nullptr, false };
+    ggml_context * ctx = ggml_init(ctx_params);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 0.1f);
+    for (const auto & s : shapes) {
+        ggml_tensor * t = s.second.size() == 1 ? ggml_new_tensor_1d(ctx, GGML_TYPE_F32, s.second[0])
+                                               : ggml_new_tensor_2d(ctx, GGML_TYPE_F32, s.second[0], s.second[1]);
+        ggml_set_name(t, s.first.c_str());
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            // the norms are 1, as after training
+            data[i] = s.second.size() == 1 ? 1.0f : dist(rng);
+        }
+        gguf_add_tensor(gguf, t);
+    }
+
+    gguf_write_to_file(gguf, fname, false);
+
+    ggml_free(ctx);
+    gguf_free(gguf);
+    gguf_free(vocab);
+    return true;
+}
+
+// The logits of a fixed schedule: three prompts, two of them in the same batch, then tokens for all the sequences,
+// with sequence 1 removed halfway and a new sequence 3 started in its place. n_holes receives the number of empty
+// cells before the last used cell at the end.
+static std::vector<float> decode(llama_model * model, llama_context_params cparams, int * n_holes = nullptr) {
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    if (!ctx) {
+        return {};
+    }
+    const int n_vocab = llama_n_vocab(model);
+
+    std::mt19937 rng(1234);
+    auto token = [&rng, n_vocab]() { return (llama_token) (rng() % n_vocab); };
+
+    std::vector<float> logits;
+    llama_batch batch = llama_batch_init(n_ctx, 0, 4);
+    llama_pos n_past[4] = {};
+
+    auto run = [&]() {
+        if (llama_decode(ctx, batch) != 0) {
+            return false;
+        }
+        for (int i = 0; i < batch.n_tokens; ++i) {
+            if (batch.logits[i]) {
+                const float * l = llama_get_logits_ith(ctx, i);
+                logits.insert(logits.end(), l, l + n_vocab);
+            }
+        }
+        llama_batch_clear(batch);
+        return true;
+    };
+    auto prompt = [&](llama_seq_id seq_id, int n) {
+        for (int i = 0; i < n; ++i) {
+            llama_batch_add(batch, token(), n_past[seq_id]++, { seq_id }, i == n - 1);
+        }
+    };
+
+    bool ok = true;
+    prompt(0, 37);
+    ok = ok && run();
+    prompt(1, 21);
+    prompt(2, 50);
+    ok = ok && run();
+    for (int step = 0; step < 24 && ok; ++step) {
+        if (step == 12) {
+            llama_kv_cache_seq_rm(ctx, 1, -1, -1);
+            prompt(3, 30);
+            ok = run();
+        }
+        for (llama_seq_id seq_id : { 0, step < 12 ? 1 : 3, 2 }) {
+            llama_batch_add(batch, token(), n_past[seq_id]++, { seq_id }, true);
+        }
+        ok = ok && run();
+    }
+
+    if (n_holes) {
+        llama_kv_cache_view view = llama_kv_cache_view_init(ctx, 4);
+        llama_kv_cache_view_update(ctx, &view);
+        int n_used = 0;
+        *n_holes = 0;
+        for (int i = 0; i < view.n_cells && n_used < view.used_cells; ++i) {
+            if (view.cells[i].pos < 0) {
+                (*n_holes)++;
+            } else {
+                n_used++;
+            }
+        }
+        llama_kv_cache_view_free(&view);
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+
+    if (!ok) {
+        logits.clear();
+    }
+    return logits;
+}
+
+static double nmse(const std::vector<float> & a, const std::vector<float> & ref) {
+    double sum2 = 0, diff2 = 0;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        sum2  += ref[i]*ref[i];
+        diff2 += (a[i] - ref[i])*(a[i] - ref[i]);
+    }
+    return sum2 > 0 ? diff2/sum2 : diff2;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab gguf>\n", argv[0]);
+        return 1;
+    }
+    const char * fname = "test-kv-cache.gguf";
+    if (!write_model(argv[1], fname)) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    llama_model * model = llama_load_model_from_file(fname, mparams);
+    std::remove(fname);
+    if (!model) {
+        fprintf(stderr, "failed to load the model\n");
+        return 1;
+    }
+
+    int n_failed = 0;
+    auto check = [&n_failed](const char * what, const std::vector<float> & logits, const std::vector<float> & ref) {
+        const bool ok = !logits.empty() && logits.size() == ref.size() && nmse(logits, ref) < MAX_NMSE;
+        printf("%-48s: %s", what, ok ? "ok" : "FAILED");
+        if (logits.size() == ref.size() && !logits.empty()) {
+            printf(" (nmse = %g)", nmse(logits, ref));
+        }
+        printf("\n");
+        n_failed += !ok;
+    };
+
+    for (bool flash_attn : { false, true }) {
+        llama_context_params cparams = llama_context_default_params();
+        cparams.n_ctx           = n_ctx;
+        cparams.n_batch         = n_ctx;
+        cparams.n_ubatch        = n_ctx;
+        cparams.n_seq_max       = 4;
+        cparams.n_threads       = 2;
+        cparams.n_threads_batch = 2;
+        cparams.flash_attn      = flash_attn;
+
+        int n_holes_ref = 0;
+        const std::vector<float> ref = decode(model, cparams, &n_holes_ref);
+        if (ref.empty()) {
+            fprintf(stderr, "failed to decode the reference\n");
+            return 1;
+        }
+
+        for (uint32_t kv_block_size : { 16, 32 }) {
+            llama_context_params cp = cparams;
+            cp.kv_block_size = kv_block_size;
+            const std::string what = "kv_block_size = " + std::to_string(kv_block_size) + (flash_attn ? ", flash_attn" : "");
+            check(what.c_str(), decode(model, cp), ref);
+        }
+
+        for (uint32_t defrag_max_cells : { 0, 8 }) {
+            for (bool defrag_async : { false, true }) {
+                llama_context_params cp = cparams;
+                cp.defrag_thold     = 0.0f;
+                cp.defrag_max_cells = defrag_max_cells;
+                cp.defrag_async     = defrag_async;
+                const std::string what = "defrag_max_cells = " + std::to_string(defrag_max_cells) +
+                    (defrag_async ? ", defrag_async" : "") + (flash_attn ? ", flash_attn" : "");
+                int n_holes = 0;
+                check(what.c_str(), decode(model, cp, &n_holes), ref);
+                if (n_holes >= n_holes_ref) {
+                    printf("%-48s: FAILED (%d holes left, %d without defrag)\n", what.c_str(), n_holes, n_holes_ref);
+                    n_failed++;
+                }
+            }
+        }
+    }
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    return n_failed > 0 ? 1 : 0;
+}